@@ -0,0 +1,298 @@
+/*
+ *   backend.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <samplerate.h>
+#include "backend.h"
+#include "interp.h"
+#include "sinc.h"
+#include "utils.h"
+
+//libsamplerate can not change the channels of a state so there is one state per channel count, created on demand out of the audio thread and kept until the end.
+struct ow_resampler_samplerate
+{
+  SRC_STATE *state;		//The one in use
+  _Atomic (SRC_STATE *) states[OB_MAX_TRACKS + 1];
+  int max_channels;
+  int quality;
+  ow_resampler_cb_t cb;
+  void *cb_data;
+};
+
+static SRC_STATE *
+ow_resampler_samplerate_new_state (struct ow_resampler_samplerate *src,
+				   int channels)
+{
+  int err;
+  SRC_STATE *state = src_callback_new (src->cb, src->quality, channels, &err,
+				       src->cb_data);
+
+  if (!state)
+    {
+      error_print ("Error while creating libsamplerate state: %s\n",
+		   src_strerror (err));
+    }
+
+  return state;
+}
+
+static void *
+ow_resampler_samplerate_new (int quality, int channels, int flags,
+			     ow_resampler_cb_t cb, void *cb_data)
+{
+  struct ow_resampler_samplerate *src;
+
+  if (flags)
+    {
+      error_print ("libsamplerate does not support planar data\n");
+      return NULL;
+    }
+
+  if (channels < 1 || channels > OB_MAX_TRACKS)
+    {
+      error_print ("Invalid number of channels: %d\n", channels);
+      return NULL;
+    }
+
+  src = malloc (sizeof (struct ow_resampler_samplerate));
+  src->max_channels = channels;
+  src->quality = quality;
+  src->cb = cb;
+  src->cb_data = cb_data;
+  src->state = ow_resampler_samplerate_new_state (src, channels);
+  if (!src->state)
+    {
+      free (src);
+      return NULL;
+    }
+  for (int i = 0; i <= OB_MAX_TRACKS; i++)
+    {
+      atomic_init (&src->states[i], NULL);
+    }
+  atomic_init (&src->states[channels], src->state);
+
+  return src;
+}
+
+static long
+ow_resampler_samplerate_read (void *data, double ratio, long frames,
+			      float *out)
+{
+  struct ow_resampler_samplerate *src = data;
+  return src_callback_read (src->state, ratio, frames, out);
+}
+
+static void
+ow_resampler_samplerate_reset (void *data)
+{
+  struct ow_resampler_samplerate *src = data;
+  src_reset (src->state);
+}
+
+static int
+ow_resampler_samplerate_set_channels (void *data, int channels)
+{
+  SRC_STATE *state;
+  struct ow_resampler_samplerate *src = data;
+
+  if (channels < 1 || channels > src->max_channels)
+    {
+      return -1;
+    }
+
+  state = atomic_load_explicit (&src->states[channels], memory_order_acquire);
+  if (!state)
+    {
+      return 1;
+    }
+  src_reset (state);
+  src->state = state;
+  return 0;
+}
+
+static int
+ow_resampler_samplerate_prepare_channels (void *data, int channels)
+{
+  SRC_STATE *state, *expected = NULL;
+  struct ow_resampler_samplerate *src = data;
+
+  if (channels < 1 || channels > src->max_channels)
+    {
+      return -1;
+    }
+
+  if (atomic_load_explicit (&src->states[channels], memory_order_acquire))
+    {
+      return 0;
+    }
+
+  state = ow_resampler_samplerate_new_state (src, channels);
+  if (!state)
+    {
+      return -1;
+    }
+  //Someone else might have prepared it in the meantime.
+  if (!atomic_compare_exchange_strong_explicit (&src->states[channels],
+						&expected, state,
+						memory_order_release,
+						memory_order_acquire))
+    {
+      src_delete (state);
+    }
+  return 0;
+}
+
+static void
+ow_resampler_samplerate_delete (void *data)
+{
+  SRC_STATE *state;
+  struct ow_resampler_samplerate *src = data;
+
+  for (int i = 1; i <= src->max_channels; i++)
+    {
+      state = atomic_load_explicit (&src->states[i], memory_order_acquire);
+      if (state)
+	{
+	  src_delete (state);
+	}
+    }
+  free (src);
+}
+
+const struct ow_resampler_impl OW_RESAMPLER_SAMPLERATE_IMPL = {
+  .name = "libsamplerate",
+  .planar = 0,
+  .new = ow_resampler_samplerate_new,
+  .read = ow_resampler_samplerate_read,
+  .reset = ow_resampler_samplerate_reset,
+  .set_channels = ow_resampler_samplerate_set_channels,
+  .prepare_channels = ow_resampler_samplerate_prepare_channels,
+  .read_fast = NULL,
+  .delete = ow_resampler_samplerate_delete
+};
+
+static void *
+ow_resampler_cubic_new (int quality, int channels, int flags,
+			ow_resampler_cb_t cb, void *cb_data)
+{
+  struct ow_interp *interp = malloc (sizeof (struct ow_interp));
+  ow_interp_init (interp, channels, flags, cb, cb_data);
+  return interp;
+}
+
+static long
+ow_resampler_cubic_read (void *state, double ratio, long frames, float *out)
+{
+  return ow_interp_read (state, ratio, frames, out);
+}
+
+static void
+ow_resampler_cubic_reset (void *state)
+{
+  ow_interp_reset (state);
+}
+
+static int
+ow_resampler_cubic_set_channels (void *state, int channels)
+{
+  return ow_interp_set_channels (state, channels);
+}
+
+static void
+ow_resampler_cubic_delete (void *state)
+{
+  ow_interp_destroy (state);
+  free (state);
+}
+
+const struct ow_resampler_impl OW_RESAMPLER_CUBIC_IMPL = {
+  .name = "cubic",
+  .planar = 1,
+  .new = ow_resampler_cubic_new,
+  .read = ow_resampler_cubic_read,
+  .reset = ow_resampler_cubic_reset,
+  .set_channels = ow_resampler_cubic_set_channels,
+  .prepare_channels = NULL,
+  .read_fast = NULL,
+  .delete = ow_resampler_cubic_delete
+};
+
+static void *
+ow_resampler_sinc_new (int quality, int channels, int flags,
+		       ow_resampler_cb_t cb, void *cb_data)
+{
+  return ow_sinc_new (quality, channels, flags, cb, cb_data);
+}
+
+static long
+ow_resampler_sinc_read (void *state, double ratio, long frames, float *out)
+{
+  return ow_sinc_read (state, ratio, frames, out);
+}
+
+static void
+ow_resampler_sinc_reset (void *state)
+{
+  ow_sinc_reset (state);
+}
+
+static long
+ow_resampler_sinc_read_fast (void *state, double ratio, long frames,
+			     float *out)
+{
+  return ow_sinc_read_fast (state, ratio, frames, out);
+}
+
+static int
+ow_resampler_sinc_set_channels (void *state, int channels)
+{
+  return ow_sinc_set_channels (state, channels);
+}
+
+static void
+ow_resampler_sinc_delete (void *state)
+{
+  ow_sinc_delete (state);
+}
+
+const struct ow_resampler_impl OW_RESAMPLER_SINC_IMPL = {
+  .name = "sinc",
+  .planar = 1,
+  .new = ow_resampler_sinc_new,
+  .read = ow_resampler_sinc_read,
+  .reset = ow_resampler_sinc_reset,
+  .set_channels = ow_resampler_sinc_set_channels,
+  .prepare_channels = NULL,
+  .read_fast = ow_resampler_sinc_read_fast,
+  .delete = ow_resampler_sinc_delete
+};
+
+const struct ow_resampler_impl *
+ow_resampler_get_impl (ow_resampler_backend_t backend)
+{
+  switch (backend)
+    {
+    case OW_RESAMPLER_BACKEND_SINC:
+      return &OW_RESAMPLER_SINC_IMPL;
+    default:
+      return &OW_RESAMPLER_SAMPLERATE_IMPL;
+    }
+}
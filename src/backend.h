@@ -0,0 +1,62 @@
+/*
+ *   backend.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "overwitch.h"
+
+//Pulls input frames. Same as a libsamplerate callback. The data is valid until the next call.
+typedef long (*ow_resampler_cb_t) (void *, float **);
+
+//Planar data is a lane per channel, one after the other, of as many samples as frames.
+//For the input, these are the frames returned by the callback; for the output, the frames requested.
+#define OW_RESAMPLER_PLANAR_IN 1
+#define OW_RESAMPLER_PLANAR_OUT 2
+
+//Every backend takes interleaved frames and accepts a different ratio on every read.
+struct ow_resampler_impl
+{
+  const char *name;
+  int planar;			//Whether the planar flags are supported
+  //Quality goes from 0, the best, to 4.
+  void *(*new) (int quality, int channels, int flags, ow_resampler_cb_t,
+		void *);
+  //The ratio is the output sample rate divided by the input sample rate.
+  long (*read) (void *, double ratio, long frames, float *);
+  void (*reset) (void *);
+  //The state is reset and it returns 0 on success. It is called from the audio thread so it never allocates memory. There can not be more channels than the ones the state was created with.
+  //It returns 1 if the backend needs prepare_channels to be called first and that has not finished yet.
+  int (*set_channels) (void *, int channels);
+  //Only for the backends that need memory for the channels. It is called from any thread but the audio one and returns 0 on success. NULL if not needed.
+  int (*prepare_channels) (void *, int channels);
+  //Like read but with a cheap interpolation that goes on from the same position and input, so both can be mixed at any time. Only for ratios close to 1. NULL if not available.
+  long (*read_fast) (void *, double ratio, long frames, float *);
+  void (*delete) (void *);
+};
+
+extern const struct ow_resampler_impl OW_RESAMPLER_SAMPLERATE_IMPL;
+extern const struct ow_resampler_impl OW_RESAMPLER_SINC_IMPL;
+//Only for drift correction as there is no filtering. It is used as the fast read of the backends that do not have one.
+extern const struct ow_resampler_impl OW_RESAMPLER_CUBIC_IMPL;
+
+const struct ow_resampler_impl *ow_resampler_get_impl (ow_resampler_backend_t);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ *   cache.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+#include <json-glib/json-glib.h>
+#include "cache.h"
+#include "utils.h"
+
+#define CACHE_DIR "overwitch"
+#define CACHE_FILE "ratios.json"
+
+//Several devices might save their ratios at the same time.
+G_LOCK_DEFINE_STATIC (cache);
+
+static gchar *
+cache_get_path ()
+{
+  return g_build_filename (g_get_user_config_dir (), CACHE_DIR, CACHE_FILE,
+			   NULL);
+}
+
+static JsonNode *
+cache_load (const gchar * path)
+{
+  JsonNode *root = NULL;
+  GError *error = NULL;
+  JsonParser *parser = json_parser_new ();
+
+  if (json_parser_load_from_file (parser, path, &error))
+    {
+      root = json_parser_get_root (parser);
+      root = root && JSON_NODE_HOLDS_OBJECT (root) ? json_node_copy (root) :
+	NULL;
+    }
+  else
+    {
+      debug_print (1, "Error while loading ratios from '%s': %s\n", path,
+		   error->message);
+      g_error_free (error);
+    }
+
+  g_object_unref (parser);
+
+  return root;
+}
+
+double
+cache_get_ratio (const char *device, uint32_t samplerate)
+{
+  JsonNode *root, *node;
+  JsonObject *object;
+  gchar key[16];
+  double ratio = 0.0;
+  gchar *path = cache_get_path ();
+
+  G_LOCK (cache);
+  root = cache_load (path);
+  G_UNLOCK (cache);
+
+  if (root)
+    {
+      snprintf (key, sizeof (key), "%u", samplerate);
+      object = json_node_get_object (root);
+      node = json_object_get_member (object, device);
+      if (node && JSON_NODE_HOLDS_OBJECT (node))
+	{
+	  object = json_node_get_object (node);
+	  if (json_object_has_member (object, key))
+	    {
+	      ratio = json_object_get_double_member (object, key);
+	    }
+	}
+      json_node_unref (root);
+    }
+
+  g_free (path);
+
+  return ratio;
+}
+
+void
+cache_set_ratio (const char *device, uint32_t samplerate, double ratio)
+{
+  JsonNode *root, *node;
+  JsonObject *object, *device_object;
+  JsonGenerator *gen;
+  GError *error = NULL;
+  gchar key[16];
+  gchar *path = cache_get_path ();
+  gchar *dir = g_path_get_dirname (path);
+
+  debug_print (1, "Saving ratio %f for %s at %u Hz...\n", ratio, device,
+	       samplerate);
+
+  G_LOCK (cache);
+
+  if (g_mkdir_with_parents (dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH |
+			    S_IXOTH))
+    {
+      error_print ("Error while creating dir '%s'\n", dir);
+      goto end;
+    }
+
+  root = cache_load (path);
+  if (!root)
+    {
+      root = json_node_new (JSON_NODE_OBJECT);
+      json_node_take_object (root, json_object_new ());
+    }
+
+  //Other devices and sample rates are kept.
+  object = json_node_get_object (root);
+  node = json_object_get_member (object, device);
+  if (node && JSON_NODE_HOLDS_OBJECT (node))
+    {
+      device_object = json_node_get_object (node);
+    }
+  else
+    {
+      device_object = json_object_new ();
+      json_object_set_object_member (object, device, device_object);
+    }
+
+  snprintf (key, sizeof (key), "%u", samplerate);
+  json_object_set_double_member (device_object, key, ratio);
+
+  gen = json_generator_new ();
+  json_generator_set_root (gen, root);
+  json_generator_set_pretty (gen, TRUE);
+  if (!json_generator_to_file (gen, path, &error))
+    {
+      error_print ("Error while saving ratios to '%s': %s\n", path,
+		   error->message);
+      g_error_free (error);
+    }
+
+  g_object_unref (gen);
+  json_node_unref (root);
+
+end:
+  G_UNLOCK (cache);
+  g_free (dir);
+  g_free (path);
+}
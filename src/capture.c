@@ -0,0 +1,346 @@
+/*
+ *   capture.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+#include "utils.h"
+
+#define OW_CAPTURE_RING_SIZE (8 * 1024 * 1024)	//Several seconds of any device
+#define OW_CAPTURE_SIGNAL_BYTES (256 * 1024)
+#define OW_CAPTURE_POLL_MS 100
+
+static int
+ow_capture_write_fd (int fd, const char *data, size_t len)
+{
+  ssize_t n;
+
+  while (len)
+    {
+      n = write (fd, data, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+	  error_print ("Error while writing capture: %s\n", strerror (errno));
+	  return -1;
+	}
+      data += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+//Writes everything in the ring, in at most two parts.
+static void
+ow_capture_writer_flush (struct ow_capture_writer *writer)
+{
+  size_t pos, len;
+  size_t head = atomic_load_explicit (&writer->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit (&writer->tail, memory_order_relaxed);
+
+  while (tail != head)
+    {
+      pos = tail & (writer->size - 1);
+      len = head - tail;
+      if (pos + len > writer->size)
+	{
+	  len = writer->size - pos;
+	}
+      if (ow_capture_write_fd (writer->fd, &writer->ring[pos], len))
+	{
+	  //There is nothing else to do but to keep the USB thread going.
+	  len = head - tail;
+	}
+      tail += len;
+      atomic_store_explicit (&writer->tail, tail, memory_order_release);
+    }
+}
+
+static void *
+ow_capture_writer_run (void *data)
+{
+  uint64_t v;
+  struct ow_capture_writer *writer = data;
+  struct pollfd pfd = {.fd = writer->event_fd,.events = POLLIN };
+
+  while (atomic_load_explicit (&writer->running, memory_order_acquire))
+    {
+      if (poll (&pfd, 1, OW_CAPTURE_POLL_MS) > 0)
+	{
+	  if (read (writer->event_fd, &v, sizeof (v)) < 0)
+	    {
+	      debug_print (2, "Error while reading eventfd: %s\n",
+			   strerror (errno));
+	    }
+	}
+      ow_capture_writer_flush (writer);
+    }
+
+  ow_capture_writer_flush (writer);
+
+  return NULL;
+}
+
+ow_err_t
+ow_capture_writer_init (struct ow_capture_writer **writer_,
+			const char *path,
+			const struct ow_capture_header *header)
+{
+  struct ow_capture_writer *writer =
+    malloc (sizeof (struct ow_capture_writer));
+
+  writer->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (writer->fd < 0)
+    {
+      error_print ("Error while opening %s: %s\n", path, strerror (errno));
+      free (writer);
+      return OW_GENERIC_ERROR;
+    }
+
+  if (ow_capture_write_fd (writer->fd, (const char *) header,
+			   sizeof (struct ow_capture_header)))
+    {
+      goto error;
+    }
+
+  writer->event_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (writer->event_fd < 0)
+    {
+      error_print ("Error while creating eventfd: %s\n", strerror (errno));
+      goto error;
+    }
+
+  writer->size = OW_CAPTURE_RING_SIZE;
+  writer->ring = malloc (writer->size);
+  //Touching the pages here prevents page faults in the USB thread.
+  memset (writer->ring, 0, writer->size);
+  atomic_init (&writer->head, 0);
+  atomic_init (&writer->tail, 0);
+  writer->unsignalled = 0;
+  atomic_init (&writer->running, 1);
+  atomic_init (&writer->dropped, 0);
+
+  if (pthread_create (&writer->thread, NULL, ow_capture_writer_run, writer))
+    {
+      error_print ("Could not start capture thread\n");
+      close (writer->event_fd);
+      free (writer->ring);
+      goto error;
+    }
+
+  debug_print (1, "Capturing %s to %s...\n", header->name, path);
+
+  *writer_ = writer;
+  return OW_OK;
+
+error:
+  close (writer->fd);
+  free (writer);
+  return OW_GENERIC_ERROR;
+}
+
+static inline void
+ow_capture_writer_copy (struct ow_capture_writer *writer, size_t head,
+			const void *data, size_t len)
+{
+  size_t pos = head & (writer->size - 1);
+  size_t first = writer->size - pos;
+
+  if (len <= first)
+    {
+      memcpy (&writer->ring[pos], data, len);
+    }
+  else
+    {
+      memcpy (&writer->ring[pos], data, first);
+      memcpy (writer->ring, (const char *) data + first, len - first);
+    }
+}
+
+inline void
+ow_capture_writer_write (struct ow_capture_writer *writer,
+			 ow_capture_record_type_t type, double time,
+			 const void *data, uint32_t len)
+{
+  uint64_t v = 1;
+  static const char padding[8];
+  struct ow_capture_record record = {.type = type,.len = len,.time = time };
+  size_t total = sizeof (struct ow_capture_record) + OW_CAPTURE_ALIGN (len);
+  size_t head = atomic_load_explicit (&writer->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit (&writer->tail, memory_order_acquire);
+
+  if (writer->size - (head - tail) < total)
+    {
+      atomic_fetch_add_explicit (&writer->dropped, 1, memory_order_relaxed);
+      return;
+    }
+
+  ow_capture_writer_copy (writer, head, &record,
+			  sizeof (struct ow_capture_record));
+  head += sizeof (struct ow_capture_record);
+  ow_capture_writer_copy (writer, head, data, len);
+  head += len;
+  ow_capture_writer_copy (writer, head, padding, OW_CAPTURE_ALIGN (len) - len);
+  head += OW_CAPTURE_ALIGN (len) - len;
+  atomic_store_explicit (&writer->head, head, memory_order_release);
+
+  writer->unsignalled += total;
+  if (writer->unsignalled >= OW_CAPTURE_SIGNAL_BYTES)
+    {
+      writer->unsignalled = 0;
+      if (write (writer->event_fd, &v, sizeof (v)) < 0)
+	{
+	  debug_print (2, "Error while writing to eventfd: %s\n",
+		       strerror (errno));
+	}
+    }
+}
+
+void
+ow_capture_writer_destroy (struct ow_capture_writer *writer)
+{
+  uint64_t v = 1;
+  unsigned int dropped;
+
+  atomic_store_explicit (&writer->running, 0, memory_order_release);
+  if (write (writer->event_fd, &v, sizeof (v)) < 0)
+    {
+      debug_print (2, "Error while writing to eventfd: %s\n",
+		   strerror (errno));
+    }
+  pthread_join (writer->thread, NULL);
+
+  dropped = atomic_load_explicit (&writer->dropped, memory_order_relaxed);
+  if (dropped)
+    {
+      error_print ("%u records were dropped from the capture\n", dropped);
+    }
+
+  close (writer->event_fd);
+  close (writer->fd);
+  free (writer->ring);
+  free (writer);
+}
+
+ow_err_t
+ow_capture_reader_init (struct ow_capture_reader **reader_, const char *path)
+{
+  int fd;
+  struct stat st;
+  void *data;
+  struct ow_capture_reader *reader;
+  const struct ow_capture_header *header;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      error_print ("Error while opening %s: %s\n", path, strerror (errno));
+      return OW_GENERIC_ERROR;
+    }
+
+  if (fstat (fd, &st) || st.st_size < sizeof (struct ow_capture_header))
+    {
+      error_print ("%s is not a capture\n", path);
+      close (fd);
+      return OW_GENERIC_ERROR;
+    }
+
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    {
+      error_print ("Error while mapping %s: %s\n", path, strerror (errno));
+      return OW_GENERIC_ERROR;
+    }
+
+  header = data;
+  if (strncmp (header->magic, OW_CAPTURE_MAGIC, sizeof (header->magic))
+      || header->version != OW_CAPTURE_VERSION)
+    {
+      error_print ("%s is not a version %d capture\n", path,
+		   OW_CAPTURE_VERSION);
+      munmap (data, st.st_size);
+      return OW_GENERIC_ERROR;
+    }
+
+  //The records are read sequentially.
+  madvise (data, st.st_size, MADV_SEQUENTIAL);
+
+  reader = malloc (sizeof (struct ow_capture_reader));
+  reader->header = header;
+  reader->data = data;
+  reader->len = st.st_size;
+  ow_capture_reader_rewind (reader);
+
+  *reader_ = reader;
+  return OW_OK;
+}
+
+inline const struct ow_capture_record *
+ow_capture_reader_next (struct ow_capture_reader *reader)
+{
+  const struct ow_capture_record *record;
+  size_t left = reader->len - reader->pos;
+
+  if (left < sizeof (struct ow_capture_record))
+    {
+      return NULL;
+    }
+
+  record = (const struct ow_capture_record *) &reader->data[reader->pos];
+  if (left - sizeof (struct ow_capture_record) < record->len)
+    {
+      return NULL;
+    }
+
+  reader->pos += sizeof (struct ow_capture_record) +
+    OW_CAPTURE_ALIGN (record->len);
+  if (reader->pos > reader->len)
+    {
+      //The padding of the last record might be missing.
+      reader->pos = reader->len;
+    }
+
+  return record;
+}
+
+void
+ow_capture_reader_rewind (struct ow_capture_reader *reader)
+{
+  reader->pos = sizeof (struct ow_capture_header);
+}
+
+void
+ow_capture_reader_destroy (struct ow_capture_reader *reader)
+{
+  munmap ((void *) reader->data, reader->len);
+  free (reader);
+}
@@ -0,0 +1,106 @@
+/*
+ *   capture.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "overwitch.h"
+
+//A capture file is a header followed by records, each one followed by its payload padded to 8 bytes, so that it can be memory-mapped and read in place.
+//Everything but the payloads, which are the USB data as they arrived, is in host endianness.
+
+#define OW_CAPTURE_MAGIC "OWCAPT"
+#define OW_CAPTURE_VERSION 1
+#define OW_CAPTURE_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+
+#define OW_CAPTURE_RECORD_DATA(r) ((const char *) ((r) + 1))
+
+typedef enum
+{
+  OW_CAPTURE_RECORD_AUDIO = 1,	//A whole data_in transfer
+  OW_CAPTURE_RECORD_MIDI	//The received bytes of a MIDI bulk transfer
+} ow_capture_record_type_t;
+
+struct ow_capture_header
+{
+  char magic[8];
+  uint32_t version;
+  uint16_t pid;
+  uint16_t reserved;
+  uint32_t blocks_per_transfer;
+  uint32_t data_in_len;
+  char name[OW_LABEL_MAX_LEN];
+};
+
+struct ow_capture_record
+{
+  uint32_t type;
+  uint32_t len;
+  double time;			//get_time() of the context when the transfer arrived
+};
+
+//Records are copied into a ring by the USB thread and written to disk by their own thread.
+struct ow_capture_writer
+{
+  int fd;
+  char *ring;
+  size_t size;			//A power of 2
+  atomic_size_t head;		//Only written by the USB thread
+  atomic_size_t tail;		//Only written by the disk thread
+  size_t unsignalled;		//Only used by the USB thread
+  int event_fd;
+  atomic_int running;
+  atomic_uint dropped;
+  pthread_t thread;
+};
+
+struct ow_capture_reader
+{
+  const struct ow_capture_header *header;
+  const char *data;
+  size_t len;
+  size_t pos;
+};
+
+ow_err_t ow_capture_writer_init (struct ow_capture_writer **, const char *,
+				 const struct ow_capture_header *);
+
+//Never blocks. The record is dropped if it does not fit in the ring.
+void ow_capture_writer_write (struct ow_capture_writer *,
+			      ow_capture_record_type_t, double, const void *,
+			      uint32_t);
+
+//Writes whatever is pending.
+void ow_capture_writer_destroy (struct ow_capture_writer *);
+
+ow_err_t ow_capture_reader_init (struct ow_capture_reader **, const char *);
+
+//NULL at the end of the file or if the last record is truncated.
+const struct ow_capture_record *ow_capture_reader_next (struct
+							 ow_capture_reader *);
+
+void ow_capture_reader_rewind (struct ow_capture_reader *);
+
+void ow_capture_reader_destroy (struct ow_capture_reader *);
+
+#endif
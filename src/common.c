@@ -18,6 +18,8 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <unistd.h>
 #include "common.h"
 #include "utils.h"
 
@@ -85,3 +87,34 @@ print_devices ()
   ow_free_usb_device_list (devices, total);
   return OW_OK;
 }
+
+//Accepts a CPU number, "auto" or "none".
+int
+parse_cpu (const char *value, int *cpu)
+{
+  long v;
+  char *endstr;
+
+  if (strcmp (value, "auto") == 0)
+    {
+      *cpu = OW_CPU_AUTO;
+      return 0;
+    }
+
+  if (strcmp (value, "none") == 0)
+    {
+      *cpu = OW_CPU_NONE;
+      return 0;
+    }
+
+  errno = 0;
+  v = strtol (value, &endstr, 10);
+  if (errno || endstr == value || *endstr != '\0' || v < 0
+      || v >= sysconf (_SC_NPROCESSORS_CONF))
+    {
+      return 1;
+    }
+
+  *cpu = v;
+  return 0;
+}
@@ -29,3 +29,5 @@
 void print_help (const char *, const char *, struct option *);
 
 ow_err_t print_devices ();
+
+int parse_cpu (const char *, int *);
@@ -0,0 +1,525 @@
+/*
+ *   conv.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <endian.h>
+#include <limits.h>
+#include "conv.h"
+#include "utils.h"
+#include "overwitch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OW_CONV_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define OW_CONV_NEON
+#endif
+
+//This is 2^31, the first float that does not fit into an int32_t.
+#define INT_MAX_F ((float) INT_MAX)
+
+//The conversions are written once as bodies that are always inlined. The generic functions call them with a runtime length while the block kernels call them with a constant one so that the compiler unrolls them completely.
+#define OW_CONV_BODY static inline __attribute__((always_inline)) void
+
+//Channel counts found in the device table. Any other count uses the generic functions.
+#define OW_CONV_FOR_EACH_CHANNELS(X) X(2) X(4) X(6) X(8) X(12) X(20)
+
+//When uniform, scale is used for every sample and scales is never read.
+OW_CONV_BODY
+ow_conv_decode_scalar_body (const int32_t * s, float *f, const float *scales,
+			    float scale, int uniform, int samples)
+{
+  int32_t hv;
+
+  for (int i = 0; i < samples; i++, s++, f++, scales++)
+    {
+      hv = be32toh (*s);
+      *f = hv * (uniform ? scale : *scales);
+    }
+}
+
+OW_CONV_BODY
+ow_conv_encode_scalar_body (const float *f, int32_t * s, int samples)
+{
+  int32_t ov;
+  float v;
+
+  for (int i = 0; i < samples; i++, s++, f++)
+    {
+      v = *f * INT_MAX_F;
+      if (v >= INT_MAX_F)
+	{
+	  ov = INT_MAX;
+	}
+      else if (v < -INT_MAX_F)
+	{
+	  ov = INT_MIN;
+	}
+      else
+	{
+	  ov = (int32_t) v;
+	}
+      *s = htobe32 (ov);
+    }
+}
+
+inline void
+ow_conv_decode_scalar (const int32_t * s, float *f, const float *scales,
+		       int samples)
+{
+  ow_conv_decode_scalar_body (s, f, scales, 0, 0, samples);
+}
+
+inline void
+ow_conv_encode_scalar (const float *f, int32_t * s, int samples)
+{
+  ow_conv_encode_scalar_body (f, s, samples);
+}
+
+inline void
+ow_conv_decode_tracks (const int32_t * s, int channels, float *f, int lane,
+		       int step, const int *tracks, const float *scales,
+		       int ntracks, int frames)
+{
+  for (int i = 0; i < frames; i++, s += channels, f += step)
+    {
+      for (int j = 0; j < ntracks; j++)
+	{
+	  f[j * lane] = ((int32_t) be32toh (s[tracks[j]])) * scales[j];
+	}
+    }
+}
+
+inline void
+ow_conv_decode_int_tracks (const int32_t * s, int channels, int32_t * d,
+			   const int *tracks, const int *shifts, int ntracks,
+			   int frames)
+{
+  int32_t v, max;
+
+  for (int i = 0; i < frames; i++, s += channels)
+    {
+      for (int j = 0; j < ntracks; j++, d++)
+	{
+	  v = be32toh (s[tracks[j]]);
+	  if (shifts[j])
+	    {
+	      max = INT_MAX >> shifts[j];
+	      //Shifting a negative value is undefined so it is done unsigned.
+	      v = v > max ? INT_MAX : v < -max ? INT_MIN :
+		(int32_t) ((uint32_t) v << shifts[j]);
+	    }
+	  *d = v;
+	}
+    }
+}
+
+//Kernels for a whole block of the given channels. The samples argument is ignored as it is always the same.
+//The arrays of their entries are named OW_CONV_<ISA>_KERNELS so the macros that define them are OW_CONV_DEFINE_<ISA>_KERNELS.
+#define OW_CONV_BLOCK_KERNELS(isa, target, channels) \
+target static void \
+ow_conv_decode_##isa##_##channels (const int32_t * s, float *f, \
+				   const float *scales, int samples) \
+{ \
+  (void) samples; \
+  ow_conv_decode_##isa##_body (s, f, scales, 0, 0, \
+			       OB_FRAMES_PER_BLOCK * channels); \
+} \
+\
+target static void \
+ow_conv_decode_##isa##_##channels##_uniform (const int32_t * s, float *f, \
+					     const float *scales, \
+					     int samples) \
+{ \
+  (void) samples; \
+  ow_conv_decode_##isa##_body (s, f, scales, scales[0], 1, \
+			       OB_FRAMES_PER_BLOCK * channels); \
+} \
+\
+target static void \
+ow_conv_encode_##isa##_##channels (const float *f, int32_t * s, \
+				   int samples) \
+{ \
+  (void) samples; \
+  ow_conv_encode_##isa##_body (f, s, OB_FRAMES_PER_BLOCK * channels); \
+}
+
+#define OW_CONV_BLOCK_KERNEL_ENTRY(isa, channels) \
+  {channels, ow_conv_decode_##isa##_##channels, \
+   ow_conv_decode_##isa##_##channels##_uniform, \
+   ow_conv_encode_##isa##_##channels},
+
+#define OW_CONV_DEFINE_SCALAR_KERNELS(channels) \
+  OW_CONV_BLOCK_KERNELS (scalar, , channels)
+#define OW_CONV_SCALAR_KERNEL_ENTRY(channels) \
+  OW_CONV_BLOCK_KERNEL_ENTRY (scalar, channels)
+
+OW_CONV_FOR_EACH_CHANNELS (OW_CONV_DEFINE_SCALAR_KERNELS)
+
+static const struct ow_conv_block_kernel OW_CONV_SCALAR_KERNELS[] = {
+  OW_CONV_FOR_EACH_CHANNELS (OW_CONV_SCALAR_KERNEL_ENTRY) {0}
+};
+
+static int
+ow_conv_is_supported_scalar ()
+{
+  return 1;
+}
+
+static const struct ow_conv_impl OW_CONV_SCALAR_IMPL = {
+  .name = "scalar",
+  .is_supported = ow_conv_is_supported_scalar,
+  .decode = ow_conv_decode_scalar,
+  .encode = ow_conv_encode_scalar,
+  .kernels = OW_CONV_SCALAR_KERNELS
+};
+
+#if defined(OW_CONV_X86)
+
+//Reverses the bytes of every 32 bits word in a 128 bits lane.
+#define BSWAP32_MASK_128 _mm_set_epi8 (12, 13, 14, 15, 8, 9, 10, 11, \
+				       4, 5, 6, 7, 0, 1, 2, 3)
+
+#define OW_CONV_TARGET_SSSE3 __attribute__((target ("ssse3")))
+#define OW_CONV_TARGET_AVX2 __attribute__((target ("avx2")))
+
+OW_CONV_TARGET_SSSE3 OW_CONV_BODY
+ow_conv_decode_ssse3_body (const int32_t * s, float *f, const float *scales,
+			   float scale, int uniform, int samples)
+{
+  int i;
+  __m128i v;
+  __m128 x;
+  const __m128i mask = BSWAP32_MASK_128;
+  const __m128 scale_v = _mm_set1_ps (scale);
+
+  for (i = 0; i + 4 <= samples; i += 4)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) &s[i]);
+      v = _mm_shuffle_epi8 (v, mask);
+      x = _mm_cvtepi32_ps (v);
+      x = _mm_mul_ps (x, uniform ? scale_v : _mm_loadu_ps (&scales[i]));
+      _mm_storeu_ps (&f[i], x);
+    }
+
+  ow_conv_decode_scalar_body (&s[i], &f[i], &scales[i], scale, uniform,
+			      samples - i);
+}
+
+OW_CONV_TARGET_SSSE3 OW_CONV_BODY
+ow_conv_encode_ssse3_body (const float *f, int32_t * s, int samples)
+{
+  int i;
+  __m128i v;
+  __m128 x, overflow;
+  const __m128i mask = BSWAP32_MASK_128;
+  const __m128 max = _mm_set1_ps (INT_MAX_F);
+
+  for (i = 0; i + 4 <= samples; i += 4)
+    {
+      x = _mm_mul_ps (_mm_loadu_ps (&f[i]), max);
+      //Out of range values are converted to 0x80000000, which is only right for negative values.
+      overflow = _mm_cmpge_ps (x, max);
+      v = _mm_cvttps_epi32 (x);
+      v = _mm_xor_si128 (v, _mm_castps_si128 (overflow));
+      v = _mm_shuffle_epi8 (v, mask);
+      _mm_storeu_si128 ((__m128i *) & s[i], v);
+    }
+
+  ow_conv_encode_scalar_body (&f[i], &s[i], samples - i);
+}
+
+OW_CONV_TARGET_AVX2 OW_CONV_BODY
+ow_conv_decode_avx2_body (const int32_t * s, float *f, const float *scales,
+			  float scale, int uniform, int samples)
+{
+  int i;
+  __m256i v;
+  __m256 x;
+  const __m256i mask = _mm256_broadcastsi128_si256 (BSWAP32_MASK_128);
+  const __m256 scale_v = _mm256_set1_ps (scale);
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) &s[i]);
+      v = _mm256_shuffle_epi8 (v, mask);
+      x = _mm256_cvtepi32_ps (v);
+      x = _mm256_mul_ps (x, uniform ? scale_v :
+			 _mm256_loadu_ps (&scales[i]));
+      _mm256_storeu_ps (&f[i], x);
+    }
+
+  ow_conv_decode_ssse3_body (&s[i], &f[i], &scales[i], scale, uniform,
+			     samples - i);
+}
+
+OW_CONV_TARGET_AVX2 OW_CONV_BODY
+ow_conv_encode_avx2_body (const float *f, int32_t * s, int samples)
+{
+  int i;
+  __m256i v;
+  __m256 x, overflow;
+  const __m256i mask = _mm256_broadcastsi128_si256 (BSWAP32_MASK_128);
+  const __m256 max = _mm256_set1_ps (INT_MAX_F);
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      x = _mm256_mul_ps (_mm256_loadu_ps (&f[i]), max);
+      overflow = _mm256_cmp_ps (x, max, _CMP_GE_OQ);
+      v = _mm256_cvttps_epi32 (x);
+      v = _mm256_xor_si256 (v, _mm256_castps_si256 (overflow));
+      v = _mm256_shuffle_epi8 (v, mask);
+      _mm256_storeu_si256 ((__m256i *) & s[i], v);
+    }
+
+  ow_conv_encode_ssse3_body (&f[i], &s[i], samples - i);
+}
+
+OW_CONV_TARGET_SSSE3 static void
+ow_conv_decode_ssse3 (const int32_t * s, float *f, const float *scales,
+		      int samples)
+{
+  ow_conv_decode_ssse3_body (s, f, scales, 0, 0, samples);
+}
+
+OW_CONV_TARGET_SSSE3 static void
+ow_conv_encode_ssse3 (const float *f, int32_t * s, int samples)
+{
+  ow_conv_encode_ssse3_body (f, s, samples);
+}
+
+OW_CONV_TARGET_AVX2 static void
+ow_conv_decode_avx2 (const int32_t * s, float *f, const float *scales,
+		     int samples)
+{
+  ow_conv_decode_avx2_body (s, f, scales, 0, 0, samples);
+}
+
+OW_CONV_TARGET_AVX2 static void
+ow_conv_encode_avx2 (const float *f, int32_t * s, int samples)
+{
+  ow_conv_encode_avx2_body (f, s, samples);
+}
+
+#define OW_CONV_DEFINE_SSSE3_KERNELS(channels) \
+  OW_CONV_BLOCK_KERNELS (ssse3, OW_CONV_TARGET_SSSE3, channels)
+#define OW_CONV_SSSE3_KERNEL_ENTRY(channels) \
+  OW_CONV_BLOCK_KERNEL_ENTRY (ssse3, channels)
+#define OW_CONV_DEFINE_AVX2_KERNELS(channels) \
+  OW_CONV_BLOCK_KERNELS (avx2, OW_CONV_TARGET_AVX2, channels)
+#define OW_CONV_AVX2_KERNEL_ENTRY(channels) \
+  OW_CONV_BLOCK_KERNEL_ENTRY (avx2, channels)
+
+OW_CONV_FOR_EACH_CHANNELS (OW_CONV_DEFINE_SSSE3_KERNELS)
+OW_CONV_FOR_EACH_CHANNELS (OW_CONV_DEFINE_AVX2_KERNELS)
+
+static const struct ow_conv_block_kernel OW_CONV_SSSE3_KERNELS[] = {
+  OW_CONV_FOR_EACH_CHANNELS (OW_CONV_SSSE3_KERNEL_ENTRY) {0}
+};
+
+static const struct ow_conv_block_kernel OW_CONV_AVX2_KERNELS[] = {
+  OW_CONV_FOR_EACH_CHANNELS (OW_CONV_AVX2_KERNEL_ENTRY) {0}
+};
+
+static int
+ow_conv_is_supported_ssse3 ()
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("ssse3");
+}
+
+static int
+ow_conv_is_supported_avx2 ()
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx2");
+}
+
+static const struct ow_conv_impl OW_CONV_SSSE3_IMPL = {
+  .name = "SSSE3",
+  .is_supported = ow_conv_is_supported_ssse3,
+  .decode = ow_conv_decode_ssse3,
+  .encode = ow_conv_encode_ssse3,
+  .kernels = OW_CONV_SSSE3_KERNELS
+};
+
+static const struct ow_conv_impl OW_CONV_AVX2_IMPL = {
+  .name = "AVX2",
+  .is_supported = ow_conv_is_supported_avx2,
+  .decode = ow_conv_decode_avx2,
+  .encode = ow_conv_encode_avx2,
+  .kernels = OW_CONV_AVX2_KERNELS
+};
+
+#elif defined(OW_CONV_NEON)
+
+OW_CONV_BODY
+ow_conv_decode_neon_body (const int32_t * s, float *f, const float *scales,
+			  float scale, int uniform, int samples)
+{
+  int i;
+  int32x4_t v;
+  float32x4_t x;
+  const float32x4_t scale_v = vdupq_n_f32 (scale);
+
+  for (i = 0; i + 4 <= samples; i += 4)
+    {
+      v = vreinterpretq_s32_u8 (vrev32q_u8 (vld1q_u8 ((const uint8_t *)
+						     &s[i])));
+      x = vcvtq_f32_s32 (v);
+      x = vmulq_f32 (x, uniform ? scale_v : vld1q_f32 (&scales[i]));
+      vst1q_f32 (&f[i], x);
+    }
+
+  ow_conv_decode_scalar_body (&s[i], &f[i], &scales[i], scale, uniform,
+			      samples - i);
+}
+
+OW_CONV_BODY
+ow_conv_encode_neon_body (const float *f, int32_t * s, int samples)
+{
+  int i;
+  int32x4_t v;
+  float32x4_t x;
+  const float32x4_t max = vdupq_n_f32 (INT_MAX_F);
+
+  for (i = 0; i + 4 <= samples; i += 4)
+    {
+      x = vmulq_f32 (vld1q_f32 (&f[i]), max);
+      //This conversion already saturates.
+      v = vcvtq_s32_f32 (x);
+      vst1q_u8 ((uint8_t *) & s[i],
+		vrev32q_u8 (vreinterpretq_u8_s32 (v)));
+    }
+
+  ow_conv_encode_scalar_body (&f[i], &s[i], samples - i);
+}
+
+static void
+ow_conv_decode_neon (const int32_t * s, float *f, const float *scales,
+		     int samples)
+{
+  ow_conv_decode_neon_body (s, f, scales, 0, 0, samples);
+}
+
+static void
+ow_conv_encode_neon (const float *f, int32_t * s, int samples)
+{
+  ow_conv_encode_neon_body (f, s, samples);
+}
+
+#define OW_CONV_DEFINE_NEON_KERNELS(channels) \
+  OW_CONV_BLOCK_KERNELS (neon, , channels)
+#define OW_CONV_NEON_KERNEL_ENTRY(channels) \
+  OW_CONV_BLOCK_KERNEL_ENTRY (neon, channels)
+
+OW_CONV_FOR_EACH_CHANNELS (OW_CONV_DEFINE_NEON_KERNELS)
+
+static const struct ow_conv_block_kernel OW_CONV_NEON_KERNELS[] = {
+  OW_CONV_FOR_EACH_CHANNELS (OW_CONV_NEON_KERNEL_ENTRY) {0}
+};
+
+static const struct ow_conv_impl OW_CONV_NEON_IMPL = {
+  .name = "NEON",
+  .is_supported = ow_conv_is_supported_scalar,
+  .decode = ow_conv_decode_neon,
+  .encode = ow_conv_encode_neon,
+  .kernels = OW_CONV_NEON_KERNELS
+};
+
+#endif
+
+const struct ow_conv_impl *OW_CONV_IMPLS[] = {
+#if defined(OW_CONV_X86)
+  &OW_CONV_AVX2_IMPL, &OW_CONV_SSSE3_IMPL,
+#elif defined(OW_CONV_NEON)
+  &OW_CONV_NEON_IMPL,
+#endif
+  &OW_CONV_SCALAR_IMPL, NULL
+};
+
+const struct ow_conv_impl *
+ow_conv_get_impl ()
+{
+  static const struct ow_conv_impl *impl = NULL;
+
+  if (!impl)
+    {
+      for (const struct ow_conv_impl ** i = OW_CONV_IMPLS; *i != NULL; i++)
+	{
+	  if ((*i)->is_supported ())
+	    {
+	      impl = *i;
+	      break;
+	    }
+	}
+      debug_print (1, "Using %s sample conversion\n", impl->name);
+    }
+
+  return impl;
+}
+
+static const struct ow_conv_block_kernel *
+ow_conv_get_block_kernel (const struct ow_conv_impl *impl, int channels)
+{
+  for (const struct ow_conv_block_kernel * k = impl->kernels; k->channels;
+       k++)
+    {
+      if (k->channels == channels)
+	{
+	  return k;
+	}
+    }
+  return NULL;
+}
+
+//The scales are the ones of the tracks, not the ones repeated for every frame.
+ow_conv_decode_t
+ow_conv_get_block_decode (const struct ow_conv_impl *impl, int channels,
+			  const float *scales)
+{
+  int uniform = 1;
+  const struct ow_conv_block_kernel *k = ow_conv_get_block_kernel (impl,
+								   channels);
+
+  if (!k)
+    {
+      return impl->decode;
+    }
+
+  for (int i = 1; i < channels; i++)
+    {
+      if (scales[i] != scales[0])
+	{
+	  uniform = 0;
+	  break;
+	}
+    }
+
+  return uniform ? k->decode_uniform : k->decode;
+}
+
+ow_conv_encode_t
+ow_conv_get_block_encode (const struct ow_conv_impl *impl, int channels)
+{
+  const struct ow_conv_block_kernel *k = ow_conv_get_block_kernel (impl,
+								   channels);
+  return k ? k->encode : impl->encode;
+}
@@ -0,0 +1,79 @@
+/*
+ *   conv.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONV_H
+#define CONV_H
+
+#include <stdint.h>
+
+//Big-endian int32 samples to float samples multiplied by a scale per sample.
+typedef void (*ow_conv_decode_t) (const int32_t *, float *, const float *,
+				  int);
+
+//Float samples to saturated big-endian int32 samples.
+typedef void (*ow_conv_encode_t) (const float *, int32_t *, int);
+
+//Conversions of a whole USB block with a fixed number of channels, fully unrolled.
+//The uniform decoder is for the devices with the same scale in all the tracks.
+struct ow_conv_block_kernel
+{
+  int channels;
+  ow_conv_decode_t decode;
+  ow_conv_decode_t decode_uniform;
+  ow_conv_encode_t encode;
+};
+
+struct ow_conv_impl
+{
+  const char *name;
+  int (*is_supported) ();
+  ow_conv_decode_t decode;
+  ow_conv_encode_t encode;
+  const struct ow_conv_block_kernel *kernels;	//Terminated by 0 channels
+};
+
+//Ordered from the fastest to the slowest. The scalar implementation is always the last one.
+extern const struct ow_conv_impl *OW_CONV_IMPLS[];
+
+const struct ow_conv_impl *ow_conv_get_impl ();
+
+//These return the generic functions if there is no kernel for the channels.
+ow_conv_decode_t ow_conv_get_block_decode (const struct ow_conv_impl *, int,
+					   const float *);
+
+ow_conv_encode_t ow_conv_get_block_encode (const struct ow_conv_impl *, int);
+
+//Reference implementation. Every other implementation must give the same results.
+void ow_conv_decode_scalar (const int32_t *, float *, const float *, int);
+
+void ow_conv_encode_scalar (const float *, int32_t *, int);
+
+//Big-endian int32 frames of the given channels to float samples of some of the tracks.
+//The output is described by the distance between the tracks of a frame and the distance between frames so that it can be either interleaved or planar.
+//There is a scale per selected track.
+void ow_conv_decode_tracks (const int32_t *, int, float *, int, int,
+			    const int *, const float *, int, int);
+
+//Big-endian int32 frames of the given channels to interleaved host endian int32 frames of some of the tracks.
+//Every selected track is shifted left, saturating, by its own amount.
+void ow_conv_decode_int_tracks (const int32_t *, int, int32_t *, const int *,
+				const int *, int, int);
+
+#endif
@@ -23,6 +23,22 @@
 #include "dll.h"
 
 #define RATIO_DIFF_THRES 0.00001
+#define SEQ_LOAD_MAX_TRIES 4
+
+static inline void
+ow_dll_overwitch_write_begin (struct ow_dll_overwitch *dll_ow)
+{
+  unsigned int seq = atomic_load_explicit (&dll_ow->seq,
+					   memory_order_relaxed);
+  atomic_store_explicit (&dll_ow->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+}
+
+static inline void
+ow_dll_overwitch_write_end (struct ow_dll_overwitch *dll_ow)
+{
+  atomic_fetch_add_explicit (&dll_ow->seq, 1, memory_order_release);
+}
 
 //Taken from https://github.com/jackaudio/tools/blob/master/zalsa/alsathread.cc.
 inline void
@@ -35,23 +51,68 @@ ow_dll_overwitch_init (struct ow_dll_overwitch *dll_ow, double samplerate,
   dll_ow->c = w * w;
 
   dll_ow->e2 = dtime;
+  dll_ow->anchored = 0;
+
+  ow_dll_overwitch_write_begin (dll_ow);
   dll_ow->i0.time = time;
   dll_ow->i1.time = dll_ow->i0.time + dll_ow->e2;
 
   dll_ow->i0.frames = 0;
   dll_ow->i1.frames = frames_per_transfer;
+  ow_dll_overwitch_write_end (dll_ow);
 }
 
 inline void
 ow_dll_overwitch_inc (struct ow_dll_overwitch *dll_ow,
 		      int frames_per_transfer, double time)
 {
-  double e = time - dll_ow->i1.time;
+  double e = dll_ow->anchored ? time - dll_ow->i1.time : 0.0;
+
+  ow_dll_overwitch_write_begin (dll_ow);
+  //The init time is not in phase with the transfers and the filter would take seconds to fix it, which the resampler would follow.
+  //Readers must not see the anchor outside of the write section.
+  if (!dll_ow->anchored)
+    {
+      dll_ow->i1.time = time;
+      dll_ow->anchored = 1;
+    }
   dll_ow->i0.time = dll_ow->i1.time;
   dll_ow->i1.time += dll_ow->b * e + dll_ow->e2;
-  dll_ow->e2 += dll_ow->c * e;
   dll_ow->i0.frames = dll_ow->i1.frames;
   dll_ow->i1.frames += frames_per_transfer;
+  ow_dll_overwitch_write_end (dll_ow);
+
+  dll_ow->e2 += dll_ow->c * e;
+}
+
+//The reader never waits for the writer. If a consistent copy can not be taken after a few tries, it returns 0 and nothing is copied.
+inline int
+ow_dll_overwitch_load (struct ow_dll_overwitch *dll_ow, struct instant *i0,
+		       struct instant *i1)
+{
+  unsigned int seq0, seq1;
+  struct instant t0, t1;
+
+  for (int i = 0; i < SEQ_LOAD_MAX_TRIES; i++)
+    {
+      seq0 = atomic_load_explicit (&dll_ow->seq, memory_order_acquire);
+      if (seq0 & 1)
+	{
+	  continue;
+	}
+      t0 = dll_ow->i0;
+      t1 = dll_ow->i1;
+      atomic_thread_fence (memory_order_acquire);
+      seq1 = atomic_load_explicit (&dll_ow->seq, memory_order_relaxed);
+      if (seq0 == seq1)
+	{
+	  *i0 = t0;
+	  *i1 = t1;
+	  return 1;
+	}
+    }
+
+  return 0;
 }
 
 //The whole calculation of the delay and the loop filter is taken from https://github.com/jackaudio/tools/blob/master/zalsa/jackclient.cc.
@@ -89,6 +150,16 @@ inline void
 ow_dll_primary_init (struct ow_dll *dll)
 {
   dll->set = 0;
+  atomic_init (&dll->dll_ow.seq, 0);
+}
+
+static void
+ow_dll_primary_set_delay (struct ow_dll *dll, int output_frames_per_transfer,
+			  int input_frames_per_transfer)
+{
+  dll->kdel_nominal =
+    2.0 * input_frames_per_transfer + 1.5 * output_frames_per_transfer;
+  dll->kdel = dll->kdel_nominal;
 }
 
 inline void
@@ -108,13 +179,31 @@ ow_dll_primary_reset (struct ow_dll *dll, double output_samplerate,
 
   dll->kj = -input_frames_per_transfer / dll->ratio;
 
-  dll->kdel =
-    2.0 * input_frames_per_transfer + 1.5 * output_frames_per_transfer;
+  ow_dll_primary_set_delay (dll, output_frames_per_transfer,
+			    input_frames_per_transfer);
 
   debug_print (2, "Target delay: %.1f ms (%d frames)\n",
 	       dll->kdel * 1000 / input_samplerate, dll->kdel);
 }
 
+//The integrator holds the whole ratio so that the loop continues from it.
+inline void
+ow_dll_primary_resume (struct ow_dll *dll, double ratio,
+		       int output_frames_per_transfer,
+		       int input_frames_per_transfer)
+{
+  dll->_z1 = 0.0;
+  dll->_z2 = 0.0;
+  dll->_z3 = 1.0 - ratio;
+  dll->ratio = ratio;
+  dll->ratio_sum = 0.0;
+  dll->ratio_avg = ratio;
+  dll->last_ratio_avg = ratio;
+
+  ow_dll_primary_set_delay (dll, output_frames_per_transfer,
+			    input_frames_per_transfer);
+}
+
 //Taken from https://github.com/jackaudio/tools/blob/master/zalsa/jackclient.cc.
 inline void
 ow_dll_primary_first_time_run (struct ow_dll *dll)
@@ -138,13 +227,25 @@ ow_dll_primary_set_loop_filter (struct ow_dll *dll, double bw,
   dll->_w2 = w * output_frames_per_transfer / 1.6;
 }
 
+inline void
+ow_dll_primary_set_target_delay (struct ow_dll *dll, int kdel)
+{
+  dll->kdel = kdel;
+}
+
 inline void
 ow_dll_primary_load_dll_overwitch (struct ow_dll *dll)
 {
-  dll->ko0 = dll->dll_ow.i0.frames;
-  dll->to0 = dll->dll_ow.i0.time;
-  dll->ko1 = dll->dll_ow.i1.frames;
-  dll->to1 = dll->dll_ow.i1.time;
+  struct instant i0, i1;
+
+  //If the writer is busy, the previous values are kept for this cycle.
+  if (ow_dll_overwitch_load (&dll->dll_ow, &i0, &i1))
+    {
+      dll->ko0 = i0.frames;
+      dll->to0 = i0.time;
+      dll->ko1 = i1.frames;
+      dll->to1 = i1.time;
+    }
 }
 
 inline int
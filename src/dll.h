@@ -22,6 +22,8 @@
 #define DLL_H
 
 #include <stdint.h>
+#include <stdatomic.h>
+#include "utils.h"
 
 struct instant
 {
@@ -29,13 +31,16 @@ struct instant
   uint32_t frames;
 };
 
+//The instants are written by the audio thread and read from the JACK thread so they are protected by a sequence lock.
 struct ow_dll_overwitch
 {
+  atomic_uint seq;
   struct instant i0;
   struct instant i1;
   double e2;
   double b;
   double c;
+  int anchored;			//The first transfer sets the phase
 };
 
 struct ow_dll
@@ -46,6 +51,7 @@ struct ow_dll
   double _w1;
   double _w2;
   int kdel;
+  int kdel_nominal;		//Worst case target delay for the transfer sizes
   double _z1;
   double _z2;
   double _z3;
@@ -57,20 +63,30 @@ struct ow_dll
   uint32_t ko1;
   double to0;
   double to1;
-  struct ow_dll_overwitch dll_ow;
   int set;
+  //Written by the audio thread, so it does not share a cache line with the fields above.
+  struct ow_dll_overwitch dll_ow OW_CACHE_ALIGNED;
 };
 
 void ow_dll_overwitch_init (struct ow_dll_overwitch *, double, int, double);
 
 void ow_dll_overwitch_inc (struct ow_dll_overwitch *, int, double);
 
+int ow_dll_overwitch_load (struct ow_dll_overwitch *, struct instant *,
+			   struct instant *);
+
 void ow_dll_primary_init (struct ow_dll *);
 
 void ow_dll_primary_reset (struct ow_dll *, double, double, int, int);
 
+//Continues from the given ratio with the given output frames per transfer.
+void ow_dll_primary_resume (struct ow_dll *, double, int, int);
+
 void ow_dll_primary_set_loop_filter (struct ow_dll *, double, int, double);
 
+//The loop follows the new target as an error, so the delay changes smoothly.
+void ow_dll_primary_set_target_delay (struct ow_dll *, int);
+
 void ow_dll_primary_update_err (struct ow_dll *, double);
 
 void ow_dll_primary_update (struct ow_dll *);
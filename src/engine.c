@@ -27,9 +27,13 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <endian.h>
+#include <limits.h>
+#include <math.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include "engine.h"
+#include "loop.h"
 
 #define AUDIO_IN_EP  0x83
 #define AUDIO_OUT_EP 0x03
@@ -41,10 +45,11 @@
 
 #define USB_BULK_MIDI_SIZE 512
 
-#define SAMPLE_TIME_NS (1e9 / ((int)OB_SAMPLE_RATE))
+//Upper bound for a single sleep so that odd timestamps do not block the p2o MIDI thread.
+#define P2O_MIDI_MAX_WAIT_S 0.1
 
-static void prepare_cycle_in_audio ();
-static void prepare_cycle_out_audio ();
+static void prepare_cycle_in_audio (struct libusb_transfer *);
+static void prepare_cycle_out_audio (struct libusb_transfer *);
 static void prepare_cycle_in_midi ();
 
 static void
@@ -52,21 +57,58 @@ ow_engine_set_name (struct ow_engine *engine, uint8_t bus, uint8_t address)
 {
   snprintf (engine->name, OW_LABEL_MAX_LEN, "%s@%03d,%03d",
 	    engine->device_desc->name, bus, address);
+  engine->usb.bus = bus;
+  engine->usb.address = address;
 }
 
-static int
-prepare_transfers (struct ow_engine *engine)
+static void
+ow_engine_set_serial (struct ow_engine *engine, uint8_t index)
 {
-  engine->usb.xfr_in = libusb_alloc_transfer (0);
-  if (!engine->usb.xfr_in)
+  if (!index || libusb_get_string_descriptor_ascii (engine->usb.device_handle,
+						    index,
+						    (unsigned char *)
+						    engine->serial,
+						    OW_LABEL_MAX_LEN) < 0)
     {
-      return -ENOMEM;
+      engine->serial[0] = 0;
     }
+}
 
-  engine->usb.xfr_out = libusb_alloc_transfer (0);
-  if (!engine->usb.xfr_out)
+static void
+ow_engine_set_thread_cpus (struct ow_engine *engine)
+{
+  engine->usb_cpu =
+    ow_get_usb_bus_thread_cpu (engine->context->usb_cpu, engine->usb.bus);
+  //This thread is idle most of the time and shares data with the USB thread.
+  if (engine->context->p2o_midi_cpu == OW_CPU_AUTO)
     {
-      return -ENOMEM;
+      engine->p2o_midi_cpu = engine->usb_cpu;
+    }
+  else
+    {
+      engine->p2o_midi_cpu = engine->context->p2o_midi_cpu;
+    }
+
+  debug_print (1, "%s: USB thread CPU: %d; p2o MIDI thread CPU: %d\n",
+	       engine->name, engine->usb_cpu, engine->p2o_midi_cpu);
+}
+
+static int
+prepare_transfers (struct ow_engine *engine)
+{
+  for (int i = 0; i < engine->usb.xfrs; i++)
+    {
+      engine->usb.xfr_in[i] = libusb_alloc_transfer (0);
+      if (!engine->usb.xfr_in[i])
+	{
+	  return -ENOMEM;
+	}
+
+      engine->usb.xfr_out[i] = libusb_alloc_transfer (0);
+      if (!engine->usb.xfr_out[i])
+	{
+	  return -ENOMEM;
+	}
     }
 
   engine->usb.xfr_in_midi = libusb_alloc_transfer (0);
@@ -75,10 +117,13 @@ prepare_transfers (struct ow_engine *engine)
       return -ENOMEM;
     }
 
-  engine->usb.xfr_out_midi = libusb_alloc_transfer (0);
-  if (!engine->usb.xfr_out_midi)
+  for (int i = 0; i < OW_ENGINE_P2O_MIDI_XFRS; i++)
     {
-      return -ENOMEM;
+      engine->usb.xfr_out_midi[i] = libusb_alloc_transfer (0);
+      if (!engine->usb.xfr_out_midi[i])
+	{
+	  return -ENOMEM;
+	}
     }
 
   return LIBUSB_SUCCESS;
@@ -87,78 +132,256 @@ prepare_transfers (struct ow_engine *engine)
 static void
 free_transfers (struct ow_engine *engine)
 {
-  libusb_free_transfer (engine->usb.xfr_in);
-  libusb_free_transfer (engine->usb.xfr_out);
+  for (int i = 0; i < engine->usb.xfrs; i++)
+    {
+      libusb_free_transfer (engine->usb.xfr_in[i]);
+      libusb_free_transfer (engine->usb.xfr_out[i]);
+    }
   libusb_free_transfer (engine->usb.xfr_in_midi);
-  libusb_free_transfer (engine->usb.xfr_out_midi);
+  for (int i = 0; i < OW_ENGINE_P2O_MIDI_XFRS; i++)
+    {
+      libusb_free_transfer (engine->usb.xfr_out_midi[i]);
+    }
+}
+
+static void
+ow_engine_set_o2p_tracks (struct ow_engine *engine, uint32_t mask)
+{
+  const struct ow_device_desc *desc = engine->device_desc;
+
+  engine->o2p_tracks = 0;
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      if (mask & (1U << i))
+	{
+	  engine->o2p_track_index[engine->o2p_tracks] = i;
+	  engine->o2p_track_scales[engine->o2p_tracks] =
+	    desc->output_track_scales[i];
+	  //The scales are the inverse of the maximum values and 1 / INT_MAX means no shift.
+	  engine->o2p_track_shifts[engine->o2p_tracks] =
+	    engine->options.o2p_int_shift ?
+	    (int) roundf (log2f (desc->output_track_scales[i] *
+				 (float) INT_MAX)) : 0;
+	  engine->o2p_tracks++;
+	}
+    }
+  engine->o2p_tracks_transfer_size = engine->frames_per_transfer *
+    engine->o2p_tracks * OB_BYTES_PER_SAMPLE;
+
+  //Readers rely on this being published before any data with the new layout.
+  //The position tells them where the data with the previous layout ends.
+  atomic_store_explicit (&engine->o2p_track_mask_pos, engine->o2p_written,
+			 memory_order_relaxed);
+  atomic_store_explicit (&engine->o2p_track_mask, mask,
+			 memory_order_release);
+}
+
+//Only called from the audio thread.
+inline void
+ow_engine_update_o2p_tracks (struct ow_engine *engine)
+{
+  uint32_t mask = atomic_load_explicit (&engine->o2p_track_mask_req,
+					memory_order_relaxed);
+
+  if (mask != atomic_load_explicit (&engine->o2p_track_mask,
+				    memory_order_relaxed))
+    {
+      ow_engine_set_o2p_tracks (engine, mask);
+      debug_print (1, "o2p: Using %d tracks (mask 0x%x)\n",
+		   engine->o2p_tracks, mask);
+    }
+}
+
+//A block of interleaved frames with just the active tracks.
+//With all the tracks, the block of the transfer already decoded into the tap is copied instead.
+static inline void
+ow_engine_decode_usb_block (struct ow_engine *engine, int n, float *f)
+{
+  struct ow_engine_usb_blk *blk = GET_NTH_INPUT_USB_BLK (engine, n);
+
+  if (engine->options.o2p_int)
+    {
+      ow_conv_decode_int_tracks (blk->data, engine->device_desc->outputs,
+				 (int32_t *) f, engine->o2p_track_index,
+				 engine->o2p_track_shifts, engine->o2p_tracks,
+				 OB_FRAMES_PER_BLOCK);
+    }
+  else if (engine->o2p_tracks == engine->device_desc->outputs)
+    {
+      if (engine->tap)
+	{
+	  memcpy (f, ow_tap_writer_get_committed_block (engine->tap,
+							engine->blocks_per_transfer
+							- n),
+		  engine->o2p_block_samples * OB_BYTES_PER_SAMPLE);
+	}
+      else
+	{
+	  engine->o2p_block_decode (blk->data, f, engine->o2p_block_scales,
+				    engine->o2p_block_samples);
+	}
+    }
+  else
+    {
+      ow_conv_decode_tracks (blk->data, engine->device_desc->outputs, f, 1,
+			     engine->o2p_tracks, engine->o2p_track_index,
+			     engine->o2p_track_scales, engine->o2p_tracks,
+			     OB_FRAMES_PER_BLOCK);
+    }
 }
 
 inline void
 ow_engine_read_usb_input_blocks (struct ow_engine *engine)
 {
-  int32_t hv;
-  int32_t *s;
   struct ow_engine_usb_blk *blk;
   float *f = engine->o2p_transfer_buf;
 
+  if (engine->options.planar)
+    {
+      for (int i = 0; i < engine->blocks_per_transfer; i++)
+	{
+	  blk = GET_NTH_INPUT_USB_BLK (engine, i);
+	  ow_conv_decode_tracks (blk->data, engine->device_desc->outputs, f,
+				 engine->frames_per_transfer, 1,
+				 engine->o2p_track_index,
+				 engine->o2p_track_scales, engine->o2p_tracks,
+				 OB_FRAMES_PER_BLOCK);
+	  f += OB_FRAMES_PER_BLOCK;
+	}
+      return;
+    }
+
   for (int i = 0; i < engine->blocks_per_transfer; i++)
     {
-      blk = GET_NTH_INPUT_USB_BLK (engine, i);
-      s = blk->data;
-      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
+      ow_engine_decode_usb_block (engine, i, f);
+      f += OB_FRAMES_PER_BLOCK * engine->o2p_tracks;
+    }
+}
+
+//Blocks are decoded straight into the buffer memory. Only a block split by the end of the buffer goes through the transfer buffer.
+inline void
+ow_engine_read_usb_input_blocks_to_vector (struct ow_engine *engine,
+					   struct ow_buffer_vector *v)
+{
+  size_t pos, first;
+  size_t blk_size =
+    OB_FRAMES_PER_BLOCK * engine->o2p_tracks * OB_BYTES_PER_SAMPLE;
+  char *aux = (char *) engine->o2p_transfer_buf;
+
+  pos = 0;
+  for (int i = 0; i < engine->blocks_per_transfer; i++)
+    {
+      if (v->len - pos >= blk_size)
 	{
-	  const float *scale = engine->device_desc->output_track_scales;
-	  for (int k = 0; k < engine->device_desc->outputs; k++, scale++)
+	  ow_engine_decode_usb_block (engine, i, (float *) &v->buf[pos]);
+	  pos += blk_size;
+	  if (pos == v->len)
 	    {
-	      hv = be32toh (*s);
-	      *f = hv * (*scale);
-	      f++;
-	      s++;
+	      v++;
+	      pos = 0;
 	    }
 	}
+      else
+	{
+	  ow_engine_decode_usb_block (engine, i, (float *) aux);
+	  first = v->len - pos;
+	  memcpy (&v->buf[pos], aux, first);
+	  v++;
+	  pos = blk_size - first;
+	  memcpy (v->buf, &aux[first], pos);
+	}
     }
 }
 
-static void
-set_usb_input_data_blks (struct ow_engine *engine)
+//All the tracks are decoded straight into the tap, whatever the engine status and the o2p mask are.
+//This must be done before reading the blocks for o2p as they are copied from here.
+static inline void
+ow_engine_write_tap (struct ow_engine *engine)
 {
-  size_t wso2p;
+  struct ow_engine_usb_blk *blk;
+
+  for (int i = 0; i < engine->blocks_per_transfer; i++)
+    {
+      blk = GET_NTH_INPUT_USB_BLK (engine, i);
+      engine->o2p_block_decode (blk->data,
+				ow_tap_writer_get_block (engine->tap),
+				engine->o2p_block_scales,
+				engine->o2p_block_samples);
+      ow_tap_writer_commit_block (engine->tap);
+    }
+}
+
+//Only the audio thread writes these so there is no need for a CAS loop.
+static inline void
+ow_engine_update_latency (atomic_size_t * latency,
+			  atomic_size_t * max_latency, size_t value)
+{
+  atomic_store_explicit (latency, value, memory_order_relaxed);
+  if (value > atomic_load_explicit (max_latency, memory_order_relaxed))
+    {
+      atomic_store_explicit (max_latency, value, memory_order_relaxed);
+    }
+}
+
+void
+ow_engine_set_usb_input_data_blks (struct ow_engine *engine)
+{
+  size_t wso2p, latency;
   ow_engine_status_t status;
+  struct ow_buffer_vector v[2];
 
-  pthread_spin_lock (&engine->lock);
-  if (engine->context->dll)
+  if (engine->options.dll)
     {
       ow_dll_overwitch_inc (engine->context->dll, engine->frames_per_transfer,
 			    engine->context->get_time ());
     }
-  status = engine->status;
-  pthread_spin_unlock (&engine->lock);
-
-  ow_engine_read_usb_input_blocks (engine);
+  ow_engine_update_o2p_tracks (engine);
+  if (engine->tap)
+    {
+      ow_engine_write_tap (engine);
+    }
+  status = ow_engine_get_status (engine);
 
   if (status < OW_ENGINE_STATUS_RUN)
     {
       return;
     }
 
-  pthread_spin_lock (&engine->lock);
-  engine->o2p_latency =
-    engine->context->read_space (engine->context->o2p_audio);
-  if (engine->o2p_latency > engine->o2p_max_latency)
+  latency = engine->context->read_space (engine->context->o2p_audio);
+  ow_engine_update_latency (&engine->o2p_latency, &engine->o2p_max_latency,
+			    latency);
+
+  if (engine->options.o2p_zero_copy)
+    {
+      engine->context->get_write_vector (engine->context->o2p_audio, v);
+      wso2p = v[0].len + v[1].len;
+    }
+  else
     {
-      engine->o2p_max_latency = engine->o2p_latency;
+      wso2p = engine->context->write_space (engine->context->o2p_audio);
     }
-  pthread_spin_unlock (&engine->lock);
 
-  wso2p = engine->context->write_space (engine->context->o2p_audio);
-  if (engine->o2p_transfer_size <= wso2p)
+  if (engine->o2p_tracks_transfer_size <= wso2p)
     {
-      engine->context->write (engine->context->o2p_audio,
-			      (void *) engine->o2p_transfer_buf,
-			      engine->o2p_transfer_size);
+      if (engine->options.o2p_zero_copy)
+	{
+	  ow_engine_read_usb_input_blocks_to_vector (engine, v);
+	  engine->context->commit (engine->context->o2p_audio,
+				   engine->o2p_tracks_transfer_size);
+	}
+      else
+	{
+	  ow_engine_read_usb_input_blocks (engine);
+	  engine->context->write (engine->context->o2p_audio,
+				  (void *) engine->o2p_transfer_buf,
+				  engine->o2p_tracks_transfer_size);
+	}
+      engine->o2p_written += engine->o2p_tracks_transfer_size;
     }
   else
     {
+      atomic_fetch_add_explicit (&engine->o2p_overflows, 1,
+				 memory_order_relaxed);
       error_print ("o2p: Audio ring buffer overflow. Discarding data...\n");
     }
 }
@@ -166,8 +389,6 @@ set_usb_input_data_blks (struct ow_engine *engine)
 inline void
 ow_engine_write_usb_output_blocks (struct ow_engine *engine)
 {
-  int32_t ov;
-  int32_t *s;
   struct ow_engine_usb_blk *blk;
   float *f = engine->p2o_transfer_buf;
 
@@ -176,27 +397,59 @@ ow_engine_write_usb_output_blocks (struct ow_engine *engine)
       blk = GET_NTH_OUTPUT_USB_BLK (engine, i);
       blk->frames = htobe16 (engine->usb.frames);
       engine->usb.frames += OB_FRAMES_PER_BLOCK;
-      s = blk->data;
-      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
+      engine->p2o_block_encode (f, blk->data, engine->p2o_block_samples);
+      f += engine->p2o_block_samples;
+    }
+}
+
+//Blocks are encoded straight from the buffer memory. Only a block split by the end of the buffer goes through the transfer buffer.
+inline void
+ow_engine_write_usb_output_blocks_from_vector (struct ow_engine *engine,
+					       struct ow_buffer_vector *v)
+{
+  size_t pos, first;
+  struct ow_engine_usb_blk *blk;
+  size_t blk_size = engine->p2o_block_samples * OB_BYTES_PER_SAMPLE;
+  char *aux = (char *) engine->p2o_transfer_buf;
+
+  pos = 0;
+  for (int i = 0; i < engine->blocks_per_transfer; i++)
+    {
+      blk = GET_NTH_OUTPUT_USB_BLK (engine, i);
+      blk->frames = htobe16 (engine->usb.frames);
+      engine->usb.frames += OB_FRAMES_PER_BLOCK;
+      if (v->len - pos >= blk_size)
 	{
-	  for (int k = 0; k < engine->device_desc->inputs; k++)
+	  engine->p2o_block_encode ((float *) &v->buf[pos], blk->data,
+				    engine->p2o_block_samples);
+	  pos += blk_size;
+	  if (pos == v->len)
 	    {
-	      ov = htobe32 ((int32_t) (*f * INT_MAX));
-	      *s = ov;
-	      f++;
-	      s++;
+	      v++;
+	      pos = 0;
 	    }
 	}
+      else
+	{
+	  first = v->len - pos;
+	  memcpy (aux, &v->buf[pos], first);
+	  v++;
+	  pos = blk_size - first;
+	  memcpy (&aux[first], v->buf, pos);
+	  engine->p2o_block_encode ((float *) aux, blk->data,
+				    engine->p2o_block_samples);
+	}
     }
 }
 
-static void
-set_usb_output_data_blks (struct ow_engine *engine)
+void
+ow_engine_set_usb_output_data_blks (struct ow_engine *engine)
 {
   size_t rsp2o;
   size_t bytes;
   long frames;
   int res;
+  struct ow_buffer_vector v[2];
   int p2o_enabled = ow_engine_is_p2o_audio_enabled (engine);
 
   if (p2o_enabled)
@@ -222,22 +475,28 @@ set_usb_output_data_blks (struct ow_engine *engine)
       goto set_blocks;
     }
 
-  pthread_spin_lock (&engine->lock);
-  engine->p2o_latency = rsp2o;
-  if (engine->p2o_latency > engine->p2o_max_latency)
-    {
-      engine->p2o_max_latency = engine->p2o_latency;
-    }
-  pthread_spin_unlock (&engine->lock);
+  ow_engine_update_latency (&engine->p2o_latency, &engine->p2o_max_latency,
+			    rsp2o);
 
   if (rsp2o >= engine->p2o_transfer_size)
     {
+      if (engine->options.p2o_zero_copy)
+	{
+	  engine->context->get_read_vector (engine->context->p2o_audio, v);
+	  ow_engine_write_usb_output_blocks_from_vector (engine, v);
+	  engine->context->advance (engine->context->p2o_audio,
+				    engine->p2o_transfer_size);
+	  return;
+	}
+
       engine->context->read (engine->context->p2o_audio,
 			     (void *) engine->p2o_transfer_buf,
 			     engine->p2o_transfer_size);
     }
   else
     {
+      atomic_fetch_add_explicit (&engine->p2o_underflows, 1,
+				 memory_order_relaxed);
       debug_print (2,
 		   "p2o: Audio ring buffer underflow (%zu < %zu). Resampling...\n",
 		   rsp2o, engine->p2o_transfer_size);
@@ -270,12 +529,72 @@ set_blocks:
   ow_engine_write_usb_output_blocks (engine);
 }
 
+//Once the engine is stopped, transfers are not resubmitted.
+static inline int
+ow_engine_end_transfer (struct ow_engine *engine)
+{
+  atomic_fetch_sub_explicit (&engine->usb.in_flight, 1, memory_order_release);
+  return ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP;
+}
+
+static int
+ow_engine_submit_transfer (struct ow_engine *engine,
+			   struct libusb_transfer *xfr)
+{
+  int err;
+
+  atomic_fetch_add_explicit (&engine->usb.in_flight, 1, memory_order_relaxed);
+  err = libusb_submit_transfer (xfr);
+  if (err)
+    {
+      atomic_fetch_sub_explicit (&engine->usb.in_flight, 1,
+				 memory_order_relaxed);
+    }
+  return err;
+}
+
+static inline void
+ow_engine_add_o2p_xfr_interval (struct ow_engine *engine, uint64_t now)
+{
+  int64_t deviation;
+
+  if (engine->o2p_xfr_last_time)
+    {
+      deviation = (int64_t) (now - engine->o2p_xfr_last_time) -
+	engine->xfr_duration;
+      deviation = deviation < 0 ? -deviation : deviation;
+      ow_stats_histogram_add (&engine->o2p_xfr_jitter,
+			      deviation > UINT32_MAX ? UINT32_MAX :
+			      deviation);
+    }
+  engine->o2p_xfr_last_time = now;
+}
+
 static void LIBUSB_CALL
 cb_xfr_in (struct libusb_transfer *xfr)
 {
+  struct ow_engine *engine = xfr->user_data;
+  uint64_t start;
+
+  if (ow_engine_end_transfer (engine))
+    {
+      return;
+    }
+
+  start = ow_get_time_ns ();
+  ow_engine_add_o2p_xfr_interval (engine, start);
+
   if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
     {
-      set_usb_input_data_blks (xfr->user_data);
+      engine->usb.data_in = (char *) xfr->buffer;
+      if (engine->capture)
+	{
+	  ow_capture_writer_write (engine->capture, OW_CAPTURE_RECORD_AUDIO,
+				   engine->context->get_time (),
+				   engine->usb.data_in,
+				   engine->usb.data_in_len);
+	}
+      ow_engine_set_usb_input_data_blks (engine);
     }
   else
     {
@@ -283,30 +602,87 @@ cb_xfr_in (struct libusb_transfer *xfr)
 		   libusb_strerror (xfr->status));
     }
   // start new cycle even if this one did not succeed
-  prepare_cycle_in_audio (xfr->user_data);
+  prepare_cycle_in_audio (xfr);
+
+  ow_stats_histogram_add (&engine->o2p_xfr_time, ow_get_time_ns () - start);
 }
 
 static void LIBUSB_CALL
 cb_xfr_out (struct libusb_transfer *xfr)
 {
+  struct ow_engine *engine = xfr->user_data;
+  uint64_t start;
+
+  if (ow_engine_end_transfer (engine))
+    {
+      return;
+    }
+
+  start = ow_get_time_ns ();
+
   if (xfr->status != LIBUSB_TRANSFER_COMPLETED)
     {
       error_print ("p2o: Error on USB audio transfer: %s\n",
 		   libusb_strerror (xfr->status));
     }
-  set_usb_output_data_blks (xfr->user_data);
+  //The other transfers are still in flight so this buffer is the last one in the queue.
+  engine->usb.data_out = (char *) xfr->buffer;
+  ow_engine_set_usb_output_data_blks (engine);
   // We have to make sure that the out cycle is always started after its callback
   // Race condition on slower systems!
-  prepare_cycle_out_audio (xfr->user_data);
+  prepare_cycle_out_audio (xfr);
+
+  ow_stats_histogram_add (&engine->p2o_xfr_time, ow_get_time_ns () - start);
+}
+
+inline void
+ow_engine_set_usb_input_midi_events (struct ow_engine *engine,
+				     const uint8_t * data, int len,
+				     double time)
+{
+  struct ow_midi_event event;
+  int length = 0;
+
+  event.time = time;
+
+  while (length < len)
+    {
+      memcpy (event.bytes, &data[length], OB_MIDI_EVENT_SIZE);
+      //Note-off, Note-on, Poly-KeyPress, Control Change, Program Change, Channel Pressure, PitchBend Change, Single Byte
+      if (event.bytes[0] >= 0x08 && event.bytes[0] <= 0x0f)
+	{
+	  debug_print (2, "o2p MIDI: %02x, %02x, %02x, %02x (%f)\n",
+		       event.bytes[0], event.bytes[1], event.bytes[2],
+		       event.bytes[3], event.time);
+
+	  if (engine->context->write_space (engine->context->o2p_midi) >=
+	      sizeof (struct ow_midi_event))
+	    {
+	      engine->context->write (engine->context->o2p_midi,
+				      (void *) &event,
+				      sizeof (struct ow_midi_event));
+	    }
+	  else
+	    {
+	      error_print
+		("o2p: MIDI ring buffer overflow. Discarding data...\n");
+	    }
+	}
+      length += OB_MIDI_EVENT_SIZE;
+    }
 }
 
 static void LIBUSB_CALL
 cb_xfr_in_midi (struct libusb_transfer *xfr)
 {
-  struct ow_midi_event event;
-  int length;
+  double time;
   struct ow_engine *engine = xfr->user_data;
 
+  if (ow_engine_end_transfer (engine))
+    {
+      return;
+    }
+
   if (ow_engine_get_status (engine) < OW_ENGINE_STATUS_RUN)
     {
       goto end;
@@ -314,35 +690,15 @@ cb_xfr_in_midi (struct libusb_transfer *xfr)
 
   if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
     {
-      length = 0;
-      event.time = engine->context->get_time ();
-
-      while (length < xfr->actual_length)
+      time = engine->context->get_time ();
+      if (engine->capture && xfr->actual_length)
 	{
-	  memcpy (event.bytes, &engine->o2p_midi_data[length],
-		  OB_MIDI_EVENT_SIZE);
-	  //Note-off, Note-on, Poly-KeyPress, Control Change, Program Change, Channel Pressure, PitchBend Change, Single Byte
-	  if (event.bytes[0] >= 0x08 && event.bytes[0] <= 0x0f)
-	    {
-	      debug_print (2, "o2p MIDI: %02x, %02x, %02x, %02x (%f)\n",
-			   event.bytes[0], event.bytes[1], event.bytes[2],
-			   event.bytes[3], event.time);
-
-	      if (engine->context->write_space (engine->context->o2p_midi) >=
-		  sizeof (struct ow_midi_event))
-		{
-		  engine->context->write (engine->context->o2p_midi,
-					  (void *) &event,
-					  sizeof (struct ow_midi_event));
-		}
-	      else
-		{
-		  error_print
-		    ("o2p: MIDI ring buffer overflow. Discarding data...\n");
-		}
-	    }
-	  length += OB_MIDI_EVENT_SIZE;
+	  ow_capture_writer_write (engine->capture, OW_CAPTURE_RECORD_MIDI,
+				   time, engine->o2p_midi_data,
+				   xfr->actual_length);
 	}
+      ow_engine_set_usb_input_midi_events (engine, engine->o2p_midi_data,
+					   xfr->actual_length, time);
     }
   else
     {
@@ -357,14 +713,34 @@ end:
   prepare_cycle_in_midi (engine);
 }
 
+//Only an eventfd write, so this can be called from any thread, including JACK's.
+static inline void
+ow_engine_signal_fd (int fd)
+{
+  uint64_t v = 1;
+
+  if (fd >= 0 && write (fd, &v, sizeof (v)) < 0)
+    {
+      error_print ("Error while writing to eventfd: %s\n", strerror (errno));
+    }
+}
+
+//Blocks until the eventfd is signalled.
+static inline void
+ow_engine_wait_fd (int fd)
+{
+  uint64_t v;
+
+  while (read (fd, &v, sizeof (v)) < 0 && errno == EINTR);
+}
+
 static void LIBUSB_CALL
 cb_xfr_out_midi (struct libusb_transfer *xfr)
 {
   struct ow_engine *engine = xfr->user_data;
 
-  pthread_spin_lock (&engine->p2o_midi_lock);
-  engine->p2o_midi_ready = 1;
-  pthread_spin_unlock (&engine->p2o_midi_lock);
+  ow_engine_end_transfer (engine);
+  ow_engine_signal_fd (engine->p2o_midi_free_fd);
 
   if (xfr->status != LIBUSB_TRANSFER_COMPLETED)
     {
@@ -374,38 +750,53 @@ cb_xfr_out_midi (struct libusb_transfer *xfr)
 }
 
 static void
-prepare_cycle_out_audio (struct ow_engine *engine)
+prepare_cycle_out_audio (struct libusb_transfer *xfr)
 {
-  libusb_fill_interrupt_transfer (engine->usb.xfr_out,
-				  engine->usb.device_handle, AUDIO_OUT_EP,
-				  (void *) engine->usb.data_out,
-				  engine->usb.data_out_len, cb_xfr_out,
-				  engine, 0);
-
-  int err = libusb_submit_transfer (engine->usb.xfr_out);
+  int err = ow_engine_submit_transfer (xfr->user_data, xfr);
   if (err)
     {
       error_print ("p2o: Error when submitting USB audio transfer: %s\n",
 		   libusb_strerror (err));
-      ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+      ow_engine_set_status (xfr->user_data, OW_ENGINE_STATUS_ERROR);
     }
 }
 
 static void
-prepare_cycle_in_audio (struct ow_engine *engine)
+prepare_cycle_in_audio (struct libusb_transfer *xfr)
 {
-  libusb_fill_interrupt_transfer (engine->usb.xfr_in,
-				  engine->usb.device_handle, AUDIO_IN_EP,
-				  (void *) engine->usb.data_in,
-				  engine->usb.data_in_len, cb_xfr_in, engine,
-				  0);
-
-  int err = libusb_submit_transfer (engine->usb.xfr_in);
+  int err = ow_engine_submit_transfer (xfr->user_data, xfr);
   if (err)
     {
       error_print ("o2p: Error when submitting USB audio in transfer: %s\n",
 		   libusb_strerror (err));
-      ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+      ow_engine_set_status (xfr->user_data, OW_ENGINE_STATUS_ERROR);
+    }
+}
+
+//Every transfer has its own buffer, which is reused every time the transfer is resubmitted.
+static void
+prepare_audio_transfers (struct ow_engine *engine)
+{
+  char *data_in;
+
+  for (int i = 0; i < engine->usb.xfrs; i++)
+    {
+      data_in = &engine->usb.data_in_queue[i * engine->usb.data_in_len];
+      libusb_fill_interrupt_transfer (engine->usb.xfr_in[i],
+				      engine->usb.device_handle, AUDIO_IN_EP,
+				      (void *) data_in,
+				      engine->usb.data_in_len, cb_xfr_in,
+				      engine, 0);
+
+      //Output blocks need consecutive frame counters across the whole queue.
+      engine->usb.data_out =
+	&engine->usb.data_out_queue[i * engine->usb.data_out_len];
+      ow_engine_write_usb_output_blocks (engine);
+      libusb_fill_interrupt_transfer (engine->usb.xfr_out[i],
+				      engine->usb.device_handle, AUDIO_OUT_EP,
+				      (void *) engine->usb.data_out,
+				      engine->usb.data_out_len, cb_xfr_out,
+				      engine, 0);
     }
 }
 
@@ -417,7 +808,7 @@ prepare_cycle_in_midi (struct ow_engine *engine)
 			     (void *) engine->o2p_midi_data,
 			     USB_BULK_MIDI_SIZE, cb_xfr_in_midi, engine, 0);
 
-  int err = libusb_submit_transfer (engine->usb.xfr_in_midi);
+  int err = ow_engine_submit_transfer (engine, engine->usb.xfr_in_midi);
   if (err)
     {
       error_print ("o2p: Error when submitting USB MIDI transfer: %s\n",
@@ -427,18 +818,20 @@ prepare_cycle_in_midi (struct ow_engine *engine)
 }
 
 static void
-prepare_cycle_out_midi (struct ow_engine *engine)
+prepare_cycle_out_midi (struct ow_engine *engine, int i,
+			unsigned char *data)
 {
-  libusb_fill_bulk_transfer (engine->usb.xfr_out_midi,
+  libusb_fill_bulk_transfer (engine->usb.xfr_out_midi[i],
 			     engine->usb.device_handle, MIDI_OUT_EP,
-			     (void *) engine->p2o_midi_data,
-			     USB_BULK_MIDI_SIZE, cb_xfr_out_midi, engine, 0);
+			     (void *) data, USB_BULK_MIDI_SIZE,
+			     cb_xfr_out_midi, engine, 0);
 
-  int err = libusb_submit_transfer (engine->usb.xfr_out_midi);
+  int err = ow_engine_submit_transfer (engine, engine->usb.xfr_out_midi[i]);
   if (err)
     {
       error_print ("p2o: Error when submitting USB MIDI transfer: %s\n",
 		   libusb_strerror (err));
+      ow_engine_signal_fd (engine->p2o_midi_free_fd);
       ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
     }
 }
@@ -446,20 +839,82 @@ prepare_cycle_out_midi (struct ow_engine *engine)
 static void
 usb_shutdown (struct ow_engine *engine)
 {
-  libusb_close (engine->usb.device_handle);
-  libusb_exit (engine->usb.context);
+  //Offline engines have none of these.
+  if (engine->usb.device_handle)
+    {
+      libusb_close (engine->usb.device_handle);
+    }
+  if (!engine->usb.loop && engine->usb.context)
+    {
+      libusb_exit (engine->usb.context);
+    }
+}
+
+//The engine has fields aligned to the cache lines.
+static struct ow_engine *
+ow_engine_alloc ()
+{
+  void *engine;
+
+  if (posix_memalign (&engine, OW_CACHE_LINE_SIZE, sizeof (struct ow_engine)))
+    {
+      return NULL;
+    }
+  return engine;
 }
 
+//The transfer buffers are cache aligned for the vector conversions and the USB data is page aligned.
+static void *
+ow_engine_alloc_zeroed (size_t size, size_t alignment)
+{
+  void *p;
+
+  if (posix_memalign (&p, alignment, size))
+    {
+      error_print ("Could not allocate %zu bytes\n", size);
+      return NULL;
+    }
+  memset (p, 0, size);
+  return p;
+}
+
+//The block kernels only depend on the device so they are selected once.
 void
-ow_engine_init_mem (struct ow_engine *engine, int blocks_per_transfer)
+ow_engine_set_conv (struct ow_engine *engine,
+		    const struct ow_conv_impl *conv)
 {
-  struct ow_engine_usb_blk *blk;
+  engine->conv = conv;
+  engine->o2p_block_decode =
+    ow_conv_get_block_decode (conv, engine->device_desc->outputs,
+			      engine->device_desc->output_track_scales);
+  engine->p2o_block_encode =
+    ow_conv_get_block_encode (conv, engine->device_desc->inputs);
+  debug_print (2, "Using %s block kernels for %d outputs and %d inputs\n",
+	       conv->name, engine->device_desc->outputs,
+	       engine->device_desc->inputs);
+}
 
-  pthread_spin_init (&engine->lock, PTHREAD_PROCESS_SHARED);
+//On error, the memory allocated so far is released.
+ow_err_t
+ow_engine_init_mem (struct ow_engine *engine, int blocks_per_transfer,
+		    int xfrs)
+{
+  struct ow_engine_usb_blk *blk;
+  long page_size = sysconf (_SC_PAGESIZE);
 
+  engine->usb.xfrs = xfrs;
   engine->blocks_per_transfer = blocks_per_transfer;
   engine->frames_per_transfer =
     OB_FRAMES_PER_BLOCK * engine->blocks_per_transfer;
+  engine->xfr_duration =
+    engine->frames_per_transfer * 1000000000ULL / OB_SAMPLE_RATE;
+
+  ow_stats_histogram_init (&engine->o2p_xfr_time);
+  ow_stats_histogram_init (&engine->p2o_xfr_time);
+  ow_stats_histogram_init (&engine->o2p_xfr_jitter);
+  engine->o2p_xfr_last_time = 0;
+  atomic_init (&engine->o2p_overflows, 0);
+  atomic_init (&engine->p2o_underflows, 0);
 
   engine->usb.data_in_blk_len =
     sizeof (struct ow_engine_usb_blk) +
@@ -473,16 +928,10 @@ ow_engine_init_mem (struct ow_engine *engine, int blocks_per_transfer)
     engine->usb.data_in_blk_len * engine->blocks_per_transfer;
   engine->usb.data_out_len =
     engine->usb.data_out_blk_len * engine->blocks_per_transfer;
-  engine->usb.data_in = malloc (engine->usb.data_in_len);
-  engine->usb.data_out = malloc (engine->usb.data_out_len);
-  memset (engine->usb.data_in, 0, engine->usb.data_in_len);
-  memset (engine->usb.data_out, 0, engine->usb.data_out_len);
-
-  for (int i = 0; i < engine->blocks_per_transfer; i++)
-    {
-      blk = GET_NTH_OUTPUT_USB_BLK (engine, i);
-      blk->header = htobe16 (0x07ff);
-    }
+  engine->usb.data_in_queue =
+    ow_engine_alloc_zeroed (engine->usb.data_in_len * xfrs, page_size);
+  engine->usb.data_out_queue =
+    ow_engine_alloc_zeroed (engine->usb.data_out_len * xfrs, page_size);
 
   engine->p2o_frame_size = OB_BYTES_PER_SAMPLE * engine->device_desc->inputs;
   engine->o2p_frame_size = OB_BYTES_PER_SAMPLE * engine->device_desc->outputs;
@@ -491,14 +940,33 @@ ow_engine_init_mem (struct ow_engine *engine, int blocks_per_transfer)
     engine->frames_per_transfer * engine->p2o_frame_size;
   engine->o2p_transfer_size =
     engine->frames_per_transfer * engine->o2p_frame_size;
-  engine->p2o_transfer_buf = malloc (engine->p2o_transfer_size);
-  engine->o2p_transfer_buf = malloc (engine->o2p_transfer_size);
-  memset (engine->p2o_transfer_buf, 0, engine->p2o_transfer_size);
-  memset (engine->o2p_transfer_buf, 0, engine->o2p_transfer_size);
+  engine->p2o_transfer_buf =
+    ow_engine_alloc_zeroed (engine->p2o_transfer_size, OW_CACHE_LINE_SIZE);
+  engine->o2p_transfer_buf =
+    ow_engine_alloc_zeroed (engine->o2p_transfer_size, OW_CACHE_LINE_SIZE);
+
+  //Sample conversion
+  ow_engine_set_conv (engine, ow_conv_get_impl ());
+  engine->o2p_block_samples =
+    OB_FRAMES_PER_BLOCK * engine->device_desc->outputs;
+  engine->p2o_block_samples =
+    OB_FRAMES_PER_BLOCK * engine->device_desc->inputs;
+  for (int i = 0; i < engine->o2p_block_samples; i++)
+    {
+      engine->o2p_block_scales[i] =
+	engine->device_desc->output_track_scales[i %
+						 engine->device_desc->outputs];
+    }
+  engine->options.o2p_int = 0;
+  engine->options.o2p_int_shift = 0;
+  atomic_init (&engine->o2p_track_mask_req,
+	       ow_engine_get_all_tracks_mask (engine));
+  engine->o2p_written = 0;
+  ow_engine_set_o2p_tracks (engine, ow_engine_get_all_tracks_mask (engine));
 
   //o2p resampler
-  engine->p2o_resampler_buf = malloc (engine->p2o_transfer_size);
-  memset (engine->p2o_resampler_buf, 0, engine->p2o_transfer_size);
+  engine->p2o_resampler_buf =
+    ow_engine_alloc_zeroed (engine->p2o_transfer_size, OW_CACHE_LINE_SIZE);
   engine->p2o_data.data_in = engine->p2o_resampler_buf;
   engine->p2o_data.data_out = engine->p2o_transfer_buf;
   engine->p2o_data.end_of_input = 1;
@@ -506,17 +974,47 @@ ow_engine_init_mem (struct ow_engine *engine, int blocks_per_transfer)
   engine->p2o_data.output_frames = engine->frames_per_transfer;
 
   //MIDI
-  engine->p2o_midi_data = malloc (USB_BULK_MIDI_SIZE);
-  engine->o2p_midi_data = malloc (USB_BULK_MIDI_SIZE);
-  memset (engine->p2o_midi_data, 0, USB_BULK_MIDI_SIZE);
-  memset (engine->o2p_midi_data, 0, USB_BULK_MIDI_SIZE);
-  pthread_spin_init (&engine->p2o_midi_lock, PTHREAD_PROCESS_SHARED);
+  engine->p2o_midi_data =
+    ow_engine_alloc_zeroed (USB_BULK_MIDI_SIZE * OW_ENGINE_P2O_MIDI_XFRS,
+			    OW_CACHE_LINE_SIZE);
+  engine->o2p_midi_data =
+    ow_engine_alloc_zeroed (USB_BULK_MIDI_SIZE, OW_CACHE_LINE_SIZE);
+  engine->options.planar = 0;
+  engine->p2o_midi_event_fd = -1;
+  engine->p2o_midi_free_fd = -1;
+  engine->capture = NULL;
+  engine->tap = NULL;
+
+  if (!engine->usb.data_in_queue || !engine->usb.data_out_queue
+      || !engine->p2o_transfer_buf || !engine->o2p_transfer_buf
+      || !engine->p2o_resampler_buf || !engine->p2o_midi_data
+      || !engine->o2p_midi_data)
+    {
+      ow_engine_free_mem (engine);
+      return OW_GENERIC_ERROR;
+    }
+
+  for (int i = 0; i < xfrs; i++)
+    {
+      engine->usb.data_out =
+	&engine->usb.data_out_queue[i * engine->usb.data_out_len];
+      for (int j = 0; j < engine->blocks_per_transfer; j++)
+	{
+	  blk = GET_NTH_OUTPUT_USB_BLK (engine, j);
+	  blk->header = htobe16 (0x07ff);
+	}
+    }
+
+  engine->usb.data_in = engine->usb.data_in_queue;
+  engine->usb.data_out = engine->usb.data_out_queue;
+
+  return OW_OK;
 }
 
 // initialization taken from sniffed session
 
 static ow_err_t
-ow_engine_init (struct ow_engine *engine, int blocks_per_transfer)
+ow_engine_init (struct ow_engine *engine, int blocks_per_transfer, int xfrs)
 {
   int err;
   ow_err_t ret = OW_OK;
@@ -587,21 +1085,26 @@ ow_engine_init (struct ow_engine *engine, int blocks_per_transfer)
       ret = OW_USB_ERROR_CANT_CLEAR_EP;
       goto end;
     }
+  engine->usb.xfrs = xfrs;
   err = prepare_transfers (engine);
   if (LIBUSB_SUCCESS != err)
     {
       ret = OW_USB_ERROR_CANT_PREPARE_TRANSFER;
     }
-
-end:
-  if (ret == OW_OK)
+  else
     {
-      ow_engine_init_mem (engine, blocks_per_transfer);
+      ret = ow_engine_init_mem (engine, blocks_per_transfer, xfrs);
+      if (ret)
+	{
+	  free_transfers (engine);
+	}
     }
-  else
+
+end:
+  //The caller frees the engine.
+  if (ret != OW_OK)
     {
       usb_shutdown (engine);
-      free (engine);
       error_print ("Error while initializing device: %s\n",
 		   libusb_error_name (ret));
     }
@@ -611,7 +1114,8 @@ end:
 ow_err_t
 ow_engine_init_from_libusb_device_descriptor (struct ow_engine **engine_,
 					      int libusb_device_descriptor,
-					      int blocks_per_transfer)
+					      int blocks_per_transfer,
+					      int xfrs)
 {
   ow_err_t err;
   uint8_t bus, address;
@@ -625,7 +1129,12 @@ ow_engine_init_from_libusb_device_descriptor (struct ow_engine **engine_,
       return OW_USB_ERROR_LIBUSB_INIT_FAILED;
     }
 
-  engine = malloc (sizeof (struct ow_engine));
+  engine = ow_engine_alloc ();
+  if (!engine)
+    {
+      return OW_GENERIC_ERROR;
+    }
+  engine->usb.loop = NULL;
 
   if (libusb_init (&engine->usb.context) != LIBUSB_SUCCESS)
     {
@@ -645,13 +1154,14 @@ ow_engine_init_from_libusb_device_descriptor (struct ow_engine **engine_,
   ow_get_device_desc_from_vid_pid (desc.idVendor, desc.idProduct,
 				   &engine->device_desc);
 
-  *engine_ = engine;
-  err = ow_engine_init (engine, blocks_per_transfer);
+  err = ow_engine_init (engine, blocks_per_transfer, xfrs);
   if (!err)
     {
       bus = libusb_get_bus_number (device);
       address = libusb_get_device_address (device);
       ow_engine_set_name (engine, bus, address);
+      ow_engine_set_serial (engine, desc.iSerialNumber);
+      *engine_ = engine;
       return err;
     }
 
@@ -660,10 +1170,63 @@ error:
   return err;
 }
 
+ow_err_t
+ow_engine_init_offline (struct ow_engine **engine_,
+			const struct ow_device_desc *desc,
+			int blocks_per_transfer)
+{
+  ow_err_t err;
+  struct ow_engine *engine = ow_engine_alloc ();
+
+  if (!engine)
+    {
+      return OW_GENERIC_ERROR;
+    }
+  //Zeroed so that there are no USB handles nor transfers to be released.
+  memset (engine, 0, sizeof (struct ow_engine));
+
+  engine->device_desc = desc;
+  snprintf (engine->name, OW_LABEL_MAX_LEN, "%s", desc->name);
+  err = ow_engine_init_mem (engine, blocks_per_transfer, 1);
+  if (err)
+    {
+      free (engine);
+      return err;
+    }
+  *engine_ = engine;
+
+  return OW_OK;
+}
+
+ow_err_t
+ow_engine_start_capture (struct ow_engine *engine, const char *path)
+{
+  struct ow_capture_header header;
+
+  memset (&header, 0, sizeof (struct ow_capture_header));
+  memcpy (header.magic, OW_CAPTURE_MAGIC, sizeof (OW_CAPTURE_MAGIC));
+  header.version = OW_CAPTURE_VERSION;
+  header.pid = engine->device_desc->pid;
+  header.blocks_per_transfer = engine->blocks_per_transfer;
+  header.data_in_len = engine->usb.data_in_len;
+  snprintf (header.name, OW_LABEL_MAX_LEN, "%s", engine->name);
+
+  return ow_capture_writer_init (&engine->capture, path, &header);
+}
+
+ow_err_t
+ow_engine_start_tap (struct ow_engine *engine)
+{
+  return ow_tap_writer_init (&engine->tap, engine->usb.bus,
+			     engine->usb.address,
+			     engine->device_desc->outputs);
+}
+
 ow_err_t
 ow_engine_init_from_bus_address (struct ow_engine **engine_,
 				 uint8_t bus, uint8_t address,
-				 int blocks_per_transfer)
+				 int blocks_per_transfer, int xfrs,
+				 struct ow_usb_loop *loop)
 {
   int err;
   ow_err_t ret;
@@ -673,9 +1236,18 @@ ow_engine_init_from_bus_address (struct ow_engine **engine_,
   struct ow_engine *engine;
   struct libusb_device_descriptor desc;
 
-  engine = malloc (sizeof (struct ow_engine));
+  engine = ow_engine_alloc ();
+  if (!engine)
+    {
+      return OW_GENERIC_ERROR;
+    }
+  engine->usb.loop = loop;
 
-  if (libusb_init (&engine->usb.context) != LIBUSB_SUCCESS)
+  if (loop)
+    {
+      engine->usb.context = loop->context;
+    }
+  else if (libusb_init (&engine->usb.context) != LIBUSB_SUCCESS)
     {
       ret = OW_USB_ERROR_LIBUSB_INIT_FAILED;
       goto error;
@@ -707,6 +1279,7 @@ ow_engine_init_from_bus_address (struct ow_engine **engine_,
 	  else
 	    {
 	      ow_engine_set_name (engine, bus, address);
+	      ow_engine_set_serial (engine, desc.iSerialNumber);
 	    }
 
 	  break;
@@ -721,8 +1294,12 @@ ow_engine_init_from_bus_address (struct ow_engine **engine_,
       goto error;
     }
 
-  *engine_ = engine;
-  return ow_engine_init (engine, blocks_per_transfer);
+  ret = ow_engine_init (engine, blocks_per_transfer, xfrs);
+  if (!ret)
+    {
+      *engine_ = engine;
+      return ret;
+    }
 
 error:
   free (engine);
@@ -752,156 +1329,224 @@ static const char *ob_err_strgs[] = {
   "'dll' not set in context"
 };
 
+//Sleeps until the given time, expressed in the context clock, using an absolute monotonic deadline so that preemptions do not add up.
+static void
+ow_engine_sleep_until (struct ow_engine *engine, double time)
+{
+  struct timespec deadline;
+  double wait = time - engine->context->get_time ();
+
+  if (wait <= 0)
+    {
+      return;
+    }
+
+  if (wait > P2O_MIDI_MAX_WAIT_S)
+    {
+      wait = P2O_MIDI_MAX_WAIT_S;
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += (time_t) wait;
+  deadline.tv_nsec += (wait - (time_t) wait) * 1.0e9;
+  if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)
+	 == EINTR);
+}
+
+static inline int
+ow_engine_read_p2o_midi_event (struct ow_engine *engine,
+			       struct ow_midi_event *event)
+{
+  if (engine->context->read_space (engine->context->p2o_midi) <
+      sizeof (struct ow_midi_event))
+    {
+      return 0;
+    }
+  engine->context->read (engine->context->p2o_midi, (void *) event,
+			 sizeof (struct ow_midi_event));
+  return 1;
+}
+
 static void *
 run_p2o_midi (void *data)
 {
-  int pos, p2o_midi_ready, event_read = 0;
-  double last_time, diff;
-  struct timespec sleep_time, smallest_sleep_time;
+  int pos, event_read = 0;
+  double now;
+  unsigned char *midi_data;
   struct ow_midi_event event;
   struct ow_engine *engine = data;
 
-  smallest_sleep_time.tv_sec = 0;
-  smallest_sleep_time.tv_nsec = SAMPLE_TIME_NS * 32 / 2;	//Average wait time for a 32 buffer sample
-
-  pos = 0;
-  diff = 0.0;
-  last_time = engine->context->get_time ();
-  engine->p2o_midi_ready = 1;
-  while (1)
+  while (ow_engine_get_status (engine) > OW_ENGINE_STATUS_STOP)
     {
-
-      while (engine->context->read_space (engine->context->p2o_midi) >=
-	     sizeof (struct ow_midi_event) && pos < USB_BULK_MIDI_SIZE)
+      if (!event_read)
 	{
-	  if (!pos)
-	    {
-	      memset (engine->p2o_midi_data, 0, USB_BULK_MIDI_SIZE);
-	      diff = 0;
-	    }
-
+	  event_read = ow_engine_read_p2o_midi_event (engine, &event);
 	  if (!event_read)
 	    {
-	      engine->context->read (engine->context->p2o_midi,
-				     (void *) &event,
-				     sizeof (struct ow_midi_event));
-	      event_read = 1;
+	      //Notifications are counted so none is lost if an event arrives before this.
+	      ow_engine_wait_fd (engine->p2o_midi_event_fd);
+	      continue;
 	    }
-
-	  if (event.time > last_time)
-	    {
-	      diff = event.time - last_time;
-	      last_time = event.time;
-	      break;
-	    }
-
-	  memcpy (&engine->p2o_midi_data[pos], event.bytes,
-		  OB_MIDI_EVENT_SIZE);
-	  pos += OB_MIDI_EVENT_SIZE;
-	  event_read = 0;
 	}
 
-      if (pos)
-	{
-	  debug_print (2, "Event frames: %f; diff: %f\n", event.time, diff);
-	  engine->p2o_midi_ready = 0;
-	  prepare_cycle_out_midi (engine);
-	  pos = 0;
-	}
+      ow_engine_sleep_until (engine, event.time);
 
-      if (diff)
-	{
-	  sleep_time.tv_sec = diff;
-	  sleep_time.tv_nsec = (diff - sleep_time.tv_sec) * 1.0e9;
-	  nanosleep (&sleep_time, NULL);
-	}
-      else
+      //Waits for an idle transfer. Events keep arriving meanwhile and they will be sent together.
+      ow_engine_wait_fd (engine->p2o_midi_free_fd);
+      if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
 	{
-	  nanosleep (&smallest_sleep_time, NULL);
+	  break;
 	}
 
-      pthread_spin_lock (&engine->p2o_midi_lock);
-      p2o_midi_ready = engine->p2o_midi_ready;
-      pthread_spin_unlock (&engine->p2o_midi_lock);
-      while (!p2o_midi_ready)
+      midi_data = &engine->p2o_midi_data[engine->p2o_midi_next_xfr *
+					 USB_BULK_MIDI_SIZE];
+      now = engine->context->get_time () + engine->p2o_midi_window;
+      pos = 0;
+      memset (midi_data, 0, USB_BULK_MIDI_SIZE);
+      while (event_read && event.time <= now && pos < USB_BULK_MIDI_SIZE)
 	{
-	  nanosleep (&smallest_sleep_time, NULL);
-	  pthread_spin_lock (&engine->p2o_midi_lock);
-	  p2o_midi_ready = engine->p2o_midi_ready;
-	  pthread_spin_unlock (&engine->p2o_midi_lock);
-	};
-
-      if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
-	{
-	  break;
+	  memcpy (&midi_data[pos], event.bytes, OB_MIDI_EVENT_SIZE);
+	  pos += OB_MIDI_EVENT_SIZE;
+	  event_read = ow_engine_read_p2o_midi_event (engine, &event);
 	}
+
+      debug_print (2, "p2o: Sending %d MIDI events...\n",
+		   pos / OB_MIDI_EVENT_SIZE);
+      prepare_cycle_out_midi (engine, engine->p2o_midi_next_xfr, midi_data);
+      engine->p2o_midi_next_xfr =
+	(engine->p2o_midi_next_xfr + 1) % OW_ENGINE_P2O_MIDI_XFRS;
     }
 
+  atomic_store_explicit (&engine->p2o_midi_running, 0, memory_order_release);
+
   return NULL;
 }
 
-static void *
-run_audio_o2p_midi (void *data)
+void
+ow_engine_boot (struct ow_engine *engine)
 {
-  size_t rsp2o, bytes;
-  struct ow_engine *engine = data;
-
-  while (ow_engine_get_status (engine) == OW_ENGINE_STATUS_READY);
+  atomic_store_explicit (&engine->p2o_latency, 0, memory_order_relaxed);
+  atomic_store_explicit (&engine->p2o_max_latency, 0, memory_order_relaxed);
+  engine->reading_at_p2o_end = 0;
+  atomic_store_explicit (&engine->o2p_latency, 0, memory_order_relaxed);
+  atomic_store_explicit (&engine->o2p_max_latency, 0, memory_order_relaxed);
 
   //status == OW_ENGINE_STATUS_BOOT
 
-  prepare_cycle_in_audio (engine);
-  prepare_cycle_out_audio (engine);
-  if (engine->options.o2p_midi)
+  if (engine->options.dll)
     {
-      prepare_cycle_in_midi (engine);
+      ow_dll_overwitch_init (engine->context->dll, OB_SAMPLE_RATE,
+			     engine->frames_per_transfer,
+			     engine->context->get_time ());
+      ow_engine_set_status (engine, OW_ENGINE_STATUS_WAIT);
     }
-
-  while (1)
+  else
     {
-      engine->p2o_latency = 0;
-      engine->p2o_max_latency = 0;
-      engine->reading_at_p2o_end = 0;
-      engine->o2p_latency = 0;
-      engine->o2p_max_latency = 0;
+      ow_engine_set_status (engine, OW_ENGINE_STATUS_RUN);
+    }
+}
 
-      //status == OW_ENGINE_STATUS_BOOT
+//This advances the engine state machine and must be called between USB event handling iterations. It returns 1 when the engine is stopped.
+inline int
+ow_engine_poll (struct ow_engine *engine)
+{
+  size_t rsp2o, bytes;
+  ow_engine_status_t status = ow_engine_get_status (engine);
 
-      pthread_spin_lock (&engine->lock);
-      if (engine->context->dll)
-	{
-	  ow_dll_overwitch_init (engine->context->dll, OB_SAMPLE_RATE,
-				 engine->frames_per_transfer,
-				 engine->context->get_time ());
-	  engine->status = OW_ENGINE_STATUS_WAIT;
-	}
-      else
+  if (status <= OW_ENGINE_STATUS_STOP)
+    {
+      return 1;
+    }
+
+  if (!engine->usb.started)
+    {
+      if (status == OW_ENGINE_STATUS_READY)
 	{
-	  engine->status = OW_ENGINE_STATUS_RUN;
+	  return 0;
 	}
-      pthread_spin_unlock (&engine->lock);
 
-      while (ow_engine_get_status (engine) >= OW_ENGINE_STATUS_WAIT)
+      //status == OW_ENGINE_STATUS_BOOT
+
+      prepare_audio_transfers (engine);
+      for (int i = 0; i < engine->usb.xfrs; i++)
 	{
-	  libusb_handle_events_completed (engine->usb.context, NULL);
+	  prepare_cycle_in_audio (engine->usb.xfr_in[i]);
+	  prepare_cycle_out_audio (engine->usb.xfr_out[i]);
 	}
-
-      if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
+      if (engine->options.o2p_midi)
 	{
-	  break;
+	  prepare_cycle_in_midi (engine);
 	}
+      engine->usb.started = 1;
 
+      ow_engine_boot (engine);
+    }
+  else if (status < OW_ENGINE_STATUS_WAIT)
+    {
       rsp2o = engine->context->read_space (engine->context->p2o_audio);
       bytes = ow_bytes_to_frame_bytes (rsp2o, engine->p2o_frame_size);
       engine->context->read (engine->context->p2o_audio, NULL, bytes);
       memset (engine->p2o_transfer_buf, 0, engine->p2o_transfer_size);
+
+      ow_engine_boot (engine);
+    }
+
+  return 0;
+}
+
+//Used by the USB loop on stopped engines. It returns 1 when there are no transfers left and the engine can leave the loop.
+int
+ow_engine_release_usb (struct ow_engine *engine)
+{
+  if (!engine->usb.cancelled)
+    {
+      for (int i = 0; i < engine->usb.xfrs && engine->usb.started; i++)
+	{
+	  libusb_cancel_transfer (engine->usb.xfr_in[i]);
+	  libusb_cancel_transfer (engine->usb.xfr_out[i]);
+	}
+      if (engine->options.o2p_midi && engine->usb.started)
+	{
+	  libusb_cancel_transfer (engine->usb.xfr_in_midi);
+	}
+      engine->usb.cancelled = 1;
+    }
+
+  if (atomic_load_explicit (&engine->usb.in_flight, memory_order_acquire)
+      || atomic_load_explicit (&engine->p2o_midi_running,
+			       memory_order_acquire))
+    {
+      return 0;
+    }
+
+  sem_post (&engine->usb.done);
+  return 1;
+}
+
+static void *
+run_audio_o2p_midi (void *data)
+{
+  struct ow_engine *engine = data;
+
+  while (!ow_engine_poll (engine))
+    {
+      if (engine->usb.started)
+	{
+	  libusb_handle_events_completed (engine->usb.context, NULL);
+	}
     }
 
   return NULL;
 }
 
 ow_err_t
-ow_engine_activate (struct ow_engine *engine, struct ow_context *context)
+ow_engine_set_context (struct ow_engine *engine, struct ow_context *context)
 {
   engine->context = context;
 
@@ -927,8 +1572,8 @@ ow_engine_activate (struct ow_engine *engine, struct ow_context *context)
 	}
     }
 
-  engine->options.p2o_audio = context->options & OW_ENGINE_OPTION_P2O_AUDIO;
-  if (engine->options.p2o_audio)
+  engine->p2o_audio = context->options & OW_ENGINE_OPTION_P2O_AUDIO;
+  if (engine->p2o_audio)
     {
       if (!context->read_space)
 	{
@@ -957,6 +1602,26 @@ ow_engine_activate (struct ow_engine *engine, struct ow_context *context)
 	}
     }
 
+  engine->options.planar = context->options & OW_ENGINE_OPTION_PLANAR;
+  engine->options.o2p_int = context->options & OW_ENGINE_OPTION_O2P_INT;
+  engine->options.o2p_int_shift =
+    context->options & OW_ENGINE_OPTION_O2P_INT_SHIFT;
+  if (engine->options.o2p_int && engine->options.planar)
+    {
+      return OW_GENERIC_ERROR;
+    }
+  //The shifts depend on the options. There is no audio thread yet.
+  ow_engine_set_o2p_tracks (engine,
+			    atomic_load_explicit (&engine->o2p_track_mask,
+						  memory_order_relaxed));
+  //Planar transfers need to be written as a whole.
+  engine->options.o2p_zero_copy = context->get_write_vector
+    && context->commit && !engine->options.planar;
+  engine->options.p2o_zero_copy = context->get_read_vector
+    && context->advance;
+  debug_print (1, "Zero-copy access (o2p, p2o): %d, %d\n",
+	       engine->options.o2p_zero_copy, engine->options.p2o_zero_copy);
+
   engine->options.p2o_midi = context->options & OW_ENGINE_OPTION_P2O_MIDI;
   if (engine->options.p2o_midi)
     {
@@ -968,8 +1633,21 @@ ow_engine_activate (struct ow_engine *engine, struct ow_context *context)
 	{
 	  return OW_INIT_ERROR_NO_P2O_MIDI_BUF;
 	}
+
+      engine->p2o_midi_event_fd = eventfd (0, EFD_CLOEXEC);
+      engine->p2o_midi_free_fd = eventfd (OW_ENGINE_P2O_MIDI_XFRS,
+					  EFD_CLOEXEC | EFD_SEMAPHORE);
+      if (engine->p2o_midi_event_fd < 0 || engine->p2o_midi_free_fd < 0)
+	{
+	  error_print ("Could not create p2o MIDI eventfds: %s\n",
+		       strerror (errno));
+	  return OW_GENERIC_ERROR;
+	}
     }
 
+  engine->p2o_midi_next_xfr = 0;
+  engine->p2o_midi_window = context->p2o_midi_window * 1.0e-6;
+
   engine->options.dll = context->options & OW_ENGINE_OPTION_DLL;
   if (engine->options.dll)
     {
@@ -981,8 +1659,17 @@ ow_engine_activate (struct ow_engine *engine, struct ow_context *context)
 	{
 	  return OW_INIT_ERROR_NO_DLL;
 	}
-      engine->status = OW_ENGINE_STATUS_READY;
+      ow_engine_set_status (engine, OW_ENGINE_STATUS_READY);
     }
+  else
+    {
+      ow_engine_set_status (engine, OW_ENGINE_STATUS_BOOT);
+    }
+
+  engine->usb.started = 0;
+  engine->usb.cancelled = 0;
+  atomic_init (&engine->usb.in_flight, 0);
+  atomic_init (&engine->p2o_midi_running, engine->options.p2o_midi != 0);
 
   if (!context->set_rt_priority)
     {
@@ -990,6 +1677,21 @@ ow_engine_activate (struct ow_engine *engine, struct ow_context *context)
       context->priority = OW_DEFAULT_RT_PROPERTY;
     }
 
+  return OW_OK;
+}
+
+ow_err_t
+ow_engine_activate (struct ow_engine *engine, struct ow_context *context)
+{
+  ow_err_t err = ow_engine_set_context (engine, context);
+
+  if (err)
+    {
+      return err;
+    }
+
+  ow_engine_set_thread_cpus (engine);
+
   if (engine->options.p2o_midi)
     {
       debug_print (1, "Starting p2o MIDI thread...\n");
@@ -1001,10 +1703,17 @@ ow_engine_activate (struct ow_engine *engine, struct ow_context *context)
 	}
       context->set_rt_priority (&engine->p2o_midi_thread,
 				engine->context->priority);
+      ow_set_thread_affinity (&engine->p2o_midi_thread, engine->p2o_midi_cpu);
+    }
+
+  if (engine->usb.loop)
+    {
+      sem_init (&engine->usb.done, 0, 0);
+      return ow_usb_loop_add (engine->usb.loop, engine, context);
     }
 
   if (engine->options.o2p_midi || engine->options.o2p_audio
-      || engine->options.p2o_audio)
+      || engine->p2o_audio)
     {
       debug_print (1, "Starting audio and o2p MIDI thread...\n");
       if (pthread_create (&engine->audio_o2p_midi_thread, NULL,
@@ -1015,15 +1724,27 @@ ow_engine_activate (struct ow_engine *engine, struct ow_context *context)
 	}
       context->set_rt_priority (&engine->audio_o2p_midi_thread,
 				engine->context->priority);
+      ow_set_thread_affinity (&engine->audio_o2p_midi_thread,
+			      engine->usb_cpu);
     }
 
-
   return OW_OK;
 }
 
 inline void
 ow_engine_wait (struct ow_engine *engine)
 {
+  if (engine->usb.loop)
+    {
+      if (engine->options.p2o_midi)
+	{
+	  pthread_join (engine->p2o_midi_thread, NULL);
+	}
+      sem_wait (&engine->usb.done);
+      sem_destroy (&engine->usb.done);
+      return;
+    }
+
   pthread_join (engine->audio_o2p_midi_thread, NULL);
   if (engine->options.o2p_midi)
     {
@@ -1042,6 +1763,14 @@ ow_engine_destroy (struct ow_engine *engine)
 {
   usb_shutdown (engine);
   free_transfers (engine);
+  if (engine->capture)
+    {
+      ow_capture_writer_destroy (engine->capture);
+    }
+  if (engine->tap)
+    {
+      ow_tap_writer_destroy (engine->tap);
+    }
   ow_engine_free_mem (engine);
   free (engine);
 }
@@ -1052,51 +1781,50 @@ ow_engine_free_mem (struct ow_engine *engine)
   free (engine->p2o_transfer_buf);
   free (engine->p2o_resampler_buf);
   free (engine->o2p_transfer_buf);
-  free (engine->usb.data_in);
-  free (engine->usb.data_out);
+  free (engine->usb.data_in_queue);
+  free (engine->usb.data_out_queue);
   free (engine->p2o_midi_data);
   free (engine->o2p_midi_data);
-  pthread_spin_destroy (&engine->lock);
-  pthread_spin_destroy (&engine->p2o_midi_lock);
+  if (engine->p2o_midi_event_fd >= 0)
+    {
+      close (engine->p2o_midi_event_fd);
+    }
+  if (engine->p2o_midi_free_fd >= 0)
+    {
+      close (engine->p2o_midi_free_fd);
+    }
 }
 
 inline ow_engine_status_t
 ow_engine_get_status (struct ow_engine *engine)
 {
-  ow_engine_status_t status;
-  pthread_spin_lock (&engine->lock);
-  status = engine->status;
-  pthread_spin_unlock (&engine->lock);
-  return status;
+  return atomic_load_explicit (&engine->status, memory_order_acquire);
 }
 
 inline void
 ow_engine_set_status (struct ow_engine *engine, ow_engine_status_t status)
 {
-  pthread_spin_lock (&engine->lock);
-  engine->status = status;
-  pthread_spin_unlock (&engine->lock);
+  atomic_store_explicit (&engine->status, status, memory_order_release);
+  if (status <= OW_ENGINE_STATUS_STOP)
+    {
+      ow_engine_notify_p2o_midi (engine);
+    }
 }
 
 inline int
 ow_engine_is_p2o_audio_enabled (struct ow_engine *engine)
 {
-  int enabled;
-  pthread_spin_lock (&engine->lock);
-  enabled = engine->options.p2o_audio;
-  pthread_spin_unlock (&engine->lock);
-  return enabled;
+  return atomic_load_explicit (&engine->p2o_audio,
+			       memory_order_relaxed);
 }
 
 inline void
 ow_engine_set_p2o_audio_enabled (struct ow_engine *engine, int enabled)
 {
-  int last = ow_engine_is_p2o_audio_enabled (engine);
+  int last = atomic_exchange_explicit (&engine->p2o_audio, enabled,
+				      memory_order_relaxed);
   if (last != enabled)
     {
-      pthread_spin_lock (&engine->lock);
-      engine->options.p2o_audio = enabled;
-      pthread_spin_unlock (&engine->lock);
       debug_print (1, "Setting p2o audio to %d...\n", enabled);
     }
 }
@@ -1114,12 +1842,62 @@ ow_engine_get_device_desc (struct ow_engine *engine)
   return engine->device_desc;
 }
 
+const char *
+ow_engine_get_serial (struct ow_engine *engine)
+{
+  return engine->serial;
+}
+
+const char *
+ow_engine_get_name (struct ow_engine *engine)
+{
+  return engine->name;
+}
+
+inline int
+ow_engine_get_frames_per_transfer (struct ow_engine *engine)
+{
+  return engine->frames_per_transfer;
+}
+
 inline void
 ow_engine_stop (struct ow_engine *engine)
 {
   ow_engine_set_status (engine, OW_ENGINE_STATUS_STOP);
 }
 
+inline uint32_t
+ow_engine_get_all_tracks_mask (struct ow_engine *engine)
+{
+  int outputs = engine->device_desc->outputs;
+  return outputs == OB_MAX_TRACKS ? UINT32_MAX : (1U << outputs) - 1;
+}
+
+inline void
+ow_engine_set_o2p_track_mask (struct ow_engine *engine, uint32_t mask)
+{
+  mask &= ow_engine_get_all_tracks_mask (engine);
+  if (!mask)
+    {
+      mask = 1;
+    }
+  atomic_store_explicit (&engine->o2p_track_mask_req, mask,
+			 memory_order_relaxed);
+}
+
+inline uint32_t
+ow_engine_get_o2p_track_mask (struct ow_engine *engine)
+{
+  return atomic_load_explicit (&engine->o2p_track_mask,
+			       memory_order_acquire);
+}
+
+inline void
+ow_engine_notify_p2o_midi (struct ow_engine *engine)
+{
+  ow_engine_signal_fd (engine->p2o_midi_event_fd);
+}
+
 void
 ow_engine_print_blocks (struct ow_engine *engine, char *blks, size_t blk_len)
 {
@@ -147,8 +147,14 @@
 #include <libusb.h>
 #include <samplerate.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <semaphore.h>
 #include "utils.h"
 #include "dll.h"
+#include "conv.h"
+#include "stats.h"
+#include "capture.h"
+#include "tap.h"
 #include "overwitch.h"
 
 #define GET_NTH_USB_BLK(blks,blk_len,n) ((struct ow_engine_usb_blk *) &blks[n * blk_len])
@@ -157,60 +163,117 @@
 
 #define OB_PADDING_SIZE 28
 
+#define OW_ENGINE_P2O_MIDI_XFRS 4
+
+//The fields are grouped by the thread that writes them and every group starts at its own cache line so that a thread writing its fields does not invalidate the ones other threads are reading.
 struct ow_engine
 {
+  //Set up before starting and only read afterwards.
   char name[OW_LABEL_MAX_LEN];
-  ow_engine_status_t status;
+  char serial[OW_LABEL_MAX_LEN];	//Empty if not available
   int blocks_per_transfer;
   int frames_per_transfer;
-  pthread_spinlock_t lock;
-  size_t o2p_latency;
-  size_t o2p_max_latency;
-  size_t p2o_latency;
-  size_t p2o_max_latency;
+  uint32_t xfr_duration;	//ns
+  struct ow_capture_writer *capture;	//Optional
+  struct ow_tap_writer *tap;	//Optional
   pthread_t audio_o2p_midi_thread;
   pthread_t p2o_midi_thread;
+  int usb_cpu;
+  int p2o_midi_cpu;
   const struct ow_device_desc *device_desc;
   size_t p2o_transfer_size;
   size_t o2p_transfer_size;
   float *p2o_transfer_buf;
   float *o2p_transfer_buf;
-  size_t o2p_frame_size;
+  size_t o2p_frame_size;	//With every track, as in o2p_transfer_size
   size_t p2o_frame_size;
+  //Sample conversion
+  const struct ow_conv_impl *conv;
+  ow_conv_decode_t o2p_block_decode;	//All the tracks of a block
+  ow_conv_encode_t p2o_block_encode;
+  int o2p_block_samples;
+  int p2o_block_samples;
+  float o2p_block_scales[OB_FRAMES_PER_BLOCK * OB_MAX_TRACKS];	//Track scales repeated for every frame in a block
+  //j2o resampler
+  float *p2o_resampler_buf;
+  unsigned char *o2p_midi_data;
+  double p2o_midi_window;	//s
+  struct ow_context *context;
+  struct
+  {
+    int o2p_audio;
+    int o2p_midi;
+    int p2o_midi;
+    int dll;
+    int planar;			//o2p audio as a lane of frames_per_transfer samples per track
+    int o2p_int;
+    int o2p_int_shift;
+    int o2p_zero_copy;
+    int p2o_zero_copy;
+  } options;
+
+  //Written by the audio thread. The latencies are read by anyone.
+  atomic_size_t o2p_latency OW_CACHE_ALIGNED;
+  atomic_size_t o2p_max_latency;
+  atomic_size_t p2o_latency;
+  atomic_size_t p2o_max_latency;
+  //Telemetry. The histograms are only written by the audio thread.
+  struct ow_stats_histogram o2p_xfr_time;
+  struct ow_stats_histogram p2o_xfr_time;
+  struct ow_stats_histogram o2p_xfr_jitter;
+  uint64_t o2p_xfr_last_time;
+  atomic_uint o2p_overflows;
+  atomic_uint p2o_underflows;
+  //Only the tracks in the mask are decoded and written to the o2p buffer.
+  //It is requested by anyone and applied by the audio thread at the beginning of a transfer.
+  atomic_uint o2p_track_mask;
+  atomic_uint o2p_track_mask_pos;	//o2p_written when the mask was applied
+  uint32_t o2p_written;		//Bytes written to the o2p buffer, wrapping around
+  int o2p_tracks;
+  int o2p_track_index[OB_MAX_TRACKS];
+  float o2p_track_scales[OB_MAX_TRACKS];
+  int o2p_track_shifts[OB_MAX_TRACKS];	//Bits to full scale with int32 samples
+  size_t o2p_tracks_transfer_size;
   struct
   {
     libusb_context *context;
     libusb_device_handle *device_handle;
-    struct libusb_transfer *xfr_in;
-    struct libusb_transfer *xfr_out;
-    struct libusb_transfer *xfr_out_midi;
+    uint8_t bus;
+    uint8_t address;
+    struct ow_usb_loop *loop;	//NULL if the engine runs its own thread
+    int started;
+    int cancelled;
+    atomic_int in_flight;	//Submitted transfers whose callback has not been called yet
+    sem_t done;			//Posted by the USB loop when the engine has left it
+    int xfrs;			//Audio transfers in flight per direction
+    struct libusb_transfer *xfr_in[OW_ENGINE_MAX_XFRS];
+    struct libusb_transfer *xfr_out[OW_ENGINE_MAX_XFRS];
+    struct libusb_transfer *xfr_out_midi[OW_ENGINE_P2O_MIDI_XFRS];
     struct libusb_transfer *xfr_in_midi;
-    char *data_in;
-    char *data_out;
+    char *data_in;		//Data of the transfer being processed
+    char *data_out;		//Data of the transfer being filled
+    char *data_in_queue;	//Data of all the transfers
+    char *data_out_queue;
     size_t data_in_blk_len;
     size_t data_out_blk_len;
     int data_in_len;
     int data_out_len;
     uint16_t frames;
   } usb;
-  //j2o resampler
-  float *p2o_resampler_buf;
   SRC_DATA p2o_data;
-  //MIDI
-  unsigned char *p2o_midi_data;
-  unsigned char *o2p_midi_data;
   int reading_at_p2o_end;
-  pthread_spinlock_t p2o_midi_lock;
-  int p2o_midi_ready;
-  struct ow_context *context;
-  struct
-  {
-    int o2p_audio;
-    int p2o_audio;
-    int o2p_midi;
-    int p2o_midi;
-    int dll;
-  } options;
+
+  //Written by the p2o MIDI thread.
+  unsigned char *p2o_midi_data OW_CACHE_ALIGNED;	//One USB_BULK_MIDI_SIZE buffer per transfer
+  int p2o_midi_next_xfr;	//Transfers are used in order as they finish in order
+  int p2o_midi_event_fd;	//Signalled when there are new p2o MIDI events
+  int p2o_midi_free_fd;		//Semaphore counting the idle p2o MIDI transfers
+
+  //Written by any thread.
+  _Atomic ow_engine_status_t status OW_CACHE_ALIGNED;
+  atomic_int p2o_audio;
+  atomic_uint o2p_track_mask_req;
+  atomic_int p2o_midi_running;
 };
 
 struct ow_engine_usb_blk
@@ -223,11 +286,44 @@ struct ow_engine_usb_blk
 
 int ow_bytes_to_frame_bytes (int, int);
 
+void ow_engine_update_o2p_tracks (struct ow_engine *);
+
 void ow_engine_read_usb_input_blocks (struct ow_engine *);
 
 void ow_engine_write_usb_output_blocks (struct ow_engine *);
 
-void ow_engine_init_mem (struct ow_engine *, int);
+void ow_engine_read_usb_input_blocks_to_vector (struct ow_engine *,
+						struct ow_buffer_vector *);
+
+void ow_engine_write_usb_output_blocks_from_vector (struct ow_engine *,
+						    struct ow_buffer_vector
+						    *);
+
+ow_err_t ow_engine_init_mem (struct ow_engine *, int, int);
+
+void ow_engine_set_conv (struct ow_engine *, const struct ow_conv_impl *);
+
+//An engine without a device. Whoever uses it must fill usb.data_in and process the transfers and the boot instead of the USB thread.
+ow_err_t ow_engine_init_offline (struct ow_engine **,
+				 const struct ow_device_desc *, int);
+
+//All of ow_engine_activate but starting the threads.
+ow_err_t ow_engine_set_context (struct ow_engine *, struct ow_context *);
+
+void ow_engine_boot (struct ow_engine *);
+
+//The audio processing done in the USB callbacks.
+void ow_engine_set_usb_input_data_blks (struct ow_engine *);
+
+void ow_engine_set_usb_output_data_blks (struct ow_engine *);
+
+//The MIDI processing done in the USB callback for the received bytes at the given time.
+void ow_engine_set_usb_input_midi_events (struct ow_engine *,
+					  const uint8_t *, int, double);
+
+int ow_engine_poll (struct ow_engine *);
+
+int ow_engine_release_usb (struct ow_engine *);
 
 void ow_engine_free_mem (struct ow_engine *);
 
@@ -0,0 +1,147 @@
+/*
+ *   interp.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "interp.h"
+#include "backend.h"
+
+#define INTERP_FRAMES 4
+
+void
+ow_interp_init (struct ow_interp *interp, int channels, int flags,
+		ow_interp_cb_t cb, void *cb_data)
+{
+  interp->channels = channels;
+  interp->max_channels = channels;
+  interp->flags = flags;
+  interp->cb = cb;
+  interp->cb_data = cb_data;
+  interp->frames = malloc (INTERP_FRAMES * channels * sizeof (float));
+  ow_interp_reset (interp);
+}
+
+void
+ow_interp_reset (struct ow_interp *interp)
+{
+  memset (interp->frames, 0,
+	  INTERP_FRAMES * interp->channels * sizeof (float));
+  interp->phase = 0.0;
+  interp->in = NULL;
+  interp->in_frames = 0;
+}
+
+int
+ow_interp_set_channels (struct ow_interp *interp, int channels)
+{
+  if (channels < 1 || channels > interp->max_channels)
+    {
+      return -1;
+    }
+  interp->channels = channels;
+  ow_interp_reset (interp);
+  return 0;
+}
+
+void
+ow_interp_destroy (struct ow_interp *interp)
+{
+  free (interp->frames);
+}
+
+//If there is no input, the last frame is replicated.
+static inline void
+ow_interp_next_frame (struct ow_interp *interp)
+{
+  int channels = interp->channels;
+  float *last = &interp->frames[(INTERP_FRAMES - 1) * channels];
+
+  memmove (interp->frames, &interp->frames[channels],
+	   (INTERP_FRAMES - 1) * channels * sizeof (float));
+
+  if (!interp->in_frames)
+    {
+      interp->in_frames = interp->cb (interp->cb_data, &interp->in);
+      if (interp->in_frames <= 0)
+	{
+	  interp->in_frames = 0;
+	  return;
+	}
+      if (interp->flags & OW_RESAMPLER_PLANAR_IN)
+	{
+	  interp->in_lane = interp->in_frames;
+	  interp->in_step = 1;
+	}
+      else
+	{
+	  interp->in_lane = 1;
+	  interp->in_step = channels;
+	}
+    }
+
+  for (int j = 0; j < channels; j++)
+    {
+      last[j] = interp->in[j * interp->in_lane];
+    }
+  interp->in += interp->in_step;
+  interp->in_frames--;
+}
+
+//The ratio is the output sample rate divided by the input sample rate, as in libsamplerate.
+inline long
+ow_interp_read (struct ow_interp *interp, double ratio, long frames,
+		float *out)
+{
+  float t, xm1, x0, x1, x2, c1, c2, c3;
+  float *o;
+  int channels = interp->channels;
+  double step = 1.0 / ratio;
+  float *x = interp->frames;
+  long out_lane = interp->flags & OW_RESAMPLER_PLANAR_OUT ? frames : 1;
+  long out_step = interp->flags & OW_RESAMPLER_PLANAR_OUT ? 1 : channels;
+
+  for (long i = 0; i < frames; i++)
+    {
+      while (interp->phase >= 1.0)
+	{
+	  ow_interp_next_frame (interp);
+	  interp->phase -= 1.0;
+	}
+
+      t = interp->phase;
+      o = out;
+      for (int j = 0; j < channels; j++, o += out_lane)
+	{
+	  xm1 = x[j];
+	  x0 = x[channels + j];
+	  x1 = x[2 * channels + j];
+	  x2 = x[3 * channels + j];
+	  c1 = 0.5f * (x1 - xm1);
+	  c2 = xm1 - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+	  c3 = 0.5f * (x2 - xm1) + 1.5f * (x0 - x1);
+	  *o = ((c3 * t + c2) * t + c1) * t + x0;
+	}
+
+      out += out_step;
+      interp->phase += step;
+    }
+
+  return frames;
+}
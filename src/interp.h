@@ -0,0 +1,54 @@
+/*
+ *   interp.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INTERP_H
+#define INTERP_H
+
+//Same signature as the libsamplerate callbacks. The data is valid until the next call.
+typedef long (*ow_interp_cb_t) (void *, float **);
+
+//Cubic Hermite interpolator meant for ratios close to 1.
+//There is no filtering so it should not be used to convert between different sample rates.
+struct ow_interp
+{
+  int channels;
+  int max_channels;		//The ones the history is allocated for
+  int flags;			//The planar flags of the backends
+  ow_interp_cb_t cb;
+  void *cb_data;
+  float *frames;		//The last 4 input frames
+  double phase;			//Position between the second and the third frame
+  float *in;			//Input frames not used yet from the last callback
+  long in_frames;
+  long in_lane;			//Distance between the channels of a frame
+  long in_step;			//Distance between frames
+};
+
+void ow_interp_init (struct ow_interp *, int, int, ow_interp_cb_t, void *);
+
+void ow_interp_reset (struct ow_interp *);
+
+int ow_interp_set_channels (struct ow_interp *, int);
+
+long ow_interp_read (struct ow_interp *, double, long, float *);
+
+void ow_interp_destroy (struct ow_interp *);
+
+#endif
@@ -30,13 +30,17 @@
 
 #include "utils.h"
 #include "jclient.h"
+#include "cache.h"
 
 #define MSG_ERROR_PORT_REGISTER "Error while registering JACK port\n"
 
 #define MIDI_BUF_EVENTS 64
 #define MIDI_BUF_SIZE (MIDI_BUF_EVENTS * OB_MIDI_EVENT_SIZE * 8)
 
-#define MAX_LATENCY (8192 * 2)	//This is twice the maximum JACK latency.
+#define MAX_LATENCY (OW_RESAMPLER_MAX_BUFSIZE * 2)	//This is twice the maximum JACK latency.
+
+//In synchronous mode, the o2j buffer holds a JACK cycle plus a transfer and is trimmed when it goes above these many extra transfers.
+#define SYNC_MAX_EXTRA_TRANSFERS 2
 
 double
 jclient_get_time ()
@@ -61,9 +65,12 @@ jclient_buffer_read (void *buffer, char *src, size_t size)
 static int
 jclient_thread_xrun_cb (void *cb_data)
 {
-  struct ow_resampler *resampler = cb_data;
+  struct jclient *jclient = cb_data;
   error_print ("JACK xrun\n");
-  ow_resampler_inc_xruns (resampler);
+  if (jclient->resampler)
+    {
+      ow_resampler_inc_xruns (jclient->resampler);
+    }
   return 0;
 }
 
@@ -73,9 +80,10 @@ jclient_port_connect_cb (jack_port_id_t a, jack_port_id_t b, int connect,
 {
   struct jclient *jclient = cb_data;
   int p2o_enabled = 0;
-  struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
+  uint32_t o2p_mask = 0;
+  struct ow_engine *engine = jclient->engine;
   const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
-  //We only check for j2o (input) ports as o2j must always be running.
+
   for (int i = 0; i < desc->inputs; i++)
     {
       if (jack_port_connected (jclient->input_ports[i]))
@@ -85,6 +93,22 @@ jclient_port_connect_cb (jack_port_id_t a, jack_port_id_t b, int connect,
 	}
     }
   ow_engine_set_p2o_audio_enabled (engine, p2o_enabled);
+
+  //In synchronous mode there is no resampler to follow layout changes so all the tracks are always decoded.
+  if (!jclient->resampler)
+    {
+      return;
+    }
+
+  //o2j must always be running but only the connected tracks are needed.
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      if (jack_port_connected (jclient->output_ports[i]))
+	{
+	  o2p_mask |= 1U << i;
+	}
+    }
+  ow_resampler_set_o2p_track_mask (jclient->resampler, o2p_mask);
 }
 
 static void
@@ -101,8 +125,21 @@ jclient_set_buffer_size_cb (jack_nframes_t nframes, void *cb_data)
   struct jclient *jclient = cb_data;
   debug_print (1, "JACK buffer size: %d\n", nframes);
   jclient->bufsize = nframes;
-  ow_resampler_set_buffer_size (jclient->resampler, nframes);
-  return 0;
+
+  if (!jclient->resampler)
+    {
+      const struct ow_device_desc *desc =
+	ow_engine_get_device_desc (jclient->engine);
+      int tracks = desc->outputs > desc->inputs ? desc->outputs :
+	desc->inputs;
+      //The process callback is not running while this is called.
+      free (jclient->sync_buf);
+      jclient->sync_buf = malloc (nframes * tracks * OB_BYTES_PER_SAMPLE);
+      jclient->sync_primed = 0;
+      return 0;
+    }
+
+  return ow_resampler_set_buffer_size (jclient->resampler, nframes);
 }
 
 static int
@@ -110,8 +147,19 @@ jclient_set_sample_rate_cb (jack_nframes_t nframes, void *cb_data)
 {
   struct jclient *jclient = cb_data;
   debug_print (1, "JACK sample rate: %d\n", nframes);
-  ow_resampler_set_samplerate (jclient->resampler, nframes);
-  return 0;
+
+  if (!jclient->resampler)
+    {
+      if (nframes != OB_SAMPLE_RATE)
+	{
+	  error_print ("Synchronous mode needs JACK to run at %.0f Hz\n",
+		       OB_SAMPLE_RATE);
+	  return -1;
+	}
+      return 0;
+    }
+
+  return ow_resampler_set_samplerate (jclient->resampler, nframes);
 }
 
 static inline void
@@ -121,11 +169,11 @@ jclient_o2j_midi (struct jclient *jclient, jack_nframes_t nframes)
   void *midi_port_buf;
   jack_midi_data_t *jmidi;
   struct ow_midi_event event;
-  jack_nframes_t last_frames, frames, last_frame_time, event_frames;
+  double pos;
+  jack_nframes_t frames;
 
   midi_port_buf = jack_port_get_buffer (jclient->midi_output_port, nframes);
   jack_midi_clear_buffer (midi_port_buf);
-  last_frames = 0;
 
   while (jack_ringbuffer_read_space (jclient->context.o2p_midi) >=
 	 sizeof (struct ow_midi_event))
@@ -133,30 +181,27 @@ jclient_o2j_midi (struct jclient *jclient, jack_nframes_t nframes)
       jack_ringbuffer_peek (jclient->context.o2p_midi, (void *) &event,
 			    sizeof (struct ow_midi_event));
 
-      event_frames = jack_time_to_frames (jclient->client, event.time);
-      last_frame_time = jack_time_to_frames (jclient->client, event.time);
+      pos = event.time * jclient->o2j_midi_frames_per_s +
+	jclient->o2j_midi_frames_offset;
+
+      if (pos >= nframes)
+	{
+	  debug_print (2, "Skipping until the next cycle...\n");
+	  break;
+	}
 
-      if (last_frame_time < event_frames)
+      if (pos < 0)
 	{
-	  debug_print (2, "Event delayed: %u frames\n",
-		       event_frames - last_frame_time);
+	  debug_print (2, "Event delayed: %f frames\n", -pos);
 	  frames = 0;
 	}
       else
 	{
-	  frames = (last_frame_time - event_frames) % jclient->bufsize;
+	  frames = pos;
 	}
 
       debug_print (2, "Event frames: %u\n", frames);
 
-      if (frames < last_frames)
-	{
-	  debug_print (2, "Skipping until the next cycle...\n");
-	  last_frames = 0;
-	  break;
-	}
-      last_frames = frames;
-
       jack_ringbuffer_read_advance (jclient->context.o2p_midi,
 				    sizeof (struct ow_midi_event));
 
@@ -189,7 +234,8 @@ jclient_j2o_midi (struct jclient *jclient, jack_nframes_t nframes)
   struct ow_midi_event oevent;
   jack_nframes_t event_count;
   jack_midi_data_t status_byte;
-  struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
+  int written = 0;
+  struct ow_engine *engine = jclient->engine;
 
   if (ow_engine_get_status (engine) < OW_ENGINE_STATUS_RUN)
     {
@@ -259,6 +305,7 @@ jclient_j2o_midi (struct jclient *jclient, jack_nframes_t nframes)
 	      jack_ringbuffer_write (jclient->context.p2o_midi,
 				     (void *) &oevent,
 				     sizeof (struct ow_midi_event));
+	      written = 1;
 	    }
 	  else
 	    {
@@ -267,21 +314,55 @@ jclient_j2o_midi (struct jclient *jclient, jack_nframes_t nframes)
 	    }
 	}
     }
+
+  if (written)
+    {
+      ow_engine_notify_p2o_midi (engine);
+    }
+}
+
+//The inactive ports are zeroed as they might be connected before the tracks are available.
+static inline void
+jclient_clear_o2j_audio (jack_nframes_t nframes,
+			 jack_default_audio_sample_t * buffer[],
+			 const struct ow_device_desc *desc, uint32_t mask)
+{
+  for (int j = 0; j < desc->outputs; j++)
+    {
+      if (!(mask & (1U << j)))
+	{
+	  memset (buffer[j], 0, nframes * sizeof (float));
+	}
+    }
 }
 
 inline void
 jclient_copy_o2j_audio (float *f, jack_nframes_t nframes,
 			jack_default_audio_sample_t * buffer[],
-			const struct ow_device_desc *desc)
+			const struct ow_device_desc *desc, uint32_t mask)
 {
+  int tracks = 0;
+  jack_default_audio_sample_t *active[OB_MAX_TRACKS];
+
+  for (int j = 0; j < desc->outputs; j++)
+    {
+      if (mask & (1U << j))
+	{
+	  active[tracks] = buffer[j];
+	  tracks++;
+	}
+    }
+
   for (int i = 0; i < nframes; i++)
     {
-      for (int j = 0; j < desc->outputs; j++)
+      for (int j = 0; j < tracks; j++)
 	{
-	  buffer[j][i] = *f;
+	  active[j][i] = *f;
 	  f++;
 	}
     }
+
+  jclient_clear_o2j_audio (nframes, buffer, desc, mask);
 }
 
 inline void
@@ -299,10 +380,108 @@ jclient_copy_j2o_audio (float *f, jack_nframes_t nframes,
     }
 }
 
+inline void
+jclient_copy_o2j_audio_planar (float *f, jack_nframes_t nframes,
+			       jack_default_audio_sample_t * buffer[],
+			       const struct ow_device_desc *desc,
+			       uint32_t mask)
+{
+  for (int j = 0; j < desc->outputs; j++)
+    {
+      if (mask & (1U << j))
+	{
+	  memcpy (buffer[j], f, nframes * sizeof (float));
+	  f += nframes;
+	}
+    }
+
+  jclient_clear_o2j_audio (nframes, buffer, desc, mask);
+}
+
+inline void
+jclient_copy_j2o_audio_planar (float *f, jack_nframes_t nframes,
+			       jack_default_audio_sample_t * buffer[],
+			       const struct ow_device_desc *desc)
+{
+  for (int j = 0; j < desc->inputs; j++, f += nframes)
+    {
+      memcpy (f, buffer[j], nframes * sizeof (float));
+    }
+}
+
+//JACK and the device share the clock so the frames are just moved around and only the buffer depth needs to be kept.
+static inline void
+jclient_read_sync_audio (struct jclient *jclient, jack_nframes_t nframes,
+			 jack_default_audio_sample_t * buffer[],
+			 const struct ow_device_desc *desc)
+{
+  size_t frame_size = desc->outputs * OB_BYTES_PER_SAMPLE;
+  jack_nframes_t fpt = ow_engine_get_frames_per_transfer (jclient->engine);
+  jack_nframes_t target = nframes + fpt;
+  size_t frames = jack_ringbuffer_read_space (jclient->context.o2p_audio) /
+    frame_size;
+
+  if (!jclient->sync_primed)
+    {
+      if (frames < target)
+	{
+	  jclient_clear_o2j_audio (nframes, buffer, desc, 0);
+	  return;
+	}
+      jclient->sync_primed = 1;
+    }
+  else if (frames < nframes)
+    {
+      jclient->sync_o2j_underflows++;
+      jclient->sync_primed = 0;
+      jclient_clear_o2j_audio (nframes, buffer, desc, 0);
+      return;
+    }
+  else if (frames <= target + SYNC_MAX_EXTRA_TRANSFERS * fpt)
+    {
+      target = frames;
+    }
+  else
+    {
+      jclient->sync_o2j_overflows++;
+    }
+
+  //Only the newest frames are kept.
+  jack_ringbuffer_read_advance (jclient->context.o2p_audio,
+				(frames - target) * frame_size);
+  jack_ringbuffer_read (jclient->context.o2p_audio,
+			(char *) jclient->sync_buf, nframes * frame_size);
+  jclient_copy_o2j_audio (jclient->sync_buf, nframes, buffer, desc,
+			  ow_engine_get_all_tracks_mask (jclient->engine));
+}
+
+static inline void
+jclient_write_sync_audio (struct jclient *jclient, jack_nframes_t nframes,
+			  jack_default_audio_sample_t * buffer[],
+			  const struct ow_device_desc *desc)
+{
+  size_t frame_size = desc->inputs * OB_BYTES_PER_SAMPLE;
+  jack_nframes_t fpt = ow_engine_get_frames_per_transfer (jclient->engine);
+  size_t max = (nframes + (SYNC_MAX_EXTRA_TRANSFERS + 1) * fpt) * frame_size;
+  size_t bytes = nframes * frame_size;
+
+  //The engine is the reader so the cycle is dropped instead of trimming.
+  if (jack_ringbuffer_read_space (jclient->context.p2o_audio) + bytes > max)
+    {
+      jclient->sync_j2o_overflows++;
+      return;
+    }
+
+  jclient_copy_j2o_audio (jclient->sync_buf, nframes, buffer, desc);
+  jack_ringbuffer_write (jclient->context.p2o_audio,
+			 (char *) jclient->sync_buf, bytes);
+}
+
 static inline int
 jclient_process_cb (jack_nframes_t nframes, void *arg)
 {
   float *f;
+  uint32_t mask;
   jack_default_audio_sample_t *buffer[OB_MAX_TRACKS];
   struct jclient *jclient = arg;
 
@@ -311,33 +490,82 @@ jclient_process_cb (jack_nframes_t nframes, void *arg)
   jack_time_t next_usecs;
   float period_usecs;
   double time;
-  struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
+  struct ow_engine *engine = jclient->engine;
   const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+  uint64_t start = ow_get_time_ns ();
 
   if (jack_get_cycle_times (jclient->client,
 			    &current_frames,
 			    &current_usecs, &next_usecs, &period_usecs))
     {
       error_print ("Error while getting JACK time\n");
+      period_usecs = 0;
     }
 
   time = current_usecs * 1.0e-6;
 
-  if (ow_resampler_compute_ratios (jclient->resampler, time))
+  //Events received during the previous cycle are played in this one, so they keep their relative timing.
+  if (period_usecs > 0)
     {
-      return 0;
+      jclient->o2j_midi_frames_per_s = nframes / (period_usecs * 1.0e-6);
+      jclient->o2j_midi_frames_offset = nframes -
+	time * jclient->o2j_midi_frames_per_s;
+    }
+  else
+    {
+      jclient->o2j_midi_frames_per_s = 0;
+      jclient->o2j_midi_frames_offset = 0;
     }
 
   //o2p
 
+  if (!jclient->resampler)
+    {
+      for (int i = 0; i < desc->outputs; i++)
+	{
+	  buffer[i] = jack_port_get_buffer (jclient->output_ports[i],
+					    nframes);
+	}
+      jclient_read_sync_audio (jclient, nframes, buffer, desc);
+
+      if (ow_engine_is_p2o_audio_enabled (engine))
+	{
+	  for (int i = 0; i < desc->inputs; i++)
+	    {
+	      buffer[i] = jack_port_get_buffer (jclient->input_ports[i],
+						nframes);
+	    }
+	  jclient_write_sync_audio (jclient, nframes, buffer, desc);
+	}
+
+      jclient_o2j_midi (jclient, nframes);
+
+      jclient_j2o_midi (jclient, nframes);
+
+      return 0;
+    }
+
+  if (ow_resampler_compute_ratios (jclient->resampler, time))
+    {
+      return 0;
+    }
+
   for (int i = 0; i < desc->outputs; i++)
     {
       buffer[i] = jack_port_get_buffer (jclient->output_ports[i], nframes);
     }
 
   f = ow_resampler_get_o2p_audio_buffer (jclient->resampler);
+  mask = ow_resampler_get_o2p_track_mask (jclient->resampler);
   ow_resampler_read_audio (jclient->resampler);
-  jclient_copy_o2j_audio (f, nframes, buffer, desc);
+  if (jclient->planar)
+    {
+      jclient_copy_o2j_audio_planar (f, nframes, buffer, desc, mask);
+    }
+  else
+    {
+      jclient_copy_o2j_audio (f, nframes, buffer, desc, mask);
+    }
 
   //p2o
 
@@ -349,7 +577,14 @@ jclient_process_cb (jack_nframes_t nframes, void *arg)
 	}
 
       f = ow_resampler_get_p2o_audio_buffer (jclient->resampler);
-      jclient_copy_j2o_audio (f, nframes, buffer, desc);
+      if (jclient->planar)
+	{
+	  jclient_copy_j2o_audio_planar (f, nframes, buffer, desc);
+	}
+      else
+	{
+	  jclient_copy_j2o_audio (f, nframes, buffer, desc);
+	}
       ow_resampler_write_audio (jclient->resampler);
     }
 
@@ -357,6 +592,8 @@ jclient_process_cb (jack_nframes_t nframes, void *arg)
 
   jclient_j2o_midi (jclient, nframes);
 
+  ow_resampler_add_cycle_time (jclient->resampler, ow_get_time_ns () - start);
+
   return 0;
 }
 
@@ -370,25 +607,91 @@ set_rt_priority (pthread_t * thread, int priority)
     }
 }
 
+const char *
+jclient_get_name (struct jclient *jclient)
+{
+  return ow_engine_get_name (jclient->engine);
+}
+
+void
+jclient_report_status (struct jclient *jclient)
+{
+  if (jclient->resampler)
+    {
+      ow_resampler_report_status (jclient->resampler);
+    }
+  else
+    {
+      printf ("%s: o2j underflows: %d, o2j overflows: %d, j2o overflows: %d\n",
+	      jclient_get_name (jclient), jclient->sync_o2j_underflows,
+	      jclient->sync_o2j_overflows, jclient->sync_j2o_overflows);
+    }
+}
+
 void
 jclient_exit (struct jclient *jclient)
 {
   if (jclient->client)
     {
-      ow_resampler_report_status (jclient->resampler);
-      ow_resampler_stop (jclient->resampler);
+      jclient_report_status (jclient);
+      ow_engine_stop (jclient->engine);
+    }
+}
+
+//Several units of the same model are told apart by their serial numbers.
+void
+jclient_get_cache_key (struct jclient *jclient, char *key)
+{
+  struct ow_engine *engine = jclient->engine;
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+  const char *serial = ow_engine_get_serial (engine);
+
+  if (*serial)
+    {
+      snprintf (key, OW_LABEL_MAX_LEN * 2, "%s %s", desc->name, serial);
+    }
+  else
+    {
+      snprintf (key, OW_LABEL_MAX_LEN * 2, "%s", desc->name);
     }
 }
 
 int
 jclient_init (struct jclient *jclient)
 {
+  ow_err_t err;
   struct ow_resampler *resampler;
-  ow_err_t err = ow_resampler_init_from_bus_address (&resampler, jclient->bus,
-						     jclient->address,
-						     jclient->blocks_per_transfer,
-						     jclient->quality);
 
+  jclient->pwclient = NULL;
+  jclient->sync_buf = NULL;
+  jclient->sync_primed = 0;
+  jclient->sync_o2j_underflows = 0;
+  jclient->sync_o2j_overflows = 0;
+  jclient->sync_j2o_overflows = 0;
+
+  if (jclient->synchronous)
+    {
+      err = ow_engine_init_from_bus_address (&jclient->engine, jclient->bus,
+					     jclient->address,
+					     jclient->blocks_per_transfer,
+					     jclient->xfrs, jclient->usb_loop);
+      if (err)
+	{
+	  error_print ("Overwitch error: %s\n", ow_get_err_str (err));
+	  return -1;
+	}
+
+      jclient->resampler = NULL;
+      jclient->planar = 0;
+
+      return 0;
+    }
+
+  err = ow_resampler_init_from_bus_address (&resampler, jclient->bus,
+					    jclient->address,
+					    jclient->blocks_per_transfer,
+					    jclient->xfrs, jclient->backend,
+					    jclient->quality, jclient->usb_loop);
   if (err)
     {
       error_print ("Overwitch error: %s\n", ow_get_err_str (err));
@@ -396,65 +699,90 @@ jclient_init (struct jclient *jclient)
     }
 
   jclient->resampler = resampler;
+  jclient->engine = ow_resampler_get_engine (resampler);
+  jclient->planar = ow_resampler_is_planar (resampler);
+  ow_resampler_set_adaptive (resampler, jclient->adaptive);
+  ow_resampler_set_fast_path (resampler, jclient->fast_path);
 
   return 0;
 }
 
-int
-jclient_run (struct jclient *jclient)
+inline int
+jclient_set_process_callback (struct jclient *jclient,
+			      jack_client_t * client)
+{
+  return jack_set_process_callback (client, jclient_process_cb, jclient);
+}
+
+//A given client belongs to the JACK server so it is not opened nor closed here.
+static int
+jclient_run_client (struct jclient *jclient, jack_client_t * client)
 {
   jack_status_t status;
   ow_err_t err = OW_OK;
   char *client_name;
+  char cache_key[OW_LABEL_MAX_LEN * 2];
+  jack_nframes_t samplerate;
+  double ratio;
   struct ow_engine *engine;
   const struct ow_device_desc *desc;
 
   jclient->output_ports = NULL;
   jclient->input_ports = NULL;
-  jclient->context.p2o_audio = NULL;
-  jclient->context.o2p_audio = NULL;
-  jclient->context.p2o_midi = NULL;
-  jclient->context.o2p_midi = NULL;
+  //Without a resampler nothing sets the DLL members, which must be NULL then.
+  memset (&jclient->context, 0, sizeof (struct ow_context));
 
-  ow_resampler_set_report_callback (jclient->resampler, &jclient->reporter);
+  if (jclient->resampler)
+    {
+      ow_resampler_set_report_callback (jclient->resampler,
+					&jclient->reporter);
+    }
 
-  engine = ow_resampler_get_engine (jclient->resampler);
+  engine = jclient->engine;
   desc = ow_engine_get_device_desc (engine);
 
-  jclient->client =
-    jack_client_open (ow_resampler_get_name (jclient->resampler),
-		      JackNoStartServer, &status, NULL);
-  if (jclient->client == NULL)
+  if (client)
     {
-      error_print ("jack_client_open() failed, status = 0x%2.0x\n", status);
-
-      if (status & JackServerFailed)
+      jclient->client = client;
+      debug_print (1, "Running as the internal client %s...\n",
+		   jack_get_client_name (client));
+    }
+  else
+    {
+      jclient->client = jack_client_open (jclient_get_name (jclient),
+					  JackNoStartServer, &status, NULL);
+      if (jclient->client == NULL)
 	{
-	  error_print ("Unable to connect to JACK server\n");
+	  error_print ("jack_client_open() failed, status = 0x%2.0x\n",
+		       status);
+
+	  if (status & JackServerFailed)
+	    {
+	      error_print ("Unable to connect to JACK server\n");
+	    }
+	  err = OW_GENERIC_ERROR;
+	  goto end;
 	}
-      err = OW_GENERIC_ERROR;
-      goto end;
-    }
 
-  if (status & JackServerStarted)
-    {
-      debug_print (1, "JACK server started\n");
-    }
+      if (status & JackServerStarted)
+	{
+	  debug_print (1, "JACK server started\n");
+	}
 
-  if (status & JackNameNotUnique)
-    {
-      client_name = jack_get_client_name (jclient->client);
-      debug_print (0, "Name client in use. Using %s...\n", client_name);
+      if (status & JackNameNotUnique)
+	{
+	  client_name = jack_get_client_name (jclient->client);
+	  debug_print (0, "Name client in use. Using %s...\n", client_name);
+	}
     }
 
-  if (jack_set_process_callback
-      (jclient->client, jclient_process_cb, jclient))
+  if (jclient_set_process_callback (jclient, jclient->client))
     {
       goto cleanup_jack;
     }
 
   if (jack_set_xrun_callback
-      (jclient->client, jclient_thread_xrun_cb, jclient->resampler))
+      (jclient->client, jclient_thread_xrun_cb, jclient))
     {
       goto cleanup_jack;
     }
@@ -538,16 +866,15 @@ jclient_run (struct jclient *jclient)
       goto cleanup_jack;
     }
 
+  //The synchronous mode keeps the buffers shallow by itself.
   jclient->context.o2p_audio =
-    jack_ringbuffer_create (MAX_LATENCY *
-			    ow_resampler_get_o2p_frame_size
-			    (jclient->resampler));
+    jack_ringbuffer_create (MAX_LATENCY * desc->outputs *
+			    OB_BYTES_PER_SAMPLE);
   jack_ringbuffer_mlock (jclient->context.o2p_audio);
 
   jclient->context.p2o_audio =
-    jack_ringbuffer_create (MAX_LATENCY *
-			    ow_resampler_get_p2o_frame_size
-			    (jclient->resampler));
+    jack_ringbuffer_create (MAX_LATENCY * desc->inputs *
+			    OB_BYTES_PER_SAMPLE);
   jack_ringbuffer_mlock (jclient->context.p2o_audio);
 
   jclient->context.o2p_midi = jack_ringbuffer_create (MIDI_BUF_SIZE);
@@ -562,26 +889,86 @@ jclient_run (struct jclient *jclient)
     (ow_buffer_rw_space_t) jack_ringbuffer_write_space;
   jclient->context.read = jclient_buffer_read;
   jclient->context.write = (ow_buffer_write_t) jack_ringbuffer_write;
+  jclient->context.get_write_vector =
+    (ow_buffer_get_vector_t) jack_ringbuffer_get_write_vector;
+  jclient->context.commit =
+    (ow_buffer_advance_t) jack_ringbuffer_write_advance;
+  jclient->context.get_read_vector =
+    (ow_buffer_get_vector_t) jack_ringbuffer_get_read_vector;
+  jclient->context.advance = (ow_buffer_advance_t) jack_ringbuffer_read_advance;
   jclient->context.get_time = jclient_get_time;
 
   jclient->context.set_rt_priority = set_rt_priority;
   jclient->context.priority = jclient->priority;
+  jclient->context.usb_cpu = jclient->usb_cpu;
+  jclient->context.p2o_midi_window = jclient->p2o_midi_window;
+  jclient->context.p2o_midi_cpu = jclient->p2o_midi_cpu;
 
   jclient->context.options =
     OW_ENGINE_OPTION_O2P_AUDIO | OW_ENGINE_OPTION_O2P_MIDI |
     OW_ENGINE_OPTION_P2O_MIDI;
 
-  err = ow_resampler_activate (jclient->resampler, &jclient->context);
-  if (err)
+  if (jclient->tap)
     {
-      goto cleanup_jack;
+      err = ow_engine_start_tap (engine);
+      if (err)
+	{
+	  goto cleanup_jack;
+	}
+    }
+
+  if (jclient->capture_path)
+    {
+      err =
+	ow_engine_start_capture (engine, jclient->capture_path);
+      if (err)
+	{
+	  goto cleanup_jack;
+	}
+    }
+
+  samplerate = jack_get_sample_rate (jclient->client);
+
+  if (jclient->resampler)
+    {
+      err = ow_resampler_activate (jclient->resampler, &jclient->context);
+      if (err)
+	{
+	  goto cleanup_jack;
+	}
+
+      jclient_get_cache_key (jclient, cache_key);
+      ratio = cache_get_ratio (cache_key, samplerate);
+      if (ratio)
+	{
+	  debug_print (1, "Using cached ratio %f\n", ratio);
+	  ow_resampler_set_ratio_seed (jclient->resampler, samplerate, ratio);
+	}
+    }
+  else
+    {
+      if (jclient_set_sample_rate_cb (samplerate, jclient))
+	{
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_jack;
+	}
+
+      //Without a DLL, the engine runs as soon as the transfers start.
+      err = ow_engine_activate (engine, &jclient->context);
+      if (err)
+	{
+	  goto cleanup_jack;
+	}
     }
 
   //Sometimes these callbacks are not called so we need to do it.
-  jclient_set_sample_rate_cb (jack_get_sample_rate (jclient->client),
-			      jclient);
-  jclient_set_buffer_size_cb (jack_get_buffer_size (jclient->client),
-			      jclient);
+  jclient_set_sample_rate_cb (samplerate, jclient);
+  if (jclient_set_buffer_size_cb (jack_get_buffer_size (jclient->client),
+				  jclient))
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_jack;
+    }
 
   if (jack_activate (jclient->client))
     {
@@ -590,7 +977,25 @@ jclient_run (struct jclient *jclient)
       goto cleanup_jack;
     }
 
-  ow_resampler_wait (jclient->resampler);
+  //The callback is only called on changes.
+  jclient_port_connect_cb (0, 0, 0, jclient);
+
+  if (jclient->resampler)
+    {
+      ow_resampler_wait (jclient->resampler);
+
+      //The sample rate might have changed.
+      ratio = ow_resampler_get_locked_ratio (jclient->resampler);
+      if (ratio)
+	{
+	  cache_set_ratio (cache_key,
+			   jack_get_sample_rate (jclient->client), ratio);
+	}
+    }
+  else
+    {
+      ow_engine_wait (engine);
+    }
 
   debug_print (1, "Exiting...\n");
   jack_deactivate (jclient->client);
@@ -600,14 +1005,38 @@ cleanup_jack:
   jack_ringbuffer_free (jclient->context.o2p_audio);
   jack_ringbuffer_free (jclient->context.p2o_midi);
   jack_ringbuffer_free (jclient->context.o2p_midi);
-  jack_client_close (jclient->client);
+  if (!client)
+    {
+      jack_client_close (jclient->client);
+    }
   free (jclient->output_ports);
   free (jclient->input_ports);
+  free (jclient->sync_buf);
+  jclient->sync_buf = NULL;
 end:
-  ow_resampler_destroy (jclient->resampler);
+  if (jclient->resampler)
+    {
+      ow_resampler_destroy (jclient->resampler);
+    }
+  else
+    {
+      ow_engine_destroy (engine);
+    }
   return err;
 }
 
+int
+jclient_run (struct jclient *jclient)
+{
+  return jclient_run_client (jclient, NULL);
+}
+
+int
+jclient_run_internal (struct jclient *jclient, jack_client_t * client)
+{
+  return jclient_run_client (jclient, client);
+}
+
 void *
 jclient_run_thread (void *data)
 {
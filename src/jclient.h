@@ -18,6 +18,9 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef JCLIENT_H
+#define JCLIENT_H
+
 #include <jack/ringbuffer.h>
 #include <jack/midiport.h>
 #include "overwitch.h"
@@ -36,13 +39,36 @@ struct jclient
   uint8_t bus;
   uint8_t address;
   int blocks_per_transfer;
+  int xfrs;
+  ow_resampler_backend_t backend;
   int quality;
   int priority;
+  struct ow_usb_loop *usb_loop;	//Optional
+  int usb_cpu;
+  int p2o_midi_cpu;
+  int p2o_midi_window;		//µs
+  int adaptive;			//Shrink the o2j delay according to the jitter
+  int fast_path;		//Interpolate while the ratio stays close to 1
+  int synchronous;		//JACK runs from the device clock so nothing is resampled
+  const char *capture_path;	//Optional
+  int tap;			//Publish the o2p audio for other processes
   jack_nframes_t bufsize;
+  //Linear time to frame mapping of the o2j MIDI events of the current cycle
+  double o2j_midi_frames_per_s;
+  double o2j_midi_frames_offset;
   // Overwitch stuff
-  struct ow_resampler *resampler;
+  struct ow_engine *engine;
+  struct ow_resampler *resampler;	//NULL in synchronous mode
+  int planar;			//Audio buffers have a lane per track
   struct ow_context context;
   struct ow_resampler_reporter reporter;
+  void *pwclient;		//Set while running as a PipeWire filter
+  //Synchronous mode
+  float *sync_buf;		//A JACK cycle of interleaved frames
+  int sync_primed;
+  int sync_o2j_underflows;
+  int sync_o2j_overflows;
+  int sync_j2o_overflows;
   // Thread end notifier
   jclient_end_notifier_t end_notifier;
 };
@@ -51,16 +77,43 @@ int jclient_init (struct jclient *);
 
 int jclient_run (struct jclient *);
 
+//Runs on a client created by the JACK server, which keeps it open when this returns.
+int jclient_run_internal (struct jclient *, jack_client_t *);
+
+//The JACK server passes the process callback argument to jack_finish, so internal clients set it before running.
+int jclient_set_process_callback (struct jclient *, jack_client_t *);
+
 void *jclient_run_thread (void *);
 
 void jclient_exit (struct jclient *);
 
+const char *jclient_get_name (struct jclient *);
+
+void jclient_report_status (struct jclient *);
+
+//The key of the device in the ratio cache. The buffer must be OW_LABEL_MAX_LEN * 2 long.
+void jclient_get_cache_key (struct jclient *, char *);
+
 void jclient_print_latencies (struct ow_resampler *, const char *);
 
+//A NULL destination discards the data.
+size_t jclient_buffer_read (void *, char *, size_t);
+
+//Only the tracks in the mask are in the buffer.
 void jclient_copy_o2j_audio (float *, jack_nframes_t,
 			     jack_default_audio_sample_t *[],
-			     const struct ow_device_desc *);
+			     const struct ow_device_desc *, uint32_t);
 
 void jclient_copy_j2o_audio (float *, jack_nframes_t,
 			     jack_default_audio_sample_t *[],
 			     const struct ow_device_desc *);
+
+void jclient_copy_o2j_audio_planar (float *, jack_nframes_t,
+				    jack_default_audio_sample_t *[],
+				    const struct ow_device_desc *, uint32_t);
+
+void jclient_copy_j2o_audio_planar (float *, jack_nframes_t,
+				    jack_default_audio_sample_t *[],
+				    const struct ow_device_desc *);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ *   loop.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include "loop.h"
+#include "engine.h"
+
+#define LOOP_TIMEOUT_US 10000
+#define LOOP_IDLE_NS 1000000
+
+static void *
+run_usb_loop (void *data)
+{
+  int active;
+  struct ow_engine *engine;
+  struct ow_usb_loop *loop = data;
+  struct timeval timeout = {
+    .tv_sec = 0,
+    .tv_usec = LOOP_TIMEOUT_US
+  };
+  struct timespec idle = {
+    .tv_sec = 0,
+    .tv_nsec = LOOP_IDLE_NS
+  };
+
+  while (!atomic_load_explicit (&loop->stop, memory_order_acquire))
+    {
+      active = 0;
+      for (int i = 0; i < OW_USB_LOOP_MAX_ENGINES; i++)
+	{
+	  engine = atomic_load_explicit (&loop->engines[i],
+					 memory_order_acquire);
+	  if (!engine)
+	    {
+	      continue;
+	    }
+
+	  if (ow_engine_poll (engine) && ow_engine_release_usb (engine))
+	    {
+	      debug_print (1, "%s: Leaving the USB loop...\n", engine->name);
+	      atomic_store_explicit (&loop->engines[i], NULL,
+				     memory_order_release);
+	      continue;
+	    }
+
+	  if (engine->usb.started)
+	    {
+	      active++;
+	    }
+	}
+
+      //Every completed transfer makes this return so the engine states are checked at least as often as in the single device case.
+      if (active)
+	{
+	  libusb_handle_events_timeout_completed (loop->context, &timeout,
+						  NULL);
+	}
+      else
+	{
+	  nanosleep (&idle, NULL);
+	}
+    }
+
+  return NULL;
+}
+
+ow_err_t
+ow_usb_loop_init (struct ow_usb_loop **loop_)
+{
+  struct ow_usb_loop *loop = malloc (sizeof (struct ow_usb_loop));
+
+  if (libusb_init (&loop->context) != LIBUSB_SUCCESS)
+    {
+      free (loop);
+      return OW_USB_ERROR_LIBUSB_INIT_FAILED;
+    }
+
+  pthread_mutex_init (&loop->mutex, NULL);
+  loop->running = 0;
+  atomic_init (&loop->stop, 0);
+  for (int i = 0; i < OW_USB_LOOP_MAX_ENGINES; i++)
+    {
+      atomic_init (&loop->engines[i], NULL);
+    }
+
+  *loop_ = loop;
+  return OW_OK;
+}
+
+static void
+ow_usb_loop_remove (struct ow_usb_loop *loop, struct ow_engine *engine)
+{
+  struct ow_engine *expected;
+
+  for (int i = 0; i < OW_USB_LOOP_MAX_ENGINES; i++)
+    {
+      expected = engine;
+      if (atomic_compare_exchange_strong (&loop->engines[i], &expected,
+					  NULL))
+	{
+	  return;
+	}
+    }
+}
+
+//The thread is started with the first engine so that it gets the RT priority of its context.
+ow_err_t
+ow_usb_loop_add (struct ow_usb_loop *loop, struct ow_engine *engine,
+		 struct ow_context *context)
+{
+  struct ow_engine *expected;
+  ow_err_t err = OW_GENERIC_ERROR;
+
+  pthread_mutex_lock (&loop->mutex);
+
+  for (int i = 0; i < OW_USB_LOOP_MAX_ENGINES; i++)
+    {
+      expected = NULL;
+      if (atomic_compare_exchange_strong (&loop->engines[i], &expected,
+					  engine))
+	{
+	  debug_print (1, "%s: Joining the USB loop (slot %d)...\n",
+		       engine->name, i);
+	  err = OW_OK;
+	  break;
+	}
+    }
+
+  if (err)
+    {
+      error_print ("No free slots in the USB loop\n");
+      goto end;
+    }
+
+  if (!loop->running)
+    {
+      debug_print (1, "Starting USB loop thread...\n");
+      if (pthread_create (&loop->thread, NULL, run_usb_loop, loop))
+	{
+	  error_print ("Could not start USB loop thread\n");
+	  ow_usb_loop_remove (loop, engine);
+	  err = OW_GENERIC_ERROR;
+	  goto end;
+	}
+      context->set_rt_priority (&loop->thread, context->priority);
+      //The first engine decides where the thread runs.
+      ow_set_thread_affinity (&loop->thread, engine->usb_cpu);
+      loop->running = 1;
+    }
+
+end:
+  pthread_mutex_unlock (&loop->mutex);
+  return err;
+}
+
+//All the engines must be already destroyed.
+void
+ow_usb_loop_destroy (struct ow_usb_loop *loop)
+{
+  if (loop->running)
+    {
+      atomic_store_explicit (&loop->stop, 1, memory_order_release);
+      pthread_join (loop->thread, NULL);
+    }
+  pthread_mutex_destroy (&loop->mutex);
+  libusb_exit (loop->context);
+  free (loop);
+}
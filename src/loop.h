@@ -0,0 +1,43 @@
+/*
+ *   loop.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <libusb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "overwitch.h"
+
+//A single thread handles the USB events of all the engines using the same libusb context.
+struct ow_usb_loop
+{
+  libusb_context *context;
+  pthread_t thread;
+  pthread_mutex_t mutex;	//Only used to start the thread and to add engines
+  int running;
+  atomic_int stop;
+  _Atomic (struct ow_engine *) engines[OW_USB_LOOP_MAX_ENGINES];
+};
+
+ow_err_t ow_usb_loop_add (struct ow_usb_loop *, struct ow_engine *,
+			  struct ow_context *);
+
+#endif
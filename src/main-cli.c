@@ -24,26 +24,50 @@
 #include "jclient.h"
 #include "utils.h"
 #include "common.h"
+#include "metrics.h"
+#if HAVE_PIPEWIRE
+#include "pwclient.h"
+#endif
 
 #define DEFAULT_QUALITY 2
 #define DEFAULT_BLOCKS 24
+#define DEFAULT_XFRS 1
 #define DEFAULT_PRIORITY -1	//With this value the default priority will be used.
 
 struct overwitch_instance
 {
   pthread_t thread;
   struct jclient jclient;
+  struct metrics_device metrics;
 };
 
 static size_t instance_count;
 static struct overwitch_instance *instances;
+static struct metrics_device **metrics_devices;
+static size_t metrics_device_count;
+static int pipewire;
 
 static struct option options[] = {
   {"use-device-number", 1, NULL, 'n'},
   {"use-device", 1, NULL, 'd'},
+  {"resampler", 1, NULL, 'r'},
   {"resampling-quality", 1, NULL, 'q'},
   {"transfer-blocks", 1, NULL, 'b'},
+  {"usb-transfers", 1, NULL, 't'},
+  {"single-usb-thread", 0, NULL, 's'},
+  {"usb-cpu", 1, NULL, 'u'},
+  {"midi-cpu", 1, NULL, 'm'},
+  {"midi-window", 1, NULL, 'w'},
   {"rt-priority", 1, NULL, 'p'},
+  {"adaptive-latency", 0, NULL, 'a'},
+  {"no-fast-path", 0, NULL, 'f'},
+  {"synchronous", 0, NULL, 'y'},
+#if HAVE_PIPEWIRE
+  {"pipewire", 0, NULL, 'P'},
+#endif
+  {"metrics-socket", 1, NULL, 'x'},
+  {"capture", 1, NULL, 'c'},
+  {"tap", 0, NULL, 'T'},
   {"list-devices", 0, NULL, 'l'},
   {"verbose", 0, NULL, 'v'},
   {"help", 0, NULL, 'h'},
@@ -58,6 +82,13 @@ signal_handler (int signo)
       struct overwitch_instance *instance = instances;
       for (int i = 0; i < instance_count; i++, instance++)
 	{
+#if HAVE_PIPEWIRE
+	  if (pipewire)
+	    {
+	      pwclient_exit (&instance->jclient);
+	      continue;
+	    }
+#endif
 	  jclient_exit (&instance->jclient);
 	}
     }
@@ -66,14 +97,46 @@ signal_handler (int signo)
       struct overwitch_instance *instance = instances;
       for (int i = 0; i < instance_count; i++, instance++)
 	{
-	  ow_resampler_report_status (instance->jclient.resampler);
+	  jclient_report_status (&instance->jclient);
 	}
     }
 }
 
+//Must be called for every instance after jclient_init and before its thread is started.
+static void
+add_instance_metrics (struct overwitch_instance *instance)
+{
+  metrics_device_init (&instance->metrics,
+		       jclient_get_name (&instance->jclient),
+		       instance->jclient.bus, instance->jclient.address);
+  instance->jclient.reporter.callback = metrics_device_report;
+  instance->jclient.reporter.data = &instance->metrics;
+  metrics_devices[metrics_device_count] = &instance->metrics;
+  metrics_device_count++;
+}
+
+static void
+start_instance (struct overwitch_instance *instance)
+{
+#if HAVE_PIPEWIRE
+  if (pipewire)
+    {
+      pthread_create (&instance->thread, NULL, pwclient_run_thread,
+		      &instance->jclient);
+      return;
+    }
+#endif
+  pthread_create (&instance->thread, NULL, jclient_run_thread,
+		  &instance->jclient);
+}
+
 static int
 run_single (int device_num, const char *device_name,
-	    int blocks_per_transfer, int quality, int priority)
+	    int blocks_per_transfer, int xfrs,
+	    ow_resampler_backend_t backend, int quality, int priority,
+	    int usb_cpu, int p2o_midi_cpu, int p2o_midi_window, int adaptive,
+	    int fast_path, int synchronous, int tap, const char *metrics_path,
+	    const char *capture_path)
 {
   struct ow_usb_device *device;
   ow_err_t err = OW_OK;
@@ -88,8 +151,19 @@ run_single (int device_num, const char *device_name,
   instances->jclient.bus = device->bus;
   instances->jclient.address = device->address;
   instances->jclient.blocks_per_transfer = blocks_per_transfer;
+  instances->jclient.xfrs = xfrs;
+  instances->jclient.backend = backend;
   instances->jclient.quality = quality;
   instances->jclient.priority = priority;
+  instances->jclient.usb_loop = NULL;
+  instances->jclient.usb_cpu = usb_cpu;
+  instances->jclient.p2o_midi_cpu = p2o_midi_cpu;
+  instances->jclient.p2o_midi_window = p2o_midi_window;
+  instances->jclient.adaptive = adaptive;
+  instances->jclient.fast_path = fast_path;
+  instances->jclient.synchronous = synchronous;
+  instances->jclient.capture_path = capture_path;
+  instances->jclient.tap = tap;
   instances->jclient.reporter.callback = NULL;
   instances->jclient.reporter.period = 2;
   instances->jclient.end_notifier = NULL;
@@ -101,21 +175,39 @@ run_single (int device_num, const char *device_name,
       goto end;
     }
 
-  pthread_create (&instances->thread, NULL, jclient_run_thread,
-		  &instances->jclient);
+  if (metrics_path)
+    {
+      metrics_devices = malloc (sizeof (struct metrics_device *));
+      metrics_device_count = 0;
+      add_instance_metrics (instances);
+      metrics_server_start (metrics_path, metrics_devices,
+			    metrics_device_count);
+    }
+
+  start_instance (instances);
   pthread_join (instances->thread, NULL);
 
+  if (metrics_path)
+    {
+      metrics_server_stop ();
+      free (metrics_devices);
+    }
+
 end:
   free (instances);
   return err;
 }
 
 static int
-run_all (int blocks_per_transfer, int quality, int priority)
+run_all (int blocks_per_transfer, int xfrs, ow_resampler_backend_t backend,
+	 int quality, int priority, int usb_cpu, int p2o_midi_cpu, int p2o_midi_window,
+	 int adaptive, int fast_path, int synchronous, int tap,
+	 int single_usb_thread, const char *metrics_path)
 {
   struct ow_usb_device *devices;
   struct ow_usb_device *device;
   struct overwitch_instance *instance;
+  struct ow_usb_loop *usb_loop = NULL;
   ow_err_t err = ow_get_devices (&devices, &instance_count);
 
   if (err)
@@ -123,7 +215,23 @@ run_all (int blocks_per_transfer, int quality, int priority)
       return err;
     }
 
+  if (single_usb_thread)
+    {
+      err = ow_usb_loop_init (&usb_loop);
+      if (err)
+	{
+	  ow_free_usb_device_list (devices, instance_count);
+	  return err;
+	}
+    }
+
   instances = malloc (sizeof (struct overwitch_instance) * instance_count);
+  if (metrics_path)
+    {
+      metrics_devices =
+	malloc (sizeof (struct metrics_device *) * instance_count);
+      metrics_device_count = 0;
+    }
 
   device = devices;
   instance = instances;
@@ -132,8 +240,19 @@ run_all (int blocks_per_transfer, int quality, int priority)
       instance->jclient.bus = device->bus;
       instance->jclient.address = device->address;
       instance->jclient.blocks_per_transfer = blocks_per_transfer;
+      instance->jclient.xfrs = xfrs;
+      instance->jclient.backend = backend;
       instance->jclient.quality = quality;
       instance->jclient.priority = priority;
+      instance->jclient.usb_loop = usb_loop;
+      instance->jclient.usb_cpu = usb_cpu;
+      instance->jclient.p2o_midi_cpu = p2o_midi_cpu;
+      instance->jclient.p2o_midi_window = p2o_midi_window;
+      instance->jclient.adaptive = adaptive;
+      instance->jclient.fast_path = fast_path;
+      instance->jclient.synchronous = synchronous;
+      instance->jclient.capture_path = NULL;
+      instance->jclient.tap = tap;
       instance->jclient.reporter.callback = NULL;
       instances->jclient.reporter.period = 2;
       instance->jclient.end_notifier = NULL;
@@ -143,20 +262,41 @@ run_all (int blocks_per_transfer, int quality, int priority)
 	  continue;
 	}
 
-      pthread_create (&instance->thread, NULL, jclient_run_thread,
-		      &instance->jclient);
+      if (metrics_path)
+	{
+	  add_instance_metrics (instance);
+	}
+
+      start_instance (instance);
     }
 
   ow_free_usb_device_list (devices, instance_count);
 
+  if (metrics_path)
+    {
+      metrics_server_start (metrics_path, metrics_devices,
+			    metrics_device_count);
+    }
+
   instance = instances;
   for (int i = 0; i < instance_count; i++, instance++)
     {
       pthread_join (instance->thread, NULL);
     }
 
+  if (metrics_path)
+    {
+      metrics_server_stop ();
+      free (metrics_devices);
+    }
+
   free (instances);
 
+  if (usb_loop)
+    {
+      ow_usb_loop_destroy (usb_loop);
+    }
+
   return OW_OK;
 }
 
@@ -164,7 +304,7 @@ int
 main (int argc, char *argv[])
 {
   int opt;
-  int vflg = 0, lflg = 0, dflg = 0, bflg = 0, pflg = 0, nflg = 0, errflg = 0;
+  int vflg = 0, lflg = 0, dflg = 0, bflg = 0, tflg = 0, sflg = 0, pflg = 0, nflg = 0, errflg = 0;
   char *endstr;
   char *device_name = NULL;
   int long_index = 0;
@@ -172,8 +312,19 @@ main (int argc, char *argv[])
   struct sigaction action;
   int device_num = -1;
   int blocks_per_transfer = DEFAULT_BLOCKS;
+  int xfrs = DEFAULT_XFRS;
+  ow_resampler_backend_t backend = OW_RESAMPLER_BACKEND_SAMPLERATE;
   int quality = DEFAULT_QUALITY;
   int priority = DEFAULT_PRIORITY;
+  int usb_cpu = OW_CPU_AUTO;
+  int p2o_midi_cpu = OW_CPU_AUTO;
+  int p2o_midi_window = OW_DEFAULT_P2O_MIDI_WINDOW_US;
+  int adaptive = 0;
+  int fast_path = 1;
+  int synchronous = 0;
+  int tap = 0;
+  const char *metrics_path = NULL;
+  const char *capture_path = NULL;
 
   action.sa_handler = signal_handler;
   sigemptyset (&action.sa_mask);
@@ -183,7 +334,7 @@ main (int argc, char *argv[])
   sigaction (SIGTERM, &action, NULL);
   sigaction (SIGUSR1, &action, NULL);
 
-  while ((opt = getopt_long (argc, argv, "n:d:q:b:p:lvh",
+  while ((opt = getopt_long (argc, argv, "n:d:r:q:b:t:su:m:w:p:afyPx:c:Tlvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
@@ -196,6 +347,21 @@ main (int argc, char *argv[])
 	  device_name = optarg;
 	  dflg++;
 	  break;
+	case 'r':
+	  if (!strcmp (optarg, "samplerate"))
+	    {
+	      backend = OW_RESAMPLER_BACKEND_SAMPLERATE;
+	    }
+	  else if (!strcmp (optarg, "sinc"))
+	    {
+	      backend = OW_RESAMPLER_BACKEND_SINC;
+	    }
+	  else
+	    {
+	      fprintf (stderr,
+		       "Resampler must be 'samplerate' or 'sinc'. Using 'samplerate'...\n");
+	    }
+	  break;
 	case 'q':
 	  quality = (int) strtol (optarg, &endstr, 10);
 	  if (errno || endstr == optarg || *endstr != '\0' || quality > 4
@@ -219,6 +385,49 @@ main (int argc, char *argv[])
 	    }
 	  bflg++;
 	  break;
+	case 't':
+	  xfrs = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || xfrs < 1 || xfrs > OW_ENGINE_MAX_XFRS)
+	    {
+	      xfrs = DEFAULT_XFRS;
+	      fprintf (stderr,
+		       "Transfers value must be in [1..%d]. Using value %d...\n",
+		       OW_ENGINE_MAX_XFRS, xfrs);
+	    }
+	  tflg++;
+	  break;
+	case 's':
+	  sflg++;
+	  break;
+	case 'u':
+	  if (parse_cpu (optarg, &usb_cpu))
+	    {
+	      usb_cpu = OW_CPU_AUTO;
+	      fprintf (stderr,
+		       "USB CPU must be a valid CPU, 'auto' or 'none'. Using 'auto'...\n");
+	    }
+	  break;
+	case 'm':
+	  if (parse_cpu (optarg, &p2o_midi_cpu))
+	    {
+	      p2o_midi_cpu = OW_CPU_AUTO;
+	      fprintf (stderr,
+		       "MIDI CPU must be a valid CPU, 'auto' or 'none'. Using 'auto'...\n");
+	    }
+	  break;
+	case 'w':
+	  p2o_midi_window = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || p2o_midi_window < 0
+	      || p2o_midi_window > OW_MAX_P2O_MIDI_WINDOW_US)
+	    {
+	      p2o_midi_window = OW_DEFAULT_P2O_MIDI_WINDOW_US;
+	      fprintf (stderr,
+		       "MIDI window value must be in [0..%d] µs. Using value %d...\n",
+		       OW_MAX_P2O_MIDI_WINDOW_US, p2o_midi_window);
+	    }
+	  break;
 	case 'p':
 	  priority = (int) strtol (optarg, &endstr, 10);
 	  if (errno || endstr == optarg || *endstr != '\0' || priority < 0
@@ -230,6 +439,27 @@ main (int argc, char *argv[])
 	    }
 	  pflg++;
 	  break;
+	case 'a':
+	  adaptive = 1;
+	  break;
+	case 'f':
+	  fast_path = 0;
+	  break;
+	case 'y':
+	  synchronous = 1;
+	  break;
+	case 'P':
+	  pipewire = 1;
+	  break;
+	case 'x':
+	  metrics_path = optarg;
+	  break;
+	case 'c':
+	  capture_path = optarg;
+	  break;
+	case 'T':
+	  tap = 1;
+	  break;
 	case 'l':
 	  lflg++;
 	  break;
@@ -272,20 +502,42 @@ main (int argc, char *argv[])
       exit (EXIT_FAILURE);
     }
 
+  if (tflg > 1)
+    {
+      fprintf (stderr, "Undetermined transfers\n");
+      exit (EXIT_FAILURE);
+    }
+
   if (pflg > 1)
     {
       fprintf (stderr, "Undetermined priority\n");
       exit (EXIT_FAILURE);
     }
 
+  if (pipewire && synchronous)
+    {
+      fprintf (stderr, "Synchronous mode is only available with JACK\n");
+      exit (EXIT_FAILURE);
+    }
+
+  if (capture_path && nflg + dflg != 1)
+    {
+      fprintf (stderr, "Capturing needs a single device\n");
+      exit (EXIT_FAILURE);
+    }
+
   if (nflg + dflg == 0)
     {
-      return run_all (blocks_per_transfer, quality, priority);
+      return run_all (blocks_per_transfer, xfrs, backend, quality, priority,
+		      usb_cpu, p2o_midi_cpu, p2o_midi_window, adaptive,
+		      fast_path, synchronous, tap, sflg, metrics_path);
     }
   else if (nflg + dflg == 1)
     {
       return run_single (device_num, device_name,
-			 blocks_per_transfer, quality, priority);
+			 blocks_per_transfer, xfrs, backend, quality, priority,
+			 usb_cpu, p2o_midi_cpu, p2o_midi_window, adaptive,
+			 fast_path, synchronous, tap, metrics_path, capture_path);
     }
   else
     {
@@ -18,49 +18,101 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <sndfile.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/eventfd.h>
 #include "../config.h"
 #include "overwitch.h"
 #include "utils.h"
 #include "common.h"
 
 #define DEFAULT_BLOCKS 24
+#define DEFAULT_XFRS 2
 #define TRACK_BUF_KB 256
-#define MAX_FILENAME_LEN 64
+#define DUMP_CHUNKS 8
+#define CHUNK_FRAMES_ALIGNMENT 1024	//This makes the chunks a whole number of 4 KiB pages.
+#define MAX_FILENAME_LEN 128
+#define FLAC_MAX_CHANNELS 8
+#define TAP_READ_FRAMES (OB_FRAMES_PER_BLOCK * 512)
+#define TAP_POLL_US 5000
+
+struct dump_encoding
+{
+  const char *name;
+  int format;
+  int integer;			//The engine delivers int32 samples, which libsndfile takes as full scale.
+};
+
+static const struct dump_encoding DUMP_ENCODINGS[] = {
+  {"float", SF_FORMAT_FLOAT, 0},
+  {"pcm24", SF_FORMAT_PCM_24, 1},
+  {"pcm32", SF_FORMAT_PCM_32, 1},
+  {NULL, 0, 0}
+};
+
+struct dump_format
+{
+  const char *name;
+  const char *extension;
+  int format;
+  const struct dump_encoding *encoding;	//Default
+};
+
+//RF64 and W64 do not have the 4 GiB limit of WAV. FLAC only takes integers up to 24 bits.
+static const struct dump_format DUMP_FORMATS[] = {
+  {"wav", "wav", SF_FORMAT_WAV, &DUMP_ENCODINGS[0]},
+  {"rf64", "wav", SF_FORMAT_RF64, &DUMP_ENCODINGS[0]},
+  {"w64", "w64", SF_FORMAT_W64, &DUMP_ENCODINGS[0]},
+  {"flac", "flac", SF_FORMAT_FLAC, &DUMP_ENCODINGS[1]},
+  {NULL, NULL, 0, NULL}
+};
+
+struct dump_file
+{
+  SNDFILE *sf;
+  int fd;
+  char name[MAX_FILENAME_LEN];
+};
 
 static struct ow_context context;
 static struct ow_engine *engine;
-static SF_INFO sfinfo;
-static SNDFILE *sf;
+static const struct dump_format *format = DUMP_FORMATS;
+static const struct dump_encoding *encoding;
+static int split_tracks;
+static struct dump_file files[OB_MAX_TRACKS];	//One per track or just one
+static int nfiles;
+static uint32_t *lane;		//Track samples of a chunk when splitting tracks, either floats or integers
 static const struct ow_device_desc *desc;
 static const char *track_mask;
+static uint32_t o2p_mask;
+static int o2p_tracks[OB_MAX_TRACKS];
 static size_t track_buf_kb = TRACK_BUF_KB;
 static float max[OB_MAX_TRACKS];
 static float min[OB_MAX_TRACKS];
-static char filename[MAX_FILENAME_LEN];
-
-typedef enum
-{
-  END = -1,
-  EMPTY,
-  READY
-} buffer_status_t;
+static int attach;
+static atomic_int tap_running;
 
+//The engine decodes straight into the chunks, which are handed over to the disk thread in order. There are no locks or copies.
 static struct
 {
-  char *mem;
-  char *disk;
-  size_t len;
+  char *chunks[DUMP_CHUNKS];
+  size_t chunk_len[DUMP_CHUNKS];	//Bytes filled in every chunk
+  size_t len;			//Bytes of every chunk
+  size_t pos;			//Position in the chunk being filled
+  atomic_uint head;		//Chunks filled. Only written by the USB thread.
+  atomic_uint tail;		//Chunks written to disk. Only written by the disk thread.
+  atomic_int end;
+  int event_fd;			//Signalled when a chunk is filled and at the end
   pthread_t pthread;
-  size_t disk_samples;
-  size_t disk_frames;
-  pthread_spinlock_t lock;
-  buffer_status_t status;
+  atomic_size_t frames;		//Written to disk
   int outputs;
-  int outputs_mask_len;
 } buffer;
 
 static struct option options[] = {
@@ -69,6 +121,10 @@ static struct option options[] = {
   {"list-devices", 0, NULL, 'l'},
   {"track-mask", 1, NULL, 'm'},
   {"track-buffer-kilobytes", 1, NULL, 'b'},
+  {"format", 1, NULL, 'f'},
+  {"encoding", 1, NULL, 'e'},
+  {"split-tracks", 0, NULL, 's'},
+  {"attach", 0, NULL, 'a'},
   {"verbose", 0, NULL, 'v'},
   {"help", 0, NULL, 'h'},
   {NULL, 0, NULL, 0}
@@ -77,7 +133,8 @@ static struct option options[] = {
 static void
 print_status ()
 {
-  fprintf (stderr, "%lu frames written\n", sfinfo.frames);
+  fprintf (stderr, "%zu frames written\n",
+	   atomic_load_explicit (&buffer.frames, memory_order_relaxed));
 }
 
 static size_t
@@ -87,166 +144,550 @@ buffer_dummy_rw_space (void *data)
     OB_BYTES_PER_SAMPLE;
 }
 
-static buffer_status_t
-get_buffer_status ()
+static void
+buffer_signal ()
+{
+  uint64_t v = 1;
+  if (write (buffer.event_fd, &v, sizeof (v)) < 0)
+    {
+      error_print ("Error while signalling the dump thread\n");
+    }
+}
+
+//Long dumps would fill the page cache otherwise. Writeback is started now and what was written before, which should be on disk by now, is dropped.
+static void
+dump_file_write (struct dump_file *file, const void *data, size_t samples)
+{
+  off_t written = lseek (file->fd, 0, SEEK_CUR);
+
+  if (encoding->integer)
+    {
+      sf_write_int (file->sf, data, samples);
+    }
+  else
+    {
+      sf_write_float (file->sf, data, samples);
+    }
+
+  sync_file_range (file->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+  if (written > 0)
+    {
+      posix_fadvise (file->fd, 0, written, POSIX_FADV_DONTNEED);
+    }
+}
+
+static inline void
+dump_update_peaks (int track, float x)
+{
+  if (x >= 0.0)
+    {
+      if (x > max[track])
+	{
+	  max[track] = x;
+	}
+    }
+  else
+    {
+      if (x < min[track])
+	{
+	  min[track] = x;
+	}
+    }
+}
+
+//Peak values, deinterleaving and encoding are done here to keep the USB thread as short as possible.
+static void
+buffer_write_chunk (int chunk)
 {
-  buffer_status_t status;
+  uint32_t *x;
+  size_t samples = buffer.chunk_len[chunk] / OB_BYTES_PER_SAMPLE;
+  size_t frames = samples / buffer.outputs;
 
-  pthread_spin_lock (&buffer.lock);
-  status = buffer.status;
-  pthread_spin_unlock (&buffer.lock);
+  if (encoding->integer)
+    {
+      int32_t *s = (int32_t *) buffer.chunks[chunk];
+      for (int i = 0; i < frames; i++)
+	{
+	  for (int j = 0; j < buffer.outputs; j++, s++)
+	    {
+	      dump_update_peaks (o2p_tracks[j], *s * (1.0f / (float) INT_MAX));
+	    }
+	}
+    }
+  else
+    {
+      float *f = (float *) buffer.chunks[chunk];
+      for (int i = 0; i < frames; i++)
+	{
+	  for (int j = 0; j < buffer.outputs; j++, f++)
+	    {
+	      dump_update_peaks (o2p_tracks[j], *f);
+	    }
+	}
+    }
+
+  debug_print (2, "Writing %zu frames to disk...\n", frames);
+  if (split_tracks)
+    {
+      for (int j = 0; j < buffer.outputs; j++)
+	{
+	  x = (uint32_t *) buffer.chunks[chunk] + j;
+	  for (int i = 0; i < frames; i++, x += buffer.outputs)
+	    {
+	      lane[i] = *x;
+	    }
+	  dump_file_write (&files[j], lane, frames);
+	}
+    }
+  else
+    {
+      dump_file_write (&files[0], buffer.chunks[chunk], samples);
+    }
+  debug_print (2, "Done\n");
 
-  return status;
+  atomic_fetch_add_explicit (&buffer.frames, frames, memory_order_relaxed);
 }
 
 static void *
 dump_buffer (void *data)
 {
-  buffer_status_t status = get_buffer_status ();
-  while (status >= EMPTY)
+  int end;
+  uint64_t v;
+  unsigned int head;
+  unsigned int tail = 0;
+
+  do
     {
-      if (status == READY)
+      end = atomic_load_explicit (&buffer.end, memory_order_acquire);
+      head = atomic_load_explicit (&buffer.head, memory_order_acquire);
+
+      for (; tail != head; tail++)
 	{
-	  pthread_spin_lock (&buffer.lock);
-	  debug_print (2, "Writing %ld frames to disk...\n",
-		       buffer.disk_frames);
-	  sf_write_float (sf, (float *) buffer.disk, buffer.disk_samples);
-	  debug_print (2, "Done\n");
-
-	  buffer.status = EMPTY;
-	  pthread_spin_unlock (&buffer.lock);
+	  buffer_write_chunk (tail % DUMP_CHUNKS);
+	  atomic_store_explicit (&buffer.tail, tail + 1,
+				 memory_order_release);
 	}
 
-      usleep (100);
-
-      status = get_buffer_status ();
+      if (!end)
+	{
+	  while (read (buffer.event_fd, &v, sizeof (v)) < 0
+		 && errno == EINTR);
+	}
     }
+  while (!end);
+
   return NULL;
 }
 
-static size_t
-buffer_write (void *data, const char *buf, size_t size)
+//The first vector is what is left of the chunk being filled and the second one is the next chunk.
+static void
+buffer_get_write_vector (void *data, struct ow_buffer_vector *v)
+{
+  unsigned int head = atomic_load_explicit (&buffer.head,
+					    memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit (&buffer.tail,
+					    memory_order_acquire);
+  unsigned int free_chunks = DUMP_CHUNKS - (head - tail);
+
+  v[0].buf = NULL;
+  v[0].len = 0;
+  v[1].buf = NULL;
+  v[1].len = 0;
+
+  if (free_chunks > 0)
+    {
+      v[0].buf = &buffer.chunks[head % DUMP_CHUNKS][buffer.pos];
+      v[0].len = buffer.len - buffer.pos;
+    }
+  if (free_chunks > 1)
+    {
+      v[1].buf = buffer.chunks[(head + 1) % DUMP_CHUNKS];
+      v[1].len = buffer.len;
+    }
+}
+
+static void
+buffer_commit (void *data, size_t size)
 {
   static int print_control = 0;
-  static size_t pos = 0;
-  size_t new_pos;
-  void *dst;
-  size_t frames = size / (desc->outputs * OB_BYTES_PER_SAMPLE);
-
-  debug_print (2, "Writing %ld bytes (%ld frames) to buffer...\n", size,
-	       frames);
-  new_pos = pos + frames * buffer.outputs * OB_BYTES_PER_SAMPLE;
-  if (new_pos >= buffer.len)
-    {
-      pthread_spin_lock (&buffer.lock);
-      buffer.status = READY;
-      buffer.disk_samples = pos / OB_BYTES_PER_SAMPLE;
-      buffer.disk_frames = buffer.disk_samples / buffer.outputs;
-      memcpy (buffer.disk, buffer.mem,
-	      buffer.disk_frames * buffer.outputs * OB_BYTES_PER_SAMPLE);
-      pthread_spin_unlock (&buffer.lock);
-      sfinfo.frames += buffer.disk_frames;
-      pos = 0;
-    }
-
-  dst = &buffer.mem[pos];
-  for (int i = 0; i < frames; i++)
-    {
-      for (int j = 0; j < OB_MAX_TRACKS; j++)
-	{
-	  if (!track_mask
-	      || (j < buffer.outputs_mask_len && (track_mask[i] != '0')))
-	    {
-	      memcpy (dst, buf, OB_BYTES_PER_SAMPLE);
-	      dst += OB_BYTES_PER_SAMPLE;
-	      pos += OB_BYTES_PER_SAMPLE;
-	      float x = *((float *) buf);
-	      if (x >= 0.0)
-		{
-		  if (x > max[j])
-		    {
-		      max[j] = x;
-		    }
-		}
-	      else
-		{
-		  if (x < min[j])
-		    {
-		      min[j] = x;
-		    }
-		}
-	    }
-	  buf += OB_BYTES_PER_SAMPLE;
-	}
+  unsigned int head = atomic_load_explicit (&buffer.head,
+					    memory_order_relaxed);
+
+  buffer.pos += size;
+  if (buffer.pos >= buffer.len)
+    {
+      buffer.chunk_len[head % DUMP_CHUNKS] = buffer.len;
+      buffer.pos -= buffer.len;
+      atomic_store_explicit (&buffer.head, head + 1, memory_order_release);
+      buffer_signal ();
     }
 
   if (debug_level)
     {
-      print_control += frames;
+      print_control += size / (buffer.outputs * OB_BYTES_PER_SAMPLE);
       if (print_control >= OB_SAMPLE_RATE)
 	{
 	  print_control -= OB_SAMPLE_RATE;
 	  print_status ();
 	}
     }
+}
+
+static size_t
+buffer_write_space (void *data)
+{
+  struct ow_buffer_vector v[2];
+  buffer_get_write_vector (data, v);
+  return v[0].len + v[1].len;
+}
+
+//Only used if the engine can not decode into the chunks.
+static size_t
+buffer_write (void *data, const char *buf, size_t size)
+{
+  size_t first;
+  struct ow_buffer_vector v[2];
+
+  buffer_get_write_vector (data, v);
+  if (size > v[0].len + v[1].len)
+    {
+      return 0;
+    }
+
+  first = size < v[0].len ? size : v[0].len;
+  memcpy (v[0].buf, buf, first);
+  if (size > first)
+    {
+      memcpy (v[1].buf, &buf[first], size - first);
+    }
+  buffer_commit (data, size);
 
   return size;
 }
 
+static void
+buffer_free ()
+{
+  free (lane);
+  for (int i = 0; i < DUMP_CHUNKS; i++)
+    {
+      free (buffer.chunks[i]);
+    }
+  if (buffer.event_fd >= 0)
+    {
+      close (buffer.event_fd);
+    }
+}
+
+static int
+buffer_init ()
+{
+  size_t frames;
+  long page_size = sysconf (_SC_PAGESIZE);
+
+  //Kilobytes per track.
+  frames = track_buf_kb * 1024 / OB_BYTES_PER_SAMPLE;
+  frames -= frames % CHUNK_FRAMES_ALIGNMENT;
+  if (!frames)
+    {
+      frames = CHUNK_FRAMES_ALIGNMENT;
+    }
+  buffer.len = frames * buffer.outputs * OB_BYTES_PER_SAMPLE;
+  buffer.pos = 0;
+  atomic_init (&buffer.head, 0);
+  atomic_init (&buffer.tail, 0);
+  atomic_init (&buffer.end, 0);
+  atomic_init (&buffer.frames, 0);
+
+  lane = malloc (frames * OB_BYTES_PER_SAMPLE);
+  buffer.event_fd = eventfd (0, EFD_CLOEXEC);
+  for (int i = 0; i < DUMP_CHUNKS; i++)
+    {
+      if (posix_memalign ((void **) &buffer.chunks[i], page_size, buffer.len))
+	{
+	  buffer.chunks[i] = NULL;
+	}
+    }
+  for (int i = 0; i < DUMP_CHUNKS; i++)
+    {
+      if (!buffer.chunks[i] || buffer.event_fd < 0 || !lane)
+	{
+	  error_print ("Error while allocating the dump buffers\n");
+	  buffer_free ();
+	  return -1;
+	}
+    }
+
+  debug_print (1, "Using %d chunks of %zu frames\n", DUMP_CHUNKS, frames);
+
+  return 0;
+}
+
+//The chunk being filled is written too.
+static void
+buffer_finish ()
+{
+  unsigned int head = atomic_load_explicit (&buffer.head,
+					    memory_order_relaxed);
+
+  if (buffer.pos)
+    {
+      buffer.chunk_len[head % DUMP_CHUNKS] = buffer.pos;
+      atomic_store_explicit (&buffer.head, head + 1, memory_order_release);
+    }
+  atomic_store_explicit (&buffer.end, 1, memory_order_release);
+  buffer_signal ();
+  pthread_join (buffer.pthread, NULL);
+}
+
+static void
+dump_files_close ()
+{
+  for (int i = 0; i < nfiles; i++)
+    {
+      sf_close (files[i].sf);
+    }
+  nfiles = 0;
+}
+
+//Track names might contain spaces.
+static void
+dump_file_set_name (struct dump_file *file, const char *prefix,
+		    const char *track)
+{
+  char *c;
+
+  if (track)
+    {
+      snprintf (file->name, MAX_FILENAME_LEN, "%s_%s.%s", prefix, track,
+		format->extension);
+    }
+  else
+    {
+      snprintf (file->name, MAX_FILENAME_LEN, "%s.%s", prefix,
+		format->extension);
+    }
+
+  for (c = file->name; *c; c++)
+    {
+      if (*c == ' ' || *c == '/')
+	{
+	  *c = '_';
+	}
+    }
+}
+
+static int
+dump_files_open (const char *prefix)
+{
+  SF_INFO sfinfo;
+  struct dump_file *file;
+  int n = split_tracks ? buffer.outputs : 1;
+
+  sfinfo.frames = 0;
+  sfinfo.samplerate = OB_SAMPLE_RATE;
+  sfinfo.channels = split_tracks ? 1 : buffer.outputs;
+  sfinfo.format = format->format | encoding->format;
+
+  if ((format->format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC
+      && sfinfo.channels > FLAC_MAX_CHANNELS)
+    {
+      error_print
+	("FLAC files can not have more than %d channels. Use fewer tracks or split them.\n",
+	 FLAC_MAX_CHANNELS);
+      return -1;
+    }
+
+  if (!sf_format_check (&sfinfo))
+    {
+      error_print ("%s files can not be %s\n", format->name, encoding->name);
+      return -1;
+    }
+
+  nfiles = 0;
+  for (int i = 0; i < n; i++)
+    {
+      file = &files[i];
+      dump_file_set_name (file, prefix, split_tracks ?
+			  desc->output_track_names[o2p_tracks[i]] : NULL);
+
+      debug_print (1, "Creating %s (%d channels)...\n", file->name,
+		   sfinfo.channels);
+      file->fd = open (file->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		       0644);
+      file->sf = file->fd < 0 ? NULL : sf_open_fd (file->fd, SFM_WRITE,
+						   &sfinfo, 1);
+      if (!file->sf)
+	{
+	  error_print ("Error while creating %s\n", file->name);
+	  if (file->fd >= 0)
+	    {
+	      close (file->fd);
+	    }
+	  dump_files_close ();
+	  return -1;
+	}
+      nfiles++;
+    }
+
+  return 0;
+}
+
 static void
 signal_handler (int signo)
 {
   print_status ();
   if (debug_level)
     {
-      const char *c = track_mask;
-      for (int i = 0; i < buffer.outputs_mask_len; i++, c++)
+      for (int i = 0; i < buffer.outputs; i++)
+	{
+	  int track = o2p_tracks[i];
+	  fprintf (stderr, "%s: max: %f; min: %f\n",
+		   desc->output_track_names[track], max[track], min[track]);
+	}
+    }
+  if (signo == SIGHUP || signo == SIGINT || signo == SIGTERM)
+    {
+      if (attach)
 	{
-	  if (*c != '0')
+	  atomic_store (&tap_running, 0);
+	}
+      else
+	{
+	  ow_engine_stop (engine);
+	}
+      for (int i = 0; i < nfiles; i++)
+	{
+	  fprintf (stderr, "%s file created\n", files[i].name);
+	}
+    }
+}
+
+static inline int32_t
+dump_float_to_int (float x)
+{
+  if (x >= 1.0f)
+    {
+      return INT_MAX;
+    }
+  if (x <= -1.0f)
+    {
+      return INT_MIN;
+    }
+  return (int32_t) (x * 2147483648.0f);
+}
+
+//The selected tracks of the tap frames are put in the chunks as the engine would do.
+static void
+dump_tap (struct ow_tap_reader *reader)
+{
+  float *f;
+  uint32_t *x;
+  size_t frames;
+  int outputs = ow_tap_reader_get_outputs (reader);
+  float *tap_buf = malloc (TAP_READ_FRAMES * outputs * sizeof (float));
+  uint32_t *frames_buf = malloc (TAP_READ_FRAMES * buffer.outputs *
+				 OB_BYTES_PER_SAMPLE);
+
+  atomic_init (&tap_running, 1);
+  while (1)
+    {
+      frames = ow_tap_reader_read (reader, tap_buf, TAP_READ_FRAMES);
+      if (!frames)
+	{
+	  if (!atomic_load (&tap_running)
+	      || !ow_tap_reader_is_running (reader))
+	    {
+	      break;
+	    }
+	  usleep (TAP_POLL_US);
+	  continue;
+	}
+
+      f = tap_buf;
+      x = frames_buf;
+      for (int i = 0; i < frames; i++, f += outputs)
+	{
+	  for (int j = 0; j < buffer.outputs; j++, x++)
 	    {
-	      fprintf (stderr, "%s: max: %f; min: %f\n",
-		       desc->output_track_names[i], max[i], min[i]);
+	      float v = f[o2p_tracks[j]];
+	      if (encoding->integer)
+		{
+		  *(int32_t *) x = dump_float_to_int (v);
+		}
+	      else
+		{
+		  memcpy (x, &v, sizeof (float));
+		}
 	    }
 	}
+
+      if (!buffer_write (NULL, (char *) frames_buf,
+			 frames * buffer.outputs * OB_BYTES_PER_SAMPLE))
+	{
+	  error_print ("Dump buffer overflow. Discarding data...\n");
+	}
     }
-  if (signo == SIGHUP || signo == SIGINT || signo == SIGTERM)
+
+  if (ow_tap_reader_get_lost_frames (reader))
     {
-      ow_engine_stop (engine);
-      fprintf (stderr, "%s file created\n", filename);
+      error_print ("%zu frames lost while reading the tap\n",
+		   ow_tap_reader_get_lost_frames (reader));
     }
+
+  free (tap_buf);
+  free (frames_buf);
 }
 
 static int
 run_dump (int device_num, const char *device_name)
 {
-  char curr_time_string[MAX_FILENAME_LEN >> 1];
+  char curr_time_string[MAX_FILENAME_LEN >> 2];
+  char prefix[MAX_FILENAME_LEN >> 1];
   time_t curr_time;
   struct tm tm;
   ow_err_t err;
   struct ow_usb_device *device;
+  struct ow_tap_reader *reader = NULL;
 
   if (ow_get_usb_device_from_device_attrs (device_num, device_name, &device))
     {
       return OW_GENERIC_ERROR;
     }
 
-  err =
-    ow_engine_init_from_bus_address (&engine, device->bus, device->address,
-				     DEFAULT_BLOCKS);
+  //A running instance owns the device so its tap is used instead.
+  if (attach)
+    {
+      engine = NULL;
+      desc = device->desc;
+      err = ow_tap_reader_init (&reader, device->bus, device->address);
+    }
+  else
+    {
+      err = ow_engine_init_from_bus_address (&engine, device->bus,
+					     device->address, DEFAULT_BLOCKS,
+					     DEFAULT_XFRS, NULL);
+    }
   free (device);
   if (err)
     {
       goto end;
     }
 
-  desc = ow_engine_get_device_desc (engine);
+  if (engine)
+    {
+      desc = ow_engine_get_device_desc (engine);
+    }
 
+  //Without a mask, every track is dumped.
   buffer.outputs = 0;
-  const char *c = track_mask;
-  for (int i = 0; i < strlen (track_mask); i++, c++)
+  o2p_mask = 0;
+  for (int i = 0; i < desc->outputs; i++)
     {
-      if (*c != '0')
+      if (!track_mask || (i < strlen (track_mask) && track_mask[i] != '0'))
 	{
+	  o2p_mask |= 1U << i;
+	  o2p_tracks[buffer.outputs] = i;
 	  buffer.outputs++;
 	}
     }
@@ -257,67 +698,88 @@ run_dump (int device_num, const char *device_name)
       goto cleanup_engine;
     }
 
-  sfinfo.frames = 0;
-  sfinfo.samplerate = OB_SAMPLE_RATE;
-  sfinfo.channels = buffer.outputs;
-  sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+  if (engine)
+    {
+      ow_engine_set_o2p_track_mask (engine, o2p_mask);
+    }
 
   curr_time = time (NULL);
   localtime_r (&curr_time, &tm);
-  strftime (curr_time_string, MAX_FILENAME_LEN, "%FT%T", &tm);
+  strftime (curr_time_string, MAX_FILENAME_LEN >> 2, "%FT%T", &tm);
 
-  snprintf (filename, MAX_FILENAME_LEN, "%s_dump_%s.wav", desc->name,
+  snprintf (prefix, MAX_FILENAME_LEN >> 1, "%s_dump_%s", desc->name,
 	    curr_time_string);
 
-  debug_print (1, "Creating sample (%d channels)...\n", buffer.outputs);
-  sf = sf_open (filename, SFM_WRITE, &sfinfo);
-
-  context.write_space = buffer_dummy_rw_space;
-  context.read_space = buffer_dummy_rw_space;
-  context.write = buffer_write;
-  context.o2p_audio = sf;
-  context.options = OW_ENGINE_OPTION_O2P_AUDIO;
-
-  err = ow_engine_activate (engine, &context);
-  if (err)
+  for (int i = 0; i < OB_MAX_TRACKS; i++)
     {
-      goto cleanup;
+      max[i] = 0.0f;
+      min[i] = 0.0f;
     }
 
-  buffer.len = track_buf_kb * 1000 * buffer.outputs;
-  buffer.mem = malloc (buffer.len * OB_BYTES_PER_SAMPLE);
-  buffer.disk = malloc (buffer.len * OB_BYTES_PER_SAMPLE);
-  buffer.outputs_mask_len = strlen (track_mask);
+  if (buffer_init ())
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_engine;
+    }
 
-  for (int i = 0; i < OB_MAX_TRACKS; i++)
+  if (dump_files_open (prefix))
     {
-      max[i] = 0.0f;
-      min[i] = 0.0f;
+      err = OW_GENERIC_ERROR;
+      goto cleanup_buffer;
     }
 
-  buffer.status = READY;
-  pthread_spin_init (&buffer.lock, PTHREAD_PROCESS_SHARED);
+  //As the disk writes are not time critical, this does not run with RT priority.
   if (pthread_create (&buffer.pthread, NULL, dump_buffer, NULL))
     {
       error_print ("Could not start dump thread\n");
+      err = OW_GENERIC_ERROR;
       goto cleanup;
     }
-  ow_set_thread_rt_priority (&buffer.pthread, OW_DEFAULT_RT_PROPERTY);
 
-  ow_engine_wait (engine);
+  if (reader)
+    {
+      dump_tap (reader);
+      buffer_finish ();
+      goto cleanup;
+    }
 
-  pthread_spin_lock (&buffer.lock);
-  buffer.status = END;
-  pthread_spin_unlock (&buffer.lock);
-  pthread_join (buffer.pthread, NULL);
+  context.write_space = buffer_write_space;
+  context.read_space = buffer_dummy_rw_space;
+  context.write = buffer_write;
+  context.get_write_vector = buffer_get_write_vector;
+  context.commit = buffer_commit;
+  context.o2p_audio = &buffer;
+  context.options = OW_ENGINE_OPTION_O2P_AUDIO;
+  if (encoding->integer)
+    {
+      context.options |= OW_ENGINE_OPTION_O2P_INT |
+	OW_ENGINE_OPTION_O2P_INT_SHIFT;
+    }
+  context.usb_cpu = OW_CPU_AUTO;
+  context.p2o_midi_window = OW_DEFAULT_P2O_MIDI_WINDOW_US;
+  context.p2o_midi_cpu = OW_CPU_AUTO;
+
+  err = ow_engine_activate (engine, &context);
+  if (!err)
+    {
+      ow_engine_wait (engine);
+    }
+
+  buffer_finish ();
 
 cleanup:
-  pthread_spin_destroy (&buffer.lock);
-  free (buffer.mem);
-  free (buffer.disk);
-  sf_close (sf);
+  dump_files_close ();
+cleanup_buffer:
+  buffer_free ();
 cleanup_engine:
-  ow_engine_destroy (engine);
+  if (engine)
+    {
+      ow_engine_destroy (engine);
+    }
+  if (reader)
+    {
+      ow_tap_reader_destroy (reader);
+    }
 end:
   if (err)
     {
@@ -346,7 +808,7 @@ main (int argc, char *argv[])
   sigaction (SIGTERM, &action, NULL);
   sigaction (SIGUSR1, &action, NULL);
 
-  while ((opt = getopt_long (argc, argv, "n:d:m:b:lvh",
+  while ((opt = getopt_long (argc, argv, "n:d:m:b:f:e:salvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
@@ -367,6 +829,40 @@ main (int argc, char *argv[])
 	  track_buf_kb = atoi (optarg);
 	  bflg++;
 	  break;
+	case 'f':
+	  for (format = DUMP_FORMATS; format->name; format++)
+	    {
+	      if (!strcmp (optarg, format->name))
+		{
+		  break;
+		}
+	    }
+	  if (!format->name)
+	    {
+	      fprintf (stderr, "Unknown format '%s'\n", optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'e':
+	  for (encoding = DUMP_ENCODINGS; encoding->name; encoding++)
+	    {
+	      if (!strcmp (optarg, encoding->name))
+		{
+		  break;
+		}
+	    }
+	  if (!encoding->name)
+	    {
+	      fprintf (stderr, "Unknown encoding '%s'\n", optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 's':
+	  split_tracks = 1;
+	  break;
+	case 'a':
+	  attach = 1;
+	  break;
 	case 'l':
 	  lflg++;
 	  break;
@@ -403,6 +899,11 @@ main (int argc, char *argv[])
       exit (EXIT_SUCCESS);
     }
 
+  if (!encoding)
+    {
+      encoding = format->encoding;
+    }
+
   if (mflg > 1)
     {
       fprintf (stderr, "Undetermined track mask\n");
@@ -0,0 +1,302 @@
+/*
+ *   main-internal.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "jclient.h"
+#include "utils.h"
+#include "common.h"
+
+#define DEFAULT_QUALITY 2
+#define DEFAULT_BLOCKS 24
+#define DEFAULT_XFRS 1
+#define DEFAULT_PRIORITY -1	//With this value the default priority will be used.
+
+#define MAX_ARGS 32
+#define FINISH_RETRY_US 10000
+
+//JACK passes the process callback argument, which is the jclient, to jack_finish so it must be the first member.
+//Every loaded instance gets its own, so no state is shared between them.
+struct overwitch_internal
+{
+  struct jclient jclient;
+  pthread_t thread;
+  atomic_int running;		//The engine is destroyed when the thread ends
+};
+
+static struct option options[] = {
+  {"use-device-number", 1, NULL, 'n'},
+  {"use-device", 1, NULL, 'd'},
+  {"resampler", 1, NULL, 'r'},
+  {"resampling-quality", 1, NULL, 'q'},
+  {"transfer-blocks", 1, NULL, 'b'},
+  {"usb-transfers", 1, NULL, 't'},
+  {"usb-cpu", 1, NULL, 'u'},
+  {"midi-cpu", 1, NULL, 'm'},
+  {"midi-window", 1, NULL, 'w'},
+  {"adaptive-latency", 0, NULL, 'a'},
+  {"no-fast-path", 0, NULL, 'f'},
+  {"synchronous", 0, NULL, 'y'},
+  {"tap", 0, NULL, 'T'},
+  {"verbose", 0, NULL, 'v'},
+  {NULL, 0, NULL, 0}
+};
+
+//The load string has the same options as overwitch-cli, separated by spaces.
+static int
+parse_load_init (char *load_init, struct jclient *jclient, int *device_num,
+		 const char **device_name)
+{
+  int opt, argc;
+  char *argv[MAX_ARGS];
+  char *endstr, *saveptr;
+  int long_index = 0;
+
+  argv[0] = "overwitch";
+  argc = 1;
+  for (char *arg = strtok_r (load_init, " ", &saveptr);
+       arg && argc < MAX_ARGS; arg = strtok_r (NULL, " ", &saveptr))
+    {
+      argv[argc] = arg;
+      argc++;
+    }
+
+  //The server might have used getopt before.
+  optind = 0;
+  while ((opt = getopt_long (argc, argv, "n:d:r:q:b:t:u:m:w:afyTv",
+			     options, &long_index)) != -1)
+    {
+      switch (opt)
+	{
+	case 'n':
+	  *device_num = (int) strtol (optarg, &endstr, 10);
+	  break;
+	case 'd':
+	  *device_name = optarg;
+	  break;
+	case 'r':
+	  if (!strcmp (optarg, "sinc"))
+	    {
+	      jclient->backend = OW_RESAMPLER_BACKEND_SINC;
+	    }
+	  else if (strcmp (optarg, "samplerate"))
+	    {
+	      error_print
+		("Resampler must be 'samplerate' or 'sinc'. Using 'samplerate'...\n");
+	    }
+	  break;
+	case 'q':
+	  jclient->quality = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || jclient->quality > 4 || jclient->quality < 0)
+	    {
+	      jclient->quality = DEFAULT_QUALITY;
+	      error_print
+		("Resampling quality value must be in [0..4]. Using value %d...\n",
+		 jclient->quality);
+	    }
+	  break;
+	case 'b':
+	  jclient->blocks_per_transfer = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || jclient->blocks_per_transfer < 2
+	      || jclient->blocks_per_transfer > 32)
+	    {
+	      jclient->blocks_per_transfer = DEFAULT_BLOCKS;
+	      error_print ("Blocks value must be in [2..32]. Using value %d...\n",
+			   jclient->blocks_per_transfer);
+	    }
+	  break;
+	case 't':
+	  jclient->xfrs = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || jclient->xfrs < 1 || jclient->xfrs > OW_ENGINE_MAX_XFRS)
+	    {
+	      jclient->xfrs = DEFAULT_XFRS;
+	      error_print
+		("Transfers value must be in [1..%d]. Using value %d...\n",
+		 OW_ENGINE_MAX_XFRS, jclient->xfrs);
+	    }
+	  break;
+	case 'u':
+	  if (parse_cpu (optarg, &jclient->usb_cpu))
+	    {
+	      jclient->usb_cpu = OW_CPU_AUTO;
+	      error_print
+		("USB CPU must be a valid CPU, 'auto' or 'none'. Using 'auto'...\n");
+	    }
+	  break;
+	case 'm':
+	  if (parse_cpu (optarg, &jclient->p2o_midi_cpu))
+	    {
+	      jclient->p2o_midi_cpu = OW_CPU_AUTO;
+	      error_print
+		("MIDI CPU must be a valid CPU, 'auto' or 'none'. Using 'auto'...\n");
+	    }
+	  break;
+	case 'w':
+	  jclient->p2o_midi_window = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || jclient->p2o_midi_window < 0
+	      || jclient->p2o_midi_window > OW_MAX_P2O_MIDI_WINDOW_US)
+	    {
+	      jclient->p2o_midi_window = OW_DEFAULT_P2O_MIDI_WINDOW_US;
+	      error_print
+		("MIDI window value must be in [0..%d] µs. Using value %d...\n",
+		 OW_MAX_P2O_MIDI_WINDOW_US, jclient->p2o_midi_window);
+	    }
+	  break;
+	case 'a':
+	  jclient->adaptive = 1;
+	  break;
+	case 'f':
+	  jclient->fast_path = 0;
+	  break;
+	case 'y':
+	  jclient->synchronous = 1;
+	  break;
+	case 'T':
+	  jclient->tap = 1;
+	  break;
+	case 'v':
+	  debug_level++;
+	  break;
+	case '?':
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+static void *
+run_internal_client (void *data)
+{
+  struct overwitch_internal *internal = data;
+  jclient_run_internal (&internal->jclient, internal->jclient.client);
+  atomic_store (&internal->running, 0);
+  return NULL;
+}
+
+//Called by the JACK server on loading with jack_load.
+int
+jack_initialize (jack_client_t * client, const char *load_init)
+{
+  struct ow_usb_device *device;
+  struct overwitch_internal *internal;
+  struct jclient *jclient;
+  int device_num = -1;
+  const char *device_name = NULL;
+  char *args = strdup (load_init ? load_init : "");
+
+  internal = malloc (sizeof (struct overwitch_internal));
+  jclient = &internal->jclient;
+  jclient->blocks_per_transfer = DEFAULT_BLOCKS;
+  jclient->xfrs = DEFAULT_XFRS;
+  jclient->backend = OW_RESAMPLER_BACKEND_SAMPLERATE;
+  jclient->quality = DEFAULT_QUALITY;
+  jclient->priority = DEFAULT_PRIORITY;
+  jclient->usb_loop = NULL;
+  jclient->usb_cpu = OW_CPU_AUTO;
+  jclient->p2o_midi_cpu = OW_CPU_AUTO;
+  jclient->p2o_midi_window = OW_DEFAULT_P2O_MIDI_WINDOW_US;
+  jclient->adaptive = 0;
+  jclient->fast_path = 1;
+  jclient->synchronous = 0;
+  jclient->capture_path = NULL;
+  jclient->tap = 0;
+  jclient->reporter.callback = NULL;
+  jclient->reporter.period = 2;
+  jclient->end_notifier = NULL;
+
+  if (parse_load_init (args, jclient, &device_num, &device_name))
+    {
+      goto error;
+    }
+
+  if ((device_num < 0) == (device_name == NULL))
+    {
+      error_print ("Device not provided properly\n");
+      goto error;
+    }
+
+  if (ow_get_usb_device_from_device_attrs (device_num, device_name, &device))
+    {
+      goto error;
+    }
+
+  jclient->bus = device->bus;
+  jclient->address = device->address;
+  free (device);
+
+  if (jclient_init (jclient))
+    {
+      goto error;
+    }
+
+  //The callback does not run before the client is activated in the thread, where the rest of the client setup is done as it waits for the engine to end.
+  if (jclient_set_process_callback (jclient, client))
+    {
+      error_print ("Cannot set the process callback\n");
+      if (jclient->resampler)
+	{
+	  ow_resampler_destroy (jclient->resampler);
+	}
+      else
+	{
+	  ow_engine_destroy (jclient->engine);
+	}
+      goto error;
+    }
+
+  jclient->client = client;
+  atomic_init (&internal->running, 1);
+  pthread_create (&internal->thread, NULL, run_internal_client, internal);
+  free (args);
+  return 0;
+
+error:
+  free (args);
+  free (internal);
+  return -1;
+}
+
+//Called by the JACK server on unloading with jack_unload.
+void
+jack_finish (void *arg)
+{
+  struct overwitch_internal *internal = arg;
+
+  //The client failed before setting the process callback.
+  if (!internal)
+    {
+      return;
+    }
+
+  //The engine status is set while the thread sets up the client so the stop is repeated until the thread ends.
+  while (atomic_load (&internal->running))
+    {
+      jclient_exit (&internal->jclient);
+      usleep (FINISH_RETRY_US);
+    }
+  pthread_join (internal->thread, NULL);
+  free (internal);
+}
@@ -43,6 +43,9 @@
 #define CONF_SHOW_ALL_METRICS "showAllColumns"
 #define CONF_BLOCKS "blocks"
 #define CONF_QUALITY "quality"
+#define CONF_XFRS "transfers"
+#define CONF_USB_CPU "usbCpu"
+#define CONF_MIDI_CPU "midiCpu"
 
 enum list_store_columns
 {
@@ -53,6 +56,9 @@ enum list_store_columns
   STATUS_LIST_STORE_J2O_LATENCY,
   STATUS_LIST_STORE_O2J_RATIO,
   STATUS_LIST_STORE_J2O_RATIO,
+  STATUS_LIST_STORE_USB_TIME,
+  STATUS_LIST_STORE_JACK_TIME,
+  STATUS_LIST_STORE_XRUNS,
   STATUS_LIST_STORE_INSTANCE
 };
 
@@ -65,6 +71,7 @@ struct overwitch_instance
   gdouble j2o_latency_max;
   gdouble o2j_ratio;
   gdouble j2o_ratio;
+  struct ow_resampler_stats stats;
   struct jclient jclient;
   const struct ow_device_desc *device_desc;
 };
@@ -80,8 +87,15 @@ static GtkWidget *refresh_button;
 static GtkWidget *stop_button;
 static GtkSpinButton *blocks_spin_button;
 static GtkComboBox *quality_combo_box;
+static GtkSpinButton *transfers_spin_button;
+//There are no widgets for these so they are kept as they are in the preferences file.
+static gint64 usb_cpu = OW_CPU_AUTO;
+static gint64 p2o_midi_cpu = OW_CPU_AUTO;
 static GtkTreeViewColumn *o2j_ratio_column;
 static GtkTreeViewColumn *j2o_ratio_column;
+static GtkTreeViewColumn *usb_time_column;
+static GtkTreeViewColumn *jack_time_column;
+static GtkTreeViewColumn *xruns_column;
 static GtkListStore *status_list_store;
 static GtkStatusbar *status_bar;
 
@@ -109,6 +123,8 @@ set_overwitch_instance_metrics (struct overwitch_instance *instance)
 {
   static char o2j_latency_s[OW_LABEL_MAX_LEN];
   static char j2o_latency_s[OW_LABEL_MAX_LEN];
+  static char usb_time_s[OW_LABEL_MAX_LEN];
+  static char jack_time_s[OW_LABEL_MAX_LEN];
   GtkTreeIter iter;
   gint bus, address;
   gboolean valid =
@@ -145,6 +161,32 @@ set_overwitch_instance_metrics (struct overwitch_instance *instance)
 	      j2o_latency_s[0] = '\0';
 	    }
 
+	  if (instance->stats.o2p_xfr_time.count)
+	    {
+	      g_snprintf (usb_time_s, OW_LABEL_MAX_LEN,
+			  "%.0f µs (p99 %.0f µs, max. %.0f µs)",
+			  instance->stats.o2p_xfr_time.p50,
+			  instance->stats.o2p_xfr_time.p99,
+			  instance->stats.o2p_xfr_time.max);
+	    }
+	  else
+	    {
+	      usb_time_s[0] = '\0';
+	    }
+
+	  if (instance->stats.cycle_time.count)
+	    {
+	      g_snprintf (jack_time_s, OW_LABEL_MAX_LEN,
+			  "%.0f µs (p99 %.0f µs, max. %.0f µs)",
+			  instance->stats.cycle_time.p50,
+			  instance->stats.cycle_time.p99,
+			  instance->stats.cycle_time.max);
+	    }
+	  else
+	    {
+	      jack_time_s[0] = '\0';
+	    }
+
 	  gtk_list_store_set (status_list_store, &iter,
 			      STATUS_LIST_STORE_O2J_LATENCY,
 			      o2j_latency_s,
@@ -153,7 +195,13 @@ set_overwitch_instance_metrics (struct overwitch_instance *instance)
 			      STATUS_LIST_STORE_O2J_RATIO,
 			      instance->o2j_ratio,
 			      STATUS_LIST_STORE_J2O_RATIO,
-			      instance->j2o_ratio, -1);
+			      instance->j2o_ratio,
+			      STATUS_LIST_STORE_USB_TIME,
+			      usb_time_s,
+			      STATUS_LIST_STORE_JACK_TIME,
+			      jack_time_s,
+			      STATUS_LIST_STORE_XRUNS,
+			      instance->stats.xruns, -1);
 
 	  break;
 	}
@@ -168,7 +216,8 @@ set_overwitch_instance_metrics (struct overwitch_instance *instance)
 static void
 set_report_data (struct overwitch_instance *instance, double o2j_latency,
 		 double j2o_latency, double o2j_latency_max,
-		 double j2o_latency_max, double o2j_ratio, double j2o_ratio)
+		 double j2o_latency_max, double o2j_ratio, double j2o_ratio,
+		 const struct ow_resampler_stats *stats)
 {
   instance->o2j_latency = o2j_latency;
   instance->j2o_latency = j2o_latency;
@@ -176,6 +225,14 @@ set_report_data (struct overwitch_instance *instance, double o2j_latency,
   instance->j2o_latency_max = j2o_latency_max;
   instance->o2j_ratio = o2j_ratio;
   instance->j2o_ratio = j2o_ratio;
+  if (stats)
+    {
+      instance->stats = *stats;
+    }
+  else
+    {
+      memset (&instance->stats, 0, sizeof (struct ow_resampler_stats));
+    }
   g_idle_add ((GSourceFunc) set_overwitch_instance_metrics, instance);
 }
 
@@ -191,6 +248,9 @@ update_all_metrics (gboolean active)
 {
   gtk_tree_view_column_set_visible (o2j_ratio_column, active);
   gtk_tree_view_column_set_visible (j2o_ratio_column, active);
+  gtk_tree_view_column_set_visible (usb_time_column, active);
+  gtk_tree_view_column_set_visible (jack_time_column, active);
+  gtk_tree_view_column_set_visible (xruns_column, active);
 }
 
 static void
@@ -313,6 +373,17 @@ save_preferences ()
   json_builder_add_int_value (builder,
 			      gtk_combo_box_get_active (quality_combo_box));
 
+  json_builder_set_member_name (builder, CONF_XFRS);
+  json_builder_add_int_value (builder,
+			      gtk_spin_button_get_value_as_int
+			      (transfers_spin_button));
+
+  json_builder_set_member_name (builder, CONF_USB_CPU);
+  json_builder_add_int_value (builder, usb_cpu);
+
+  json_builder_set_member_name (builder, CONF_MIDI_CPU);
+  json_builder_add_int_value (builder, p2o_midi_cpu);
+
 
   json_builder_end_object (builder);
 
@@ -341,6 +412,7 @@ load_preferences ()
   gboolean refresh_at_startup = FALSE;
   gint64 blocks = 24;
   gint64 quality = 2;
+  gint64 xfrs = 1;
 
   error = NULL;
   json_parser_load_from_file (parser, preferences_file, &error);
@@ -379,6 +451,24 @@ load_preferences ()
     }
   json_reader_end_member (reader);
 
+  if (json_reader_read_member (reader, CONF_XFRS))
+    {
+      xfrs = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, CONF_USB_CPU))
+    {
+      usb_cpu = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, CONF_MIDI_CPU))
+    {
+      p2o_midi_cpu = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
   g_object_unref (reader);
   g_object_unref (parser);
 
@@ -391,6 +481,7 @@ end:
 		show_all_metrics, NULL);
   gtk_spin_button_set_value (blocks_spin_button, blocks);
   gtk_combo_box_set_active (quality_combo_box, quality);
+  gtk_spin_button_set_value (transfers_spin_button, xfrs);
   update_all_metrics (show_all_metrics);
 }
 
@@ -565,8 +656,18 @@ refresh_devices ()
       instance->jclient.bus = device->bus;
       instance->jclient.address = device->address;
       instance->jclient.blocks_per_transfer = 4;
+      instance->jclient.backend = OW_RESAMPLER_BACKEND_SAMPLERATE;
       instance->jclient.quality = 2;
       instance->jclient.priority = -1;
+      instance->jclient.usb_loop = NULL;
+      instance->jclient.usb_cpu = usb_cpu;
+      instance->jclient.p2o_midi_cpu = p2o_midi_cpu;
+      instance->jclient.p2o_midi_window = OW_DEFAULT_P2O_MIDI_WINDOW_US;
+      instance->jclient.adaptive = 0;
+      instance->jclient.fast_path = 1;
+      instance->jclient.synchronous = 0;
+      instance->jclient.capture_path = NULL;
+      instance->jclient.tap = 0;
       instance->jclient.reporter.callback =
 	(ow_resampler_report_t) set_report_data;
       instance->jclient.reporter.data = instance;
@@ -576,6 +677,8 @@ refresh_devices ()
 	gtk_spin_button_get_value_as_int (blocks_spin_button);
       instance->jclient.quality =
 	gtk_combo_box_get_active (quality_combo_box);
+      instance->jclient.xfrs =
+	gtk_spin_button_get_value_as_int (transfers_spin_button);
       instance->o2j_latency = 0.0;
       instance->j2o_latency = 0.0;
       instance->o2j_ratio = 1.0;
@@ -606,10 +709,15 @@ refresh_devices ()
 					 instance->o2j_ratio,
 					 STATUS_LIST_STORE_J2O_RATIO,
 					 instance->j2o_ratio,
+					 STATUS_LIST_STORE_USB_TIME,
+					 "",
+					 STATUS_LIST_STORE_JACK_TIME,
+					 "",
+					 STATUS_LIST_STORE_XRUNS, 0,
 					 STATUS_LIST_STORE_INSTANCE, instance,
 					 -1);
 
-      set_report_data (instance, -1.0, -1.0, -1.0, -1.0, 1.0, 1.0);
+      set_report_data (instance, -1.0, -1.0, -1.0, -1.0, 1.0, 1.0, NULL);
 
       start_instance (instance);
       gtk_widget_set_sensitive (stop_button, TRUE);
@@ -712,6 +820,9 @@ main (int argc, char *argv[])
     GTK_SPIN_BUTTON (gtk_builder_get_object (builder, "blocks_spin_button"));
   quality_combo_box =
     GTK_COMBO_BOX (gtk_builder_get_object (builder, "quality_combo_box"));
+  transfers_spin_button =
+    GTK_SPIN_BUTTON (gtk_builder_get_object
+		     (builder, "transfers_spin_button"));
 
   refresh_button =
     GTK_WIDGET (gtk_builder_get_object (builder, "refresh_button"));
@@ -726,6 +837,14 @@ main (int argc, char *argv[])
   j2o_ratio_column =
     GTK_TREE_VIEW_COLUMN (gtk_builder_get_object
 			  (builder, "j2o_ratio_column"));
+  usb_time_column =
+    GTK_TREE_VIEW_COLUMN (gtk_builder_get_object
+			  (builder, "usb_time_column"));
+  jack_time_column =
+    GTK_TREE_VIEW_COLUMN (gtk_builder_get_object
+			  (builder, "jack_time_column"));
+  xruns_column =
+    GTK_TREE_VIEW_COLUMN (gtk_builder_get_object (builder, "xruns_column"));
 
   status_bar = GTK_STATUSBAR (gtk_builder_get_object (builder, "status_bar"));
   gtk_statusbar_push (status_bar, 0, MSG_NO_JACK_SERVER_FOUND);
@@ -0,0 +1,397 @@
+/*
+ *   metrics.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <json-glib/json-glib.h>
+#include "metrics.h"
+#include "utils.h"
+
+#define SEQ_LOAD_MAX_TRIES 4
+#define LISTEN_BACKLOG 4
+
+static struct
+{
+  int fd;
+  int stop_fd;
+  struct sockaddr_un addr;
+  pthread_t thread;
+  struct metrics_device **devices;
+  size_t count;
+} server = {.fd = -1,.stop_fd = -1 };
+
+void
+metrics_device_init (struct metrics_device *device, const char *name,
+		     uint8_t bus, uint8_t address)
+{
+  snprintf (device->name, OW_LABEL_MAX_LEN, "%s", name);
+  device->bus = bus;
+  device->address = address;
+  atomic_flag_clear (&device->writing);
+  atomic_init (&device->seq, 0);
+  device->reports = 0;
+  memset (&device->stats, 0, sizeof (struct ow_resampler_stats));
+}
+
+void
+metrics_device_report (void *data, double o2j_latency, double j2o_latency,
+		       double o2j_latency_max, double j2o_latency_max,
+		       double o2j_ratio, double j2o_ratio,
+		       const struct ow_resampler_stats *stats)
+{
+  unsigned int seq;
+  struct metrics_device *device = data;
+
+  //Reports come from the audio thread but also from the signal handlers.
+  if (atomic_flag_test_and_set_explicit (&device->writing,
+					 memory_order_acquire))
+    {
+      return;
+    }
+
+  seq = atomic_load_explicit (&device->seq, memory_order_relaxed);
+  atomic_store_explicit (&device->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+
+  device->reports++;
+  device->o2j_latency = o2j_latency;
+  device->j2o_latency = j2o_latency;
+  device->o2j_latency_max = o2j_latency_max;
+  device->j2o_latency_max = j2o_latency_max;
+  device->o2j_ratio = o2j_ratio;
+  device->j2o_ratio = j2o_ratio;
+  device->stats = *stats;
+
+  atomic_fetch_add_explicit (&device->seq, 1, memory_order_release);
+  atomic_flag_clear_explicit (&device->writing, memory_order_release);
+}
+
+static int
+metrics_device_load (struct metrics_device *device,
+		     struct metrics_device *copy)
+{
+  unsigned int seq0, seq1;
+
+  for (int i = 0; i < SEQ_LOAD_MAX_TRIES; i++)
+    {
+      seq0 = atomic_load_explicit (&device->seq, memory_order_acquire);
+      if (seq0 & 1)
+	{
+	  continue;
+	}
+      memcpy (copy->name, device->name, OW_LABEL_MAX_LEN);
+      copy->bus = device->bus;
+      copy->address = device->address;
+      copy->reports = device->reports;
+      copy->o2j_latency = device->o2j_latency;
+      copy->j2o_latency = device->j2o_latency;
+      copy->o2j_latency_max = device->o2j_latency_max;
+      copy->j2o_latency_max = device->j2o_latency_max;
+      copy->o2j_ratio = device->o2j_ratio;
+      copy->j2o_ratio = device->j2o_ratio;
+      copy->stats = device->stats;
+      atomic_thread_fence (memory_order_acquire);
+      seq1 = atomic_load_explicit (&device->seq, memory_order_relaxed);
+      if (seq0 == seq1)
+	{
+	  return 1;
+	}
+    }
+
+  return 0;
+}
+
+static void
+metrics_add_double (JsonBuilder * builder, const char *name, double value)
+{
+  json_builder_set_member_name (builder, name);
+  json_builder_add_double_value (builder, value);
+}
+
+static void
+metrics_add_int (JsonBuilder * builder, const char *name, gint64 value)
+{
+  json_builder_set_member_name (builder, name);
+  json_builder_add_int_value (builder, value);
+}
+
+static void
+metrics_add_summary (JsonBuilder * builder, const char *name,
+		     const struct ow_stats_summary *summary)
+{
+  json_builder_set_member_name (builder, name);
+  json_builder_begin_object (builder);
+  metrics_add_int (builder, "count", summary->count);
+  metrics_add_double (builder, "p50_us", summary->p50);
+  metrics_add_double (builder, "p99_us", summary->p99);
+  metrics_add_double (builder, "max_us", summary->max);
+  json_builder_end_object (builder);
+}
+
+//Latencies are -1 while they are unknown.
+static void
+metrics_add_device (JsonBuilder * builder, struct metrics_device *device)
+{
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "name");
+  json_builder_add_string_value (builder, device->name);
+  metrics_add_int (builder, "bus", device->bus);
+  metrics_add_int (builder, "address", device->address);
+  metrics_add_int (builder, "reports", device->reports);
+
+  metrics_add_double (builder, "o2j_latency_ms", device->o2j_latency);
+  metrics_add_double (builder, "o2j_latency_max_ms", device->o2j_latency_max);
+  metrics_add_double (builder, "j2o_latency_ms", device->j2o_latency);
+  metrics_add_double (builder, "j2o_latency_max_ms", device->j2o_latency_max);
+  metrics_add_double (builder, "o2j_ratio", device->o2j_ratio);
+  metrics_add_double (builder, "j2o_ratio", device->j2o_ratio);
+  metrics_add_int (builder, "o2j_fill_frames", device->stats.o2p_fill);
+  metrics_add_int (builder, "j2o_fill_frames", device->stats.p2o_fill);
+
+  metrics_add_int (builder, "o2j_overflows", device->stats.o2p_overflows);
+  metrics_add_int (builder, "o2j_underflows", device->stats.o2p_underflows);
+  metrics_add_int (builder, "j2o_overflows", device->stats.p2o_overflows);
+  metrics_add_int (builder, "j2o_underflows", device->stats.p2o_underflows);
+  metrics_add_int (builder, "xruns", device->stats.xruns);
+
+  metrics_add_summary (builder, "o2j_usb_time", &device->stats.o2p_xfr_time);
+  metrics_add_summary (builder, "o2j_usb_jitter",
+		       &device->stats.o2p_xfr_jitter);
+  metrics_add_summary (builder, "j2o_usb_time", &device->stats.p2o_xfr_time);
+  metrics_add_summary (builder, "jack_cycle_time",
+		       &device->stats.cycle_time);
+  metrics_add_summary (builder, "dll_error", &device->stats.dll_err);
+  metrics_add_double (builder, "dll_target_delay_ms",
+		      device->stats.target_delay);
+  metrics_add_double (builder, "dll_bandwidth_hz", device->stats.bandwidth);
+
+  json_builder_end_object (builder);
+}
+
+static gchar *
+metrics_get_json (gsize * len)
+{
+  gchar *json;
+  JsonNode *root;
+  JsonGenerator *gen;
+  struct metrics_device copy;
+  JsonBuilder *builder = json_builder_new ();
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "devices");
+  json_builder_begin_array (builder);
+
+  for (int i = 0; i < server.count; i++)
+    {
+      struct metrics_device *device = server.devices[i];
+
+      if (metrics_device_load (device, &copy))
+	{
+	  metrics_add_device (builder, &copy);
+	}
+      else
+	{
+	  debug_print (1, "Could not load %s metrics\n", device->name);
+	}
+    }
+
+  json_builder_end_array (builder);
+  json_builder_end_object (builder);
+
+  gen = json_generator_new ();
+  root = json_builder_get_root (builder);
+  json_generator_set_root (gen, root);
+  json = json_generator_to_data (gen, len);
+
+  json_node_free (root);
+  g_object_unref (gen);
+  g_object_unref (builder);
+
+  return json;
+}
+
+static void
+metrics_send (int fd)
+{
+  gsize len;
+  ssize_t n;
+  gchar *json = metrics_get_json (&len);
+  gchar *p = json;
+
+  while (len)
+    {
+      n = send (fd, p, len, MSG_NOSIGNAL);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+	  debug_print (1, "Error while sending metrics: %s\n",
+		       strerror (errno));
+	  break;
+	}
+      p += n;
+      len -= n;
+    }
+
+  g_free (json);
+}
+
+static void *
+metrics_server_run (void *data)
+{
+  int fd;
+  struct pollfd fds[2];
+
+  fds[0].fd = server.fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = server.stop_fd;
+  fds[1].events = POLLIN;
+
+  while (1)
+    {
+      if (poll (fds, 2, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+	  error_print ("Error while polling metrics socket: %s\n",
+		       strerror (errno));
+	  break;
+	}
+
+      if (fds[1].revents)
+	{
+	  break;
+	}
+
+      if (fds[0].revents & POLLIN)
+	{
+	  fd = accept (server.fd, NULL, NULL);
+	  if (fd < 0)
+	    {
+	      debug_print (1, "Error while accepting connection: %s\n",
+			   strerror (errno));
+	      continue;
+	    }
+	  metrics_send (fd);
+	  close (fd);
+	}
+    }
+
+  return NULL;
+}
+
+int
+metrics_server_start (const char *path, struct metrics_device **devices,
+		      size_t count)
+{
+  server.devices = devices;
+  server.count = count;
+
+  if (strlen (path) >= sizeof (server.addr.sun_path))
+    {
+      error_print ("Metrics socket path too long\n");
+      return -1;
+    }
+
+  memset (&server.addr, 0, sizeof (struct sockaddr_un));
+  server.addr.sun_family = AF_UNIX;
+  strcpy (server.addr.sun_path, path);
+
+  server.fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server.fd < 0)
+    {
+      error_print ("Error while creating metrics socket: %s\n",
+		   strerror (errno));
+      return -1;
+    }
+
+  //A socket left by a previous run would make bind fail.
+  unlink (path);
+  if (bind (server.fd, (struct sockaddr *) &server.addr,
+	    sizeof (struct sockaddr_un))
+      || listen (server.fd, LISTEN_BACKLOG))
+    {
+      error_print ("Error while binding metrics socket to '%s': %s\n", path,
+		   strerror (errno));
+      goto error;
+    }
+
+  server.stop_fd = eventfd (0, EFD_CLOEXEC);
+  if (server.stop_fd < 0)
+    {
+      error_print ("Error while creating eventfd: %s\n", strerror (errno));
+      goto error;
+    }
+
+  if (pthread_create (&server.thread, NULL, metrics_server_run, NULL))
+    {
+      error_print ("Error while creating metrics thread\n");
+      goto error;
+    }
+
+  debug_print (1, "Serving metrics at '%s'\n", path);
+
+  return 0;
+
+error:
+  if (server.stop_fd >= 0)
+    {
+      close (server.stop_fd);
+      server.stop_fd = -1;
+    }
+  close (server.fd);
+  server.fd = -1;
+  unlink (path);
+  return -1;
+}
+
+void
+metrics_server_stop ()
+{
+  uint64_t v = 1;
+
+  if (server.fd < 0)
+    {
+      return;
+    }
+
+  if (write (server.stop_fd, &v, sizeof (v)) != sizeof (v))
+    {
+      error_print ("Error while stopping metrics thread\n");
+    }
+  pthread_join (server.thread, NULL);
+
+  close (server.stop_fd);
+  close (server.fd);
+  unlink (server.addr.sun_path);
+  server.stop_fd = -1;
+  server.fd = -1;
+}
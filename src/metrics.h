@@ -0,0 +1,57 @@
+/*
+ *   metrics.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include "overwitch.h"
+
+//The last report of a device. It is written from the reports and read by the server thread with a sequence lock, so none of them waits for the other.
+struct metrics_device
+{
+  char name[OW_LABEL_MAX_LEN];
+  uint8_t bus;
+  uint8_t address;
+  atomic_flag writing;		//Reports from other threads are dropped while one is being written
+  atomic_uint seq;
+  int reports;
+  double o2j_latency;
+  double j2o_latency;
+  double o2j_latency_max;
+  double j2o_latency_max;
+  double o2j_ratio;
+  double j2o_ratio;
+  struct ow_resampler_stats stats;
+};
+
+void metrics_device_init (struct metrics_device *, const char *, uint8_t,
+			  uint8_t);
+
+//An ow_resampler_report_t whose data is a struct metrics_device.
+void metrics_device_report (void *, double, double, double, double, double,
+			    double, const struct ow_resampler_stats *);
+
+//Every connection to the Unix socket receives a JSON document with all the devices and is closed.
+int metrics_server_start (const char *, struct metrics_device **, size_t);
+
+void metrics_server_stop ();
+
+#endif
@@ -18,14 +18,24 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <libusb.h>
 #include <string.h>
 #include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <dirent.h>
 #include "overwitch.h"
 #include "utils.h"
 
 #define ELEKTRON_VID 0x1935
 
+#define SYSFS_USB_DEVICES "/sys/bus/usb/devices"
+#define SYSFS_CPU_ISOLATED "/sys/devices/system/cpu/isolated"
+#define PROC_IRQ "/proc/irq"
+#define LINE_MAX_LEN 1024
+
 #define AFMK1_PID 0x0004
 #define AKEYS_PID 0x0006
 #define ARMK1_PID 0x0008
@@ -322,3 +332,207 @@ ow_set_thread_rt_priority (pthread_t * thread, int p)
   };
   pthread_setschedparam (*thread, SCHED_FIFO, &default_rt_param);
 }
+
+void
+ow_set_thread_affinity (pthread_t * thread, int cpu)
+{
+  int err;
+  cpu_set_t set;
+
+  if (cpu < 0)
+    {
+      return;
+    }
+
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+  err = pthread_setaffinity_np (*thread, sizeof (cpu_set_t), &set);
+  if (err)
+    {
+      error_print ("Could not set thread affinity to CPU %d: %s\n", cpu,
+		   strerror (err));
+    }
+}
+
+static int
+ow_read_first_line (const char *path, char *line)
+{
+  int err = 0;
+  FILE *file = fopen (path, "r");
+
+  if (!file)
+    {
+      return 1;
+    }
+
+  if (fgets (line, LINE_MAX_LEN, file))
+    {
+      line[strcspn (line, "\n")] = '\0';
+    }
+  else
+    {
+      err = 1;
+    }
+
+  fclose (file);
+  return err;
+}
+
+//Lists are like "0-3,8,10-11" as in sysfs and procfs.
+static void
+ow_parse_cpu_list (const char *list, cpu_set_t * set)
+{
+  long first, last;
+  char *end;
+  const char *c = list;
+
+  CPU_ZERO (set);
+
+  while (*c)
+    {
+      first = strtol (c, &end, 10);
+      if (end == c || first < 0)
+	{
+	  return;
+	}
+      last = first;
+      if (*end == '-')
+	{
+	  c = end + 1;
+	  last = strtol (c, &end, 10);
+	  if (end == c)
+	    {
+	      return;
+	    }
+	}
+
+      for (long i = first; i <= last && i < CPU_SETSIZE; i++)
+	{
+	  CPU_SET (i, set);
+	}
+
+      if (*end != ',')
+	{
+	  return;
+	}
+      c = end + 1;
+    }
+}
+
+//The parent of the root hub of the bus is the host controller. With MSI, the lowest IRQ is the one of the primary interrupter.
+static int
+ow_get_usb_bus_irq (uint8_t bus)
+{
+  int v, irq = -1;
+  DIR *dir;
+  struct dirent *entry;
+  char path[PATH_MAX];
+  char line[LINE_MAX_LEN];
+
+  snprintf (path, PATH_MAX, SYSFS_USB_DEVICES "/usb%d/../msi_irqs", bus);
+  dir = opendir (path);
+  if (dir)
+    {
+      while ((entry = readdir (dir)))
+	{
+	  if (entry->d_name[0] == '.')
+	    {
+	      continue;
+	    }
+	  v = atoi (entry->d_name);
+	  if (v > 0 && (irq < 0 || v < irq))
+	    {
+	      irq = v;
+	    }
+	}
+      closedir (dir);
+    }
+
+  if (irq < 0)
+    {
+      snprintf (path, PATH_MAX, SYSFS_USB_DEVICES "/usb%d/../irq", bus);
+      if (!ow_read_first_line (path, line))
+	{
+	  v = atoi (line);
+	  irq = v > 0 ? v : -1;
+	}
+    }
+
+  return irq;
+}
+
+static int
+ow_get_usb_bus_irq_cpu (uint8_t bus)
+{
+  cpu_set_t set;
+  char path[PATH_MAX];
+  char line[LINE_MAX_LEN];
+  int irq = ow_get_usb_bus_irq (bus);
+
+  if (irq < 0)
+    {
+      debug_print (1, "Could not find the IRQ of USB bus %d\n", bus);
+      return -1;
+    }
+
+  snprintf (path, PATH_MAX, PROC_IRQ "/%d/effective_affinity_list", irq);
+  if (ow_read_first_line (path, line))
+    {
+      snprintf (path, PATH_MAX, PROC_IRQ "/%d/smp_affinity_list", irq);
+      if (ow_read_first_line (path, line))
+	{
+	  return -1;
+	}
+    }
+
+  ow_parse_cpu_list (line, &set);
+  debug_print (2, "USB bus %d uses IRQ %d (CPUs %s)\n", bus, irq, line);
+
+  for (int i = 0; i < CPU_SETSIZE; i++)
+    {
+      if (CPU_ISSET (i, &set))
+	{
+	  return i;
+	}
+    }
+
+  return -1;
+}
+
+//With OW_CPU_AUTO, the CPU handling the IRQ of the USB host controller is used. If there are isolated CPUs, the closest isolated one is used instead as these are the ones reserved for this kind of work.
+int
+ow_get_usb_bus_thread_cpu (int cpu, uint8_t bus)
+{
+  cpu_set_t isolated;
+  char line[LINE_MAX_LEN];
+  int irq_cpu, best = -1;
+
+  if (cpu != OW_CPU_AUTO)
+    {
+      return cpu;
+    }
+
+  irq_cpu = ow_get_usb_bus_irq_cpu (bus);
+
+  if (ow_read_first_line (SYSFS_CPU_ISOLATED, line))
+    {
+      line[0] = '\0';
+    }
+  ow_parse_cpu_list (line, &isolated);
+
+  if (!CPU_COUNT (&isolated))
+    {
+      return irq_cpu >= 0 ? irq_cpu : OW_CPU_NONE;
+    }
+
+  for (int i = 0; i < CPU_SETSIZE; i++)
+    {
+      if (CPU_ISSET (i, &isolated)
+	  && (best < 0 || abs (i - irq_cpu) < abs (best - irq_cpu)))
+	{
+	  best = i;
+	}
+    }
+
+  return best;
+}
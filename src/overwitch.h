@@ -33,12 +33,38 @@
 
 #define OW_DEFAULT_RT_PROPERTY 20
 
+#define OW_ENGINE_MAX_XFRS 8
+
+//The resampler buffers are allocated once for these limits of the JACK side.
+#define OW_RESAMPLER_MAX_BUFSIZE 8192	//The maximum JACK and PipeWire buffer size
+#define OW_RESAMPLER_MIN_SAMPLERATE 22050
+
+#define OW_USB_LOOP_MAX_ENGINES 32
+
+#define OW_CPU_AUTO -1		//Near the CPU handling the IRQ of the USB host controller
+#define OW_CPU_NONE -2		//No affinity
+
+//p2o MIDI events due within this window are sent in the same USB transfer.
+#define OW_DEFAULT_P2O_MIDI_WINDOW_US 125	//A USB high speed microframe
+#define OW_MAX_P2O_MIDI_WINDOW_US 10000
+
 #define OW_LABEL_MAX_LEN 64
 
 typedef size_t (*ow_buffer_rw_space_t) (void *);
 typedef size_t (*ow_buffer_read_t) (void *, char *, size_t);
 typedef size_t (*ow_buffer_write_t) (void *, const char *, size_t);
 
+//Same layout as jack_ringbuffer_data_t.
+struct ow_buffer_vector
+{
+  char *buf;
+  size_t len;
+};
+
+//These fill two vectors as the available memory might wrap around the end of the buffer.
+typedef void (*ow_buffer_get_vector_t) (void *, struct ow_buffer_vector *);
+typedef void (*ow_buffer_advance_t) (void *, size_t);
+
 typedef double (*ow_get_time_t) ();	//Time in seconds
 
 typedef size_t (*ow_dll_overwitch_init_t) (void *, double, int, double);
@@ -46,8 +72,11 @@ typedef size_t (*ow_dll_overwitch_inc_t) (void *, int, double);
 
 typedef void (*ow_set_rt_priority_t) (pthread_t *, int);
 
+struct ow_resampler_stats;
+
 typedef void (*ow_resampler_report_t) (void *, double, double, double, double,
-				       double, double);
+				       double, double,
+				       const struct ow_resampler_stats *);
 
 typedef enum
 {
@@ -93,13 +122,22 @@ typedef enum
   OW_RESAMPLER_STATUS_RUN
 } ow_resampler_status_t;
 
+typedef enum
+{
+  OW_RESAMPLER_BACKEND_SAMPLERATE,	//libsamplerate
+  OW_RESAMPLER_BACKEND_SINC	//Built-in polyphase windowed sinc
+} ow_resampler_backend_t;
+
 typedef enum
 {
   OW_ENGINE_OPTION_O2P_AUDIO = 1,
   OW_ENGINE_OPTION_P2O_AUDIO = 2,
   OW_ENGINE_OPTION_O2P_MIDI = 4,
   OW_ENGINE_OPTION_P2O_MIDI = 8,
-  OW_ENGINE_OPTION_DLL = 16
+  OW_ENGINE_OPTION_DLL = 16,
+  OW_ENGINE_OPTION_PLANAR = 32,	//o2p audio is written to the buffer as a lane per track for every transfer
+  OW_ENGINE_OPTION_O2P_INT = 64,	//o2p audio is written as host endian int32 samples instead of floats. Not compatible with planar audio.
+  OW_ENGINE_OPTION_O2P_INT_SHIFT = 128	//With int32 samples, the tracks with less bits are shifted to full scale
 } ow_engine_option_t;
 
 struct ow_context
@@ -109,6 +147,11 @@ struct ow_context
   ow_buffer_write_t write;
   ow_buffer_rw_space_t read_space;
   ow_buffer_read_t read;
+  //Optional zero-copy access to the audio buffers. If any of these are NULL, read and write are used.
+  ow_buffer_get_vector_t get_write_vector;
+  ow_buffer_advance_t commit;
+  ow_buffer_get_vector_t get_read_vector;
+  ow_buffer_advance_t advance;
   //Needed for MIDI and the DLL
   ow_get_time_t get_time;
   //Data
@@ -123,6 +166,11 @@ struct ow_context
   //RT priority is always activated. If this is NULL, Overwitch will set itself with its default RT priority and policy.
   ow_set_rt_priority_t set_rt_priority;
   int priority;
+  //CPU affinity of the threads. Either a CPU number, OW_CPU_AUTO or OW_CPU_NONE.
+  int usb_cpu;
+  int p2o_midi_cpu;
+  //Coalescing window for p2o MIDI events in µs.
+  int p2o_midi_window;
   //Options
   int options;
 };
@@ -153,15 +201,48 @@ struct ow_midi_event
   uint8_t bytes[OB_MIDI_EVENT_SIZE];
 };
 
+//Values since the previous report. Times are in µs.
+struct ow_stats_summary
+{
+  uint32_t count;
+  double p50;
+  double p99;
+  double max;
+};
+
+struct ow_resampler_stats
+{
+  struct ow_stats_summary o2p_xfr_time;	//USB callback
+  struct ow_stats_summary p2o_xfr_time;	//USB callback
+  struct ow_stats_summary o2p_xfr_jitter;	//Deviation of the time between o2p USB callbacks from the transfer duration
+  struct ow_stats_summary cycle_time;	//Audio cycle of the client, as given to ow_resampler_add_cycle_time
+  struct ow_stats_summary dll_err;	//Absolute DLL error
+  //DLL loop
+  double target_delay;		//ms
+  double bandwidth;		//Hz
+  //Frames in the ring buffers
+  uint32_t o2p_fill;
+  uint32_t p2o_fill;
+  //Totals since the resampler was created
+  uint32_t o2p_overflows;
+  uint32_t o2p_underflows;
+  uint32_t p2o_overflows;
+  uint32_t p2o_underflows;
+  uint32_t xruns;
+};
+
 struct ow_resampler_reporter
 {
   ow_resampler_report_t callback;
   int period;
   void *data;
+  struct ow_resampler_stats stats;	//Updated right before every report
 };
 
 struct ow_engine;
 struct ow_resampler;
+struct ow_usb_loop;
+struct ow_tap_reader;
 
 extern const struct ow_device_desc *OB_DEVICE_DESCS[];
 
@@ -180,15 +261,35 @@ int ow_get_usb_device_from_device_attrs (int, const char *,
 
 void ow_set_thread_rt_priority (pthread_t *, int);
 
+//Monotonic clock for the telemetry.
+uint64_t ow_get_time_ns ();
+
+void ow_set_thread_affinity (pthread_t *, int);
+
+int ow_get_usb_bus_thread_cpu (int, uint8_t);
+
+//USB loop
+ow_err_t ow_usb_loop_init (struct ow_usb_loop **);
+
+void ow_usb_loop_destroy (struct ow_usb_loop *);
+
 //Engine
+//If the USB loop is NULL, the engine uses its own libusb context and thread.
 ow_err_t ow_engine_init_from_bus_address (struct ow_engine **, uint8_t,
-					  uint8_t, int);
+					  uint8_t, int, int,
+					  struct ow_usb_loop *);
 
 ow_err_t ow_engine_init_from_libusb_device_descriptor (struct ow_engine **,
-						       int, int);
+						       int, int, int);
 
 ow_err_t ow_engine_activate (struct ow_engine *, struct ow_context *);
 
+//Records the o2p USB transfers and their times to the given file until the engine is destroyed. It must be called before activating the engine.
+ow_err_t ow_engine_start_capture (struct ow_engine *, const char *);
+
+//Publishes the o2p audio of all the tracks in shared memory until the engine is destroyed so that other processes can read it with an ow_tap_reader. It must be called before activating the engine.
+ow_err_t ow_engine_start_tap (struct ow_engine *);
+
 void ow_engine_destroy (struct ow_engine *);
 
 void ow_engine_wait (struct ow_engine *);
@@ -203,11 +304,48 @@ int ow_engine_is_p2o_audio_enabled (struct ow_engine *);
 
 const struct ow_device_desc *ow_engine_get_device_desc (struct ow_engine *);
 
+//The USB serial number, which might be empty.
+const char *ow_engine_get_serial (struct ow_engine *);
+
+const char *ow_engine_get_name (struct ow_engine *);
+
+int ow_engine_get_frames_per_transfer (struct ow_engine *);
+
 void ow_engine_stop (struct ow_engine *);
 
+uint32_t ow_engine_get_all_tracks_mask (struct ow_engine *);
+
+//Only the o2p tracks in the mask are decoded and written to the o2p buffer, whose frames contain just these tracks in their order.
+//The mask is applied at the beginning of the next transfer. As the device clock is followed through the o2p data, an empty mask keeps the first track.
+void ow_engine_set_o2p_track_mask (struct ow_engine *, uint32_t);
+
+//The mask of the o2p data written from now on.
+uint32_t ow_engine_get_o2p_track_mask (struct ow_engine *);
+
+//Wakes up the p2o MIDI thread. Call it after writing events to the p2o_midi buffer.
+void ow_engine_notify_p2o_midi (struct ow_engine *);
+
+//Tap
+//Attaches to the tap of the engine running the device at the given bus and address. Only what is written after this is read.
+ow_err_t ow_tap_reader_init (struct ow_tap_reader **, uint8_t, uint8_t);
+
+//Copies up to the given number of frames of all the tracks, interleaved, and returns how many were copied. Frames are read in whole blocks and those overwritten before being read are lost.
+size_t ow_tap_reader_read (struct ow_tap_reader *, float *, size_t);
+
+size_t ow_tap_reader_get_lost_frames (struct ow_tap_reader *);
+
+int ow_tap_reader_get_outputs (struct ow_tap_reader *);
+
+//Returns 0 once the engine has been destroyed.
+int ow_tap_reader_is_running (struct ow_tap_reader *);
+
+void ow_tap_reader_destroy (struct ow_tap_reader *);
+
 //Resampler
 ow_err_t ow_resampler_init_from_bus_address (struct ow_resampler **, uint8_t,
-					     uint8_t, int, int);
+					     uint8_t, int, int,
+					     ow_resampler_backend_t, int,
+					     struct ow_usb_loop *);
 
 ow_err_t ow_resampler_activate (struct ow_resampler *, struct ow_context *);
 
@@ -219,6 +357,9 @@ void ow_resampler_report_status (struct ow_resampler *);
 
 void ow_resampler_reset_buffers (struct ow_resampler *);
 
+//If true, the audio buffers of the resampler contain a lane per track instead of interleaved frames.
+int ow_resampler_is_planar (struct ow_resampler *);
+
 void ow_resampler_reset_dll (struct ow_resampler *, uint32_t);
 
 void ow_resampler_read_audio (struct ow_resampler *);
@@ -229,15 +370,40 @@ int ow_resampler_compute_ratios (struct ow_resampler *, double);
 
 void ow_resampler_inc_xruns (struct ow_resampler *);
 
+//Time spent in an audio cycle in ns. Only to be called from the thread that runs ow_resampler_compute_ratios.
+void ow_resampler_add_cycle_time (struct ow_resampler *, uint64_t);
+
+//Like ow_engine_set_o2p_track_mask. It can be called from any thread and the change is done by ow_resampler_compute_ratios.
+void ow_resampler_set_o2p_track_mask (struct ow_resampler *, uint32_t);
+
+//The tracks in the o2p audio buffer after ow_resampler_compute_ratios. Only to be called from the thread that runs it.
+uint32_t ow_resampler_get_o2p_track_mask (struct ow_resampler *);
+
 ow_resampler_status_t ow_resampler_get_status (struct ow_resampler *);
 
 struct ow_engine *ow_resampler_get_engine (struct ow_resampler *);
 
 void ow_resampler_stop (struct ow_resampler *);
 
-void ow_resampler_set_buffer_size (struct ow_resampler *, uint32_t);
+//The DLL starts from this ratio if it runs at this sample rate, which shortens the startup. It must be called before the first ow_resampler_compute_ratios.
+void ow_resampler_set_ratio_seed (struct ow_resampler *, uint32_t, double);
+
+//The average ratio once the DLL is locked and 0 before.
+double ow_resampler_get_locked_ratio (struct ow_resampler *);
+
+//Once locked, the o2p target delay and the DLL bandwidth are shrunk according to the measured jitter and restored after an underflow.
+void ow_resampler_set_adaptive (struct ow_resampler *, int);
+
+//At 48 kHz, once the ratio has stayed within a few ppm of 1 for a while, a cubic interpolation is used instead of the backend. It is enabled by default.
+void ow_resampler_set_fast_path (struct ow_resampler *, int);
+
+//Returns -1 if the buffer size is above OW_RESAMPLER_MAX_BUFSIZE.
+//Like ow_resampler_set_o2p_track_mask, the change is done by ow_resampler_compute_ratios. While running, the DLL keeps its ratio.
+int ow_resampler_set_buffer_size (struct ow_resampler *, uint32_t);
 
-void ow_resampler_set_samplerate (struct ow_resampler *, uint32_t);
+//Returns -1 if the sample rate is below OW_RESAMPLER_MIN_SAMPLERATE.
+//Same as ow_resampler_set_buffer_size.
+int ow_resampler_set_samplerate (struct ow_resampler *, uint32_t);
 
 ow_resampler_status_t ow_resampler_get_status (struct ow_resampler *);
 
@@ -0,0 +1,536 @@
+/*
+ *   pwclient.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pipewire/pipewire.h>
+#include <pipewire/filter.h>
+#include <spa/utils/ringbuffer.h>
+
+#include "utils.h"
+#include "pwclient.h"
+
+#define MAX_LATENCY (OW_RESAMPLER_MAX_BUFSIZE * 2)	//This is twice the maximum PipeWire quantum.
+
+struct pwclient_ring
+{
+  struct spa_ringbuffer rb;
+  uint32_t size;		//A power of 2
+  char *data;
+};
+
+struct pwclient_port
+{
+  int track;
+};
+
+struct pwclient
+{
+  struct pw_main_loop *loop;
+  struct pw_filter *filter;
+  struct pwclient_port *output_ports[OB_MAX_TRACKS];
+  struct pwclient_port *input_ports[OB_MAX_TRACKS];
+  //Unconnected ports have no buffer so these are used instead.
+  float *discard;
+  float *silence;
+  uint32_t bufsize;
+  uint32_t samplerate;
+  int valid_bufsize;
+  uint32_t o2p_mask;
+  int p2o_enabled;
+};
+
+static struct pwclient_ring *
+pwclient_ring_new (size_t min_size)
+{
+  struct pwclient_ring *ring = malloc (sizeof (struct pwclient_ring));
+  ring->size = 1;
+  while (ring->size < min_size)
+    {
+      ring->size <<= 1;
+    }
+  ring->data = calloc (1, ring->size);
+  spa_ringbuffer_init (&ring->rb);
+  return ring;
+}
+
+static void
+pwclient_ring_free (struct pwclient_ring *ring)
+{
+  if (ring)
+    {
+      free (ring->data);
+      free (ring);
+    }
+}
+
+static size_t
+pwclient_ring_read_space (void *data)
+{
+  uint32_t index;
+  struct pwclient_ring *ring = data;
+  return spa_ringbuffer_get_read_index (&ring->rb, &index);
+}
+
+static size_t
+pwclient_ring_write_space (void *data)
+{
+  uint32_t index;
+  struct pwclient_ring *ring = data;
+  return ring->size - spa_ringbuffer_get_write_index (&ring->rb, &index);
+}
+
+//A NULL destination discards the data.
+static size_t
+pwclient_ring_read (void *data, char *dst, size_t size)
+{
+  uint32_t index;
+  struct pwclient_ring *ring = data;
+  size_t filled = spa_ringbuffer_get_read_index (&ring->rb, &index);
+
+  if (size > filled)
+    {
+      size = filled;
+    }
+  if (dst)
+    {
+      spa_ringbuffer_read_data (&ring->rb, ring->data, ring->size,
+				index & (ring->size - 1), dst, size);
+    }
+  spa_ringbuffer_read_update (&ring->rb, index + size);
+
+  return dst ? size : 0;
+}
+
+static size_t
+pwclient_ring_write (void *data, const char *src, size_t size)
+{
+  uint32_t index;
+  struct pwclient_ring *ring = data;
+  size_t avail = ring->size -
+    spa_ringbuffer_get_write_index (&ring->rb, &index);
+
+  if (size > avail)
+    {
+      size = avail;
+    }
+  spa_ringbuffer_write_data (&ring->rb, ring->data, ring->size,
+			     index & (ring->size - 1), src, size);
+  spa_ringbuffer_write_update (&ring->rb, index + size);
+
+  return size;
+}
+
+static inline void
+pwclient_ring_get_vector (struct pwclient_ring *ring, uint32_t index,
+			  size_t len, struct ow_buffer_vector *v)
+{
+  uint32_t offset = index & (ring->size - 1);
+
+  v[0].buf = ring->data + offset;
+  v[0].len = len < ring->size - offset ? len : ring->size - offset;
+  v[1].buf = ring->data;
+  v[1].len = len - v[0].len;
+}
+
+static void
+pwclient_ring_get_write_vector (void *data, struct ow_buffer_vector *v)
+{
+  uint32_t index;
+  struct pwclient_ring *ring = data;
+  size_t avail = ring->size -
+    spa_ringbuffer_get_write_index (&ring->rb, &index);
+  pwclient_ring_get_vector (ring, index, avail, v);
+}
+
+static void
+pwclient_ring_commit (void *data, size_t size)
+{
+  uint32_t index;
+  struct pwclient_ring *ring = data;
+  spa_ringbuffer_get_write_index (&ring->rb, &index);
+  spa_ringbuffer_write_update (&ring->rb, index + size);
+}
+
+static void
+pwclient_ring_get_read_vector (void *data, struct ow_buffer_vector *v)
+{
+  uint32_t index;
+  struct pwclient_ring *ring = data;
+  size_t filled = spa_ringbuffer_get_read_index (&ring->rb, &index);
+  pwclient_ring_get_vector (ring, index, filled, v);
+}
+
+static void
+pwclient_ring_advance (void *data, size_t size)
+{
+  uint32_t index;
+  struct pwclient_ring *ring = data;
+  spa_ringbuffer_get_read_index (&ring->rb, &index);
+  spa_ringbuffer_read_update (&ring->rb, index + size);
+}
+
+//PipeWire cycle times are taken from the monotonic clock too.
+static double
+pwclient_get_time ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+static inline void
+pwclient_clear_outputs (jack_default_audio_sample_t * buffer[],
+			const struct ow_device_desc *desc, uint32_t nframes)
+{
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      memset (buffer[i], 0, nframes * sizeof (float));
+    }
+}
+
+static void
+pwclient_process_cb (void *data, struct spa_io_position *position)
+{
+  float *f;
+  uint32_t mask;
+  int p2o_enabled;
+  jack_default_audio_sample_t *buffer[OB_MAX_TRACKS];
+  struct jclient *jclient = data;
+  struct pwclient *pw = jclient->pwclient;
+  struct ow_engine *engine = jclient->engine;
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+  uint32_t nframes = position->clock.duration;
+  uint32_t samplerate = position->clock.rate.denom;
+  double time = position->clock.nsec * 1.0e-9;
+  uint64_t start = ow_get_time_ns ();
+
+  if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
+    {
+      pw_main_loop_quit (pw->loop);
+      return;
+    }
+
+  //Changes are applied at the beginning of the next cycle.
+  if (samplerate != pw->samplerate)
+    {
+      debug_print (1, "PipeWire sample rate: %d\n", samplerate);
+      pw->samplerate = samplerate;
+      ow_resampler_set_samplerate (jclient->resampler, samplerate);
+    }
+
+  if (nframes != pw->bufsize)
+    {
+      debug_print (1, "PipeWire quantum: %d\n", nframes);
+      pw->bufsize = nframes;
+      jclient->bufsize = nframes;
+      pw->valid_bufsize =
+	!ow_resampler_set_buffer_size (jclient->resampler, nframes);
+    }
+
+  //The discard buffer might be smaller than the quantum so only the connected ports are cleared.
+  if (!pw->valid_bufsize)
+    {
+      for (int i = 0; i < desc->outputs; i++)
+	{
+	  f = pw_filter_get_dsp_buffer (pw->output_ports[i], nframes);
+	  if (f)
+	    {
+	      memset (f, 0, nframes * sizeof (float));
+	    }
+	}
+      return;
+    }
+
+  //o2p must always be running but only the connected tracks are needed.
+  mask = 0;
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      buffer[i] = pw_filter_get_dsp_buffer (pw->output_ports[i], nframes);
+      if (buffer[i])
+	{
+	  mask |= 1U << i;
+	}
+      else
+	{
+	  buffer[i] = pw->discard;
+	}
+    }
+  if (mask != pw->o2p_mask)
+    {
+      pw->o2p_mask = mask;
+      ow_resampler_set_o2p_track_mask (jclient->resampler, mask);
+    }
+
+  if (ow_resampler_compute_ratios (jclient->resampler, time))
+    {
+      pwclient_clear_outputs (buffer, desc, nframes);
+      return;
+    }
+
+  //o2p
+
+  f = ow_resampler_get_o2p_audio_buffer (jclient->resampler);
+  mask = ow_resampler_get_o2p_track_mask (jclient->resampler);
+  ow_resampler_read_audio (jclient->resampler);
+  if (jclient->planar)
+    {
+      jclient_copy_o2j_audio_planar (f, nframes, buffer, desc, mask);
+    }
+  else
+    {
+      jclient_copy_o2j_audio (f, nframes, buffer, desc, mask);
+    }
+
+  //p2o
+
+  p2o_enabled = 0;
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      buffer[i] = pw_filter_get_dsp_buffer (pw->input_ports[i], nframes);
+      if (buffer[i])
+	{
+	  p2o_enabled = 1;
+	}
+      else
+	{
+	  buffer[i] = pw->silence;
+	}
+    }
+  if (p2o_enabled != pw->p2o_enabled)
+    {
+      pw->p2o_enabled = p2o_enabled;
+      ow_engine_set_p2o_audio_enabled (engine, p2o_enabled);
+    }
+
+  if (ow_engine_is_p2o_audio_enabled (engine))
+    {
+      f = ow_resampler_get_p2o_audio_buffer (jclient->resampler);
+      if (jclient->planar)
+	{
+	  jclient_copy_j2o_audio_planar (f, nframes, buffer, desc);
+	}
+      else
+	{
+	  jclient_copy_j2o_audio (f, nframes, buffer, desc);
+	}
+      ow_resampler_write_audio (jclient->resampler);
+    }
+
+  ow_resampler_add_cycle_time (jclient->resampler, ow_get_time_ns () - start);
+}
+
+static const struct pw_filter_events pwclient_filter_events = {
+  PW_VERSION_FILTER_EVENTS,
+  .process = pwclient_process_cb,
+};
+
+static struct pwclient_port *
+pwclient_add_port (struct pwclient *pw, enum pw_direction direction,
+		   const char *name, int track)
+{
+  struct pwclient_port *port = pw_filter_add_port (pw->filter, direction,
+						   PW_FILTER_PORT_FLAG_MAP_BUFFERS,
+						   sizeof (struct
+							   pwclient_port),
+						   pw_properties_new
+						   (PW_KEY_FORMAT_DSP,
+						    "32 bit float mono audio",
+						    PW_KEY_PORT_NAME, name,
+						    NULL),
+						   NULL, 0);
+  if (port == NULL)
+    {
+      error_print ("Error while registering PipeWire port\n");
+      return NULL;
+    }
+  port->track = track;
+  return port;
+}
+
+void
+pwclient_exit (struct jclient *jclient)
+{
+  struct pwclient *pw = jclient->pwclient;
+
+  if (pw)
+    {
+      jclient_report_status (jclient);
+      ow_engine_stop (jclient->engine);
+      pw_main_loop_quit (pw->loop);
+    }
+}
+
+int
+pwclient_run (struct jclient *jclient)
+{
+  ow_err_t err = OW_OK;
+  struct pwclient *pw;
+  struct pw_properties *props;
+  struct ow_engine *engine = jclient->engine;
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+
+  if (!jclient->resampler)
+    {
+      error_print ("Synchronous mode is only available with JACK\n");
+      ow_engine_destroy (engine);
+      return OW_GENERIC_ERROR;
+    }
+
+  pw_init (NULL, NULL);
+
+  pw = calloc (1, sizeof (struct pwclient));
+  pw->discard = malloc (OW_RESAMPLER_MAX_BUFSIZE * sizeof (float));
+  pw->silence = calloc (OW_RESAMPLER_MAX_BUFSIZE, sizeof (float));
+  pw->o2p_mask = ow_engine_get_all_tracks_mask (engine);
+  pw->p2o_enabled = 0;
+
+  ow_resampler_set_report_callback (jclient->resampler, &jclient->reporter);
+
+  jclient->context.o2p_audio =
+    pwclient_ring_new (MAX_LATENCY *
+		       ow_resampler_get_o2p_frame_size (jclient->resampler));
+  jclient->context.p2o_audio =
+    pwclient_ring_new (MAX_LATENCY *
+		       ow_resampler_get_p2o_frame_size (jclient->resampler));
+  jclient->context.o2p_midi = NULL;
+  jclient->context.p2o_midi = NULL;
+
+  jclient->context.read_space = pwclient_ring_read_space;
+  jclient->context.write_space = pwclient_ring_write_space;
+  jclient->context.read = pwclient_ring_read;
+  jclient->context.write = pwclient_ring_write;
+  jclient->context.get_write_vector = pwclient_ring_get_write_vector;
+  jclient->context.commit = pwclient_ring_commit;
+  jclient->context.get_read_vector = pwclient_ring_get_read_vector;
+  jclient->context.advance = pwclient_ring_advance;
+  jclient->context.get_time = pwclient_get_time;
+
+  //The PipeWire data thread is already RT so Overwitch uses its default priority.
+  jclient->context.set_rt_priority = NULL;
+  jclient->context.usb_cpu = jclient->usb_cpu;
+  jclient->context.p2o_midi_window = jclient->p2o_midi_window;
+  jclient->context.p2o_midi_cpu = jclient->p2o_midi_cpu;
+
+  jclient->context.options = OW_ENGINE_OPTION_O2P_AUDIO;
+
+  if (jclient->tap)
+    {
+      err = ow_engine_start_tap (engine);
+      if (err)
+	{
+	  goto cleanup;
+	}
+    }
+
+  pw->loop = pw_main_loop_new (NULL);
+  if (pw->loop == NULL)
+    {
+      error_print ("Cannot create PipeWire loop\n");
+      err = OW_GENERIC_ERROR;
+      goto cleanup;
+    }
+
+  props = pw_properties_new (PW_KEY_MEDIA_TYPE, "Audio",
+			     PW_KEY_MEDIA_CATEGORY, "Duplex",
+			     PW_KEY_MEDIA_ROLE, "DSP", NULL);
+  pw->filter = pw_filter_new_simple (pw_main_loop_get_loop (pw->loop),
+				     jclient_get_name (jclient), props,
+				     &pwclient_filter_events, jclient);
+  if (pw->filter == NULL)
+    {
+      error_print ("Cannot create PipeWire filter\n");
+      err = OW_GENERIC_ERROR;
+      goto cleanup_loop;
+    }
+
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      pw->output_ports[i] = pwclient_add_port (pw, PW_DIRECTION_OUTPUT,
+					       desc->output_track_names[i], i);
+      if (pw->output_ports[i] == NULL)
+	{
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_filter;
+	}
+    }
+
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      pw->input_ports[i] = pwclient_add_port (pw, PW_DIRECTION_INPUT,
+					      desc->input_track_names[i], i);
+      if (pw->input_ports[i] == NULL)
+	{
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_filter;
+	}
+    }
+
+  jclient->pwclient = pw;
+
+  err = ow_resampler_activate (jclient->resampler, &jclient->context);
+  if (err)
+    {
+      goto cleanup_filter;
+    }
+
+  if (pw_filter_connect (pw->filter, PW_FILTER_FLAG_RT_PROCESS, NULL, 0) < 0)
+    {
+      error_print ("Cannot connect PipeWire filter\n");
+      ow_resampler_stop (jclient->resampler);
+      ow_resampler_wait (jclient->resampler);
+      err = OW_GENERIC_ERROR;
+      goto cleanup_filter;
+    }
+
+  pw_main_loop_run (pw->loop);
+
+  debug_print (1, "Exiting...\n");
+  ow_resampler_stop (jclient->resampler);
+  ow_resampler_wait (jclient->resampler);
+
+cleanup_filter:
+  jclient->pwclient = NULL;
+  pw_filter_destroy (pw->filter);
+cleanup_loop:
+  pw_main_loop_destroy (pw->loop);
+cleanup:
+  pwclient_ring_free (jclient->context.o2p_audio);
+  pwclient_ring_free (jclient->context.p2o_audio);
+  free (pw->discard);
+  free (pw->silence);
+  free (pw);
+  ow_resampler_destroy (jclient->resampler);
+  return err;
+}
+
+void *
+pwclient_run_thread (void *data)
+{
+  struct jclient *jclient = data;
+  pwclient_run (jclient);
+  if (jclient->end_notifier)
+    {
+      jclient->end_notifier (jclient->bus, jclient->address);
+    }
+  return NULL;
+}
@@ -0,0 +1,33 @@
+/*
+ *   pwclient.h
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PWCLIENT_H
+#define PWCLIENT_H
+
+#include "jclient.h"
+
+//Runs the jclient as a PipeWire filter instead of a JACK client. Only the parameters and the resampler set by jclient_init are used and there is no MIDI.
+int pwclient_run (struct jclient *);
+
+void *pwclient_run_thread (void *);
+
+void pwclient_exit (struct jclient *);
+
+#endif
@@ -21,11 +21,35 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "resampler.h"
 
 #define MAX_READ_FRAMES 5
+//A slot being written, another one lent and some slack for the cycles in which the backend does not read.
+#define P2O_FIFO_FRAMES (OW_RESAMPLER_MAX_BUFSIZE * 4)
+//The p2o output of a cycle with the lowest sample rate and a 10 % margin for the ratio deviations.
+#define P2O_MAX_FRAMES (OW_RESAMPLER_MAX_BUFSIZE * 11 / 10 * OB_SAMPLE_RATE / OW_RESAMPLER_MIN_SAMPLERATE + 1)
+#define ARENA_ALIGNMENT 64
 #define STARTUP_TIME 5
+#define SEEDED_STARTUP_TIME 1
+//Crystal deviations are usually below 100 ppm, so seeds that are far off come from a different setup.
+#define SEED_MAX_DEV 0.001
+//The DLL error settles after the first cycle with a new buffer size.
+#define REALIGN_CYCLES 2
 #define DEFAULT_REPORT_PERIOD 2
+//The fast path is taken once the ratio has stayed this close to 1 for the dwell time and it is left as soon as it goes further than the second value.
+#define FAST_PATH_MAX_DEV_IN 0.00001
+#define FAST_PATH_MAX_DEV_OUT 0.00002
+#define FAST_PATH_DWELL_TIME 10
+#define RUN_BANDWIDTH 0.02
+//With the adaptive mode, the o2p headroom is kept at this times the p99 jitter, as a start.
+#define ADAPTIVE_JITTER_FACTOR 2
+#define ADAPTIVE_MIN_BANDWIDTH 0.01
+#define ADAPTIVE_BANDWIDTH_STEP 0.7
+//The loop needs some time to follow a delay change and the jitter is measured after that.
+#define ADAPTIVE_SETTLE_REPORTS 5
+#define ADAPTIVE_MAX_MARGIN_SCALE 8
 
 inline const char *
 ow_resampler_get_name (struct ow_resampler *resampler)
@@ -40,23 +64,28 @@ ow_resampler_report_status (struct ow_resampler *resampler)
   double o2p_latency_d, o2p_max_latency_d, p2o_latency_d, p2o_max_latency_d;
   ow_engine_status_t status;
   int p2o_audio_enabled;
-
-  pthread_spin_lock (&resampler->engine->lock);
-  o2p_latency_s = resampler->engine->o2p_latency;
-  o2p_max_latency_s = resampler->engine->o2p_max_latency;
-  p2o_latency_s = resampler->engine->p2o_latency;
-  p2o_max_latency_s = resampler->engine->p2o_max_latency;
-  p2o_audio_enabled = resampler->engine->options.p2o_audio;
-  status = resampler->engine->status;
-  pthread_spin_unlock (&resampler->engine->lock);
+  const struct ow_resampler_stats *stats = &resampler->reporter.stats;
+
+  o2p_latency_s = atomic_load_explicit (&resampler->engine->o2p_latency,
+					memory_order_relaxed);
+  o2p_max_latency_s =
+    atomic_load_explicit (&resampler->engine->o2p_max_latency,
+			  memory_order_relaxed);
+  p2o_latency_s = atomic_load_explicit (&resampler->engine->p2o_latency,
+					memory_order_relaxed);
+  p2o_max_latency_s =
+    atomic_load_explicit (&resampler->engine->p2o_max_latency,
+			  memory_order_relaxed);
+  p2o_audio_enabled = ow_engine_is_p2o_audio_enabled (resampler->engine);
+  status = ow_engine_get_status (resampler->engine);
 
   if (status == OW_ENGINE_STATUS_RUN)
     {
       o2p_latency_d =
-	o2p_latency_s * 1000.0 / (resampler->engine->o2p_frame_size *
+	o2p_latency_s * 1000.0 / (resampler->o2p_tracks_frame_size *
 				  OB_SAMPLE_RATE);
       o2p_max_latency_d =
-	o2p_max_latency_s * 1000.0 / (resampler->engine->o2p_frame_size *
+	o2p_max_latency_s * 1000.0 / (resampler->o2p_tracks_frame_size *
 				      OB_SAMPLE_RATE);
     }
   else
@@ -87,6 +116,22 @@ ow_resampler_report_status (struct ow_resampler *resampler)
 	 ow_resampler_get_name (resampler),
 	 o2p_latency_d, o2p_max_latency_d, p2o_latency_d, p2o_max_latency_d,
 	 resampler->dll.ratio, resampler->dll.ratio_avg);
+      //p50, p99 and max. values
+      printf
+	("%s: o2j USB: %.1f, %.1f, %.1f µs, jitter: %.1f, %.1f, %.1f µs; j2o USB: %.1f, %.1f, %.1f µs; JACK: %.1f, %.1f, %.1f µs; DLL error: %.1f, %.1f, %.1f µs\n",
+	 ow_resampler_get_name (resampler),
+	 stats->o2p_xfr_time.p50, stats->o2p_xfr_time.p99,
+	 stats->o2p_xfr_time.max, stats->o2p_xfr_jitter.p50,
+	 stats->o2p_xfr_jitter.p99, stats->o2p_xfr_jitter.max,
+	 stats->p2o_xfr_time.p50, stats->p2o_xfr_time.p99,
+	 stats->p2o_xfr_time.max, stats->cycle_time.p50,
+	 stats->cycle_time.p99, stats->cycle_time.max, stats->dll_err.p50,
+	 stats->dll_err.p99, stats->dll_err.max);
+      printf
+	("%s: o2j overflows: %u, underflows: %u; j2o overflows: %u, underflows: %u; xruns: %u; DLL delay: %.1f ms, bandwidth: %.3f Hz\n",
+	 ow_resampler_get_name (resampler), stats->o2p_overflows,
+	 stats->o2p_underflows, stats->p2o_overflows, stats->p2o_underflows,
+	 stats->xruns, stats->target_delay, stats->bandwidth);
     }
 
   if (resampler->reporter.callback)
@@ -94,50 +139,111 @@ ow_resampler_report_status (struct ow_resampler *resampler)
       resampler->reporter.callback (resampler->reporter.data, o2p_latency_d,
 				    p2o_latency_d, o2p_max_latency_d,
 				    p2o_max_latency_d, resampler->o2p_ratio,
-				    resampler->p2o_ratio);
+				    resampler->p2o_ratio, stats);
     }
 }
 
-void
-ow_resampler_reset_buffers (struct ow_resampler *resampler)
+static inline float *
+ow_resampler_get_p2o_slot (struct ow_resampler *resampler, unsigned int slot)
 {
-  size_t rso2p, bytes;
-  size_t frame_size = resampler->engine->o2p_frame_size;
-  struct ow_context *context = resampler->engine->context;
+  return (float *) ((char *) resampler->p2o_fifo +
+		    (slot % resampler->p2o_fifo_slots) *
+		    resampler->p2o_slot_size);
+}
 
-  resampler->o2p_bufsize =
-    resampler->bufsize * resampler->engine->o2p_frame_size;
-  resampler->p2o_bufsize =
+//The slots depend on the buffer size.
+static void
+ow_resampler_reset_p2o_fifo (struct ow_resampler *resampler)
+{
+  resampler->p2o_slot_size =
     resampler->bufsize * resampler->engine->p2o_frame_size;
+  resampler->p2o_fifo_slots = P2O_FIFO_FRAMES / resampler->bufsize;
+  //The first slot is lent with silence so that there is always one.
+  resampler->p2o_fifo_head = 1;
+  resampler->p2o_fifo_tail = 1;
+  memset (resampler->p2o_fifo, 0, resampler->p2o_slot_size);
+}
 
-  if (resampler->p2o_aux)
+//While switching, the data written with the next layout can not be read until the resampler uses it.
+static inline size_t
+ow_resampler_get_o2p_read_space (struct ow_resampler *resampler)
+{
+  uint32_t left;
+  struct ow_engine *engine = resampler->engine;
+  size_t rso2p = engine->context->read_space (engine->context->o2p_audio);
+
+  if (resampler->o2p_switching
+      && ow_engine_get_o2p_track_mask (engine) ==
+      resampler->o2p_next_track_mask)
     {
-      free (resampler->p2o_aux);
-      free (resampler->p2o_buf_out);
-      free (resampler->p2o_buf_in);
-      free (resampler->p2o_queue);
-      free (resampler->o2p_buf_in);
-      free (resampler->o2p_buf_out);
+      left = atomic_load_explicit (&engine->o2p_track_mask_pos,
+				   memory_order_relaxed) - resampler->o2p_read;
+      return rso2p < left ? rso2p : left;
     }
 
-  //The 8 times scale allow up to more than 192 kHz sample rate in JACK.
-  resampler->p2o_buf_in = malloc (resampler->p2o_bufsize);
-  resampler->p2o_buf_out = malloc (resampler->p2o_bufsize * 8);
-  resampler->p2o_aux = malloc (resampler->p2o_bufsize * 8);
-  resampler->p2o_queue = malloc (resampler->p2o_bufsize * 8);
-  resampler->p2o_queue_len = 0;
+  return rso2p;
+}
+
+static inline void
+ow_resampler_read_o2p (struct ow_resampler *resampler, void *data,
+		       size_t bytes)
+{
+  struct ow_context *context = resampler->engine->context;
+  context->read (context->o2p_audio, data, bytes);
+  resampler->o2p_read += bytes;
+}
+
+static inline void
+ow_resampler_advance_o2p (struct ow_resampler *resampler, size_t bytes)
+{
+  struct ow_context *context = resampler->engine->context;
+  context->advance (context->o2p_audio, bytes);
+  resampler->o2p_read += bytes;
+}
+
+void
+ow_resampler_reset_buffers (struct ow_resampler *resampler)
+{
+  size_t rso2p, bytes;
+  size_t frame_size = resampler->o2p_tracks_frame_size;
 
-  resampler->o2p_buf_in = malloc (resampler->o2p_bufsize);
-  resampler->o2p_buf_out = malloc (resampler->o2p_bufsize);
+  ow_resampler_reset_p2o_fifo (resampler);
+  resampler->p2o_acc = 0.0;
 
-  memset (resampler->p2o_aux, 0, resampler->p2o_bufsize);
-  memset (resampler->o2p_buf_in, 0, resampler->p2o_bufsize);
+  memset (resampler->o2p_buf_in, 0, resampler->o2p_buf_in_size);
 
   resampler->reading_at_o2p_end = 0;
+  //Whatever was lent is discarded below.
+  resampler->o2p_lent_bytes = 0;
+  resampler->o2p_last_frames = 1;
+  memset (resampler->o2p_chunk, 0, resampler->engine->o2p_transfer_size);
+  resampler->o2p_chunk_pos = resampler->engine->frames_per_transfer;
+
+  resampler->fast_path = 0;
+  resampler->fast_path_cycles = 0;
+  resampler->impl->reset (resampler->p2o_state);
+  resampler->impl->reset (resampler->o2p_state);
+
+  rso2p = ow_resampler_get_o2p_read_space (resampler);
+  if (resampler->planar)
+    {
+      bytes = rso2p - rso2p % resampler->o2p_tracks_transfer_size;
+    }
+  else
+    {
+      bytes = ow_bytes_to_frame_bytes (rso2p, frame_size);
+    }
+  ow_resampler_read_o2p (resampler, NULL, bytes);
+}
+
+static int
+ow_resampler_is_seed_valid (struct ow_resampler *resampler,
+			    uint32_t samplerate)
+{
+  double ratio = samplerate / (double) OB_SAMPLE_RATE;
 
-  rso2p = context->read_space (context->o2p_audio);
-  bytes = ow_bytes_to_frame_bytes (rso2p, frame_size);
-  context->read (context->o2p_audio, NULL, bytes);
+  return resampler->seed_samplerate == samplerate &&
+    fabs (resampler->seed_ratio / ratio - 1.0) < SEED_MAX_DEV;
 }
 
 void
@@ -162,33 +268,151 @@ ow_resampler_reset_dll (struct ow_resampler *resampler,
       ow_dll_primary_reset (&resampler->dll, new_samplerate, OB_SAMPLE_RATE,
 			    resampler->bufsize,
 			    resampler->engine->frames_per_transfer);
+      resampler->seeded = ow_resampler_is_seed_valid (resampler,
+						      new_samplerate);
+      if (resampler->seeded)
+	{
+	  debug_print (2, "Seeding the DLL with ratio %f...\n",
+		       resampler->seed_ratio);
+	  ow_dll_primary_resume (&resampler->dll, resampler->seed_ratio,
+				 resampler->bufsize,
+				 resampler->engine->frames_per_transfer);
+	}
       ow_engine_set_status (resampler->engine, OW_ENGINE_STATUS_READY);
     }
 
+  //Both sides start up again.
+  resampler->status = OW_RESAMPLER_STATUS_READY;
+  resampler->dll_realign = 0;
+  resampler->bandwidth = RUN_BANDWIDTH;
   resampler->o2p_ratio = resampler->dll.ratio;
+  resampler->p2o_ratio = 1.0 / resampler->o2p_ratio;
   resampler->samplerate = new_samplerate;
 }
 
+//A slot is lent at a time, which is valid for both layouts as planar slots have lanes of bufsize samples.
+//The previous slot is no longer used by the backend, so it can be written again.
 static long
 resampler_p2o_reader (void *cb_data, float **data)
 {
-  long ret;
   struct ow_resampler *resampler = cb_data;
 
-  *data = resampler->p2o_aux;
-
-  if (resampler->p2o_queue_len == 0)
+  if (resampler->p2o_fifo_tail == resampler->p2o_fifo_head)
     {
       debug_print (2, "j2o: Can not read data from queue\n");
+      //The last slot is still valid and is lent again.
+      *data = ow_resampler_get_p2o_slot (resampler,
+					 resampler->p2o_fifo_tail - 1);
       return resampler->bufsize;
     }
 
-  ret = resampler->p2o_queue_len;
-  memcpy (resampler->p2o_aux, resampler->p2o_queue,
-	  ret * resampler->engine->p2o_frame_size);
-  resampler->p2o_queue_len = 0;
+  *data = ow_resampler_get_p2o_slot (resampler, resampler->p2o_fifo_tail);
+  resampler->p2o_fifo_tail++;
+
+  return resampler->bufsize;
+}
+
+//Silence is valid for both layouts.
+static long
+ow_resampler_read_o2p_pad (struct ow_resampler *resampler)
+{
+  long frames = resampler->o2p_pad_frames > MAX_READ_FRAMES ?
+    MAX_READ_FRAMES : resampler->o2p_pad_frames;
 
-  return ret;
+  resampler->o2p_pad_frames -= frames;
+  memset (resampler->o2p_buf_in, 0,
+	  frames * resampler->o2p_tracks_frame_size);
+  resampler->dll.kj += frames;
+
+  return frames;
+}
+
+//Whole transfers are read into the chunk and then delivered in small pieces so that the DLL sees a smooth consumption.
+static long
+resampler_o2p_reader_planar (void *cb_data, float **data)
+{
+  long frames;
+  size_t rso2p = 0, bytes;
+  float *lane;
+  struct ow_resampler *resampler = cb_data;
+  struct ow_engine *engine = resampler->engine;
+  struct ow_context *context = engine->context;
+  int tracks = resampler->o2p_tracks;
+  size_t transfer_size = resampler->o2p_tracks_transfer_size;
+  long chunk_frames = engine->frames_per_transfer;
+
+  *data = resampler->o2p_buf_in;
+
+  if (resampler->o2p_pad_frames)
+    {
+      return ow_resampler_read_o2p_pad (resampler);
+    }
+
+  if (!resampler->reading_at_o2p_end)
+    {
+      rso2p = context->read_space (context->o2p_audio);
+      if (!resampler->o2p_switching
+	  && rso2p >= resampler->bufsize * resampler->o2p_tracks_frame_size)
+	{
+	  debug_print (2, "o2j: Emptying buffer and running...\n");
+	  bytes = rso2p - rso2p % transfer_size;
+	  ow_resampler_read_o2p (resampler, NULL, bytes);
+	  resampler->reading_at_o2p_end = 1;
+	}
+      memset (resampler->o2p_buf_in, 0,
+	      MAX_READ_FRAMES * resampler->o2p_tracks_frame_size);
+      frames = MAX_READ_FRAMES;
+    }
+  else
+    {
+      if (resampler->o2p_chunk_pos == chunk_frames)
+	{
+	  rso2p = ow_resampler_get_o2p_read_space (resampler);
+	  if (rso2p >= transfer_size)
+	    {
+	      ow_resampler_read_o2p (resampler, resampler->o2p_chunk,
+				     transfer_size);
+	      resampler->o2p_chunk_pos = 0;
+	    }
+	}
+
+      if (resampler->o2p_chunk_pos < chunk_frames)
+	{
+	  frames = chunk_frames - resampler->o2p_chunk_pos;
+	  frames = frames > MAX_READ_FRAMES ? MAX_READ_FRAMES : frames;
+	  lane = &resampler->o2p_chunk[resampler->o2p_chunk_pos];
+	  for (int j = 0; j < tracks; j++, lane += chunk_frames)
+	    {
+	      memcpy (&resampler->o2p_buf_in[j * frames], lane,
+		      frames * sizeof (float));
+	    }
+	  resampler->o2p_chunk_pos += frames;
+	}
+      else
+	{
+	  //The data with the previous layout runs out while switching, which is not an underflow.
+	  if (!resampler->o2p_switching)
+	    {
+	      atomic_fetch_add_explicit (&resampler->o2p_underflows, 1,
+					 memory_order_relaxed);
+	    }
+	  debug_print (2,
+		       "o2j: Audio ring buffer underflow (%zu < %zu). Replicating last sample...\n",
+		       rso2p, transfer_size);
+	  lane = &resampler->o2p_chunk[chunk_frames - 1];
+	  for (int j = 0; j < tracks; j++, lane += chunk_frames)
+	    {
+	      for (int k = 0; k < MAX_READ_FRAMES; k++)
+		{
+		  resampler->o2p_buf_in[j * MAX_READ_FRAMES + k] = *lane;
+		}
+	    }
+	  frames = MAX_READ_FRAMES;
+	}
+    }
+
+  resampler->dll.kj += frames;
+  return frames;
 }
 
 static long
@@ -196,74 +420,314 @@ resampler_o2p_reader (void *cb_data, float **data)
 {
   size_t rso2p;
   size_t bytes;
+  size_t bufsize;
   long frames;
-  static int last_frames = 1;
+  struct ow_buffer_vector v[2];
   struct ow_resampler *resampler = cb_data;
+  struct ow_engine *engine = resampler->engine;
 
   *data = resampler->o2p_buf_in;
 
-  rso2p =
-    resampler->engine->context->read_space (resampler->engine->context->
-					    o2p_audio);
+  //libsamplerate is done with the data lent in the previous call.
+  if (resampler->o2p_lent_bytes)
+    {
+      //Just in case the last frame needs to be replicated.
+      uint64_t pos = (resampler->o2p_last_frames - 1) * resampler->o2p_tracks;
+      memcpy (&resampler->o2p_buf_in[pos], &resampler->o2p_lent[pos],
+	      resampler->o2p_tracks_frame_size);
+      ow_resampler_advance_o2p (resampler, resampler->o2p_lent_bytes);
+      resampler->o2p_lent_bytes = 0;
+    }
+
+  if (resampler->o2p_pad_frames)
+    {
+      resampler->o2p_last_frames = ow_resampler_read_o2p_pad (resampler);
+      return resampler->o2p_last_frames;
+    }
+
+  rso2p = ow_resampler_get_o2p_read_space (resampler);
   if (resampler->reading_at_o2p_end)
     {
-      if (rso2p >= resampler->engine->o2p_frame_size)
+      if (rso2p >= resampler->o2p_tracks_frame_size)
 	{
-	  frames = rso2p / resampler->engine->o2p_frame_size;
+	  frames = rso2p / resampler->o2p_tracks_frame_size;
 	  frames = frames > MAX_READ_FRAMES ? MAX_READ_FRAMES : frames;
-	  bytes = frames * resampler->engine->o2p_frame_size;
-	  resampler->engine->context->read (resampler->engine->
-					    context->o2p_audio,
-					    (void *) resampler->o2p_buf_in,
-					    bytes);
+	  bytes = frames * resampler->o2p_tracks_frame_size;
+	  if (engine->options.o2p_zero_copy)
+	    {
+	      engine->context->get_read_vector (engine->context->o2p_audio,
+						v);
+	    }
+	  if (engine->options.o2p_zero_copy && v[0].len >= bytes)
+	    {
+	      resampler->o2p_lent = (float *) v[0].buf;
+	      resampler->o2p_lent_bytes = bytes;
+	      *data = resampler->o2p_lent;
+	    }
+	  else
+	    {
+	      ow_resampler_read_o2p (resampler, resampler->o2p_buf_in, bytes);
+	    }
 	}
       else
 	{
+	  //The data with the previous layout runs out while switching, which is not an underflow.
+	  if (!resampler->o2p_switching)
+	    {
+	      atomic_fetch_add_explicit (&resampler->o2p_underflows, 1,
+					 memory_order_relaxed);
+	    }
 	  debug_print (2,
 		       "o2j: Audio ring buffer underflow (%zu < %zu). Replicating last sample...\n",
-		       rso2p, resampler->engine->o2p_transfer_size);
-	  if (last_frames > 1)
+		       rso2p, resampler->o2p_tracks_frame_size);
+	  if (resampler->o2p_last_frames > 1)
 	    {
 	      uint64_t pos =
-		(last_frames - 1) * resampler->engine->device_desc->outputs;
+		(resampler->o2p_last_frames - 1) * resampler->o2p_tracks;
 	      memcpy (resampler->o2p_buf_in, &resampler->o2p_buf_in[pos],
-		      resampler->engine->o2p_frame_size);
+		      resampler->o2p_tracks_frame_size);
 	    }
 	  frames = MAX_READ_FRAMES;
 	}
     }
   else
     {
-      if (rso2p >= resampler->o2p_bufsize)
+      bufsize = resampler->bufsize * resampler->o2p_tracks_frame_size;
+      if (!resampler->o2p_switching && rso2p >= bufsize)
 	{
 	  debug_print (2, "o2j: Emptying buffer and running...\n");
-	  bytes = ow_bytes_to_frame_bytes (rso2p, resampler->o2p_bufsize);
-	  resampler->engine->context->read (resampler->engine->
-					    context->o2p_audio, NULL, bytes);
+	  bytes = ow_bytes_to_frame_bytes (rso2p, bufsize);
+	  ow_resampler_read_o2p (resampler, NULL, bytes);
 	  resampler->reading_at_o2p_end = 1;
 	}
       frames = MAX_READ_FRAMES;
     }
 
   resampler->dll.kj += frames;
-  last_frames = frames;
+  resampler->o2p_last_frames = frames;
   return frames;
 }
 
+static void
+ow_resampler_update_fast_path (struct ow_resampler *resampler)
+{
+  double max_dev = resampler->fast_path ? FAST_PATH_MAX_DEV_OUT :
+    FAST_PATH_MAX_DEV_IN;
+  int fast_path = resampler->fast_path_enabled
+    && resampler->status == OW_RESAMPLER_STATUS_RUN
+    && resampler->samplerate == OB_SAMPLE_RATE
+    && fabs (resampler->o2p_ratio - 1.0) < max_dev;
+
+  if (!fast_path)
+    {
+      resampler->fast_path_cycles = 0;
+    }
+  else if (!resampler->fast_path)
+    {
+      resampler->fast_path_cycles++;
+      if (resampler->fast_path_cycles <
+	  FAST_PATH_DWELL_TIME * resampler->samplerate / resampler->bufsize)
+	{
+	  return;
+	}
+    }
+
+  if (fast_path == resampler->fast_path)
+    {
+      return;
+    }
+
+  //The backends with a fast read just go on from where they are.
+  if (!resampler->impl->read_fast)
+    {
+      if (fast_path)
+	{
+	  OW_RESAMPLER_CUBIC_IMPL.reset (resampler->p2o_fast_state);
+	  OW_RESAMPLER_CUBIC_IMPL.reset (resampler->o2p_fast_state);
+	}
+      else
+	{
+	  resampler->impl->reset (resampler->p2o_state);
+	  resampler->impl->reset (resampler->o2p_state);
+	}
+    }
+
+  if (fast_path)
+    {
+      debug_print (2, "Using the fast path (ratio %f)...\n",
+		   resampler->o2p_ratio);
+    }
+  else
+    {
+      debug_print (2, "Using %s (ratio %f)...\n", resampler->impl->name,
+		   resampler->o2p_ratio);
+    }
+
+  resampler->fast_path = fast_path;
+}
+
+static void
+ow_resampler_set_o2p_tracks (struct ow_resampler *resampler, uint32_t mask)
+{
+  resampler->o2p_track_mask = mask;
+  resampler->o2p_tracks = __builtin_popcount (mask);
+  resampler->o2p_tracks_frame_size =
+    resampler->o2p_tracks * OB_BYTES_PER_SAMPLE;
+  resampler->o2p_tracks_transfer_size =
+    resampler->engine->frames_per_transfer *
+    resampler->o2p_tracks_frame_size;
+}
+
+//The engine changes the layout at the beginning of a transfer and the resampler keeps reading the data with the previous one until it reaches that point.
+//Then it uses the new layout from the next cycle on, so the tracks that are in both masks are not interrupted.
+//Only the rest of the cycle in which the data with the previous layout runs out replicates the last sample.
+static int
+ow_resampler_update_o2p_tracks (struct ow_resampler *resampler)
+{
+  int err;
+  uint32_t mask, pos;
+  size_t rso2p;
+  struct ow_engine *engine = resampler->engine;
+
+  if (!resampler->o2p_switching)
+    {
+      mask = atomic_load_explicit (&resampler->o2p_track_mask_req,
+				   memory_order_relaxed);
+      if (mask == resampler->o2p_track_mask)
+	{
+	  return 0;
+	}
+
+      //The backend must be ready before the engine changes the layout as there is no way back after that.
+      if (resampler->impl->prepare_channels &&
+	  !(atomic_load_explicit (&resampler->prepared_channels,
+				  memory_order_acquire) &
+	    (1U << (__builtin_popcount (mask) - 1))))
+	{
+	  return 0;
+	}
+
+      debug_print (2, "o2j: Changing track mask to 0x%x...\n", mask);
+      ow_engine_set_o2p_track_mask (engine, mask);
+      resampler->o2p_next_track_mask = mask;
+      resampler->o2p_switching = 1;
+      return 0;
+    }
+
+  mask = resampler->o2p_next_track_mask;
+  if (ow_engine_get_o2p_track_mask (engine) != mask)
+    {
+      return 0;
+    }
+
+  //Nobody reads the buffer before running so the previous data is just discarded.
+  if (!resampler->reading_at_o2p_end)
+    {
+      rso2p = ow_resampler_get_o2p_read_space (resampler);
+      ow_resampler_read_o2p (resampler, NULL, rso2p);
+    }
+
+  pos = atomic_load_explicit (&engine->o2p_track_mask_pos,
+			      memory_order_relaxed);
+  if (resampler->o2p_read + resampler->o2p_lent_bytes != pos)
+    {
+      return 0;
+    }
+
+  err = resampler->impl->set_channels (resampler->o2p_state,
+				       __builtin_popcount (mask));
+  if (err > 0)
+    {
+      //The prepare thread is still working on it.
+      return 0;
+    }
+
+  if (err || OW_RESAMPLER_CUBIC_IMPL.set_channels (resampler->o2p_fast_state,
+						   __builtin_popcount (mask)))
+    {
+      error_print
+	("Error while changing the o2j tracks. Stopping resampler...\n");
+      ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+      return 1;
+    }
+
+  //The backends are reset by the channel change, so nothing lent is used anymore.
+  if (resampler->o2p_lent_bytes)
+    {
+      ow_resampler_advance_o2p (resampler, resampler->o2p_lent_bytes);
+      resampler->o2p_lent_bytes = 0;
+    }
+
+  ow_resampler_set_o2p_tracks (resampler, mask);
+
+  resampler->o2p_last_frames = 1;
+  memset (resampler->o2p_buf_in, 0, resampler->o2p_buf_in_size);
+  memset (resampler->o2p_chunk, 0, engine->o2p_transfer_size);
+  resampler->o2p_chunk_pos = engine->frames_per_transfer;
+  resampler->o2p_switching = 0;
+
+  debug_print (2, "o2j: Using %d tracks\n", resampler->o2p_tracks);
+
+  return 0;
+}
+
+//Right after a cycle, the o2p buffer is at its lowest so this is how close it was to an underflow.
+static inline void
+ow_resampler_update_o2p_headroom (struct ow_resampler *resampler)
+{
+  struct ow_context *context = resampler->engine->context;
+  uint32_t frames = context->read_space (context->o2p_audio) /
+    resampler->o2p_tracks_frame_size;
+
+  if (resampler->planar)
+    {
+      frames += resampler->engine->frames_per_transfer -
+	resampler->o2p_chunk_pos;
+    }
+
+  if (frames < resampler->o2p_min_headroom)
+    {
+      resampler->o2p_min_headroom = frames;
+    }
+}
+
 void
 ow_resampler_read_audio (struct ow_resampler *resampler)
 {
   long gen_frames;
 
-  gen_frames =
-    src_callback_read (resampler->o2p_state, resampler->o2p_ratio,
-		       resampler->bufsize, resampler->o2p_buf_out);
+  if (resampler->fast_path && resampler->impl->read_fast)
+    {
+      gen_frames =
+	resampler->impl->read_fast (resampler->o2p_state,
+				    resampler->o2p_ratio, resampler->bufsize,
+				    resampler->o2p_buf_out);
+    }
+  else if (resampler->fast_path)
+    {
+      gen_frames =
+	OW_RESAMPLER_CUBIC_IMPL.read (resampler->o2p_fast_state,
+				      resampler->o2p_ratio,
+				      resampler->bufsize,
+				      resampler->o2p_buf_out);
+    }
+  else
+    {
+      gen_frames =
+	resampler->impl->read (resampler->o2p_state, resampler->o2p_ratio,
+			       resampler->bufsize, resampler->o2p_buf_out);
+    }
   if (gen_frames != resampler->bufsize)
     {
       error_print
 	("o2j: Unexpected frames with ratio %f (output %ld, expected %d)\n",
 	 resampler->o2p_ratio, gen_frames, resampler->bufsize);
     }
+
+  if (resampler->reading_at_o2p_end)
+    {
+      ow_resampler_update_o2p_headroom (resampler);
+    }
 }
 
 void
@@ -274,22 +738,55 @@ ow_resampler_write_audio (struct ow_resampler *resampler)
   int frames;
   size_t bytes;
   size_t wsj2o;
-  static double p2o_acc = .0;
 
-  memcpy (&resampler->p2o_queue
-	  [resampler->p2o_queue_len *
-	   resampler->engine->p2o_frame_size], resampler->p2o_buf_in,
-	  resampler->p2o_bufsize);
-  resampler->p2o_queue_len += resampler->bufsize;
+  //The head slot has just been filled. One slot is always kept free for the next cycle.
+  if (resampler->p2o_fifo_head - resampler->p2o_fifo_tail + 2 <
+      resampler->p2o_fifo_slots)
+    {
+      resampler->p2o_fifo_head++;
+    }
+  else
+    {
+      debug_print (2, "j2o: Queue full. Discarding data...\n");
+    }
 
-  p2o_acc += resampler->bufsize * (resampler->p2o_ratio - 1.0);
-  inc = trunc (p2o_acc);
-  p2o_acc -= inc;
+  resampler->p2o_acc += resampler->bufsize * (resampler->p2o_ratio - 1.0);
+  if (resampler->p2o_comp_frames != 0.0)
+    {
+      double comp = resampler->p2o_comp_frames;
+      comp = comp > resampler->p2o_comp_step ? resampler->p2o_comp_step :
+	comp < -resampler->p2o_comp_step ? -resampler->p2o_comp_step : comp;
+      resampler->p2o_comp_frames -= comp;
+      resampler->p2o_acc += comp;
+    }
+  inc = trunc (resampler->p2o_acc);
+  resampler->p2o_acc -= inc;
   frames = resampler->bufsize + inc;
+  if (frames > P2O_MAX_FRAMES)
+    {
+      frames = P2O_MAX_FRAMES;
+    }
 
-  gen_frames =
-    src_callback_read (resampler->p2o_state,
-		       resampler->p2o_ratio, frames, resampler->p2o_buf_out);
+  if (resampler->fast_path && resampler->impl->read_fast)
+    {
+      gen_frames =
+	resampler->impl->read_fast (resampler->p2o_state,
+				    resampler->p2o_ratio, frames,
+				    resampler->p2o_buf_out);
+    }
+  else if (resampler->fast_path)
+    {
+      gen_frames =
+	OW_RESAMPLER_CUBIC_IMPL.read (resampler->p2o_fast_state,
+				      resampler->p2o_ratio, frames,
+				      resampler->p2o_buf_out);
+    }
+  else
+    {
+      gen_frames =
+	resampler->impl->read (resampler->p2o_state, resampler->p2o_ratio,
+			       frames, resampler->p2o_buf_out);
+    }
   if (gen_frames != frames)
     {
       error_print
@@ -316,10 +813,229 @@ ow_resampler_write_audio (struct ow_resampler *resampler)
     }
   else
     {
+      atomic_fetch_add_explicit (&resampler->p2o_overflows, 1,
+				 memory_order_relaxed);
       error_print ("j2o: Audio ring buffer overflow. Discarding data...\n");
     }
 }
 
+static inline void
+ow_resampler_add_dll_err (struct ow_resampler *resampler)
+{
+  double err = fabs (resampler->dll.err) * 1.0e9 / OB_SAMPLE_RATE;
+  ow_stats_histogram_add (&resampler->dll_err,
+			  err > UINT32_MAX ? UINT32_MAX : (uint32_t) err);
+}
+
+//Only the thread that computes the ratios summarizes the histograms.
+static void
+ow_resampler_update_stats (struct ow_resampler *resampler)
+{
+  struct ow_resampler_stats *stats = &resampler->reporter.stats;
+  struct ow_engine *engine = resampler->engine;
+
+  ow_stats_histogram_summarize (&engine->o2p_xfr_time, &stats->o2p_xfr_time,
+				1.0e-3);
+  ow_stats_histogram_summarize (&engine->p2o_xfr_time, &stats->p2o_xfr_time,
+				1.0e-3);
+  ow_stats_histogram_summarize (&engine->o2p_xfr_jitter,
+				&stats->o2p_xfr_jitter, 1.0e-3);
+  ow_stats_histogram_summarize (&resampler->cycle_time, &stats->cycle_time,
+				1.0e-3);
+  ow_stats_histogram_summarize (&resampler->dll_err, &stats->dll_err,
+				1.0e-3);
+  stats->o2p_fill = atomic_load_explicit (&engine->o2p_latency,
+					  memory_order_relaxed) /
+    resampler->o2p_tracks_frame_size;
+  stats->p2o_fill = atomic_load_explicit (&engine->p2o_latency,
+					  memory_order_relaxed) /
+    engine->p2o_frame_size;
+  stats->o2p_overflows = atomic_load_explicit (&engine->o2p_overflows,
+					       memory_order_relaxed);
+  stats->o2p_underflows = atomic_load_explicit (&resampler->o2p_underflows,
+						memory_order_relaxed);
+  stats->p2o_overflows = atomic_load_explicit (&resampler->p2o_overflows,
+					       memory_order_relaxed);
+  stats->p2o_underflows = atomic_load_explicit (&engine->p2o_underflows,
+						memory_order_relaxed);
+  stats->xruns = atomic_load_explicit (&resampler->xruns_total,
+				       memory_order_relaxed);
+  stats->target_delay = resampler->dll.kdel * 1000.0 / OB_SAMPLE_RATE;
+  stats->bandwidth = resampler->bandwidth;
+}
+
+static void
+ow_resampler_set_bandwidth (struct ow_resampler *resampler, double bandwidth)
+{
+  resampler->bandwidth = bandwidth;
+  ow_dll_primary_set_loop_filter (&resampler->dll, bandwidth,
+				  resampler->bufsize, resampler->samplerate);
+}
+
+static void
+ow_resampler_start_adapting (struct ow_resampler *resampler)
+{
+  resampler->o2p_min_headroom = UINT32_MAX;
+  resampler->p2o_comp_frames = 0.0;
+  resampler->adaptive_underflows =
+    atomic_load_explicit (&resampler->o2p_underflows, memory_order_relaxed);
+  resampler->adaptive_margin_scale = 1;
+  resampler->adaptive_holdoff = ADAPTIVE_SETTLE_REPORTS;
+}
+
+//The underflows make the DLL count frames that are not in the buffer, so the delay it keeps settles wherever no more underflows happen. This is why the headroom, instead of the delay itself, is what is measured.
+//The delay is moved so that the headroom becomes some times the p99 of the USB and the JACK jitter, halfway when shrinking so that it does not overshoot. Once there, the bandwidth is narrowed to filter out more of the jitter from the ratio.
+//An underflow doubles the margin, up to a limit, and restores the nominal bandwidth.
+static void
+ow_resampler_adapt (struct ow_resampler *resampler)
+{
+  int kdel, max_kdel;
+  uint32_t underflows;
+  double jitter, margin, diff, bandwidth;
+  struct ow_dll *dll = &resampler->dll;
+  const struct ow_resampler_stats *stats = &resampler->reporter.stats;
+  uint32_t headroom = resampler->o2p_min_headroom;
+
+  resampler->o2p_min_headroom = UINT32_MAX;
+
+  underflows = stats->o2p_underflows;
+  if (underflows != resampler->adaptive_underflows
+      && dll->kdel == dll->kdel_nominal
+      && resampler->bandwidth == RUN_BANDWIDTH)
+    {
+      //Nothing has been adapted yet, as after the startup, so this is not a reason to back off.
+      resampler->adaptive_underflows = underflows;
+      resampler->adaptive_holdoff = ADAPTIVE_SETTLE_REPORTS;
+      return;
+    }
+
+  if (underflows != resampler->adaptive_underflows)
+    {
+      resampler->adaptive_underflows = underflows;
+      if (resampler->adaptive_margin_scale < ADAPTIVE_MAX_MARGIN_SCALE)
+	{
+	  resampler->adaptive_margin_scale *= 2;
+	}
+      debug_print (2, "Backing off the DLL (margin scale %d)...\n",
+		   resampler->adaptive_margin_scale);
+      ow_resampler_set_bandwidth (resampler, RUN_BANDWIDTH);
+      resampler->adaptive_holdoff = ADAPTIVE_SETTLE_REPORTS;
+      return;
+    }
+
+  if (resampler->adaptive_holdoff)
+    {
+      resampler->adaptive_holdoff--;
+      return;
+    }
+
+  if (headroom == UINT32_MAX)
+    {
+      return;
+    }
+
+  //Both p99 are in µs.
+  jitter = (stats->o2p_xfr_jitter.p99 + stats->dll_err.p99) * 1.0e-6 *
+    OB_SAMPLE_RATE;
+  margin = MAX_READ_FRAMES + resampler->adaptive_margin_scale *
+    ADAPTIVE_JITTER_FACTOR * jitter;
+  diff = headroom - margin;
+
+  if (fabs (diff) >= MAX_READ_FRAMES)
+    {
+      kdel = dll->kdel - (diff > 0 ? floor (diff / 2) : floor (diff));
+      max_kdel = 2 * dll->kdel_nominal;
+      kdel = kdel < resampler->engine->frames_per_transfer ?
+	resampler->engine->frames_per_transfer : kdel > max_kdel ?
+	max_kdel : kdel;
+      //As the p2o side follows the o2p ratio, it would lose what the o2p side gains while the loop follows the new delay.
+      resampler->p2o_comp_frames += kdel - dll->kdel;
+      resampler->p2o_comp_step = fabs (resampler->p2o_comp_frames) /
+	(ADAPTIVE_SETTLE_REPORTS * resampler->log_control_cycles);
+      ow_dll_primary_set_target_delay (dll, kdel);
+      debug_print (2,
+		   "Setting the DLL delay to %d frames (headroom %u, margin %.1f frames)...\n",
+		   dll->kdel, headroom, margin);
+      resampler->adaptive_holdoff = ADAPTIVE_SETTLE_REPORTS;
+    }
+  else if (resampler->bandwidth > ADAPTIVE_MIN_BANDWIDTH)
+    {
+      bandwidth = resampler->bandwidth * ADAPTIVE_BANDWIDTH_STEP;
+      ow_resampler_set_bandwidth (resampler, bandwidth <
+				  ADAPTIVE_MIN_BANDWIDTH ?
+				  ADAPTIVE_MIN_BANDWIDTH : bandwidth);
+      debug_print (2, "Narrowing the DLL bandwidth to %f Hz...\n",
+		   resampler->bandwidth);
+    }
+}
+
+//While running, the o2p data and the converged ratio are kept and only the p2o slots change, so there is no startup.
+//The DLL error jumps by 2.5 times the buffer size change, 1.5 from the target delay and 1 from the data waiting for the next cycle. The DLL is not updated until the error settles and then the current delay is taken as the target, as in the startup.
+//With bigger buffers, that much silence is inserted in the o2p side as the current delay would not be enough.
+static void
+ow_resampler_reconfigure_running (struct ow_resampler *resampler,
+				  uint32_t bufsize, uint32_t samplerate)
+{
+  struct ow_dll *dll = &resampler->dll;
+  double ratio = dll->last_ratio_avg * samplerate / resampler->samplerate;
+  uint32_t old_bufsize = resampler->bufsize;
+
+  debug_print (2, "Reconfiguring running resampler (%d frames, %d Hz)...\n",
+	       bufsize, samplerate);
+
+  resampler->bufsize = bufsize;
+  resampler->samplerate = samplerate;
+
+  ow_resampler_reset_p2o_fifo (resampler);
+  resampler->impl->reset (resampler->p2o_state);
+  OW_RESAMPLER_CUBIC_IMPL.reset (resampler->p2o_fast_state);
+
+  ow_dll_primary_resume (dll, ratio, bufsize,
+			 resampler->engine->frames_per_transfer);
+  ow_dll_primary_set_loop_filter (dll, resampler->bandwidth, bufsize,
+				  samplerate);
+  resampler->dll_realign = REALIGN_CYCLES;
+  if (bufsize > old_bufsize)
+    {
+      resampler->o2p_pad_frames = 5 * (bufsize - old_bufsize) / 2;
+    }
+
+  resampler->o2p_ratio = ratio;
+  resampler->p2o_ratio = 1.0 / ratio;
+  ow_resampler_update_fast_path (resampler);
+
+  resampler->log_cycles = 0;
+  resampler->log_control_cycles =
+    resampler->reporter.period * samplerate / bufsize;
+}
+
+//The requests are applied at the beginning of a cycle by the thread that runs it, so nothing else uses the buffers meanwhile and, as they are in the arena, nothing is allocated.
+static void
+ow_resampler_update_config (struct ow_resampler *resampler)
+{
+  uint32_t bufsize = atomic_load_explicit (&resampler->bufsize_req,
+					   memory_order_relaxed);
+  uint32_t samplerate = atomic_load_explicit (&resampler->samplerate_req,
+					      memory_order_relaxed);
+
+  if (!bufsize || !samplerate || (bufsize == resampler->bufsize &&
+				  samplerate == resampler->samplerate))
+    {
+      return;
+    }
+
+  if (resampler->status == OW_RESAMPLER_STATUS_RUN)
+    {
+      ow_resampler_reconfigure_running (resampler, bufsize, samplerate);
+    }
+  else
+    {
+      resampler->bufsize = bufsize;
+      ow_resampler_reset_buffers (resampler);
+      ow_resampler_reset_dll (resampler, samplerate);
+    }
+}
+
 int
 ow_resampler_compute_ratios (struct ow_resampler *resampler, double time)
 {
@@ -327,14 +1043,17 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler, double time)
   ow_engine_status_t engine_status;
   struct ow_dll *dll = &resampler->dll;
 
-  pthread_spin_lock (&resampler->lock);
-  xruns = resampler->xruns;
-  resampler->xruns = 0;
-  pthread_spin_unlock (&resampler->lock);
+  ow_resampler_update_config (resampler);
+
+  if (ow_resampler_update_o2p_tracks (resampler))
+    {
+      return 1;
+    }
+
+  xruns = atomic_exchange_explicit (&resampler->xruns, 0,
+				    memory_order_relaxed);
 
-  pthread_spin_lock (&resampler->engine->lock);
   ow_dll_primary_load_dll_overwitch (dll);
-  pthread_spin_unlock (&resampler->engine->lock);
 
   engine_status = ow_engine_get_status (resampler->engine);
   if (resampler->status == OW_RESAMPLER_STATUS_READY
@@ -354,12 +1073,24 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler, double time)
       ow_dll_primary_update_err (dll, time);
       ow_dll_primary_first_time_run (dll);
 
+      resampler->log_cycles = 0;
+
+      //A seeded ratio is already close to the final one so the wide boot loop would only take it away.
+      if (resampler->seeded)
+	{
+	  debug_print (2, "Tuning seeded resampler...\n");
+	  ow_dll_primary_set_loop_filter (dll, 0.05, resampler->bufsize,
+					  resampler->samplerate);
+	  resampler->status = OW_RESAMPLER_STATUS_TUNE;
+	  resampler->log_control_cycles =
+	    SEEDED_STARTUP_TIME * resampler->samplerate / resampler->bufsize;
+	  return 0;
+	}
+
       debug_print (2, "Starting up resampler...\n");
       ow_dll_primary_set_loop_filter (dll, 1.0, resampler->bufsize,
 				      resampler->samplerate);
       resampler->status = OW_RESAMPLER_STATUS_BOOT;
-
-      resampler->log_cycles = 0;
       resampler->log_control_cycles =
 	STARTUP_TIME * resampler->samplerate / resampler->bufsize;
       return 0;
@@ -372,6 +1103,7 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler, double time)
       //With this, we try to recover from the unreaded frames that are in the o2p buffer and...
       resampler->o2p_ratio = dll->ratio * (1 + xruns);
       resampler->p2o_ratio = 1.0 / resampler->o2p_ratio;
+      ow_resampler_update_fast_path (resampler);
       ow_resampler_read_audio (resampler);
 
       //... we skip the current cycle DLL update as time masurements are not precise enough and would lead to errors.
@@ -379,7 +1111,17 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler, double time)
     }
 
   ow_dll_primary_update_err (dll, time);
+  if (resampler->dll_realign)
+    {
+      resampler->dll_realign--;
+      if (resampler->dll_realign)
+	{
+	  return 0;
+	}
+      ow_dll_primary_first_time_run (dll);
+    }
   ow_dll_primary_update (dll);
+  ow_resampler_add_dll_err (resampler);
 
   if (dll->ratio < 0.0)
     {
@@ -390,16 +1132,25 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler, double time)
 
   resampler->o2p_ratio = dll->ratio;
   resampler->p2o_ratio = 1.0 / resampler->o2p_ratio;
+  ow_resampler_update_fast_path (resampler);
 
   resampler->log_cycles++;
   if (resampler->log_cycles == resampler->log_control_cycles)
     {
       ow_dll_primary_calc_avg (dll, resampler->log_control_cycles);
 
+      ow_resampler_update_stats (resampler);
       ow_resampler_report_status (resampler);
 
       resampler->log_cycles = 0;
 
+      if (resampler->adaptive
+	  && resampler->status == OW_RESAMPLER_STATUS_RUN
+	  && !resampler->dll_realign && resampler->reading_at_o2p_end)
+	{
+	  ow_resampler_adapt (resampler);
+	}
+
       if (resampler->status == OW_RESAMPLER_STATUS_BOOT)
 	{
 	  debug_print (2, "Tunning resampler...\n");
@@ -411,86 +1162,326 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler, double time)
 	    resampler->bufsize;
 	}
 
+      //With a seed, the first average is compared to it so tuning ends after the first window if the seed was right.
       if (resampler->status == OW_RESAMPLER_STATUS_TUNE && ow_dll_tuned (dll))
 	{
 	  debug_print (2, "Running resampler...\n");
-	  ow_dll_primary_set_loop_filter (dll, 0.02, resampler->bufsize,
-					  resampler->samplerate);
+	  ow_resampler_set_bandwidth (resampler, RUN_BANDWIDTH);
 	  resampler->status = OW_RESAMPLER_STATUS_RUN;
 	  ow_engine_set_status (resampler->engine, OW_ENGINE_STATUS_RUN);
+	  ow_resampler_start_adapting (resampler);
 	}
     }
 
   return 0;
 }
 
+static inline void *
+ow_resampler_take_from_arena (char **pos, size_t size)
+{
+  void *buf = *pos;
+  *pos += (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+  return buf;
+}
+
+//Every buffer is taken from a single mlocked allocation so that neither buffer size changes nor the first cycles cause allocations or page faults.
+static int
+ow_resampler_init_arena (struct ow_resampler *resampler)
+{
+  char *pos;
+  struct ow_engine *engine = resampler->engine;
+  size_t sizes[] = {
+    MAX_READ_FRAMES * engine->o2p_frame_size,
+    OW_RESAMPLER_MAX_BUFSIZE * engine->o2p_frame_size,
+    engine->o2p_transfer_size,
+    P2O_FIFO_FRAMES * engine->p2o_frame_size,
+    P2O_MAX_FRAMES * engine->p2o_frame_size
+  };
+
+  resampler->arena_size = 0;
+  for (int i = 0; i < sizeof (sizes) / sizeof (size_t); i++)
+    {
+      resampler->arena_size += (sizes[i] + ARENA_ALIGNMENT - 1) &
+	~((size_t) ARENA_ALIGNMENT - 1);
+    }
+
+  if (posix_memalign (&resampler->arena, sysconf (_SC_PAGESIZE),
+		      resampler->arena_size))
+    {
+      error_print ("Could not allocate %zu bytes for the resampler\n",
+		   resampler->arena_size);
+      return -1;
+    }
+  memset (resampler->arena, 0, resampler->arena_size);
+  if (mlock (resampler->arena, resampler->arena_size))
+    {
+      debug_print (1, "Could not lock the resampler memory\n");
+    }
+  debug_print (1, "Using %zu bytes for the resampler buffers\n",
+	       resampler->arena_size);
+
+  pos = resampler->arena;
+  resampler->o2p_buf_in_size = sizes[0];
+  resampler->o2p_buf_in = ow_resampler_take_from_arena (&pos, sizes[0]);
+  resampler->o2p_buf_out = ow_resampler_take_from_arena (&pos, sizes[1]);
+  resampler->o2p_chunk = ow_resampler_take_from_arena (&pos, sizes[2]);
+  resampler->p2o_fifo = ow_resampler_take_from_arena (&pos, sizes[3]);
+  resampler->p2o_buf_out = ow_resampler_take_from_arena (&pos, sizes[4]);
+
+  return 0;
+}
+
+static void
+ow_resampler_free_arena (struct ow_resampler *resampler)
+{
+  munlock (resampler->arena, resampler->arena_size);
+  free (resampler->arena);
+}
+
+static void *
+ow_resampler_prepare_thread (void *data)
+{
+  uint32_t requested;
+  struct ow_resampler *resampler = data;
+
+  while (1)
+    {
+      sem_wait (&resampler->prepare_sem);
+      if (!atomic_load_explicit (&resampler->prepare_running,
+				 memory_order_acquire))
+	{
+	  break;
+	}
+
+      //Every request is prepared as the audio thread might be waiting for any of them.
+      requested = atomic_exchange_explicit (&resampler->prepare_channels, 0,
+					    memory_order_relaxed);
+      for (int i = 0; i < OB_MAX_TRACKS; i++)
+	{
+	  if (!(requested & (1U << i)))
+	    {
+	      continue;
+	    }
+	  debug_print (2, "o2j: Preparing %s for %d tracks...\n",
+		       resampler->impl->name, i + 1);
+	  if (resampler->impl->prepare_channels (resampler->o2p_state, i + 1))
+	    {
+	      error_print
+		("Error while preparing the o2j tracks. Stopping resampler...\n");
+	      ow_engine_set_status (resampler->engine,
+				    OW_ENGINE_STATUS_ERROR);
+	      continue;
+	    }
+	  atomic_fetch_or_explicit (&resampler->prepared_channels, 1U << i,
+				    memory_order_release);
+	}
+    }
+
+  return NULL;
+}
+
 ow_err_t
-ow_resampler_init_from_bus_address (struct ow_resampler **resampler_,
-				    uint8_t bus, uint8_t address,
-				    int blocks_per_transfer, int quality)
+ow_resampler_init_from_engine (struct ow_resampler **resampler_,
+			       struct ow_engine *engine,
+			       ow_resampler_backend_t backend, int quality)
 {
-  struct ow_resampler *resampler = malloc (sizeof (struct ow_resampler));
-  ow_err_t err =
-    ow_engine_init_from_bus_address (&resampler->engine, bus, address,
-				     blocks_per_transfer);
-  if (err)
+  int inputs, outputs, p2o_flags, o2p_flags;
+  ow_resampler_cb_t o2p_reader;
+  struct ow_resampler *resampler;
+
+  //The resampler has fields aligned to the cache lines.
+  if (posix_memalign ((void **) &resampler, OW_CACHE_LINE_SIZE,
+		      sizeof (struct ow_resampler)))
     {
+      ow_engine_destroy (engine);
+      return OW_GENERIC_ERROR;
+    }
+
+  resampler->engine = engine;
+  inputs = resampler->engine->device_desc->inputs;
+  outputs = resampler->engine->device_desc->outputs;
+
+  if (ow_resampler_init_arena (resampler))
+    {
+      ow_engine_destroy (resampler->engine);
       free (resampler);
-      return err;
+      return OW_GENERIC_ERROR;
+    }
+
+  resampler->impl = ow_resampler_get_impl (backend);
+  //Planar data is used whenever the backend supports it. The p2o output stays interleaved as it is read in arbitrary amounts of frames.
+  resampler->planar = resampler->impl->planar;
+  if (resampler->planar)
+    {
+      p2o_flags = OW_RESAMPLER_PLANAR_IN;
+      o2p_flags = OW_RESAMPLER_PLANAR_IN | OW_RESAMPLER_PLANAR_OUT;
+      o2p_reader = resampler_o2p_reader_planar;
+    }
+  else
+    {
+      p2o_flags = 0;
+      o2p_flags = 0;
+      o2p_reader = resampler_o2p_reader;
+    }
+  debug_print (1, "Using %s resampler with quality %d (planar: %d)\n",
+	       resampler->impl->name, quality, resampler->planar);
+
+  resampler->p2o_state = resampler->impl->new (quality, inputs, p2o_flags,
+					       resampler_p2o_reader,
+					       resampler);
+  resampler->o2p_state = resampler->impl->new (quality, outputs, o2p_flags,
+					       o2p_reader, resampler);
+  if (!resampler->p2o_state || !resampler->o2p_state)
+    {
+      if (resampler->p2o_state)
+	{
+	  resampler->impl->delete (resampler->p2o_state);
+	}
+      if (resampler->o2p_state)
+	{
+	  resampler->impl->delete (resampler->o2p_state);
+	}
+      ow_resampler_free_arena (resampler);
+      ow_engine_destroy (resampler->engine);
+      free (resampler);
+      return OW_GENERIC_ERROR;
+    }
+
+  resampler->fast_path = 0;
+  resampler->fast_path_enabled = 1;
+  resampler->fast_path_cycles = 0;
+  resampler->p2o_fast_state =
+    OW_RESAMPLER_CUBIC_IMPL.new (0, inputs, p2o_flags,
+				 resampler_p2o_reader, resampler);
+  resampler->o2p_fast_state =
+    OW_RESAMPLER_CUBIC_IMPL.new (0, outputs, o2p_flags, o2p_reader,
+				 resampler);
+
+  ow_resampler_set_o2p_tracks (resampler,
+			       ow_engine_get_all_tracks_mask (resampler->
+							      engine));
+  atomic_init (&resampler->o2p_track_mask_req, resampler->o2p_track_mask);
+  resampler->o2p_switching = 0;
+
+  resampler->o2p_read = 0;
+  atomic_init (&resampler->prepare_channels, 0);
+  //The backend is created with all the tracks.
+  atomic_init (&resampler->prepared_channels, 1U << (outputs - 1));
+  atomic_init (&resampler->prepare_running, 0);
+  if (resampler->impl->prepare_channels)
+    {
+      sem_init (&resampler->prepare_sem, 0, 0);
+      atomic_store (&resampler->prepare_running, 1);
+      pthread_create (&resampler->prepare_thread, NULL,
+		      ow_resampler_prepare_thread, resampler);
     }
 
   *resampler_ = resampler;
 
   resampler->samplerate = 0;
   resampler->bufsize = 0;
+  atomic_init (&resampler->samplerate_req, 0);
+  atomic_init (&resampler->bufsize_req, 0);
+  resampler->dll_realign = 0;
+  resampler->o2p_pad_frames = 0;
+  resampler->seed_ratio = 0.0;
+  resampler->seed_samplerate = 0;
+  resampler->seeded = 0;
+  resampler->adaptive = 0;
+  resampler->bandwidth = RUN_BANDWIDTH;
+  resampler->o2p_min_headroom = UINT32_MAX;
+  resampler->p2o_comp_frames = 0.0;
+  resampler->p2o_comp_step = 0.0;
+  resampler->p2o_acc = 0.0;
+  resampler->adaptive_underflows = 0;
+  resampler->adaptive_margin_scale = 1;
+  resampler->adaptive_holdoff = 0;
   resampler->xruns = 0;
-  resampler->p2o_aux = NULL;
+  ow_stats_histogram_init (&resampler->cycle_time);
+  ow_stats_histogram_init (&resampler->dll_err);
+  atomic_init (&resampler->xruns_total, 0);
+  atomic_init (&resampler->o2p_underflows, 0);
+  atomic_init (&resampler->p2o_overflows, 0);
+  resampler->o2p_lent_bytes = 0;
+  resampler->o2p_last_frames = 1;
   resampler->status = OW_RESAMPLER_STATUS_READY;
 
-  resampler->p2o_state =
-    src_callback_new (resampler_p2o_reader, quality,
-		      resampler->engine->device_desc->inputs, NULL,
-		      resampler);
-  resampler->o2p_state =
-    src_callback_new (resampler_o2p_reader, quality,
-		      resampler->engine->device_desc->outputs, NULL,
-		      resampler);
-
-  pthread_spin_init (&resampler->lock, PTHREAD_PROCESS_SHARED);
-
   resampler->reporter.callback = NULL;
   resampler->reporter.data = NULL;
   resampler->reporter.period = DEFAULT_REPORT_PERIOD;
+  memset (&resampler->reporter.stats, 0, sizeof (struct ow_resampler_stats));
 
   ow_dll_primary_init (&resampler->dll);
 
   return OW_OK;
 }
 
+ow_err_t
+ow_resampler_init_from_bus_address (struct ow_resampler **resampler,
+				    uint8_t bus, uint8_t address,
+				    int blocks_per_transfer, int xfrs,
+				    ow_resampler_backend_t backend,
+				    int quality, struct ow_usb_loop *loop)
+{
+  struct ow_engine *engine;
+  ow_err_t err = ow_engine_init_from_bus_address (&engine, bus, address,
+						  blocks_per_transfer, xfrs,
+						  loop);
+  if (err)
+    {
+      return err;
+    }
+
+  return ow_resampler_init_from_engine (resampler, engine, backend, quality);
+}
+
 void
 ow_resampler_destroy (struct ow_resampler *resampler)
 {
-  src_delete (resampler->p2o_state);
-  src_delete (resampler->o2p_state);
-  free (resampler->p2o_aux);
-  free (resampler->p2o_buf_out);
-  free (resampler->p2o_buf_in);
-  free (resampler->p2o_queue);
-  free (resampler->o2p_buf_in);
-  free (resampler->o2p_buf_out);
-  pthread_spin_destroy (&resampler->lock);
+  if (resampler->impl->prepare_channels)
+    {
+      atomic_store_explicit (&resampler->prepare_running, 0,
+			     memory_order_release);
+      sem_post (&resampler->prepare_sem);
+      pthread_join (resampler->prepare_thread, NULL);
+      sem_destroy (&resampler->prepare_sem);
+    }
+  resampler->impl->delete (resampler->p2o_state);
+  resampler->impl->delete (resampler->o2p_state);
+  OW_RESAMPLER_CUBIC_IMPL.delete (resampler->p2o_fast_state);
+  OW_RESAMPLER_CUBIC_IMPL.delete (resampler->o2p_fast_state);
+  ow_resampler_free_arena (resampler);
   ow_engine_destroy (resampler->engine);
   free (resampler);
 }
 
-ow_err_t
-ow_resampler_activate (struct ow_resampler *resampler,
-		       struct ow_context *context)
+static void
+ow_resampler_prepare_context (struct ow_resampler *resampler,
+			      struct ow_context *context)
 {
   context->dll = &resampler->dll.dll_ow;
   context->dll_init = (ow_dll_overwitch_init_t) ow_dll_overwitch_init;
   context->dll_inc = (ow_dll_overwitch_inc_t) ow_dll_overwitch_inc;
   context->options |= OW_ENGINE_OPTION_DLL;
+  if (resampler->planar)
+    {
+      context->options |= OW_ENGINE_OPTION_PLANAR;
+    }
+}
+
+ow_err_t
+ow_resampler_set_context (struct ow_resampler *resampler,
+			  struct ow_context *context)
+{
+  ow_resampler_prepare_context (resampler, context);
+  return ow_engine_set_context (resampler->engine, context);
+}
+
+ow_err_t
+ow_resampler_activate (struct ow_resampler *resampler,
+		       struct ow_context *context)
+{
+  ow_resampler_prepare_context (resampler, context);
   return ow_engine_activate (resampler->engine, context);
 }
 
@@ -503,9 +1494,48 @@ ow_resampler_wait (struct ow_resampler *resampler)
 void
 ow_resampler_inc_xruns (struct ow_resampler *resampler)
 {
-  pthread_spin_lock (&resampler->lock);
-  resampler->xruns++;
-  pthread_spin_unlock (&resampler->lock);
+  atomic_fetch_add_explicit (&resampler->xruns, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&resampler->xruns_total, 1,
+			     memory_order_relaxed);
+}
+
+inline void
+ow_resampler_add_cycle_time (struct ow_resampler *resampler, uint64_t time)
+{
+  ow_stats_histogram_add (&resampler->cycle_time,
+			  time > UINT32_MAX ? UINT32_MAX : time);
+}
+
+inline int
+ow_resampler_is_planar (struct ow_resampler *resampler)
+{
+  return resampler->planar;
+}
+
+inline void
+ow_resampler_set_o2p_track_mask (struct ow_resampler *resampler,
+				 uint32_t mask)
+{
+  //Same as the engine does so that the masks can be compared.
+  mask &= ow_engine_get_all_tracks_mask (resampler->engine);
+  mask = mask ? mask : 1;
+  atomic_store_explicit (&resampler->o2p_track_mask_req, mask,
+			 memory_order_relaxed);
+
+  //This can be called from the audio thread so the preparation is left to its own thread. sem_post does not block.
+  if (resampler->impl->prepare_channels)
+    {
+      atomic_fetch_or_explicit (&resampler->prepare_channels,
+				1U << (__builtin_popcount (mask) - 1),
+				memory_order_relaxed);
+      sem_post (&resampler->prepare_sem);
+    }
+}
+
+inline uint32_t
+ow_resampler_get_o2p_track_mask (struct ow_resampler *resampler)
+{
+  return resampler->o2p_track_mask;
 }
 
 inline struct ow_engine *
@@ -521,32 +1551,64 @@ ow_resampler_stop (struct ow_resampler *resampler)
 }
 
 inline void
+ow_resampler_set_ratio_seed (struct ow_resampler *resampler,
+			     uint32_t samplerate, double ratio)
+{
+  resampler->seed_samplerate = samplerate;
+  resampler->seed_ratio = ratio;
+}
+
+inline void
+ow_resampler_set_fast_path (struct ow_resampler *resampler, int fast_path)
+{
+  resampler->fast_path_enabled = fast_path;
+}
+
+inline void
+ow_resampler_set_adaptive (struct ow_resampler *resampler, int adaptive)
+{
+  resampler->adaptive = adaptive;
+}
+
+inline double
+ow_resampler_get_locked_ratio (struct ow_resampler *resampler)
+{
+  return resampler->status == OW_RESAMPLER_STATUS_RUN ?
+    resampler->dll.ratio_avg : 0.0;
+}
+
+inline int
 ow_resampler_set_buffer_size (struct ow_resampler *resampler,
 			      uint32_t bufsize)
 {
-  if (resampler->bufsize != bufsize)
+  if (!bufsize || bufsize > OW_RESAMPLER_MAX_BUFSIZE)
     {
-      resampler->bufsize = bufsize;
-      ow_resampler_reset_buffers (resampler);
-      ow_resampler_reset_dll (resampler, resampler->samplerate);
+      error_print ("Buffer size %d out of limits (maximum is %d)\n", bufsize,
+		   OW_RESAMPLER_MAX_BUFSIZE);
+      return -1;
     }
+
+  atomic_store_explicit (&resampler->bufsize_req, bufsize,
+			 memory_order_relaxed);
+
+  return 0;
 }
 
-inline void
+inline int
 ow_resampler_set_samplerate (struct ow_resampler *resampler,
 			     uint32_t samplerate)
 {
-  if (resampler->samplerate != samplerate)
+  if (samplerate < OW_RESAMPLER_MIN_SAMPLERATE)
     {
-      if (resampler->p2o_buf_in)	//This means that ow_resampler_reset_buffers has been called and thus bufsize has been set.
-	{
-	  ow_resampler_reset_dll (resampler, samplerate);
-	}
-      else
-	{
-	  resampler->samplerate = samplerate;
-	}
+      error_print ("Sample rate %d below the minimum (%d)\n", samplerate,
+		   OW_RESAMPLER_MIN_SAMPLERATE);
+      return -1;
     }
+
+  atomic_store_explicit (&resampler->samplerate_req, samplerate,
+			 memory_order_relaxed);
+
+  return 0;
 }
 
 inline size_t
@@ -570,7 +1632,7 @@ ow_resampler_get_o2p_audio_buffer (struct ow_resampler *resampler)
 inline float *
 ow_resampler_get_p2o_audio_buffer (struct ow_resampler *resampler)
 {
-  return resampler->p2o_buf_in;
+  return ow_resampler_get_p2o_slot (resampler, resampler->p2o_fifo_head);
 }
 
 void
@@ -18,7 +18,9 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <semaphore.h>
 #include "dll.h"
+#include "backend.h"
 #include "engine.h"
 #include "overwitch.h"
 
@@ -29,23 +31,91 @@ struct ow_resampler
   struct ow_dll dll;		//The DLL is based on o2j data
   double o2p_ratio;
   double p2o_ratio;
-  SRC_STATE *p2o_state;
-  SRC_STATE *o2p_state;
-  float *p2o_buf_in;
+  const struct ow_resampler_impl *impl;
+  void *p2o_state;
+  void *o2p_state;
+  //Used instead of the backend while both sides run at the same sample rate and the ratio is close to 1.
+  int fast_path;
+  int fast_path_enabled;
+  int fast_path_cycles;		//Cycles in a row with the ratio close enough to 1
+  //Only used by the backends without a fast read.
+  void *p2o_fast_state;
+  void *o2p_fast_state;
+  //Every buffer is in the arena, which is sized for the maximum buffer size so that changing it does not allocate.
+  void *arena;
+  size_t arena_size;
   float *p2o_buf_out;
-  float *p2o_aux;
-  float *p2o_queue;
   float *o2p_buf_in;
   float *o2p_buf_out;
-  size_t p2o_queue_len;
+  //The JACK input is copied into the head slot and lent from the tail slot to the backend, which reads it in place. The slot before the tail is the one lent.
+  float *p2o_fifo;
+  unsigned int p2o_fifo_slots;
+  unsigned int p2o_fifo_head;
+  unsigned int p2o_fifo_tail;
+  //Only the o2p tracks in the mask are resampled. It is requested by anyone and the JACK thread changes the layout.
+  uint32_t o2p_track_mask;
+  uint32_t o2p_next_track_mask;
+  int o2p_switching;		//Waiting for the engine to apply the next mask
+  uint32_t o2p_read;		//Bytes read from the o2p buffer, wrapping around as the engine count
+  int o2p_tracks;
+  size_t o2p_tracks_frame_size;
+  size_t o2p_tracks_transfer_size;
+  //With planar data, the buffers contain a lane per track and the o2p buffer is read one transfer at a time.
+  int planar;
+  float *o2p_chunk;
+  long o2p_chunk_pos;
+  size_t o2p_lent_bytes;	//Bytes of the o2p buffer lent to libsamplerate in the last callback
+  float *o2p_lent;
+  long o2p_last_frames;		//Frames given in the last callback
   int log_control_cycles;
   int log_cycles;
-  int xruns;
-  pthread_spinlock_t lock;	//Used to synchronize access to xruns.
+  //Telemetry. The histograms are only written by the thread that computes the ratios.
+  struct ow_stats_histogram cycle_time;
+  struct ow_stats_histogram dll_err;
+  atomic_uint xruns_total;
+  atomic_uint o2p_underflows;
+  atomic_uint p2o_overflows;
   int reading_at_o2p_end;
-  size_t o2p_bufsize;
-  size_t p2o_bufsize;
+  size_t o2p_buf_in_size;
+  size_t p2o_slot_size;
   uint32_t bufsize;
   double samplerate;
+  //A previous ratio for the sample rate, which is ignored if it is 0.
+  double seed_ratio;
+  uint32_t seed_samplerate;
+  int seeded;
+  long o2p_pad_frames;		//Silence to lend before reading the o2p buffer again
+  int dll_realign;		//Cycles until the DLL takes the current delay as the target
+  //Adaptive delay and bandwidth, updated at every report while running.
+  int adaptive;
+  double bandwidth;
+  uint32_t o2p_min_headroom;	//Minimum o2p frames left after a cycle since the previous report
+  uint32_t adaptive_underflows;	//o2p underflows at the previous report
+  int adaptive_margin_scale;	//Doubled after every underflow
+  int adaptive_holdoff;		//Reports until the delay can be changed again
+  double p2o_comp_frames;	//Still to be added to the p2o side after a delay change
+  double p2o_comp_step;		//Frames added per cycle
+  double p2o_acc;		//Fraction of a frame carried to the next cycle
   struct ow_resampler_reporter reporter;
+  //Written by other threads, so they do not share a cache line with the fields above, which are the ones of the JACK thread.
+  atomic_uint o2p_track_mask_req OW_CACHE_ALIGNED;
+  atomic_int xruns;
+  //Requested by anyone and applied by ow_resampler_compute_ratios.
+  atomic_uint bufsize_req;
+  atomic_uint samplerate_req;
+  //The backends that need memory for the o2p channels get it in this thread, which is only used with them.
+  pthread_t prepare_thread;
+  sem_t prepare_sem;
+  atomic_int prepare_running;
+  atomic_uint prepare_channels;	//Bit n - 1 is set for n channels
+  atomic_uint prepared_channels;	//Same bits for the ones ready to be used
 };
+
+//The resampler owns the engine from now on, even if there is an error. This is used with offline engines.
+ow_err_t ow_resampler_init_from_engine (struct ow_resampler **,
+					struct ow_engine *,
+					ow_resampler_backend_t, int);
+
+//All of ow_resampler_activate but starting the engine threads.
+ow_err_t ow_resampler_set_context (struct ow_resampler *,
+				   struct ow_context *);
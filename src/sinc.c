@@ -0,0 +1,460 @@
+/*
+ *   sinc.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sinc.h"
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OW_SINC_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define OW_SINC_NEON
+#endif
+
+//Room for new input frames on top of the filter length.
+#define SINC_CHUNK 512
+//A table is used for ratios up to this much below the one it was designed for.
+#define SINC_MAX_CUTOFF_DEV 0.01
+
+struct ow_sinc_preset
+{
+  int taps;
+  int phases;
+  double rolloff;
+  double beta;
+};
+
+//Indexed by quality, from the best to the fastest, as the libsamplerate converters.
+static const struct ow_sinc_preset OW_SINC_PRESETS[] = {
+  {.taps = 64,.phases = 256,.rolloff = 0.945,.beta = 9.0},
+  {.taps = 48,.phases = 256,.rolloff = 0.93,.beta = 8.0},
+  {.taps = 32,.phases = 128,.rolloff = 0.91,.beta = 7.0},
+  {.taps = 16,.phases = 128,.rolloff = 0.87,.beta = 6.0},
+  {.taps = 8,.phases = 64,.rolloff = 0.8,.beta = 5.0}
+};
+
+#define SINC_PRESETS (sizeof (OW_SINC_PRESETS) / sizeof (struct ow_sinc_preset))
+
+//Downsampling needs a lower cutoff to avoid aliasing. Designing a table is too slow for the audio thread so there is one for the ratio between 48 kHz and every usual sample rate, in decreasing order, and the read uses the highest one not above the ratio.
+static const double OW_SINC_CUTOFF_RATIOS[] = {
+  1.0, 44100.0 / 48000, 32000.0 / 48000, 48000.0 / 88200, 24000.0 / 48000,
+  22050.0 / 48000, 48000.0 / 176400, 48000.0 / 192000
+};
+
+#define SINC_CUTOFF_RATIOS (sizeof (OW_SINC_CUTOFF_RATIOS) / sizeof (double))
+
+inline float
+ow_sinc_dot_scalar (const float *a, const float *b, int n)
+{
+  float acc = 0;
+
+  for (int i = 0; i < n; i++)
+    {
+      acc += a[i] * b[i];
+    }
+
+  return acc;
+}
+
+#if defined(OW_SINC_X86)
+
+//The length is always a multiple of 8.
+__attribute__((target ("avx2")))
+static float
+ow_sinc_dot_avx2 (const float *a, const float *b, int n)
+{
+  __m256 acc = _mm256_setzero_ps ();
+  __m128 s;
+
+  for (int i = 0; i < n; i += 8)
+    {
+      acc = _mm256_add_ps (acc, _mm256_mul_ps (_mm256_loadu_ps (&a[i]),
+					       _mm256_loadu_ps (&b[i])));
+    }
+
+  s = _mm_add_ps (_mm256_castps256_ps128 (acc),
+		  _mm256_extractf128_ps (acc, 1));
+  s = _mm_hadd_ps (s, s);
+  s = _mm_hadd_ps (s, s);
+  return _mm_cvtss_f32 (s);
+}
+
+static int
+ow_sinc_is_supported_avx2 ()
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx2");
+}
+
+#elif defined(OW_SINC_NEON)
+
+static float
+ow_sinc_dot_neon (const float *a, const float *b, int n)
+{
+  float32x4_t acc = vdupq_n_f32 (0);
+  float32x2_t s;
+
+  for (int i = 0; i < n; i += 4)
+    {
+      acc = vmlaq_f32 (acc, vld1q_f32 (&a[i]), vld1q_f32 (&b[i]));
+    }
+
+  s = vadd_f32 (vget_low_f32 (acc), vget_high_f32 (acc));
+  return vget_lane_f32 (vpadd_f32 (s, s), 0);
+}
+
+#endif
+
+//Modified Bessel function of the first kind and order 0.
+static double
+ow_sinc_bessel_i0 (double x)
+{
+  double sum = 1.0, term = 1.0, q = x * x / 4.0;
+
+  for (int k = 1; k < 64 && term > sum * 1e-12; k++)
+    {
+      term *= q / ((double) k * k);
+      sum += term;
+    }
+
+  return sum;
+}
+
+//Every row is normalized to have unity gain at DC.
+static void
+ow_sinc_design (struct ow_sinc *sinc, float *table, double cutoff)
+{
+  double d, u, h, sum, x;
+  int half = sinc->taps / 2;
+  double i0_beta = ow_sinc_bessel_i0 (sinc->beta);
+
+  for (int p = 0; p <= sinc->phases; p++)
+    {
+      float *row = &table[p * sinc->taps];
+
+      sum = 0;
+      for (int j = 0; j < sinc->taps; j++)
+	{
+	  d = j - half + 1 - (double) p / sinc->phases;
+	  u = d / half;
+	  x = M_PI * cutoff * d;
+	  h = d == 0 ? cutoff : cutoff * sin (x) / x;
+	  h *= u * u < 1 ? ow_sinc_bessel_i0 (sinc->beta * sqrt (1 - u * u)) /
+	    i0_beta : 0;
+	  row[j] = h;
+	  sum += h;
+	}
+
+      for (int j = 0; j < sinc->taps; j++)
+	{
+	  row[j] /= sum;
+	}
+    }
+
+  debug_print (2, "Sinc filter designed with cutoff %f\n", cutoff);
+}
+
+static inline float *
+ow_sinc_get_table (struct ow_sinc *sinc, double ratio)
+{
+  int i;
+  size_t table_len = (sinc->phases + 1) * sinc->taps;
+
+  for (i = 0; i < SINC_CUTOFF_RATIOS - 1; i++)
+    {
+      if (OW_SINC_CUTOFF_RATIOS[i] <= ratio * (1.0 + SINC_MAX_CUTOFF_DEV))
+	{
+	  break;
+	}
+    }
+
+  return &sinc->tables[i * table_len];
+}
+
+struct ow_sinc *
+ow_sinc_new (int quality, int channels, int flags, ow_resampler_cb_t cb,
+	     void *cb_data)
+{
+  size_t table_len;
+  const struct ow_sinc_preset *preset;
+  struct ow_sinc *sinc = malloc (sizeof (struct ow_sinc));
+
+  if (quality < 0 || quality >= SINC_PRESETS)
+    {
+      quality = SINC_PRESETS - 1;
+    }
+  preset = &OW_SINC_PRESETS[quality];
+
+  sinc->channels = channels;
+  sinc->max_channels = channels;
+  sinc->flags = flags;
+  sinc->taps = preset->taps;
+  sinc->phases = preset->phases;
+  sinc->rolloff = preset->rolloff;
+  sinc->beta = preset->beta;
+  sinc->capacity = sinc->taps + SINC_CHUNK;
+  sinc->cb = cb;
+  sinc->cb_data = cb_data;
+
+  table_len = (sinc->phases + 1) * sinc->taps;
+  sinc->tables = malloc (SINC_CUTOFF_RATIOS * table_len * sizeof (float));
+  sinc->kernel = malloc (sinc->taps * sizeof (float));
+  sinc->hist = malloc (channels * sinc->capacity * sizeof (float));
+
+  sinc->dot = ow_sinc_dot_scalar;
+#if defined(OW_SINC_X86)
+  if (ow_sinc_is_supported_avx2 ())
+    {
+      sinc->dot = ow_sinc_dot_avx2;
+    }
+#elif defined(OW_SINC_NEON)
+  sinc->dot = ow_sinc_dot_neon;
+#endif
+
+  for (int i = 0; i < SINC_CUTOFF_RATIOS; i++)
+    {
+      ow_sinc_design (sinc, &sinc->tables[i * table_len],
+		      sinc->rolloff * OW_SINC_CUTOFF_RATIOS[i]);
+    }
+  sinc->table = sinc->tables;
+  ow_sinc_reset (sinc);
+
+  debug_print (1, "Sinc resampler: %d taps, %d phases\n", sinc->taps,
+	       sinc->phases);
+
+  return sinc;
+}
+
+void
+ow_sinc_reset (struct ow_sinc *sinc)
+{
+  //The lanes start with a whole filter of silence.
+  memset (sinc->hist, 0, sinc->channels * sinc->capacity * sizeof (float));
+  sinc->len = sinc->taps;
+  sinc->pos = sinc->taps / 2 - 1;
+  sinc->in = NULL;
+  sinc->in_frames = 0;
+}
+
+//Only the lanes already allocated can be used so that this can be called from the audio thread.
+int
+ow_sinc_set_channels (struct ow_sinc *sinc, int channels)
+{
+  if (channels < 1 || channels > sinc->max_channels)
+    {
+      return -1;
+    }
+  sinc->channels = channels;
+  ow_sinc_reset (sinc);
+  return 0;
+}
+
+void
+ow_sinc_delete (struct ow_sinc *sinc)
+{
+  free (sinc->tables);
+  free (sinc->kernel);
+  free (sinc->hist);
+  free (sinc);
+}
+
+//Discards the samples not needed anymore by the filter.
+static void
+ow_sinc_compact (struct ow_sinc *sinc)
+{
+  int drop = (int) sinc->pos - sinc->taps / 2 + 1;
+
+  if (drop <= 0)
+    {
+      return;
+    }
+
+  for (int c = 0; c < sinc->channels; c++)
+    {
+      float *lane = &sinc->hist[c * sinc->capacity];
+      memmove (lane, &lane[drop], (sinc->len - drop) * sizeof (float));
+    }
+
+  sinc->len -= drop;
+  sinc->pos -= drop;
+}
+
+//Deinterleaves as much input as possible into the lanes. If there is no input, the last frame is replicated.
+static void
+ow_sinc_pull (struct ow_sinc *sinc)
+{
+  long frames;
+  const float *in;
+
+  if (sinc->len == sinc->capacity)
+    {
+      ow_sinc_compact (sinc);
+    }
+
+  if (!sinc->in_frames)
+    {
+      sinc->in_frames = sinc->cb (sinc->cb_data, &sinc->in);
+      if (sinc->in_frames <= 0)
+	{
+	  sinc->in_frames = 0;
+	  for (int c = 0; c < sinc->channels; c++)
+	    {
+	      float *lane = &sinc->hist[c * sinc->capacity];
+	      lane[sinc->len] = lane[sinc->len - 1];
+	    }
+	  sinc->len++;
+	  return;
+	}
+      if (sinc->flags & OW_RESAMPLER_PLANAR_IN)
+	{
+	  sinc->in_lane = sinc->in_frames;
+	  sinc->in_step = 1;
+	}
+      else
+	{
+	  sinc->in_lane = 1;
+	  sinc->in_step = sinc->channels;
+	}
+    }
+
+  frames = sinc->capacity - sinc->len;
+  frames = frames > sinc->in_frames ? sinc->in_frames : frames;
+
+  for (int c = 0; c < sinc->channels; c++)
+    {
+      float *lane = &sinc->hist[c * sinc->capacity + sinc->len];
+      in = &sinc->in[c * sinc->in_lane];
+      if (sinc->in_step == 1)
+	{
+	  memcpy (lane, in, frames * sizeof (float));
+	  continue;
+	}
+      for (long i = 0; i < frames; i++, in += sinc->in_step)
+	{
+	  lane[i] = *in;
+	}
+    }
+
+  sinc->in += frames * sinc->in_step;
+  sinc->in_frames -= frames;
+  sinc->len += frames;
+}
+
+inline long
+ow_sinc_read (struct ow_sinc *sinc, double ratio, long frames, float *out)
+{
+  int i, p;
+  double phase, a;
+  float *o;
+  const float *row0, *row1, *lane;
+  int half = sinc->taps / 2;
+  double step = 1.0 / ratio;
+  long out_lane = sinc->flags & OW_RESAMPLER_PLANAR_OUT ? frames : 1;
+  long out_step = sinc->flags & OW_RESAMPLER_PLANAR_OUT ? 1 : sinc->channels;
+
+  sinc->table = ow_sinc_get_table (sinc, ratio);
+
+  for (long n = 0; n < frames; n++)
+    {
+      while ((int) sinc->pos + half >= sinc->len)
+	{
+	  ow_sinc_pull (sinc);
+	}
+
+      i = (int) sinc->pos;
+      phase = (sinc->pos - i) * sinc->phases;
+      p = (int) phase;
+      a = phase - p;
+      if (p >= sinc->phases)
+	{
+	  p = sinc->phases - 1;
+	  a = 1.0;
+	}
+      row0 = &sinc->table[p * sinc->taps];
+      row1 = row0 + sinc->taps;
+      for (int j = 0; j < sinc->taps; j++)
+	{
+	  sinc->kernel[j] = row0[j] + a * (row1[j] - row0[j]);
+	}
+
+      lane = &sinc->hist[i - half + 1];
+      o = out;
+      for (int c = 0; c < sinc->channels;
+	   c++, o += out_lane, lane += sinc->capacity)
+	{
+	  *o = sinc->dot (sinc->kernel, lane, sinc->taps);
+	}
+
+      out += out_step;
+      sinc->pos += step;
+    }
+
+  return frames;
+}
+
+//Cubic Hermite interpolation at the same position and on the same lanes, so that it can be used instead of the filter at any time.
+//The input is pulled as the filter does so that the callback sees the same consumption.
+inline long
+ow_sinc_read_fast (struct ow_sinc *sinc, double ratio, long frames,
+		   float *out)
+{
+  int i;
+  float t, xm1, x0, x1, x2, c1, c2, c3;
+  float *o;
+  const float *lane;
+  int half = sinc->taps / 2;
+  double step = 1.0 / ratio;
+  long out_lane = sinc->flags & OW_RESAMPLER_PLANAR_OUT ? frames : 1;
+  long out_step = sinc->flags & OW_RESAMPLER_PLANAR_OUT ? 1 : sinc->channels;
+
+  for (long n = 0; n < frames; n++)
+    {
+      while ((int) sinc->pos + half >= sinc->len)
+	{
+	  ow_sinc_pull (sinc);
+	}
+
+      i = (int) sinc->pos;
+      t = sinc->pos - i;
+      lane = &sinc->hist[i - 1];
+      o = out;
+      for (int c = 0; c < sinc->channels;
+	   c++, o += out_lane, lane += sinc->capacity)
+	{
+	  xm1 = lane[0];
+	  x0 = lane[1];
+	  x1 = lane[2];
+	  x2 = lane[3];
+	  c1 = 0.5f * (x1 - xm1);
+	  c2 = xm1 - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+	  c3 = 0.5f * (x2 - xm1) + 1.5f * (x0 - x1);
+	  *o = ((c3 * t + c2) * t + c1) * t + x0;
+	}
+
+      out += out_step;
+      sinc->pos += step;
+    }
+
+  return frames;
+}
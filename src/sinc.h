@@ -0,0 +1,68 @@
+/*
+ *   sinc.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SINC_H
+#define SINC_H
+
+#include "backend.h"
+
+//Polyphase windowed sinc resampler. The input is kept planar so that every channel is a contiguous lane for the vectorized dot products.
+struct ow_sinc
+{
+  int channels;
+  int max_channels;		//The ones the lanes are allocated for
+  int flags;			//The planar flags of the backends
+  int taps;			//A multiple of 8
+  int phases;
+  double rolloff;
+  double beta;			//Kaiser window
+  float *tables;		//A table of (phases + 1) rows of taps for every cutoff ratio
+  float *table;			//The one in use
+  float *kernel;		//Table row interpolated for the current position
+  float *hist;			//One lane of capacity samples per channel
+  int capacity;
+  int len;
+  double pos;			//Position of the next output in the lanes
+  ow_resampler_cb_t cb;
+  void *cb_data;
+  float *in;			//Input frames not used yet from the last callback
+  long in_frames;
+  long in_lane;			//Distance between the channels of a frame
+  long in_step;			//Distance between frames
+  float (*dot) (const float *, const float *, int);
+};
+
+struct ow_sinc *ow_sinc_new (int, int, int, ow_resampler_cb_t, void *);
+
+long ow_sinc_read (struct ow_sinc *, double, long, float *);
+
+//Only for ratios close to 1 as there is no filtering.
+long ow_sinc_read_fast (struct ow_sinc *, double, long, float *);
+
+void ow_sinc_reset (struct ow_sinc *);
+
+int ow_sinc_set_channels (struct ow_sinc *, int);
+
+void ow_sinc_delete (struct ow_sinc *);
+
+//Reference implementation. The vectorized ones only differ in the rounding errors.
+float ow_sinc_dot_scalar (const float *, const float *, int);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ *   stats.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+#define OW_STATS_SUB_BUCKETS (1 << OW_STATS_SUB_BITS)
+
+inline int
+ow_stats_get_bucket (uint32_t value)
+{
+  int exp;
+
+  if (value < OW_STATS_SUB_BUCKETS)
+    {
+      return value;
+    }
+
+  exp = 31 - __builtin_clz (value);
+  return ((exp - OW_STATS_SUB_BITS + 1) << OW_STATS_SUB_BITS) +
+    ((value >> (exp - OW_STATS_SUB_BITS)) & (OW_STATS_SUB_BUCKETS - 1));
+}
+
+inline double
+ow_stats_get_bucket_value (int bucket)
+{
+  int exp;
+  double width;
+
+  if (bucket < OW_STATS_SUB_BUCKETS)
+    {
+      return bucket;
+    }
+
+  exp = (bucket >> OW_STATS_SUB_BITS) + OW_STATS_SUB_BITS - 1;
+  width = (double) (1ULL << (exp - OW_STATS_SUB_BITS));
+  return ((1ULL << exp) + (bucket & (OW_STATS_SUB_BUCKETS - 1)) * width) +
+    (width - 1) * 0.5;
+}
+
+void
+ow_stats_histogram_init (struct ow_stats_histogram *histogram)
+{
+  for (int i = 0; i < OW_STATS_BUCKETS; i++)
+    {
+      atomic_init (&histogram->buckets[i], 0);
+    }
+  atomic_init (&histogram->max, 0);
+  memset (histogram->last, 0, sizeof (histogram->last));
+}
+
+//As there is only one writer, there is no need for atomic read-modify-write operations.
+inline void
+ow_stats_histogram_add (struct ow_stats_histogram *histogram, uint32_t value)
+{
+  atomic_uint *bucket = &histogram->buckets[ow_stats_get_bucket (value)];
+
+  atomic_store_explicit (bucket,
+			 atomic_load_explicit (bucket,
+					       memory_order_relaxed) + 1,
+			 memory_order_relaxed);
+  if (value > atomic_load_explicit (&histogram->max, memory_order_relaxed))
+    {
+      atomic_store_explicit (&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+//A maximum written while it is being reset might end up in the next summary, which is harmless.
+void
+ow_stats_histogram_summarize (struct ow_stats_histogram *histogram,
+			      struct ow_stats_summary *summary, double scale)
+{
+  uint32_t counts[OW_STATS_BUCKETS];
+  uint32_t count, acc, p50, p99;
+  int i;
+
+  count = 0;
+  for (i = 0; i < OW_STATS_BUCKETS; i++)
+    {
+      uint32_t v = atomic_load_explicit (&histogram->buckets[i],
+					 memory_order_relaxed);
+      //Unsigned arithmetic works even if the counter wraps around.
+      counts[i] = v - histogram->last[i];
+      histogram->last[i] = v;
+      count += counts[i];
+    }
+
+  summary->count = count;
+  summary->max = atomic_exchange_explicit (&histogram->max, 0,
+					   memory_order_relaxed) * scale;
+
+  if (!count)
+    {
+      summary->p50 = 0.0;
+      summary->p99 = 0.0;
+      return;
+    }
+
+  //These are the ranks of the percentiles, starting at 1.
+  p50 = (count + 1) / 2;
+  p99 = count - count / 100;
+  summary->p50 = -1.0;
+  acc = 0;
+  for (i = 0; i < OW_STATS_BUCKETS; i++)
+    {
+      acc += counts[i];
+      if (summary->p50 < 0 && acc >= p50)
+	{
+	  summary->p50 = ow_stats_get_bucket_value (i) * scale;
+	}
+      if (acc >= p99)
+	{
+	  summary->p99 = ow_stats_get_bucket_value (i) * scale;
+	  break;
+	}
+    }
+
+  //The percentiles can not be above the maximum, which is exact.
+  if (summary->p50 > summary->max)
+    {
+      summary->p50 = summary->max;
+    }
+  if (summary->p99 > summary->max)
+    {
+      summary->p99 = summary->max;
+    }
+}
+
+inline uint64_t
+ow_get_time_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,53 @@
+/*
+ *   stats.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "overwitch.h"
+
+//There are 2^OW_STATS_SUB_BITS buckets for every power of 2 so the error is below 12.5 %.
+#define OW_STATS_SUB_BITS 3
+#define OW_STATS_BUCKETS ((32 - OW_STATS_SUB_BITS + 1) << OW_STATS_SUB_BITS)
+
+//Values are written by a single thread and summarized by another one without locks.
+struct ow_stats_histogram
+{
+  atomic_uint buckets[OW_STATS_BUCKETS];
+  atomic_uint max;
+  uint32_t last[OW_STATS_BUCKETS];	//Counts at the previous summary. Only used by the reader.
+};
+
+void ow_stats_histogram_init (struct ow_stats_histogram *);
+
+void ow_stats_histogram_add (struct ow_stats_histogram *, uint32_t);
+
+//Values added since the previous call, multiplied by the scale.
+void ow_stats_histogram_summarize (struct ow_stats_histogram *,
+				   struct ow_stats_summary *, double);
+
+int ow_stats_get_bucket (uint32_t);
+
+//The middle value of the bucket.
+double ow_stats_get_bucket_value (int);
+
+#endif
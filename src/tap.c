@@ -0,0 +1,279 @@
+/*
+ *   tap.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tap.h"
+#include "utils.h"
+
+#define OW_TAP_BLOCKS 8192	//More than a second
+
+//Other processes map the header read only so they can not take a lock for the head.
+_Static_assert (ATOMIC_LLONG_LOCK_FREE == 2,
+		"The tap head must be lock free to be shared between processes");
+
+static void
+ow_tap_get_name (char *name, uint8_t bus, uint8_t address)
+{
+  snprintf (name, OW_TAP_NAME_LEN, OW_TAP_NAME_FORMAT, bus, address);
+}
+
+ow_err_t
+ow_tap_writer_init (struct ow_tap_writer **writer_, uint8_t bus,
+		    uint8_t address, int outputs)
+{
+  int fd;
+  void *mem;
+  struct ow_tap_writer *writer = malloc (sizeof (struct ow_tap_writer));
+
+  if (!writer)
+    {
+      error_print ("Error while allocating the tap writer\n");
+      return OW_GENERIC_ERROR;
+    }
+
+  ow_tap_get_name (writer->name, bus, address);
+  writer->block_samples = OB_FRAMES_PER_BLOCK * outputs;
+  writer->size = OW_TAP_DATA_OFFSET + OW_TAP_BLOCKS * writer->block_samples *
+    OB_BYTES_PER_SAMPLE;
+
+  //A tap left by a crashed instance is replaced.
+  fd = shm_open (writer->name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      error_print ("Error while opening tap %s: %s\n", writer->name,
+		   strerror (errno));
+      free (writer);
+      return OW_GENERIC_ERROR;
+    }
+
+  if (ftruncate (fd, writer->size))
+    {
+      error_print ("Error while sizing tap %s: %s\n", writer->name,
+		   strerror (errno));
+      goto error;
+    }
+
+  mem = mmap (NULL, writer->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    {
+      error_print ("Error while mapping tap %s: %s\n", writer->name,
+		   strerror (errno));
+      goto error;
+    }
+  close (fd);
+
+  writer->header = mem;
+  writer->data = (float *) ((char *) mem + OW_TAP_DATA_OFFSET);
+  writer->header->version = OW_TAP_VERSION;
+  writer->header->outputs = outputs;
+  writer->header->blocks = OW_TAP_BLOCKS;
+  atomic_init (&writer->header->running, 1);
+  atomic_init (&writer->header->head, 0);
+  //Readers check this last.
+  atomic_thread_fence (memory_order_release);
+  writer->header->magic = OW_TAP_MAGIC;
+
+  debug_print (1, "Tapping o2p audio at %s\n", writer->name);
+
+  *writer_ = writer;
+  return OW_OK;
+
+error:
+  close (fd);
+  shm_unlink (writer->name);
+  free (writer);
+  return OW_GENERIC_ERROR;
+}
+
+inline float *
+ow_tap_writer_get_block (struct ow_tap_writer *writer)
+{
+  uint64_t head = atomic_load_explicit (&writer->header->head,
+					memory_order_relaxed);
+  return &writer->data[(head & (OW_TAP_BLOCKS - 1)) * writer->block_samples];
+}
+
+inline void
+ow_tap_writer_commit_block (struct ow_tap_writer *writer)
+{
+  atomic_fetch_add_explicit (&writer->header->head, 1, memory_order_release);
+}
+
+inline const float *
+ow_tap_writer_get_committed_block (struct ow_tap_writer *writer, int back)
+{
+  uint64_t head = atomic_load_explicit (&writer->header->head,
+					memory_order_relaxed) - back;
+  return &writer->data[(head & (OW_TAP_BLOCKS - 1)) * writer->block_samples];
+}
+
+//Mapped readers keep the memory until they are done.
+void
+ow_tap_writer_destroy (struct ow_tap_writer *writer)
+{
+  atomic_store_explicit (&writer->header->running, 0, memory_order_release);
+  munmap (writer->header, writer->size);
+  shm_unlink (writer->name);
+  free (writer);
+}
+
+ow_err_t
+ow_tap_reader_init (struct ow_tap_reader **reader_, uint8_t bus,
+		    uint8_t address)
+{
+  int fd;
+  void *mem;
+  struct stat st;
+  char name[OW_TAP_NAME_LEN];
+  struct ow_tap_reader *reader;
+
+  ow_tap_get_name (name, bus, address);
+  fd = shm_open (name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0)
+    {
+      error_print ("Error while opening tap %s: %s\n", name,
+		   strerror (errno));
+      return OW_GENERIC_ERROR;
+    }
+
+  if (fstat (fd, &st) || st.st_size < OW_TAP_DATA_OFFSET)
+    {
+      error_print ("Invalid tap %s\n", name);
+      close (fd);
+      return OW_GENERIC_ERROR;
+    }
+
+  mem = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (mem == MAP_FAILED)
+    {
+      error_print ("Error while mapping tap %s: %s\n", name,
+		   strerror (errno));
+      return OW_GENERIC_ERROR;
+    }
+
+  reader = malloc (sizeof (struct ow_tap_reader));
+  if (!reader)
+    {
+      error_print ("Error while allocating the tap reader\n");
+      munmap (mem, st.st_size);
+      return OW_GENERIC_ERROR;
+    }
+
+  reader->header = mem;
+  reader->size = st.st_size;
+  reader->block_samples = OB_FRAMES_PER_BLOCK * reader->header->outputs;
+
+  if (reader->header->magic != OW_TAP_MAGIC
+      || reader->header->version != OW_TAP_VERSION
+      || reader->size < OW_TAP_DATA_OFFSET + reader->header->blocks *
+      reader->block_samples * OB_BYTES_PER_SAMPLE)
+    {
+      error_print ("Invalid tap %s\n", name);
+      munmap (mem, reader->size);
+      free (reader);
+      return OW_GENERIC_ERROR;
+    }
+  atomic_thread_fence (memory_order_acquire);
+
+  reader->data = (const float *) ((const char *) mem + OW_TAP_DATA_OFFSET);
+  //Reading starts now.
+  reader->cursor = atomic_load_explicit (&reader->header->head,
+					 memory_order_acquire);
+  reader->lost = 0;
+
+  *reader_ = reader;
+  return OW_OK;
+}
+
+inline size_t
+ow_tap_reader_read (struct ow_tap_reader *reader, float *f, size_t frames)
+{
+  uint64_t head, n, pos;
+  uint32_t blocks = reader->header->blocks;
+  size_t block_size = reader->block_samples * OB_BYTES_PER_SAMPLE;
+
+  head = atomic_load_explicit (&reader->header->head, memory_order_acquire);
+  //The block at head - blocks might be being overwritten.
+  if (head - reader->cursor >= blocks)
+    {
+      n = head - reader->cursor - blocks / 2;
+      reader->lost += n;
+      reader->cursor += n;
+    }
+
+  n = head - reader->cursor;
+  if (n > frames / OB_FRAMES_PER_BLOCK)
+    {
+      n = frames / OB_FRAMES_PER_BLOCK;
+    }
+
+  for (uint64_t i = 0; i < n; i++)
+    {
+      pos = (reader->cursor + i) & (blocks - 1);
+      memcpy (f, &reader->data[pos * reader->block_samples], block_size);
+      f += reader->block_samples;
+    }
+
+  //Everything copied is discarded if the writer went over it in the meantime.
+  head = atomic_load_explicit (&reader->header->head, memory_order_acquire);
+  if (head - reader->cursor >= blocks)
+    {
+      reader->lost += n;
+      reader->cursor += n;
+      return 0;
+    }
+
+  reader->cursor += n;
+  return n * OB_FRAMES_PER_BLOCK;
+}
+
+inline size_t
+ow_tap_reader_get_lost_frames (struct ow_tap_reader *reader)
+{
+  return reader->lost * OB_FRAMES_PER_BLOCK;
+}
+
+inline int
+ow_tap_reader_get_outputs (struct ow_tap_reader *reader)
+{
+  return reader->header->outputs;
+}
+
+inline int
+ow_tap_reader_is_running (struct ow_tap_reader *reader)
+{
+  return atomic_load_explicit (&reader->header->running,
+			       memory_order_acquire);
+}
+
+void
+ow_tap_reader_destroy (struct ow_tap_reader *reader)
+{
+  munmap ((void *) reader->header, reader->size);
+  free (reader);
+}
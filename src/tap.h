@@ -0,0 +1,82 @@
+/*
+ *   tap.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TAP_H
+#define TAP_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "overwitch.h"
+
+//A tap is a shared memory ring of o2p blocks with all the tracks decoded as interleaved floats, written by a running engine and read by any number of processes.
+//The writer never waits. Every reader has its own cursor and skips what has been overwritten.
+
+#define OW_TAP_MAGIC 0x5054574f	//"OWTP"
+#define OW_TAP_VERSION 1
+#define OW_TAP_NAME_FORMAT "/overwitch-%03d-%03d"	//Bus and address
+#define OW_TAP_NAME_LEN 32
+
+struct ow_tap_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t outputs;
+  uint32_t blocks;		//A power of 2
+  atomic_int running;
+  //The only value written on every block has a cache line for itself.
+  char reserved[44];
+  atomic_uint_least64_t head;	//Blocks written
+};
+
+#define OW_TAP_DATA_OFFSET ((sizeof (struct ow_tap_header) + 63) & ~((size_t) 63))
+
+struct ow_tap_writer
+{
+  struct ow_tap_header *header;
+  float *data;
+  size_t size;
+  size_t block_samples;
+  char name[OW_TAP_NAME_LEN];
+};
+
+struct ow_tap_reader
+{
+  const struct ow_tap_header *header;
+  const float *data;
+  size_t size;
+  size_t block_samples;
+  uint64_t cursor;
+  uint64_t lost;		//Blocks
+};
+
+ow_err_t ow_tap_writer_init (struct ow_tap_writer **, uint8_t, uint8_t,
+			     int);
+
+//The block the next transfer must be decoded into.
+float *ow_tap_writer_get_block (struct ow_tap_writer *);
+
+void ow_tap_writer_commit_block (struct ow_tap_writer *);
+
+//The block committed the given number of blocks ago, starting at 1. Only the writer changes the blocks so they are valid until the ring wraps.
+const float *ow_tap_writer_get_committed_block (struct ow_tap_writer *, int);
+
+void ow_tap_writer_destroy (struct ow_tap_writer *);
+
+#endif
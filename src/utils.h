@@ -26,6 +26,9 @@
 #define debug_print(level, format, ...) if (level <= debug_level) fprintf(stderr, "DEBUG:" __FILE__ ":%d:(%s): " format, __LINE__, __FUNCTION__, ## __VA_ARGS__)
 #define error_print(format, ...) fprintf(stderr, "\x1b[31mERROR:" __FILE__ ":%d:(%s): " format "\x1b[m", __LINE__, __FUNCTION__, ## __VA_ARGS__)
 
+#define OW_CACHE_LINE_SIZE 64
+#define OW_CACHE_ALIGNED __attribute__((aligned (OW_CACHE_LINE_SIZE)))
+
 extern int debug_level;
 
 #endif
@@ -0,0 +1,852 @@
+/*
+ *   benchmark.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//This runs the engine and the resampler of every device without hardware.
+//The USB transfers and the JACK cycles are scheduled in a simulated time line so the results only depend on the CPU.
+//The USB transfers and their times can also be replayed from a capture made with overwitch-cli.
+
+#include <math.h>
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <jack/ringbuffer.h>
+#include "../config.h"
+#include "../src/jclient.h"
+#include "../src/resampler.h"
+#include "../src/capture.h"
+#include "../src/common.h"
+#include "../src/utils.h"
+
+#define DEFAULT_BLOCKS 24
+#define DEFAULT_QUALITY 2
+#define DEFAULT_BUFSIZE 128
+#define DEFAULT_SAMPLERATE 48000
+#define DEFAULT_SECONDS 60
+#define MAX_LATENCY (OW_RESAMPLER_MAX_BUFSIZE * 2)
+#define RECONFIGURATION_DELAY 5.0	//s after the convergence
+#define MIDI_BUF_SIZE (4096 * sizeof (struct ow_midi_event))
+#define SIGNAL_W (2.0 * M_PI * 440.0 / OB_SAMPLE_RATE)
+
+enum bench_stage
+{
+  BENCH_STAGE_O2J_USB,
+  BENCH_STAGE_J2O_USB,
+  BENCH_STAGE_O2J_RESAMPLING,
+  BENCH_STAGE_JACK_COPY,
+  BENCH_STAGE_J2O_RESAMPLING,
+  BENCH_STAGES
+};
+
+static const char *BENCH_STAGE_NAMES[] = {
+  "o2j USB", "j2o USB", "o2j resampling", "JACK copy", "j2o resampling"
+};
+
+struct bench_options
+{
+  ow_resampler_backend_t backend;
+  int quality;
+  int blocks_per_transfer;
+  int bufsize;
+  int new_bufsize;		//Set once the DLL is running if not 0
+  int samplerate;
+  double drift;			//ppm
+  double seed_ratio;		//Not used if 0
+  int adaptive;
+  int fast_path;
+  double seconds;
+  int real_time;		//Events happen at their time instead of as fast as possible
+  const struct ow_conv_impl *conv;
+  struct ow_capture_reader *capture;	//Optional
+};
+
+struct bench_result
+{
+  uint64_t ns[BENCH_STAGES];
+  uint64_t frames[BENCH_STAGES];
+  double convergence;		//s
+  double reconfiguration;	//s
+  double recovery;		//s, back in RUN after the reconfiguration
+  unsigned int reconfiguration_underflows;	//o2p underflows since then
+  double ratio;
+  double target_delay;		//ms
+  double bandwidth;		//Hz
+  double usb_rate;		//Measured from the transfers
+  uint64_t midi_events;
+  double midi_delay_max;	//s
+  double midi_delay_sum;	//s
+  unsigned int o2p_overflows;
+  unsigned int o2p_underflows;
+  unsigned int p2o_overflows;
+  unsigned int p2o_underflows;
+};
+
+static double bench_time;
+
+static struct option options[] = {
+  {"resampler", 1, NULL, 'r'},
+  {"resampling-quality", 1, NULL, 'q'},
+  {"transfer-blocks", 1, NULL, 'b'},
+  {"buffer-size", 1, NULL, 'f'},
+  {"new-buffer-size", 1, NULL, 'F'},
+  {"sample-rate", 1, NULL, 's'},
+  {"drift", 1, NULL, 'd'},
+  {"ratio-seed", 1, NULL, 'S'},
+  {"adaptive-latency", 0, NULL, 'A'},
+  {"no-fast-path", 0, NULL, 'N'},
+  {"seconds", 1, NULL, 't'},
+  {"conversion", 1, NULL, 'c'},
+  {"replay", 1, NULL, 'i'},
+  {"real-time", 0, NULL, 'R'},
+  {"verbose", 0, NULL, 'v'},
+  {"help", 0, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static double
+bench_get_time ()
+{
+  return bench_time;
+}
+
+//Every track gets the same sine with a different amplitude.
+static void
+bench_fill_usb_input (struct ow_engine *engine)
+{
+  struct ow_engine_usb_blk *blk;
+  int outputs = engine->device_desc->outputs;
+  int frame = 0;
+
+  for (int i = 0; i < engine->blocks_per_transfer; i++)
+    {
+      blk = GET_NTH_INPUT_USB_BLK (engine, i);
+      blk->frames = htobe16 (frame);
+      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++, frame++)
+	{
+	  for (int k = 0; k < outputs; k++)
+	    {
+	      double v = sin (SIGNAL_W * frame) / (k + 1);
+	      blk->data[j * outputs + k] = htobe32 ((int32_t) (v * INT_MAX));
+	    }
+	}
+    }
+}
+
+static void
+bench_add (struct bench_result *result, enum bench_stage stage,
+	   uint64_t start, uint64_t end, uint32_t frames)
+{
+  result->ns[stage] += end - start;
+  result->frames[stage] += frames;
+}
+
+static void
+bench_wait (uint64_t start, double time)
+{
+  struct timespec ts;
+  uint64_t t = start + (uint64_t) (time * 1.0e9);
+
+  ts.tv_sec = t / 1000000000;
+  ts.tv_nsec = t % 1000000000;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	 EINTR);
+}
+
+//Only audio records are returned if MIDI is not being processed.
+static const struct ow_capture_record *
+bench_next_record (struct ow_capture_reader *reader)
+{
+  const struct ow_capture_record *record;
+
+  while ((record = ow_capture_reader_next (reader)))
+    {
+      if (record->type == OW_CAPTURE_RECORD_AUDIO
+	  || record->type == OW_CAPTURE_RECORD_MIDI)
+	{
+	  return record;
+	}
+      debug_print (1, "Skipping unknown record type %d...\n", record->type);
+    }
+
+  return NULL;
+}
+
+static void
+bench_read_midi (struct ow_context *context, struct bench_result *result)
+{
+  double delay;
+  struct ow_midi_event event;
+
+  while (jack_ringbuffer_read_space (context->o2p_midi) >=
+	 sizeof (struct ow_midi_event))
+    {
+      jack_ringbuffer_read (context->o2p_midi, (void *) &event,
+			    sizeof (struct ow_midi_event));
+      delay = bench_time - event.time;
+      result->midi_events++;
+      result->midi_delay_sum += delay;
+      if (delay > result->midi_delay_max)
+	{
+	  result->midi_delay_max = delay;
+	}
+    }
+}
+
+static int
+bench_device (const struct ow_device_desc *desc,
+	      struct bench_options *bench_options,
+	      struct bench_result *result)
+{
+  int planar;
+  int bufsize = bench_options->bufsize;
+  int max_bufsize;
+  uint32_t mask;
+  uint64_t t0, t1, t2, t3, start;
+  uint64_t usb_xfrs, jack_cycles;
+  double usb_period, jack_period, usb_time, jack_time, first_time;
+  double usb_first_time = 0, usb_last_time = 0;
+  struct ow_engine *engine;
+  struct ow_resampler *resampler;
+  struct ow_context context;
+  const struct ow_capture_record *record = NULL;
+  float *o2j_buffers[OB_MAX_TRACKS];
+  float *j2o_buffers[OB_MAX_TRACKS];
+  float *f;
+  ow_err_t err;
+
+  memset (result, 0, sizeof (struct bench_result));
+  result->convergence = -1.0;
+  result->reconfiguration = -1.0;
+  result->recovery = -1.0;
+
+  err = ow_engine_init_offline (&engine, desc,
+				bench_options->blocks_per_transfer);
+  if (err)
+    {
+      return err;
+    }
+  if (bench_options->conv)
+    {
+      ow_engine_set_conv (engine, bench_options->conv);
+    }
+
+  if (bench_options->capture
+      && bench_options->capture->header->data_in_len !=
+      engine->usb.data_in_len)
+    {
+      error_print ("Unexpected transfer length in capture (%u != %d)\n",
+		   bench_options->capture->header->data_in_len,
+		   engine->usb.data_in_len);
+      ow_engine_destroy (engine);
+      return OW_GENERIC_ERROR;
+    }
+
+  err = ow_resampler_init_from_engine (&resampler, engine,
+				       bench_options->backend,
+				       bench_options->quality);
+  if (err)
+    {
+      return err;
+    }
+
+  memset (&context, 0, sizeof (struct ow_context));
+  context.o2p_audio = jack_ringbuffer_create (MAX_LATENCY *
+					      ow_resampler_get_o2p_frame_size
+					      (resampler));
+  context.p2o_audio = jack_ringbuffer_create (MAX_LATENCY *
+					      ow_resampler_get_p2o_frame_size
+					      (resampler));
+  context.o2p_midi = jack_ringbuffer_create (MIDI_BUF_SIZE);
+  context.read_space = (ow_buffer_rw_space_t) jack_ringbuffer_read_space;
+  context.write_space = (ow_buffer_rw_space_t) jack_ringbuffer_write_space;
+  context.read = jclient_buffer_read;
+  context.write = (ow_buffer_write_t) jack_ringbuffer_write;
+  context.get_write_vector =
+    (ow_buffer_get_vector_t) jack_ringbuffer_get_write_vector;
+  context.commit = (ow_buffer_advance_t) jack_ringbuffer_write_advance;
+  context.get_read_vector =
+    (ow_buffer_get_vector_t) jack_ringbuffer_get_read_vector;
+  context.advance = (ow_buffer_advance_t) jack_ringbuffer_read_advance;
+  context.get_time = bench_get_time;
+  context.options = OW_ENGINE_OPTION_O2P_AUDIO | OW_ENGINE_OPTION_O2P_MIDI;
+
+  bench_time = 0.0;
+  err = ow_resampler_set_context (resampler, &context);
+  if (err)
+    {
+      goto end;
+    }
+
+  ow_resampler_set_ratio_seed (resampler, bench_options->samplerate,
+			       bench_options->seed_ratio);
+  ow_resampler_set_adaptive (resampler, bench_options->adaptive);
+  ow_resampler_set_fast_path (resampler, bench_options->fast_path);
+  if (ow_resampler_set_samplerate (resampler, bench_options->samplerate) ||
+      ow_resampler_set_buffer_size (resampler, bench_options->bufsize))
+    {
+      err = OW_GENERIC_ERROR;
+      goto end;
+    }
+  ow_engine_set_p2o_audio_enabled (engine, 1);
+  planar = ow_resampler_is_planar (resampler);
+
+  max_bufsize = bufsize > bench_options->new_bufsize ? bufsize :
+    bench_options->new_bufsize;
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      o2j_buffers[i] = malloc (max_bufsize * sizeof (float));
+    }
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      j2o_buffers[i] = malloc (max_bufsize * sizeof (float));
+      for (int j = 0; j < max_bufsize; j++)
+	{
+	  j2o_buffers[i][j] = sin (SIGNAL_W * j) / (i + 1);
+	}
+    }
+
+  usb_period = engine->frames_per_transfer /
+    (OB_SAMPLE_RATE * (1.0 + bench_options->drift * 1.0e-6));
+  jack_period = bufsize / (double) bench_options->samplerate;
+  usb_xfrs = 0;
+  jack_cycles = 0;
+  jack_time = 0;
+  usb_time = 0;
+  first_time = 0;
+
+  if (bench_options->capture)
+    {
+      ow_capture_reader_rewind (bench_options->capture);
+      record = bench_next_record (bench_options->capture);
+      if (!record)
+	{
+	  error_print ("Empty capture\n");
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup;
+	}
+      first_time = record->time;
+    }
+  else
+    {
+      bench_fill_usb_input (engine);
+    }
+
+  start = ow_get_time_ns ();
+
+  while (1)
+    {
+      if (usb_time > bench_options->seconds
+	  && jack_time > bench_options->seconds)
+	{
+	  break;
+	}
+
+      if (usb_time <= jack_time)
+	{
+	  bench_time = usb_time;
+	  if (bench_options->real_time)
+	    {
+	      bench_wait (start, bench_time);
+	    }
+
+	  if (record && record->type == OW_CAPTURE_RECORD_MIDI)
+	    {
+	      //The MIDI transfers are only processed while running.
+	      if (ow_engine_get_status (engine) >= OW_ENGINE_STATUS_RUN)
+		{
+		  ow_engine_set_usb_input_midi_events (engine,
+						       (const uint8_t *)
+						       OW_CAPTURE_RECORD_DATA
+						       (record), record->len,
+						       bench_time);
+		}
+	    }
+	  else
+	    {
+	      //This is what the USB thread does between events.
+	      if (ow_engine_get_status (engine) == OW_ENGINE_STATUS_BOOT)
+		{
+		  ow_engine_boot (engine);
+		}
+
+	      if (record)
+		{
+		  //The engine only reads the transfers so they are used in place.
+		  engine->usb.data_in = (char *) OW_CAPTURE_RECORD_DATA (record);
+		}
+
+	      t0 = ow_get_time_ns ();
+	      ow_engine_set_usb_input_data_blks (engine);
+	      t1 = ow_get_time_ns ();
+	      ow_engine_set_usb_output_data_blks (engine);
+	      t2 = ow_get_time_ns ();
+
+	      bench_add (result, BENCH_STAGE_O2J_USB, t0, t1,
+			 engine->frames_per_transfer);
+	      bench_add (result, BENCH_STAGE_J2O_USB, t1, t2,
+			 engine->frames_per_transfer);
+
+	      if (!usb_xfrs)
+		{
+		  usb_first_time = bench_time;
+		}
+	      usb_last_time = bench_time;
+	      usb_xfrs++;
+	    }
+
+	  if (record)
+	    {
+	      record = bench_next_record (bench_options->capture);
+	      if (!record)
+		{
+		  break;
+		}
+	      usb_time = record->time - first_time;
+	    }
+	  else
+	    {
+	      usb_time = usb_xfrs * usb_period;
+	    }
+	  continue;
+	}
+
+      bench_time = jack_time;
+      if (bench_options->real_time)
+	{
+	  bench_wait (start, bench_time);
+	}
+      jack_cycles++;
+      jack_time += jack_period;
+
+      //This is what jclient_set_buffer_size_cb does.
+      if (bench_options->new_bufsize && result->reconfiguration < 0
+	  && result->convergence >= 0
+	  && bench_time >= result->convergence + RECONFIGURATION_DELAY)
+	{
+	  bufsize = bench_options->new_bufsize;
+	  jack_period = bufsize / (double) bench_options->samplerate;
+	  ow_resampler_set_buffer_size (resampler, bufsize);
+	  result->reconfiguration = bench_time;
+	  result->reconfiguration_underflows =
+	    atomic_load_explicit (&resampler->o2p_underflows,
+				  memory_order_relaxed);
+	}
+
+      //This is what jclient_process_cb does.
+      t0 = ow_get_time_ns ();
+      if (ow_resampler_compute_ratios (resampler, bench_time))
+	{
+	  continue;
+	}
+
+      f = ow_resampler_get_o2p_audio_buffer (resampler);
+      mask = ow_resampler_get_o2p_track_mask (resampler);
+      ow_resampler_read_audio (resampler);
+      t1 = ow_get_time_ns ();
+      if (planar)
+	{
+	  jclient_copy_o2j_audio_planar (f, bufsize, o2j_buffers, desc,
+					 mask);
+	}
+      else
+	{
+	  jclient_copy_o2j_audio (f, bufsize, o2j_buffers, desc, mask);
+	}
+
+      f = ow_resampler_get_p2o_audio_buffer (resampler);
+      if (planar)
+	{
+	  jclient_copy_j2o_audio_planar (f, bufsize, j2o_buffers, desc);
+	}
+      else
+	{
+	  jclient_copy_j2o_audio (f, bufsize, j2o_buffers, desc);
+	}
+      t2 = ow_get_time_ns ();
+      ow_resampler_write_audio (resampler);
+      t3 = ow_get_time_ns ();
+
+      bench_add (result, BENCH_STAGE_O2J_RESAMPLING, t0, t1, bufsize);
+      bench_add (result, BENCH_STAGE_JACK_COPY, t1, t2, bufsize);
+      bench_add (result, BENCH_STAGE_J2O_RESAMPLING, t2, t3, bufsize);
+
+      bench_read_midi (&context, result);
+
+      if (result->convergence < 0
+	  && resampler->status == OW_RESAMPLER_STATUS_RUN)
+	{
+	  result->convergence = bench_time;
+	}
+
+      if (result->reconfiguration >= 0 && result->recovery < 0
+	  && resampler->status == OW_RESAMPLER_STATUS_RUN
+	  && ow_engine_get_status (engine) == OW_ENGINE_STATUS_RUN)
+	{
+	  result->recovery = bench_time - result->reconfiguration;
+	}
+    }
+
+  result->ratio = resampler->o2p_ratio;
+  result->target_delay = resampler->dll.kdel * 1000.0 / OB_SAMPLE_RATE;
+  result->bandwidth = resampler->bandwidth;
+  if (usb_xfrs > 1)
+    {
+      result->usb_rate = (usb_xfrs - 1) * engine->frames_per_transfer /
+	(usb_last_time - usb_first_time);
+    }
+  result->o2p_overflows = atomic_load_explicit (&engine->o2p_overflows,
+						memory_order_relaxed);
+  result->p2o_underflows = atomic_load_explicit (&engine->p2o_underflows,
+						 memory_order_relaxed);
+  result->o2p_underflows = atomic_load_explicit (&resampler->o2p_underflows,
+						 memory_order_relaxed);
+  result->p2o_overflows = atomic_load_explicit (&resampler->p2o_overflows,
+						memory_order_relaxed);
+  if (result->reconfiguration >= 0)
+    {
+      result->reconfiguration_underflows =
+	result->o2p_underflows - result->reconfiguration_underflows;
+    }
+
+cleanup:
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      free (o2j_buffers[i]);
+    }
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      free (j2o_buffers[i]);
+    }
+
+end:
+  ow_resampler_destroy (resampler);
+  jack_ringbuffer_free (context.o2p_audio);
+  jack_ringbuffer_free (context.p2o_audio);
+  jack_ringbuffer_free (context.o2p_midi);
+  return err;
+}
+
+static void
+bench_print_result (const struct ow_device_desc *desc,
+		    struct bench_options *bench_options,
+		    struct bench_result *result)
+{
+  double ns, total = 0.0;
+  double expected = bench_options->samplerate / result->usb_rate;
+
+  printf ("%s:\n", desc->name);
+  for (int i = 0; i < BENCH_STAGES; i++)
+    {
+      ns = result->frames[i] ? (double) result->ns[i] / result->frames[i] :
+	0.0;
+      total += ns;
+      printf ("  %-16s %8.2f ns/frame\n", BENCH_STAGE_NAMES[i], ns);
+    }
+  printf ("  %-16s %8.2f ns/frame\n", "Total", total);
+
+  if (result->convergence >= 0)
+    {
+      printf ("  DLL convergence: %.2f s\n", result->convergence);
+    }
+  else
+    {
+      printf ("  DLL convergence: not reached\n");
+    }
+  if (result->recovery >= 0)
+    {
+      printf
+	("  Reconfiguration to %d frames: running after %.2f ms, %u o2p underflows\n",
+	 bench_options->new_bufsize, result->recovery * 1000.0,
+	 result->reconfiguration_underflows);
+    }
+  else if (result->reconfiguration >= 0)
+    {
+      printf ("  Reconfiguration to %d frames: not running again\n",
+	      bench_options->new_bufsize);
+    }
+  printf ("  Ratio: %f (expected %f, error %.2f ppm)\n", result->ratio,
+	  expected, (result->ratio / expected - 1.0) * 1.0e6);
+  printf ("  DLL delay: %.2f ms, bandwidth: %.3f Hz\n", result->target_delay,
+	  result->bandwidth);
+  printf ("  Buffers (o2p overflows, o2p underflows, p2o overflows, p2o underflows): %u, %u, %u, %u\n",
+	  result->o2p_overflows, result->o2p_underflows,
+	  result->p2o_overflows, result->p2o_underflows);
+
+  if (result->midi_events)
+    {
+      printf ("  MIDI: %" PRIu64 " events, delay %.3f ms (max. %.3f ms)\n",
+	      result->midi_events,
+	      result->midi_delay_sum * 1000.0 / result->midi_events,
+	      result->midi_delay_max * 1000.0);
+    }
+}
+
+static const struct ow_conv_impl *
+bench_get_conv (const char *name)
+{
+  for (const struct ow_conv_impl ** impl = OW_CONV_IMPLS; *impl; impl++)
+    {
+      if (!strcasecmp ((*impl)->name, name) && (*impl)->is_supported ())
+	{
+	  return *impl;
+	}
+    }
+  return NULL;
+}
+
+static const struct ow_device_desc *
+bench_get_device_desc (uint16_t pid)
+{
+  for (const struct ow_device_desc ** desc = OB_DEVICE_DESCS; *desc; desc++)
+    {
+      if ((*desc)->pid == pid)
+	{
+	  return *desc;
+	}
+    }
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int opt;
+  int tflg = 0;
+  int long_index = 0;
+  char *endstr;
+  const char *capture_path = NULL;
+  const struct ow_device_desc *desc = NULL;
+  struct bench_result result;
+  struct bench_options bench_options = {
+    .backend = OW_RESAMPLER_BACKEND_SAMPLERATE,
+    .quality = DEFAULT_QUALITY,
+    .blocks_per_transfer = DEFAULT_BLOCKS,
+    .bufsize = DEFAULT_BUFSIZE,
+    .new_bufsize = 0,
+    .samplerate = DEFAULT_SAMPLERATE,
+    .drift = 0.0,
+    .seed_ratio = 0.0,
+    .adaptive = 0,
+    .fast_path = 1,
+    .seconds = DEFAULT_SECONDS,
+    .real_time = 0,
+    .conv = NULL,
+    .capture = NULL
+  };
+
+  while ((opt = getopt_long (argc, argv, "r:q:b:f:F:s:d:S:ANt:c:i:Rvh",
+			     options, &long_index)) != -1)
+    {
+      errno = 0;
+      switch (opt)
+	{
+	case 'r':
+	  if (!strcmp (optarg, "samplerate"))
+	    {
+	      bench_options.backend = OW_RESAMPLER_BACKEND_SAMPLERATE;
+	    }
+	  else if (!strcmp (optarg, "sinc"))
+	    {
+	      bench_options.backend = OW_RESAMPLER_BACKEND_SINC;
+	    }
+	  else
+	    {
+	      fprintf (stderr, "Resampler must be 'samplerate' or 'sinc'\n");
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'q':
+	  bench_options.quality = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || bench_options.quality < 0 || bench_options.quality > 4)
+	    {
+	      fprintf (stderr, "Resampling quality value must be in [0..4]\n");
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'b':
+	  bench_options.blocks_per_transfer =
+	    (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || bench_options.blocks_per_transfer < 2
+	      || bench_options.blocks_per_transfer > 32)
+	    {
+	      fprintf (stderr, "Blocks value must be in [2..32]\n");
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'f':
+	  bench_options.bufsize = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || bench_options.bufsize < 16
+	      || bench_options.bufsize > OW_RESAMPLER_MAX_BUFSIZE)
+	    {
+	      fprintf (stderr, "Buffer size must be in [16..%d]\n",
+		       OW_RESAMPLER_MAX_BUFSIZE);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'F':
+	  bench_options.new_bufsize = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || bench_options.new_bufsize < 16
+	      || bench_options.new_bufsize > OW_RESAMPLER_MAX_BUFSIZE)
+	    {
+	      fprintf (stderr, "Buffer size must be in [16..%d]\n",
+		       OW_RESAMPLER_MAX_BUFSIZE);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 's':
+	  bench_options.samplerate = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || bench_options.samplerate < OW_RESAMPLER_MIN_SAMPLERATE
+	      || bench_options.samplerate > 192000)
+	    {
+	      fprintf (stderr, "Sample rate must be in [%d..192000]\n",
+		       OW_RESAMPLER_MIN_SAMPLERATE);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'd':
+	  bench_options.drift = strtod (optarg, &endstr);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || fabs (bench_options.drift) > 1000)
+	    {
+	      fprintf (stderr, "Drift must be in [-1000..1000] ppm\n");
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'S':
+	  bench_options.seed_ratio = strtod (optarg, &endstr);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || bench_options.seed_ratio <= 0)
+	    {
+	      fprintf (stderr, "Ratio seed must be positive\n");
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'A':
+	  bench_options.adaptive = 1;
+	  break;
+	case 'N':
+	  bench_options.fast_path = 0;
+	  break;
+	case 't':
+	  bench_options.seconds = strtod (optarg, &endstr);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || bench_options.seconds <= 0)
+	    {
+	      fprintf (stderr, "Seconds must be positive\n");
+	      exit (EXIT_FAILURE);
+	    }
+	  tflg++;
+	  break;
+	case 'c':
+	  bench_options.conv = bench_get_conv (optarg);
+	  if (!bench_options.conv)
+	    {
+	      fprintf (stderr, "Sample conversion '%s' not available\n",
+		       optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'i':
+	  capture_path = optarg;
+	  break;
+	case 'R':
+	  bench_options.real_time = 1;
+	  break;
+	case 'v':
+	  debug_level++;
+	  break;
+	case 'h':
+	  print_help (argv[0], PACKAGE_STRING, options);
+	  exit (EXIT_SUCCESS);
+	case '?':
+	  print_help (argv[0], PACKAGE_STRING, options);
+	  exit (EXIT_FAILURE);
+	}
+    }
+
+  if (capture_path)
+    {
+      if (ow_capture_reader_init (&bench_options.capture, capture_path))
+	{
+	  exit (EXIT_FAILURE);
+	}
+
+      desc = bench_get_device_desc (bench_options.capture->header->pid);
+      if (!desc)
+	{
+	  fprintf (stderr, "Unknown device in capture (PID %04x)\n",
+		   bench_options.capture->header->pid);
+	  exit (EXIT_FAILURE);
+	}
+
+      //The whole capture is replayed unless told otherwise.
+      bench_options.blocks_per_transfer =
+	bench_options.capture->header->blocks_per_transfer;
+      if (!tflg)
+	{
+	  bench_options.seconds = INFINITY;
+	}
+
+      printf ("Replaying %s capture from %s\n",
+	      bench_options.capture->header->name, capture_path);
+    }
+  else
+    {
+      printf ("%.0f s of simulated time with %.1f ppm drift\n",
+	      bench_options.seconds, bench_options.drift);
+    }
+
+  printf
+    ("%d Hz with %d frames against %d blocks per transfer, %s resampler with quality %d and %s sample conversion\n",
+     bench_options.samplerate, bench_options.bufsize,
+     bench_options.blocks_per_transfer,
+     bench_options.backend == OW_RESAMPLER_BACKEND_SINC ? "sinc" :
+     "samplerate", bench_options.quality,
+     bench_options.conv ? bench_options.conv->name :
+     ow_conv_get_impl ()->name);
+
+  for (const struct ow_device_desc ** d = OB_DEVICE_DESCS; *d; d++)
+    {
+      if (bench_options.capture && *d != desc)
+	{
+	  continue;
+	}
+
+      if (bench_device (*d, &bench_options, &result))
+	{
+	  fprintf (stderr, "Error while running %s\n", (*d)->name);
+	  continue;
+	}
+      bench_print_result (*d, &bench_options, &result);
+    }
+
+  if (bench_options.capture)
+    {
+      ow_capture_reader_destroy (bench_options.capture);
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -1,14 +1,33 @@
 #include <string.h>
+#include <unistd.h>
 #include <math.h>
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
 #include "../src/jclient.h"
-#include "../src/engine.h"
+#include "../src/resampler.h"
+#include "../src/interp.h"
+#include "../src/sinc.h"
+#include "../src/stats.h"
+#include "../src/capture.h"
+#include "../src/tap.h"
 
 #define OW_CONV_SCALE_32 (1.0f / (float) INT_MAX)
 #define BLOCKS 4
 #define TRACKS 6
 #define NFRAMES 64
+#define CONV_SAMPLES (OB_FRAMES_PER_BLOCK * OB_MAX_TRACKS + 5)
+#define INTERP_CHANNELS 3
+#define INTERP_CHUNK 5
+#define SINC_TEST_FRAMES 1024
+#define SINC_TEST_W 0.05
+#define CAPTURE_RECORDS 100
+#define TAP_BUS 255
+#define TAP_ADDRESS 254
+#define SEED_SAMPLERATE 48000
+#define SEED_BUFSIZE 128
+#define SEED_QUALITY 2
+#define SEED_TEST_TIME 1.5
+#define SEED_RING_FRAMES 8192
 
 static const struct ow_device_desc TESTDEV_DESC = {
   .pid = 0,
@@ -32,7 +51,7 @@ test_usb_blocks ()
   printf ("\n");
 
   engine.device_desc = &TESTDEV_DESC;
-  ow_engine_init_mem (&engine, BLOCKS);
+  CU_ASSERT_EQUAL (ow_engine_init_mem (&engine, BLOCKS, 1), OW_OK);
 
   blk_size =
     sizeof (struct ow_engine_usb_blk) +
@@ -88,9 +107,412 @@ test_usb_blocks ()
 	}
     }
 
+  engine.options.planar = 1;
+  ow_engine_read_usb_input_blocks (&engine);
+
+  a = engine.p2o_transfer_buf;
+  b = engine.o2p_transfer_buf;
+  for (int i = 0; i < engine.frames_per_transfer; i++)
+    {
+      for (int k = 0; k < engine.device_desc->outputs; k++)
+	{
+	  float error = fabsf (*a - b[k * engine.frames_per_transfer + i]);
+	  CU_ASSERT_TRUE (error < 1e-8);
+	  a++;
+	}
+    }
+
+  //Only the second and the fourth tracks.
+  engine.options.planar = 0;
+  ow_engine_set_o2p_track_mask (&engine, 0xa);
+  ow_engine_update_o2p_tracks (&engine);
+  CU_ASSERT_EQUAL (engine.o2p_tracks, 2);
+  CU_ASSERT_EQUAL (ow_engine_get_o2p_track_mask (&engine), 0xa);
+  ow_engine_read_usb_input_blocks (&engine);
+
+  a = engine.p2o_transfer_buf;
+  b = engine.o2p_transfer_buf;
+  for (int i = 0; i < engine.frames_per_transfer; i++)
+    {
+      CU_ASSERT_TRUE (fabsf (a[1] - b[0]) < 1e-8);
+      CU_ASSERT_TRUE (fabsf (a[3] - b[1]) < 1e-8);
+      a += engine.device_desc->outputs;
+      b += 2;
+    }
+
+  ow_engine_free_mem (&engine);
+}
+
+void
+test_usb_blocks_vector ()
+{
+  size_t size;
+  char *ref_in, *ref_out, *data;
+  struct ow_buffer_vector v[2];
+  struct ow_engine engine;
+
+  engine.device_desc = &TESTDEV_DESC;
+  CU_ASSERT_EQUAL (ow_engine_init_mem (&engine, BLOCKS, 1), OW_OK);
+  size = engine.o2p_transfer_size;
+
+  for (int i = 0; i < engine.frames_per_transfer * TRACKS; i++)
+    {
+      engine.p2o_transfer_buf[i] = 1e-3 * (i - 100);
+    }
+  ow_engine_write_usb_output_blocks (&engine);
+  memcpy (engine.usb.data_in, engine.usb.data_out, engine.usb.data_in_len);
+  ow_engine_read_usb_input_blocks (&engine);
+
+  ref_in = malloc (size);
+  ref_out = malloc (engine.usb.data_out_len);
+  data = malloc (size);
+  memcpy (ref_in, engine.o2p_transfer_buf, size);
+  memcpy (ref_out, engine.usb.data_out, engine.usb.data_out_len);
+
+  //Every possible split point of the buffer memory, including none.
+  for (size_t split = 0; split <= size; split += OB_BYTES_PER_SAMPLE)
+    {
+      v[0].buf = data;
+      v[0].len = split;
+      v[1].buf = &data[split];
+      v[1].len = size - split;
+
+      memset (data, 0, size);
+      ow_engine_read_usb_input_blocks_to_vector (&engine, v);
+      CU_ASSERT_EQUAL (memcmp (data, ref_in, size), 0);
+
+      engine.usb.frames = 0;
+      memset (engine.usb.data_out, 0, engine.usb.data_out_len);
+      for (int i = 0; i < BLOCKS; i++)
+	{
+	  GET_NTH_OUTPUT_USB_BLK (&engine, i)->header = htobe16 (0x07ff);
+	}
+      ow_engine_write_usb_output_blocks_from_vector (&engine, v);
+      CU_ASSERT_EQUAL (memcmp (engine.usb.data_out, ref_out,
+			       engine.usb.data_out_len), 0);
+    }
+
+  free (ref_in);
+  free (ref_out);
+  free (data);
   ow_engine_free_mem (&engine);
 }
 
+void
+test_conv ()
+{
+  int32_t in[CONV_SAMPLES];
+  int32_t out[CONV_SAMPLES];
+  int32_t ref_out[CONV_SAMPLES];
+  float f[CONV_SAMPLES];
+  float ref_f[CONV_SAMPLES];
+  float scales[CONV_SAMPLES];
+  float uniform[CONV_SAMPLES];
+
+  printf ("\n");
+
+  srand (0);
+  for (int i = 0; i < CONV_SAMPLES; i++)
+    {
+      in[i] = (int32_t) (((uint32_t) rand () << 16) ^ (uint32_t) rand ());
+      scales[i] = i % 3 ? OW_CONV_SCALE_32 : OW_CONV_SCALE_32 * 4;
+      uniform[i] = OW_CONV_SCALE_32 * 4;
+    }
+  //Saturation is tested too.
+  in[0] = htobe32 (INT_MAX);
+  in[1] = htobe32 (INT_MIN);
+
+  for (const struct ow_conv_impl ** impl = OW_CONV_IMPLS; *impl; impl++)
+    {
+      if (!(*impl)->is_supported ())
+	{
+	  printf ("%s not supported\n", (*impl)->name);
+	  continue;
+	}
+
+      printf ("Testing %s...\n", (*impl)->name);
+
+      //Every length is tested to cover the non vectorized tails.
+      for (int n = 0; n <= CONV_SAMPLES; n++)
+	{
+	  memset (f, 0, sizeof (f));
+	  memset (ref_f, 0, sizeof (ref_f));
+	  ow_conv_decode_scalar (in, ref_f, scales, n);
+	  (*impl)->decode (in, f, scales, n);
+	  CU_ASSERT_EQUAL (memcmp (f, ref_f, sizeof (f)), 0);
+
+	  memset (out, 0, sizeof (out));
+	  memset (ref_out, 0, sizeof (ref_out));
+	  ow_conv_encode_scalar (ref_f, ref_out, n);
+	  (*impl)->encode (ref_f, out, n);
+	  CU_ASSERT_EQUAL (memcmp (out, ref_out, sizeof (out)), 0);
+	}
+
+      //Block kernels with mixed and uniform scales.
+      for (int c = 1; c <= OB_MAX_TRACKS; c++)
+	{
+	  int n = OB_FRAMES_PER_BLOCK * c;
+	  for (int u = 0; u < 2; u++)
+	    {
+	      const float *s = u ? uniform : scales;
+	      ow_conv_decode_t decode = ow_conv_get_block_decode (*impl, c,
+								  s);
+	      memset (f, 0, sizeof (f));
+	      memset (ref_f, 0, sizeof (ref_f));
+	      ow_conv_decode_scalar (in, ref_f, s, n);
+	      decode (in, f, s, n);
+	      CU_ASSERT_EQUAL (memcmp (f, ref_f, sizeof (f)), 0);
+	    }
+
+	  memset (out, 0, sizeof (out));
+	  memset (ref_out, 0, sizeof (ref_out));
+	  ow_conv_encode_scalar (ref_f, ref_out, n);
+	  ow_conv_get_block_encode (*impl, c) (ref_f, out, n);
+	  CU_ASSERT_EQUAL (memcmp (out, ref_out, sizeof (out)), 0);
+	}
+    }
+
+  CU_ASSERT_TRUE (ow_conv_get_impl ()->is_supported ());
+
+  //Integer decoding of tracks 2 and 0, the latter shifted to full scale.
+  {
+    const int tracks[] = { 2, 0 };
+    const int shifts[] = { 0, 8 };
+    int32_t frames[] = {
+      htobe32 (0x00123456), 0, htobe32 (INT_MIN),
+      htobe32 (0x00800000), 0, htobe32 (-1),
+      htobe32 (-0x123456), 0, 0,
+      htobe32 (-0x800000), 0, 0,
+      htobe32 (-0x800001), 0, 0
+    };
+    int32_t d[10];
+
+    ow_conv_decode_int_tracks (frames, 3, d, tracks, shifts, 2, 5);
+    CU_ASSERT_EQUAL (d[0], INT_MIN);
+    CU_ASSERT_EQUAL (d[1], 0x12345600);
+    CU_ASSERT_EQUAL (d[2], -1);
+    CU_ASSERT_EQUAL (d[3], INT_MAX);
+    CU_ASSERT_EQUAL (d[5], -0x12345600);
+    CU_ASSERT_EQUAL (d[7], INT_MIN);
+    CU_ASSERT_EQUAL (d[9], INT_MIN);
+  }
+}
+
+static long
+interp_test_cb (void *cb_data, float **data)
+{
+  static float frames[INTERP_CHUNK * INTERP_CHANNELS];
+  int *next = cb_data;
+
+  for (int i = 0; i < INTERP_CHUNK; i++, (*next)++)
+    {
+      for (int j = 0; j < INTERP_CHANNELS; j++)
+	{
+	  frames[i * INTERP_CHANNELS + j] = *next * (j + 1);
+	}
+    }
+
+  *data = frames;
+  return INTERP_CHUNK;
+}
+
+void
+test_interp ()
+{
+  int next;
+  double pos;
+  struct ow_interp interp;
+  float out[NFRAMES * INTERP_CHANNELS];
+  const double ratios[] = { 1.0, 2.0, 1.0001, 0.9999 };
+
+  printf ("\n");
+
+  ow_interp_init (&interp, INTERP_CHANNELS, 0, interp_test_cb, &next);
+
+  //A ramp must be reproduced exactly, with a 3 frames delay, once the history is full.
+  for (int r = 0; r < sizeof (ratios) / sizeof (double); r++)
+    {
+      next = 0;
+      ow_interp_reset (&interp);
+      CU_ASSERT_EQUAL (ow_interp_read (&interp, ratios[r], NFRAMES, out),
+		       NFRAMES);
+
+      for (int i = 0; i < NFRAMES; i++)
+	{
+	  pos = i / ratios[r] - 3;
+	  if (pos < 1)
+	    {
+	      continue;
+	    }
+	  for (int j = 0; j < INTERP_CHANNELS; j++)
+	    {
+	      CU_ASSERT_DOUBLE_EQUAL (out[i * INTERP_CHANNELS + j],
+				      pos * (j + 1), 1e-3);
+	    }
+	}
+    }
+
+  ow_interp_destroy (&interp);
+}
+
+static long
+sinc_test_cb (void *cb_data, float **data)
+{
+  static float frames[INTERP_CHUNK * INTERP_CHANNELS];
+  int *next = cb_data;
+
+  for (int i = 0; i < INTERP_CHUNK; i++, (*next)++)
+    {
+      for (int j = 0; j < INTERP_CHANNELS; j++)
+	{
+	  frames[i * INTERP_CHANNELS + j] = sin (SINC_TEST_W * *next) / (j + 1);
+	}
+    }
+
+  *data = frames;
+  return INTERP_CHUNK;
+}
+
+static long
+sinc_test_planar_cb (void *cb_data, float **data)
+{
+  static float frames[INTERP_CHUNK * INTERP_CHANNELS];
+  int *next = cb_data;
+
+  for (int i = 0; i < INTERP_CHUNK; i++, (*next)++)
+    {
+      for (int j = 0; j < INTERP_CHANNELS; j++)
+	{
+	  frames[j * INTERP_CHUNK + i] = sin (SINC_TEST_W * *next) / (j + 1);
+	}
+    }
+
+  *data = frames;
+  return INTERP_CHUNK;
+}
+
+void
+test_sinc ()
+{
+  int next;
+  double pos;
+  struct ow_sinc *sinc;
+  float a[SINC_TEST_FRAMES], b[SINC_TEST_FRAMES];
+  float out[SINC_TEST_FRAMES * INTERP_CHANNELS];
+  float planar[SINC_TEST_FRAMES * INTERP_CHANNELS];
+  const double ratios[] = { 1.0, 2.0, 1.0001, 0.9999, 0.9 };
+
+  printf ("\n");
+
+  for (int i = 0; i < SINC_TEST_FRAMES; i++)
+    {
+      a[i] = sin (i);
+      b[i] = cos (i * 0.5);
+    }
+
+  //A low frequency sine must go through with the delay of half a filter plus one frame.
+  for (int q = 0; q <= 4; q++)
+    {
+      sinc = ow_sinc_new (q, INTERP_CHANNELS, 0, sinc_test_cb, &next);
+
+      for (int t = 8; t <= sinc->taps; t += 8)
+	{
+	  CU_ASSERT_DOUBLE_EQUAL (sinc->dot (a, b, t),
+				  ow_sinc_dot_scalar (a, b, t), 1e-5);
+	}
+
+      for (int r = 0; r < sizeof (ratios) / sizeof (double); r++)
+	{
+	  next = 0;
+	  ow_sinc_reset (sinc);
+	  CU_ASSERT_EQUAL (ow_sinc_read (sinc, ratios[r], SINC_TEST_FRAMES,
+					 out), SINC_TEST_FRAMES);
+
+	  for (int i = 0; i < SINC_TEST_FRAMES; i++)
+	    {
+	      pos = i / ratios[r] - sinc->taps / 2 - 1;
+	      if (pos < sinc->taps / 2)
+		{
+		  continue;
+		}
+	      for (int j = 0; j < INTERP_CHANNELS; j++)
+		{
+		  CU_ASSERT_DOUBLE_EQUAL (out[i * INTERP_CHANNELS + j],
+					  sin (SINC_TEST_W * pos) / (j + 1),
+					  2e-3);
+		}
+	    }
+	}
+
+      ow_sinc_delete (sinc);
+    }
+
+  //The fast read goes on from the same position, so mixing both reads gives the same sine.
+  sinc = ow_sinc_new (0, INTERP_CHANNELS, 0, sinc_test_cb, &next);
+  next = 0;
+  for (int i = 0; i < SINC_TEST_FRAMES; i += SINC_TEST_FRAMES / 8)
+    {
+      if ((i / (SINC_TEST_FRAMES / 8)) % 2)
+	{
+	  ow_sinc_read_fast (sinc, 0.9999, SINC_TEST_FRAMES / 8,
+			     &out[i * INTERP_CHANNELS]);
+	}
+      else
+	{
+	  ow_sinc_read (sinc, 0.9999, SINC_TEST_FRAMES / 8,
+			&out[i * INTERP_CHANNELS]);
+	}
+    }
+  for (int i = 0; i < SINC_TEST_FRAMES; i++)
+    {
+      pos = i / 0.9999 - sinc->taps / 2 - 1;
+      if (pos < sinc->taps / 2)
+	{
+	  continue;
+	}
+      for (int j = 0; j < INTERP_CHANNELS; j++)
+	{
+	  CU_ASSERT_DOUBLE_EQUAL (out[i * INTERP_CHANNELS + j],
+				  sin (SINC_TEST_W * pos) / (j + 1), 2e-3);
+	}
+    }
+  ow_sinc_delete (sinc);
+
+  //Every table is designed beforehand and the read only picks one.
+  sinc = ow_sinc_new (0, INTERP_CHANNELS, 0, sinc_test_cb, &next);
+  next = 0;
+  ow_sinc_read (sinc, 0.9999, SINC_TEST_FRAMES, out);
+  CU_ASSERT_PTR_EQUAL (sinc->table, sinc->tables);
+  ow_sinc_read (sinc, 44100.0 / 48000, SINC_TEST_FRAMES, out);
+  CU_ASSERT_PTR_EQUAL (sinc->table, &sinc->tables[(sinc->phases + 1) *
+						  sinc->taps]);
+  ow_sinc_read (sinc, 0.1, SINC_TEST_FRAMES, out);
+  CU_ASSERT_PTR_NOT_NULL (sinc->table);
+  ow_sinc_delete (sinc);
+
+  //Planar data must give the same results.
+  sinc = ow_sinc_new (0, INTERP_CHANNELS, 0, sinc_test_cb, &next);
+  next = 0;
+  ow_sinc_read (sinc, 0.9, SINC_TEST_FRAMES, out);
+  ow_sinc_delete (sinc);
+
+  sinc = ow_sinc_new (0, INTERP_CHANNELS,
+		      OW_RESAMPLER_PLANAR_IN | OW_RESAMPLER_PLANAR_OUT,
+		      sinc_test_planar_cb, &next);
+  next = 0;
+  ow_sinc_read (sinc, 0.9, SINC_TEST_FRAMES, planar);
+  ow_sinc_delete (sinc);
+
+  for (int i = 0; i < SINC_TEST_FRAMES; i++)
+    {
+      for (int j = 0; j < INTERP_CHANNELS; j++)
+	{
+	  CU_ASSERT_EQUAL (out[i * INTERP_CHANNELS + j],
+			   planar[j * SINC_TEST_FRAMES + i]);
+	}
+    }
+}
+
 void
 test_jack_buffers ()
 {
@@ -116,7 +538,8 @@ test_jack_buffers ()
   memcpy (input, output,
 	  TRACKS * NFRAMES * sizeof (jack_default_audio_sample_t));
 
-  jclient_copy_o2j_audio (input, NFRAMES, jack_output, &TESTDEV_DESC);
+  jclient_copy_o2j_audio (input, NFRAMES, jack_output, &TESTDEV_DESC,
+			  (1U << TRACKS) - 1);
 
   for (int i = 0; i < TRACKS; i++)
     {
@@ -131,6 +554,409 @@ test_jack_buffers ()
     }
 }
 
+void
+test_stats ()
+{
+  struct ow_stats_histogram histogram;
+  struct ow_stats_summary summary;
+  int bucket, last = 0;
+
+  printf ("\n");
+
+  //Buckets are contiguous and the value of every bucket falls into it.
+  for (uint32_t v = 1; v < (1 << 20); v++)
+    {
+      bucket = ow_stats_get_bucket (v);
+      CU_ASSERT_TRUE (bucket == last || bucket == last + 1);
+      last = bucket;
+      CU_ASSERT_EQUAL (ow_stats_get_bucket ((uint32_t)
+					    ow_stats_get_bucket_value
+					    (bucket)), bucket);
+    }
+  CU_ASSERT_EQUAL (ow_stats_get_bucket (UINT32_MAX), OW_STATS_BUCKETS - 1);
+
+  ow_stats_histogram_init (&histogram);
+  for (uint32_t v = 1; v <= 1000; v++)
+    {
+      ow_stats_histogram_add (&histogram, v);
+    }
+
+  ow_stats_histogram_summarize (&histogram, &summary, 1.0);
+  printf ("p50: %f; p99: %f; max: %f\n", summary.p50, summary.p99,
+	  summary.max);
+  CU_ASSERT_EQUAL (summary.count, 1000);
+  CU_ASSERT_TRUE (fabs (summary.p50 - 500) < 500 * 0.125);
+  CU_ASSERT_TRUE (fabs (summary.p99 - 990) < 990 * 0.125);
+  CU_ASSERT_EQUAL (summary.max, 1000);
+
+  //Only the values since the previous summary are taken into account.
+  ow_stats_histogram_add (&histogram, 10);
+  ow_stats_histogram_summarize (&histogram, &summary, 1.0);
+  CU_ASSERT_EQUAL (summary.count, 1);
+  CU_ASSERT_EQUAL (summary.max, 10);
+  CU_ASSERT_EQUAL (summary.p99, 10);
+}
+
+void
+test_capture ()
+{
+  int fd;
+  char path[] = "/tmp/overwitch-test-XXXXXX";
+  char data[CAPTURE_RECORDS + 1];
+  struct ow_capture_header header;
+  struct ow_capture_writer *writer;
+  struct ow_capture_reader *reader;
+  const struct ow_capture_record *record;
+  ow_err_t err;
+
+  printf ("\n");
+
+  fd = mkstemp (path);
+  CU_ASSERT_TRUE (fd >= 0);
+  close (fd);
+
+  memset (&header, 0, sizeof (struct ow_capture_header));
+  memcpy (header.magic, OW_CAPTURE_MAGIC, sizeof (OW_CAPTURE_MAGIC));
+  header.version = OW_CAPTURE_VERSION;
+  header.pid = 0x1234;
+  header.blocks_per_transfer = BLOCKS;
+  snprintf (header.name, OW_LABEL_MAX_LEN, "%s", TESTDEV_DESC.name);
+
+  for (int i = 0; i <= CAPTURE_RECORDS; i++)
+    {
+      data[i] = i;
+    }
+
+  err = ow_capture_writer_init (&writer, path, &header);
+  CU_ASSERT_EQUAL (err, OW_OK);
+  if (err)
+    {
+      return;
+    }
+
+  //Every length is used so that every padding is tested.
+  for (int i = 0; i < CAPTURE_RECORDS; i++)
+    {
+      ow_capture_writer_write (writer, i % 2 ? OW_CAPTURE_RECORD_MIDI :
+			       OW_CAPTURE_RECORD_AUDIO, i * 0.5, data, i);
+    }
+  ow_capture_writer_destroy (writer);
+
+  err = ow_capture_reader_init (&reader, path);
+  CU_ASSERT_EQUAL (err, OW_OK);
+  if (err)
+    {
+      unlink (path);
+      return;
+    }
+
+  CU_ASSERT_EQUAL (reader->header->pid, 0x1234);
+  CU_ASSERT_EQUAL (reader->header->blocks_per_transfer, BLOCKS);
+  CU_ASSERT_STRING_EQUAL (reader->header->name, TESTDEV_DESC.name);
+
+  for (int i = 0; i < CAPTURE_RECORDS; i++)
+    {
+      record = ow_capture_reader_next (reader);
+      CU_ASSERT_PTR_NOT_NULL (record);
+      if (!record)
+	{
+	  break;
+	}
+      CU_ASSERT_EQUAL ((uintptr_t) record % 8, 0);
+      CU_ASSERT_EQUAL (record->type, i % 2 ? OW_CAPTURE_RECORD_MIDI :
+		       OW_CAPTURE_RECORD_AUDIO);
+      CU_ASSERT_EQUAL (record->len, i);
+      CU_ASSERT_EQUAL (record->time, i * 0.5);
+      CU_ASSERT_EQUAL (memcmp (OW_CAPTURE_RECORD_DATA (record), data, i), 0);
+    }
+  CU_ASSERT_PTR_NULL (ow_capture_reader_next (reader));
+
+  ow_capture_reader_destroy (reader);
+  unlink (path);
+}
+
+static void
+tap_write_block (struct ow_tap_writer *writer, int block)
+{
+  float *f = ow_tap_writer_get_block (writer);
+  for (int i = 0; i < OB_FRAMES_PER_BLOCK * TRACKS; i++)
+    {
+      f[i] = block;
+    }
+  ow_tap_writer_commit_block (writer);
+}
+
+void
+test_tap ()
+{
+  uint32_t blocks;
+  ow_err_t err;
+  struct ow_tap_writer *writer;
+  struct ow_tap_reader *reader;
+  struct ow_engine engine;
+  float f[OB_FRAMES_PER_BLOCK * TRACKS * 2];
+  float *o2p;
+
+  printf ("\n");
+
+  err = ow_tap_writer_init (&writer, TAP_BUS, TAP_ADDRESS, TRACKS);
+  CU_ASSERT_EQUAL (err, OW_OK);
+  if (err)
+    {
+      return;
+    }
+  blocks = writer->header->blocks;
+
+  //What was written before attaching is not read.
+  tap_write_block (writer, 0);
+
+  err = ow_tap_reader_init (&reader, TAP_BUS, TAP_ADDRESS);
+  CU_ASSERT_EQUAL (err, OW_OK);
+  if (err)
+    {
+      ow_tap_writer_destroy (writer);
+      return;
+    }
+  CU_ASSERT_EQUAL (ow_tap_reader_get_outputs (reader), TRACKS);
+  CU_ASSERT_EQUAL (ow_tap_reader_read (reader, f, OB_FRAMES_PER_BLOCK * 2),
+		   0);
+
+  for (int i = 1; i <= 3; i++)
+    {
+      tap_write_block (writer, i);
+    }
+
+  //Only whole blocks are read.
+  CU_ASSERT_EQUAL (ow_tap_reader_read (reader, f, OB_FRAMES_PER_BLOCK * 2 -
+				       1), OB_FRAMES_PER_BLOCK);
+  CU_ASSERT_EQUAL (f[0], 1);
+  CU_ASSERT_EQUAL (ow_tap_reader_read (reader, f, OB_FRAMES_PER_BLOCK * 2),
+		   OB_FRAMES_PER_BLOCK * 2);
+  CU_ASSERT_EQUAL (f[0], 2);
+  CU_ASSERT_EQUAL (f[OB_FRAMES_PER_BLOCK * TRACKS * 2 - 1], 3);
+  CU_ASSERT_EQUAL (ow_tap_reader_get_lost_frames (reader), 0);
+
+  //A slow reader skips to the middle of the ring.
+  for (int i = 0; i <= blocks; i++)
+    {
+      tap_write_block (writer, 4 + i);
+    }
+  CU_ASSERT_EQUAL (ow_tap_reader_read (reader, f, OB_FRAMES_PER_BLOCK),
+		   OB_FRAMES_PER_BLOCK);
+  CU_ASSERT_EQUAL (ow_tap_reader_get_lost_frames (reader),
+		   (blocks / 2 + 1) * OB_FRAMES_PER_BLOCK);
+  CU_ASSERT_EQUAL (f[0], 4 + blocks / 2 + 1);
+
+  //With all the tracks, o2p copies the last blocks of the tap instead of decoding the transfer again.
+  engine.device_desc = &TESTDEV_DESC;
+  CU_ASSERT_EQUAL (ow_engine_init_mem (&engine, BLOCKS, 1), OW_OK);
+  engine.tap = writer;
+  for (int i = 0; i < BLOCKS; i++)
+    {
+      tap_write_block (writer, -i);
+    }
+  ow_engine_read_usb_input_blocks (&engine);
+  o2p = engine.o2p_transfer_buf;
+  for (int i = 0; i < BLOCKS; i++)
+    {
+      CU_ASSERT_EQUAL (o2p[i * OB_FRAMES_PER_BLOCK * TRACKS], -i);
+    }
+  ow_engine_free_mem (&engine);
+
+  CU_ASSERT_TRUE (ow_tap_reader_is_running (reader));
+  ow_tap_writer_destroy (writer);
+  CU_ASSERT_FALSE (ow_tap_reader_is_running (reader));
+
+  ow_tap_reader_destroy (reader);
+}
+
+static double seed_time;
+
+static double
+seed_get_time ()
+{
+  return seed_time;
+}
+
+//Both sides are run in a simulated time line as the benchmark does and the resampler status is returned.
+//If there is a mask, the o2p tracks are changed once reading, which must not interrupt it.
+static ow_resampler_status_t
+seed_run (double seed_ratio, uint32_t mask)
+{
+  double usb_time, jack_time;
+  int requested = 0, restarted = 0;
+  ow_err_t err;
+  ow_resampler_status_t status;
+  struct ow_engine *engine;
+  struct ow_resampler *resampler;
+  struct ow_context context;
+
+  err = ow_engine_init_offline (&engine, &TESTDEV_DESC, BLOCKS);
+  CU_ASSERT_EQUAL (err, OW_OK);
+  if (err)
+    {
+      return OW_RESAMPLER_STATUS_ERROR;
+    }
+
+  err = ow_resampler_init_from_engine (&resampler, engine,
+				       OW_RESAMPLER_BACKEND_SINC,
+				       SEED_QUALITY);
+  CU_ASSERT_EQUAL (err, OW_OK);
+  if (err)
+    {
+      return OW_RESAMPLER_STATUS_ERROR;
+    }
+
+  memset (&context, 0, sizeof (struct ow_context));
+  context.o2p_audio = jack_ringbuffer_create (SEED_RING_FRAMES *
+					      ow_resampler_get_o2p_frame_size
+					      (resampler));
+  context.p2o_audio = jack_ringbuffer_create (SEED_RING_FRAMES *
+					      ow_resampler_get_p2o_frame_size
+					      (resampler));
+  context.read_space = (ow_buffer_rw_space_t) jack_ringbuffer_read_space;
+  context.write_space = (ow_buffer_rw_space_t) jack_ringbuffer_write_space;
+  context.read = jclient_buffer_read;
+  context.write = (ow_buffer_write_t) jack_ringbuffer_write;
+  context.get_write_vector =
+    (ow_buffer_get_vector_t) jack_ringbuffer_get_write_vector;
+  context.commit = (ow_buffer_advance_t) jack_ringbuffer_write_advance;
+  context.get_read_vector =
+    (ow_buffer_get_vector_t) jack_ringbuffer_get_read_vector;
+  context.advance = (ow_buffer_advance_t) jack_ringbuffer_read_advance;
+  context.get_time = seed_get_time;
+  context.options = OW_ENGINE_OPTION_O2P_AUDIO;
+
+  seed_time = 0.0;
+  err = ow_resampler_set_context (resampler, &context);
+  CU_ASSERT_EQUAL (err, OW_OK);
+
+  ow_resampler_set_ratio_seed (resampler, SEED_SAMPLERATE, seed_ratio);
+  CU_ASSERT_EQUAL (ow_resampler_set_samplerate (resampler, SEED_SAMPLERATE),
+		   0);
+  CU_ASSERT_EQUAL (ow_resampler_set_buffer_size (resampler, SEED_BUFSIZE),
+		   0);
+  ow_engine_set_p2o_audio_enabled (engine, 1);
+
+  usb_time = 0.0;
+  jack_time = 0.0;
+  while (jack_time < SEED_TEST_TIME)
+    {
+      if (usb_time <= jack_time)
+	{
+	  seed_time = usb_time;
+	  if (ow_engine_get_status (engine) == OW_ENGINE_STATUS_BOOT)
+	    {
+	      ow_engine_boot (engine);
+	    }
+	  ow_engine_set_usb_input_data_blks (engine);
+	  ow_engine_set_usb_output_data_blks (engine);
+	  usb_time += engine->frames_per_transfer / (double) OB_SAMPLE_RATE;
+	  continue;
+	}
+
+      seed_time = jack_time;
+      jack_time += SEED_BUFSIZE / (double) SEED_SAMPLERATE;
+      if (ow_resampler_compute_ratios (resampler, seed_time))
+	{
+	  continue;
+	}
+      if (requested && !resampler->reading_at_o2p_end)
+	{
+	  restarted = 1;
+	}
+      if (mask && !requested && resampler->reading_at_o2p_end)
+	{
+	  ow_resampler_set_o2p_track_mask (resampler, mask);
+	  requested = 1;
+	}
+      ow_resampler_read_audio (resampler);
+      ow_resampler_write_audio (resampler);
+    }
+
+  status = resampler->status;
+  if (mask)
+    {
+      CU_ASSERT_TRUE (requested);
+      CU_ASSERT_EQUAL (ow_resampler_get_o2p_track_mask (resampler), mask);
+      CU_ASSERT_FALSE (resampler->o2p_switching);
+      CU_ASSERT_FALSE (restarted);
+    }
+
+  ow_resampler_destroy (resampler);
+  jack_ringbuffer_free (context.o2p_audio);
+  jack_ringbuffer_free (context.p2o_audio);
+  return status;
+}
+
+//The first window lasts a second and ends in RUN if it agrees with the seed.
+void
+test_resampler_seed ()
+{
+  printf ("\n");
+
+  CU_ASSERT_EQUAL (seed_run (1.0, 0), OW_RESAMPLER_STATUS_RUN);
+  //This is within SEED_MAX_DEV but far from the measured ratio so tuning continues.
+  CU_ASSERT_EQUAL (seed_run (1.0002, 0), OW_RESAMPLER_STATUS_TUNE);
+}
+
+//Changing the o2p tracks while running neither restarts the reading nor stops the resampler.
+void
+test_resampler_o2p_tracks ()
+{
+  printf ("\n");
+
+  CU_ASSERT_EQUAL (seed_run (1.0, 0x5), OW_RESAMPLER_STATUS_RUN);
+  CU_ASSERT_EQUAL (seed_run (1.0, 0x3f), OW_RESAMPLER_STATUS_RUN);
+}
+
+//Without the DLL option, the engine never touches the DLL, whatever the context has.
+void
+test_engine_no_dll ()
+{
+  ow_err_t err;
+  struct ow_engine *engine;
+  struct ow_context context;
+  struct ow_dll_overwitch dll_ow;
+
+  printf ("\n");
+
+  err = ow_engine_init_offline (&engine, &TESTDEV_DESC, BLOCKS);
+  CU_ASSERT_EQUAL (err, OW_OK);
+  if (err)
+    {
+      return;
+    }
+
+  memset (&dll_ow, 0, sizeof (struct ow_dll_overwitch));
+  memset (&context, 0, sizeof (struct ow_context));
+  context.o2p_audio = jack_ringbuffer_create (SEED_RING_FRAMES *
+					      engine->o2p_frame_size);
+  context.read_space = (ow_buffer_rw_space_t) jack_ringbuffer_read_space;
+  context.write_space = (ow_buffer_rw_space_t) jack_ringbuffer_write_space;
+  context.write = (ow_buffer_write_t) jack_ringbuffer_write;
+  context.dll = &dll_ow;
+  context.options = OW_ENGINE_OPTION_O2P_AUDIO;
+
+  err = ow_engine_set_context (engine, &context);
+  CU_ASSERT_EQUAL (err, OW_OK);
+  CU_ASSERT_EQUAL (ow_engine_get_status (engine), OW_ENGINE_STATUS_BOOT);
+
+  ow_engine_boot (engine);
+  CU_ASSERT_EQUAL (ow_engine_get_status (engine), OW_ENGINE_STATUS_RUN);
+  for (int i = 0; i < 4; i++)
+    {
+      ow_engine_set_usb_input_data_blks (engine);
+    }
+  CU_ASSERT_EQUAL (jack_ringbuffer_read_space (context.o2p_audio),
+		   4 * engine->o2p_transfer_size);
+  CU_ASSERT_EQUAL (dll_ow.i1.frames, 0);
+  CU_ASSERT_EQUAL (dll_ow.seq, 0);
+
+  ow_engine_destroy (engine);
+  jack_ringbuffer_free (context.o2p_audio);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -151,11 +977,63 @@ main (int argc, char *argv[])
       goto cleanup;
     }
 
+  if (!CU_add_test (suite, "test_usb_blocks_vector",
+		    test_usb_blocks_vector))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_conv", test_conv))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_interp", test_interp))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_sinc", test_sinc))
+    {
+      goto cleanup;
+    }
+
   if (!CU_add_test (suite, "test_jack_buffers", test_jack_buffers))
     {
       goto cleanup;
     }
 
+  if (!CU_add_test (suite, "test_stats", test_stats))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_capture", test_capture))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_tap", test_tap))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_resampler_seed", test_resampler_seed))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_engine_no_dll", test_engine_no_dll))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_resampler_o2p_tracks",
+		    test_resampler_o2p_tracks))
+    {
+      goto cleanup;
+    }
+
   CU_basic_set_mode (CU_BRM_VERBOSE);
 
   CU_basic_run_tests ();